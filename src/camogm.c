@@ -15,6 +15,10 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
+
+/** @brief This define is needed to use lseek64 and off64_t and should be set before includes */
+#define _LARGEFILE64_SOURCE
+
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -35,8 +39,22 @@
 #include "camogm_ogm.h"
 #include "camogm_jpeg.h"
 #include "camogm_mov.h"
+#include "camogm_fmp4.h"
+#include "camogm_mkv.h"
+#include "camogm_jpack.h"
+#include "camogm_writeback.h"
+#include "camogm_ctl.h"
+#include "camogm_control.h"
+#include "camogm_events.h"
+#include "camogm_metrics.h"
+#include "camogm_flight.h"
+#include "camogm_trace.h"
+#include "camogm_sim.h"
 #include "camogm_kml.h"
 #include "camogm_read.h"
+#include "camogm_align.h"
+#include "camogm_superblock.h"
+#include "camogm_finalize.h"
 
 /** @brief Default debug level */
 #define DEFAULT_DEBUG_LVL         6
@@ -52,6 +70,16 @@
 #define DEFAULT_GREEDY            0
 /** @brief 0 - restartf file if fps changed, 1 - ignore variable fps (and skip less frames) */
 #define DEFAULT_IGNORE_FPS        0
+/** @brief Default time to wait for the frames of a group from all active ports, in milliseconds */
+#define DEFAULT_GROUP_TIMEOUT     500
+/** @brief Default number of JPEG files in one directory in counter layout */
+#define DEFAULT_JPEG_DIR_FILES    1000
+/** @brief The maximal writeback chunk size, in MiB */
+#define MAX_WRITEBACK_SIZE        1024
+/** @brief Frames with time stamps differing less than this value (in microseconds) belong to the same group */
+#define FRAME_GROUP_TOLERANCE     1000
+/** @brief Delay between checks while waiting for the frames of a group, in microseconds */
+#define FRAME_GROUP_WAIT_DELAY    1000
 /** @brief Maximal number of frames in file segment (each need 4* (1 + 1/frames_per_chunk) bytes for the frame index.
  * This parameter is mostrly for Quicktime */
 #define DEFAULT_FRAMES            16384
@@ -90,7 +118,7 @@ unsigned long            *aglobalPars[SENSOR_PORTS];
 /** @brief Global structure containing current state of the running program */
 camogm_state sstate;
 /** @brief Memory mapped circular buffer arrays */
-unsigned long * ccam_dma_buf[SENSOR_PORTS];
+uint32_t * ccam_dma_buf[SENSOR_PORTS];
 
 pthread_mutex_t print_mutex = PTHREAD_MUTEX_INITIALIZER;
 
@@ -118,6 +146,9 @@ FILE* debug_file;
 void camogm_init(camogm_state *state, char *pipe_name, uint16_t port_num);
 int camogm_start(camogm_state *state);
 int camogm_stop(camogm_state *state);
+static int camogm_end_segment(camogm_state *state, bool async);
+static int camogm_next_segment(camogm_state *state);
+static int select_group_port(camogm_state *state);
 void camogm_reset(camogm_state *state);
 int camogm_debug(camogm_state *state, const char *fname);
 int camogm_debug_level(int d);
@@ -128,6 +159,8 @@ void  camogm_set_ignore_fps(camogm_state *state, int d);
 
 void  camogm_set_save_gp(camogm_state *state, int d);
 void  camogm_set_prefix(camogm_state *state, const char * p, path_type type);
+void camogm_set_rawdev_size(camogm_state *state, uint64_t d);
+void camogm_set_rawdev_storage(camogm_state *state, const char *cfg);
 void  camogm_set_exif(camogm_state *state, int d);
 void  camogm_set_timescale(camogm_state *state, double d);   // set timescale, default=1.0
 void  camogm_set_frames_skip(camogm_state *state, int d);    // set number of frames to skip, if negative - seconds between frames
@@ -141,16 +174,27 @@ void  camogm_kml_set_height(camogm_state *state, double dd);
 void  camogm_kml_set_period(camogm_state *state, int d);
 void  camogm_kml_set_near(camogm_state *state, double dd); // distance to PhotoOverlay
 
-int   parse_cmd(camogm_state *state, FILE* npipe);
-char * getLineFromPipe(FILE* npipe);
+int   parse_cmd(camogm_state *state, int npipe);
+char * getLineFromPipe(int npipe);
 
 int  sendImageFrame(camogm_state *state);
 
 void  camogm_set_start_after_timestamp(camogm_state *state, double d);
 void  camogm_set_max_frames(camogm_state *state, int d);
 void  camogm_set_frames_per_chunk(camogm_state *state, int d);
+void  camogm_set_frag_frames(camogm_state *state, int d);
+void  camogm_set_frag_duration(camogm_state *state, int d);
+void  camogm_set_multitrack(camogm_state *state, int d);
+void  camogm_set_frame_groups(camogm_state *state, int d);
+void  camogm_set_group_timeout(camogm_state *state, int d);
+void  camogm_set_jpeg_layout(camogm_state *state, int d);
+void  camogm_set_jpeg_dir_files(camogm_state *state, int d);
+void  camogm_set_writeback(camogm_state *state, int d);
+void  camogm_set_prealloc(camogm_state *state, int d);
+void  camogm_latency_reset(camogm_state *state);
 
 static uint64_t get_disk_size(const char *name);
+static int prep_rawdev_file(camogm_state *state);
 static int get_sysfs_name(const char *dev_name, char *sys_name, size_t str_sz, int type);
 static int get_disk_range(const char *name, struct range *rng);
 static int set_disk_range(const struct range *rng);
@@ -164,7 +208,11 @@ inline void set_chn_state(camogm_state *s, unsigned int port, unsigned int new_s
 inline int is_chn_active(camogm_state *s, unsigned int port);
 void clean_up(camogm_state *state);
 static void camogm_err_stat(const camogm_state *state, int port, FILE *f, bool xml);
+static void camogm_lat_stat(camogm_state *state, FILE *f, bool xml);
 static void camogm_set_dummy_read(camogm_state *state, int d);
+static void camogm_apply_settings(camogm_state *state, const struct camogm_settings *s);
+static void camogm_publish_counters(camogm_state *state);
+static void camogm_flight_error(camogm_state *state, int port, int rslt);
 
 void put_uint16(void *buf, u_int16_t val)
 {
@@ -204,6 +252,20 @@ void put_uint64(void *buf, u_int64_t val)
 	tmp[7] = (val >>= 8) & 0xff;
 }
 
+u_int32_t get_uint32(const void *buf)
+{
+	const unsigned char *tmp = (const unsigned char*)buf;
+
+	return tmp[0] | (tmp[1] << 8) | (tmp[2] << 16) | ((u_int32_t)tmp[3] << 24);
+}
+
+u_int64_t get_uint64(const void *buf)
+{
+	const unsigned char *tmp = (const unsigned char*)buf;
+
+	return get_uint32(tmp) | ((u_int64_t)get_uint32(tmp + 4) << 32);
+}
+
 /**
  * @brief Detect running compressors and update active channels mask. This function should be
  * called right after all driver files are opened.
@@ -238,6 +300,12 @@ void camogm_init(camogm_state *state, char *pipe_name, uint16_t port_num)
 	camogm_set_ignore_fps(state, DEFAULT_IGNORE_FPS);
 	camogm_set_max_frames(state, DEFAULT_FRAMES);
 	camogm_set_frames_per_chunk(state, DEFAULT_FRAMES_PER_CHUNK);
+	camogm_set_frag_frames(state, FMP4_DEFAULT_FRAG_FRAMES);
+	camogm_set_frag_duration(state, FMP4_DEFAULT_FRAG_DURATION);
+	camogm_set_group_timeout(state, DEFAULT_GROUP_TIMEOUT);
+	camogm_set_jpeg_dir_files(state, DEFAULT_JPEG_DIR_FILES);
+	camogm_set_rawdev_storage(state, STORAGE_DEFAULT_CFG);
+	writeback_init(state);
 	camogm_reset(state);                    // sets state->buf_overruns =- 1
 	state->serialno = ipser[0];
 	debug_file = stderr;
@@ -246,7 +314,7 @@ void camogm_init(camogm_state *state, char *pipe_name, uint16_t port_num)
 	camogm_set_timescale(state, 1.0);
 	camogm_set_frames_skip(state, 0);       // don't skip
 	camogm_set_format(state, CAMOGM_FORMAT_MOV);
-	state->exif = DEFAULT_EXIF;
+	camogm_set_exif(state, DEFAULT_EXIF);
 	state->frame_lengths = NULL;
 
 	// reading thread has not been started yet, mutex lock is not necessary
@@ -273,8 +341,14 @@ void camogm_init(camogm_state *state, char *pipe_name, uint16_t port_num)
 	state->writer_params.data_ready = false;
 	state->writer_params.exit_thread = false;
 	state->writer_params.state = STATE_STOPPED;
+	state->writer_params.ckpt_fd = -1;
 
 	camogm_set_dummy_read(state, 0);
+
+	// settings are applied by capture thread from now on
+	control_init(state);
+	events_init();
+	camogm_apply_settings(state, control_snapshot(&state->set));
 }
 
 /**
@@ -288,6 +362,9 @@ int camogm_debug(camogm_state *state, const char * fname)
 	int none = 1;
 
 	if (fname && strlen(fname) && strcmp(fname, "none") && strcmp(fname, "null")  && strcmp(fname, "/dev/null")) none = 0;
+	// write pending messages to the old file, log thread writes debug messages while holding the mutex
+	log_flush();
+	pthread_mutex_lock(&print_mutex);
 	if (debug_file) {
 		if (strcmp(state->debug_name, "stdout") && strcmp(state->debug_name, "stderr")) fclose(debug_file);
 		debug_file = NULL;
@@ -302,6 +379,7 @@ int camogm_debug(camogm_state *state, const char * fname)
 		strncpy(state->debug_name, fname, sizeof(state->debug_name) - 1);
 		state->debug_name[sizeof(state->debug_name) - 1] = '\0';
 	}
+	pthread_mutex_unlock(&print_mutex);
 	return 0;
 }
 
@@ -336,6 +414,9 @@ int camogm_start(camogm_state *state)
 	D1(fprintf(debug_file, "Starting recording\n"));
 	double dtime_stamp;
 	state->frameno = 0;
+	state->group.pending = 0;
+	state->group.start = false;
+	state->group.waiting = false;
 
 	// do not trigger overrun alert on successfull (from GUI) restarts
 	if (state->prog_state != STATE_RESTARTING)
@@ -355,6 +436,9 @@ int camogm_start(camogm_state *state)
 		case CAMOGM_FORMAT_OGM:  rslt = camogm_init_ogm(); break;
 		case CAMOGM_FORMAT_JPEG: rslt = camogm_init_jpeg(state); break;
 		case CAMOGM_FORMAT_MOV:  rslt = camogm_init_mov(); break;
+		case CAMOGM_FORMAT_FMP4: rslt = camogm_init_fmp4(state); break;
+		case CAMOGM_FORMAT_MKV:  rslt = camogm_init_mkv(); break;
+		case CAMOGM_FORMAT_JPACK: rslt = camogm_init_jpack(); break;
 		}
 		state->formats |= 1 << (state->format);
 		// exit on unknown formats?
@@ -368,15 +452,22 @@ int camogm_start(camogm_state *state)
 		if (is_chn_active(state, chn)) {
 			// Check/set circbuf read pointer
 			D3(fprintf(debug_file, "1: state->cirbuf_rp=0x%x\n", state->cirbuf_rp[chn]));
-			D3(fprintf(debug_file, "1a: compressed frame number = %li\n", lseek(state->fd_circ[chn], LSEEK_CIRC_GETFRAME, SEEK_END)));
-			if ((state->cirbuf_rp[chn] < 0) || (lseek(state->fd_circ[chn], state->cirbuf_rp[chn], SEEK_SET) < 0) || (lseek(state->fd_circ[chn], LSEEK_CIRC_VALID, SEEK_END) < 0 )) {
+			D3(fprintf(debug_file, "1a: compressed frame number = %li\n", dev_lseek(state->fd_circ[chn], LSEEK_CIRC_GETFRAME, SEEK_END)));
+			if ((state->cirbuf_rp[chn] < 0) || (dev_lseek(state->fd_circ[chn], state->cirbuf_rp[chn], SEEK_SET) < 0) || (dev_lseek(state->fd_circ[chn], LSEEK_CIRC_VALID, SEEK_END) < 0 )) {
 				D3(fprintf(debug_file, "2: state->cirbuf_rp=0x%x\n", state->cirbuf_rp[chn]));
 				/* In "greedy" mode try to save as many frames from the circbuf as possible */
-				state->cirbuf_rp[chn] = lseek(state->fd_circ[chn], state->greedy ? LSEEK_CIRC_SCND : LSEEK_CIRC_LAST, SEEK_END);
+				state->cirbuf_rp[chn] = dev_lseek(state->fd_circ[chn], state->greedy ? LSEEK_CIRC_SCND : LSEEK_CIRC_LAST, SEEK_END);
 				if (!state->ignore_fps) {                                                                               // don't even try in ignore mode
-					if (((fp = lseek(state->fd_circ[chn], LSEEK_CIRC_PREV, SEEK_END))) >= 0) state->cirbuf_rp[chn] = fp;//try to have 2 frames available for fps
+					if (((fp = dev_lseek(state->fd_circ[chn], LSEEK_CIRC_PREV, SEEK_END))) >= 0) state->cirbuf_rp[chn] = fp;//try to have 2 frames available for fps
 				}
 				state->buf_overruns[chn]++;
+				if (state->buf_overruns[chn] > 0) {
+					CNT_INC(state->cnt.overruns[chn]);
+					camogm_event(EVENT_OVERRUN, chn, CNT_GET(state->cnt.overruns[chn]), NULL);
+					flight_record(FLIGHT_OVERRUN, chn, lat_time(), state->cirbuf_rp[chn], getGPValue(chn, G_FREECIRCBUF),
+							0, 0, 0, state->sched_reason, 0);
+					flight_trigger(FLIGHT_TRIGGER_OVERRUN);
+				}
 				// file pointer here should match state->rp; so no need to do    lseek(state->fd_circ,state->cirbuf_rp,SEEK_SET);
 				state->buf_min[chn] = getGPValue(chn, G_FREECIRCBUF);
 
@@ -385,10 +476,10 @@ int camogm_start(camogm_state *state)
 
 			}
 			D3(fprintf(debug_file, "3: state->cirbuf_rp=0x%x\n", state->cirbuf_rp[chn]));
-			D3(fprintf(debug_file, "4:lseek(state->fd_circ,LSEEK_CIRC_READY,SEEK_END)=%d\n", (int)lseek(state->fd_circ[chn], LSEEK_CIRC_READY, SEEK_END)));
+			D3(fprintf(debug_file, "4:lseek(state->fd_circ,LSEEK_CIRC_READY,SEEK_END)=%d\n", (int)dev_lseek(state->fd_circ[chn], LSEEK_CIRC_READY, SEEK_END)));
 
 			// is this frame ready?
-			if (lseek(state->fd_circ[chn], LSEEK_CIRC_READY, SEEK_END) < 0) return -CAMOGM_FRAME_NOT_READY;  // frame pointer valid, but no frames yet
+			if (dev_lseek(state->fd_circ[chn], LSEEK_CIRC_READY, SEEK_END) < 0) return -CAMOGM_FRAME_NOT_READY;  // frame pointer valid, but no frames yet
 			D3(fprintf(debug_file, "5: state->cirbuf_rp=0x%x\n", state->cirbuf_rp[chn]));
 			state->metadata_start = (state->cirbuf_rp[chn]) - 32;
 			if (state->metadata_start < 0) state->metadata_start += state->circ_buff_size[chn];
@@ -422,12 +513,12 @@ int camogm_start(camogm_state *state)
 			}
 			D3(fprintf(debug_file, "6: state->cirbuf_rp=0x%x\n", state->cirbuf_rp[chn]));
 			// see if next frame is available
-			if ((lseek(state->fd_circ[chn], LSEEK_CIRC_NEXT, SEEK_END) < 0 ) ||
+			if ((dev_lseek(state->fd_circ[chn], LSEEK_CIRC_NEXT, SEEK_END) < 0 ) ||
 					// is that next frame ready?
-					(((fp = lseek(state->fd_circ[chn], LSEEK_CIRC_READY, SEEK_END))) < 0)) {
-				D3(fprintf(debug_file, "6a:lseek(state->fd_circ,LSEEK_CIRC_NEXT,SEEK_END)=0x%x,  fp=0x%x\n", (int)lseek(state->fd_circ[chn], LSEEK_CIRC_NEXT, SEEK_END), (int)lseek(state->fd_circ[chn], LSEEK_CIRC_READY, SEEK_END)));
+					(((fp = dev_lseek(state->fd_circ[chn], LSEEK_CIRC_READY, SEEK_END))) < 0)) {
+				D3(fprintf(debug_file, "6a:lseek(state->fd_circ,LSEEK_CIRC_NEXT,SEEK_END)=0x%x,  fp=0x%x\n", (int)dev_lseek(state->fd_circ[chn], LSEEK_CIRC_NEXT, SEEK_END), (int)dev_lseek(state->fd_circ[chn], LSEEK_CIRC_READY, SEEK_END)));
 
-				lseek(state->fd_circ[chn], state->cirbuf_rp[chn], SEEK_SET);      // just in case - restore pointer
+				dev_lseek(state->fd_circ[chn], state->cirbuf_rp[chn], SEEK_SET);      // just in case - restore pointer
 				return -CAMOGM_FRAME_NOT_READY;                                   // frame pointer valid, but no frames yet
 			}
 			next_metadata_start = fp - 32;
@@ -472,41 +563,47 @@ int camogm_start(camogm_state *state)
 			}
 			D3(fprintf(debug_file, "9: state->frame_period=0x%x\n", state->frame_period[chn]));
 
-			state->time_unit = (ogg_int64_t)(((double)state->frame_period[chn]) * ((double)10) / ((double)state->timescale));
+			state->time_unit = (int64_t)(((double)state->frame_period[chn]) * ((double)10) / ((double)state->timescale));
 			state->width = state->frame_params[chn].width;
 			state->height = state->frame_params[chn].height;
 
 			// read JPEG header - it should stay the same for the whole file (restart new file if any parameters changed)
 			// rebuild JPEG header:
-			lseek(state->fd_head[chn], state->cirbuf_rp[chn] + 1, SEEK_END);  // +1 to avoid condition when jpeg_start==0. overloaded lseek will ignore 5 LSBs when SEEK_END
-			state->head_size[chn] = lseek(state->fd_head[chn], 0, SEEK_END);  // In 8.0 the header size might change for some jp4 modes
+			dev_lseek(state->fd_head[chn], state->cirbuf_rp[chn] + 1, SEEK_END);  // +1 to avoid condition when jpeg_start==0. overloaded lseek will ignore 5 LSBs when SEEK_END
+			state->head_size[chn] = dev_lseek(state->fd_head[chn], 0, SEEK_END);  // In 8.0 the header size might change for some jp4 modes
 			if (state->head_size[chn] > JPEG_HEADER_MAXSIZE) {
 				D0(fprintf(debug_file, "%s:%d: Too big JPEG header (%d > %d)", __FILE__, __LINE__, state->head_size[chn], JPEG_HEADER_MAXSIZE ));
 				return -2;
 			}
 			// and read it
-			lseek(state->fd_head[chn], 0, 0);
-			read(state->fd_head[chn], state->jpegHeader[chn], state->head_size[chn]);
+			dev_lseek(state->fd_head[chn], 0, 0);
+			dev_read(state->fd_head[chn], state->jpegHeader[chn], state->head_size[chn]);
 			// Restore read pointer to the original (now there may be no frame ready there yet)
-			lseek(state->fd_circ[chn], state->cirbuf_rp[chn], SEEK_SET);
+			dev_lseek(state->fd_circ[chn], state->cirbuf_rp[chn], SEEK_SET);
 		}
 	}
 
 // here we are ready to initialize Ogm (or other) file
+	TRACE_BEGIN("segment_start", port);
 	switch (state->format) {
 	case CAMOGM_FORMAT_NONE: rslt = 0;  break;
 	case CAMOGM_FORMAT_OGM:  rslt = camogm_start_ogm(state);  break;
 	case CAMOGM_FORMAT_JPEG: rslt = camogm_start_jpeg(state); break;
 	case CAMOGM_FORMAT_MOV:  rslt = camogm_start_mov(state);  break;
+	case CAMOGM_FORMAT_FMP4: rslt = camogm_start_fmp4(state); break;
+	case CAMOGM_FORMAT_MKV:  rslt = camogm_start_mkv(state);  break;
+	case CAMOGM_FORMAT_JPACK: rslt = camogm_start_jpack(state); break;
 	default: rslt = 0; // do nothing
 	}
+	TRACE_END("segment_start", port);
 	if (rslt) {
 		unsigned int err_code = -rslt;
 		D0(fprintf(debug_file, "camogm_start() error, rslt=0x%x\n", rslt));
 		if (err_code > 0 && err_code < CAMOGM_ERRNUM)
-			state->error_stat[port][err_code]++;
+			CNT_INC(state->cnt.error_stat[port][err_code]);
 		return rslt;
 	}
+	writeback_start(state);
 	if (state->kml_enable) rslt = camogm_start_kml(state);  // will turn on state->kml_used if it can
 	if (rslt) return rslt;
 	pthread_mutex_lock(&state->mutex);
@@ -529,117 +626,121 @@ int sendImageFrame(camogm_state *state)
 	int * ifp_this = (int*)&(state->this_frame_params[state->port_num]);
 	int fp;
 	int port = state->port_num;
-	struct timeval start_time, end_time;
+	uint64_t t_write, t_done;
+	struct timeval fpga_time;
 
-//	start_time = get_fpga_time(state->fd_fparmsall[port], port);
-
-// This is probably needed only for Quicktime (not to exceed already allocated frame index)
-	if (!state->rawdev_op && (state->frameno >= (state->max_frames))) {
-		D3(fprintf(debug_file, "sendImageFrame:1: state->frameno(0x%x) >= state->max_frames(0x%x)\n", state->frameno, state->max_frames));
-		return -CAMOGM_FRAME_CHANGED;
+// This is probably needed only for Quicktime (not to exceed already allocated frame index), fragmented MP4 uses constant memory,
+// Matroska Cues table grows as needed and JPEG pack index is written as frames go
+	if (!state->rawdev_op && state->format != CAMOGM_FORMAT_FMP4 && state->format != CAMOGM_FORMAT_MKV &&
+			state->format != CAMOGM_FORMAT_JPACK && (state->frameno >= (state->max_frames))) {
+		DB(3, "sendImageFrame:1: state->frameno(0x%x) >= state->max_frames(0x%x)\n", state->frameno, state->max_frames);
+		return -CAMOGM_FRAME_NEXTFILE;
 	}
 // Format changed?
 //   D3(fprintf (debug_file,"sendImageFrame: format=%d, set_format=%d\n", state->format, state->set_format));
 
 	if (state->format != state->set_format) {
-		D3(fprintf(debug_file, "sendImageFrame:2: state->format(0x%x) != state->set_format(0x%x)\n", state->format, state->set_format));
-		return -CAMOGM_FRAME_CHANGED;
-	}
-//   check if file size is exceeded (assuming fopen),-CAMOGM_FRAME_CHANGED will trigger a new segment
-	if ((state->vf) && (state->segment_length >= 0) && (ftell(state->vf) > state->segment_length)) {
-		D3(fprintf(debug_file, "sendImageFrame:3: segment length exceeded\n"));
+		DB(3, "sendImageFrame:2: state->format(0x%x) != state->set_format(0x%x)\n", state->format, state->set_format);
 		return -CAMOGM_FRAME_CHANGED;
 	}
-//same for open
+//   check if file size is exceeded, -CAMOGM_FRAME_NEXTFILE will trigger a new segment
 	if (!state->rawdev_op && ((state->ivf) >= 0) && (state->segment_length >= 0) && (lseek(state->ivf, 0, SEEK_CUR) > state->segment_length)) {
-		D3(fprintf(debug_file, "sendImageFrame:4: segment length exceeded\n"));
-		return -CAMOGM_FRAME_CHANGED;
+		DB(3, "sendImageFrame:4: segment length exceeded\n");
+		return -CAMOGM_FRAME_NEXTFILE;
 	}
 // check the frame pointer is valid
-	if ((fp = lseek(state->fd_circ[port], state->cirbuf_rp[port], SEEK_SET)) < 0) {
-		D3(fprintf(debug_file, "sendImageFrame:5: invalid frame\n"));
+	if ((fp = dev_lseek(state->fd_circ[port], state->cirbuf_rp[port], SEEK_SET)) < 0) {
+		DB(3, "sendImageFrame:5: invalid frame\n");
 		return -CAMOGM_FRAME_INVALID; //it will probably be that allready
 	}
 // is the frame ready?
-	if (lseek(state->fd_circ[port], LSEEK_CIRC_READY, SEEK_END) < 0) {
-		D3(fprintf(debug_file, "?6,fp=0x%x ", fp));     //frame not ready, frame pointer seems valid, but not ready
+	if (dev_lseek(state->fd_circ[port], LSEEK_CIRC_READY, SEEK_END) < 0) {
+		DB(3, "?6,fp=0x%x ", fp);     //frame not ready, frame pointer seems valid, but not ready
 		return -CAMOGM_FRAME_NOT_READY;                 // frame pointer valid, but no frames yet
 	}
 
 // process skipping frames. TODO: add - skipping time between frames (or better -  actual time period - use the nearest frame) instead of the frame number
 	if ( (state->frames_skip > 0) && (state->frames_skip_left[port] > 0 )) { //skipping frames, not seconds.
-		state->cirbuf_rp[port] = lseek(state->fd_circ[port], LSEEK_CIRC_NEXT, SEEK_END);
+		state->cirbuf_rp[port] = dev_lseek(state->fd_circ[port], LSEEK_CIRC_NEXT, SEEK_END);
 //optionally save it to global read pointer (i.e. for debugging with imgsrv "/pointers")
-		if (state->save_gp) lseek(state->fd_circ[port], LSEEK_CIRC_SETP, SEEK_END);
+		if (state->save_gp) dev_lseek(state->fd_circ[port], LSEEK_CIRC_SETP, SEEK_END);
 		state->frames_skip_left[port]--;
-		D3(fprintf(debug_file, "?7 ")); //frame not ready
+		DB(3, "?7 "); //frame not ready
 		return -CAMOGM_FRAME_NOT_READY; // the required frame is not ready
 	}
 
 // Get metadata
-	D3(fprintf(debug_file, "_1_"));
+	DB(3, "_1_");
 	state->metadata_start = state->cirbuf_rp[port] - 32;
 	if (state->metadata_start < 0) state->metadata_start += state->circ_buff_size[port];
 	memcpy(&(state->this_frame_params[port]), (unsigned long* )&ccam_dma_buf[state->port_num][state->metadata_start >> 2], 32);
 	state->jpeg_len = state->this_frame_params[port].frame_length; // frame_params.frame_length are now the length of bitstream
 	if (state->this_frame_params[port].signffff != 0xffff) {
 		D0(fprintf(debug_file, "%s:%d: wrong signature - %d\r\n", __FILE__, __LINE__, (int)state->this_frame_params[port].signffff));
-		D1(fprintf(debug_file, "state->cirbuf_rp=0x%x\r\n", (int)state->cirbuf_rp[port]));
-		D1(fprintf(debug_file, "%08x %08x %08x %08x %08x %08x %08x %08x\r\n", ifp_this[0], ifp_this[1], ifp_this[2], ifp_this[3], ifp_this[4], ifp_this[5], ifp_this[6], ifp_this[7]));
+		DB(1, "state->cirbuf_rp=0x%x\r\n", (int)state->cirbuf_rp[port]);
+		DB(1, "%08x %08x %08x %08x %08x %08x %08x %08x\r\n", ifp_this[0], ifp_this[1], ifp_this[2], ifp_this[3], ifp_this[4], ifp_this[5], ifp_this[6], ifp_this[7]);
 
-		D3(fprintf(debug_file, "sendImageFrame:8: frame broken\n"));
+		DB(3, "sendImageFrame:8: frame broken\n");
 		return -CAMOGM_FRAME_BROKEN;
 	}
-	D3(fprintf(debug_file, "_2_"));
+	DB(3, "_2_");
 //   find location of the timestamp and copy it to the frame_params structure
 	timestamp_start = state->cirbuf_rp[port] + ((state->jpeg_len + CCAM_MMAP_META + 3) & (~0x1f)) + 32 - CCAM_MMAP_META_SEC; // magic shift - should index first byte of the time stamp
 	if (timestamp_start >= state->circ_buff_size[port]) timestamp_start -= state->circ_buff_size[port];
-	D3(fprintf(debug_file, "_3_"));
+	DB(3, "_3_");
 	memcpy(&(state->this_frame_params[port].timestamp_sec), (unsigned long* )&ccam_dma_buf[state->port_num][timestamp_start >> 2], 8);
 // verify that the essential current frame params did not change, if they did - return an error (need new file header)
 	if (!state->ignore_fps && ((state->frame_params[port].width  != state->this_frame_params[port].width) ||
 				   (state->frame_params[port].height != state->this_frame_params[port].height))) {
-		D3(fprintf(debug_file, "sendImageFrame:9: WOI changed\n"));
+		DB(3, "sendImageFrame:9: WOI changed\n");
 		return -CAMOGM_FRAME_CHANGED; // not yet checking for the FPS
 	}
-//   check if file duration (in seconds) exceeded ,-CAMOGM_FRAME_CHANGED will trigger a new segment
+//   check if file duration (in seconds) exceeded ,-CAMOGM_FRAME_NEXTFILE will trigger a new segment
 	if (!state->rawdev_op && (state->segment_duration > 0) &&
 	    ((state->this_frame_params[port].timestamp_sec - state->frame_params[port].timestamp_sec) > state->segment_duration)) {
-		D3(fprintf(debug_file, "sendImageFrame:10: segment duration in seconds exceeded\n"));
-		return -CAMOGM_FRAME_CHANGED;
+		DB(3, "sendImageFrame:10: segment duration in seconds exceeded\n");
+		return -CAMOGM_FRAME_NEXTFILE;
 	}
 // check if (in timelapse mode)  it is too early for the frame to be stored
 	if ((state->frames_skip < 0) && (state->frames_skip_left[port] > state->this_frame_params[port].timestamp_sec) ) {
-		state->cirbuf_rp[port] = lseek(state->fd_circ[port], LSEEK_CIRC_NEXT, SEEK_END);
+		state->cirbuf_rp[port] = dev_lseek(state->fd_circ[port], LSEEK_CIRC_NEXT, SEEK_END);
 //optionally save it to global read pointer (i.e. for debugging with imgsrv "/pointers")
-		if (state->save_gp) lseek(state->fd_circ[port], LSEEK_CIRC_SETP, SEEK_END);
-		D3(fprintf(debug_file, "sendImageFrame:11: timelapse: frame will be skipped\n"));
+		if (state->save_gp) dev_lseek(state->fd_circ[port], LSEEK_CIRC_SETP, SEEK_END);
+		DB(3, "sendImageFrame:11: timelapse: frame will be skipped\n");
 		return -CAMOGM_FRAME_NOT_READY; // the required frame is not ready
 	}
+// the frame will be recorded, measure how long it has been waiting in circbuf
+	state->t_harvest = lat_time();
+	TRACE_BEGIN("harvest", port);
+	fpga_time = get_fpga_time(state->fd_fparmsall[port], port);
+	hist_add(&state->cnt.lat[LAT_CAPTURE],
+			((int64_t)fpga_time.tv_sec - (int64_t)state->this_frame_params[port].timestamp_sec) * 1000000 +
+			((int64_t)fpga_time.tv_usec - (int64_t)state->this_frame_params[port].timestamp_usec));
 
-
-	D3(fprintf(debug_file, "_4_"));
+	DB(3, "_4_");
 	if (state->exif) {
-		D3(fprintf(debug_file, "_5_"));
+		DB(3, "_5_");
+		TRACE_BEGIN("exif", port);
 // update the Exif header with the current frame metadata
-		state->exifSize[port] = lseek(state->fd_exif[port], 1, SEEK_END); // at the beginning of page 1 - position == page length
+		state->exifSize[port] = dev_lseek(state->fd_exif[port], 1, SEEK_END); // at the beginning of page 1 - position == page length
 		if (state->exifSize[port] > 0) {
 //state->this_frame_params.meta_index
-			lseek(state->fd_exif[port], state->this_frame_params[port].meta_index, SEEK_END); // select meta page to use (matching frame)
-			rslt = read(state->fd_exif[port], state->ed[port], state->exifSize[port]);
+			dev_lseek(state->fd_exif[port], state->this_frame_params[port].meta_index, SEEK_END); // select meta page to use (matching frame)
+			rslt = dev_read(state->fd_exif[port], state->ed[port], state->exifSize[port]);
 			if (rslt < 0) rslt = 0;
 			state->exifSize[port] = rslt;
 		} else state->exifSize[port] = 0;
+		TRACE_END("exif", port);
 	} else state->exifSize[port] = 0;
 
-	D3(fprintf(debug_file, "_6_"));
+	DB(3, "_6_");
 
 // prepare a packet to be sent (a lst of memory chunks)
 	state->chunk_index = 0;
 	state->packetchunks[state->chunk_index  ].bytes = 1;
 	state->packetchunks[state->chunk_index++].chunk = &frame_packet_type;
 	if (state->exif > 0) { // insert Exif
-		D3(fprintf(debug_file, "_7_"));
+		DB(3, "_7_");
 		state->packetchunks[state->chunk_index  ].bytes = 2;
 		state->packetchunks[state->chunk_index++].chunk = state->jpegHeader[port];
 		state->packetchunks[state->chunk_index  ].bytes = state->exifSize[port];
@@ -647,16 +748,16 @@ int sendImageFrame(camogm_state *state)
 		state->packetchunks[state->chunk_index  ].bytes = state->head_size[port] - 2;
 		state->packetchunks[state->chunk_index++].chunk = &(state->jpegHeader[port][2]);
 	} else {
-		D3(fprintf(debug_file, "_8_"));
+		DB(3, "_8_");
 		state->packetchunks[state->chunk_index  ].bytes = state->head_size[port];
 		state->packetchunks[state->chunk_index++].chunk = state->jpegHeader[port];
 	}
-	D3(fprintf(debug_file, "_9_"));
+	DB(3, "_9_");
 
 /* JPEG image data may be split in two segments (rolled over buffer end) - process both variants */
 	if ((state->cirbuf_rp[port] + state->jpeg_len) > state->circ_buff_size[port]) { // two segments
 /* copy from the beginning of the frame to the end of the buffer */
-		D3(fprintf(debug_file, "_10_"));
+		DB(3, "_10_");
 		state->packetchunks[state->chunk_index  ].bytes = state->circ_buff_size[port] - state->cirbuf_rp[port];
 		state->packetchunks[state->chunk_index++].chunk = (unsigned char*)&ccam_dma_buf[state->port_num][state->cirbuf_rp[port] >> 2];
 /* copy from the beginning of the buffer to the end of the frame */
@@ -664,40 +765,61 @@ int sendImageFrame(camogm_state *state)
 		state->packetchunks[state->chunk_index++].chunk = (unsigned char*)&ccam_dma_buf[state->port_num][0];
 		state->writer_params.segments = 2;
 	} else { // single segment
-		D3(fprintf(debug_file, "_11_"));
+		DB(3, "_11_");
 
 /* copy from the beginning of the frame to the end of the frame (no buffer rollovers) */
 		state->packetchunks[state->chunk_index  ].bytes = state->jpeg_len;
 		state->packetchunks[state->chunk_index++].chunk = (unsigned char*)&ccam_dma_buf[state->port_num][state->cirbuf_rp[port] >> 2];
 		state->writer_params.segments = 1;
 	}
-	D3(fprintf(debug_file, "\tcirbuf_rp = 0x%x\t", state->cirbuf_rp[port]));
-	D3(fprintf(debug_file, "_12_"));
+	DB(3, "\tcirbuf_rp = 0x%x\t", state->cirbuf_rp[port]);
+	DB(3, "_12_");
 	state->packetchunks[state->chunk_index  ].bytes = 2;
 	state->packetchunks[state->chunk_index++].chunk = (unsigned char*)trailer;
 
+// raw device frames are aligned and queued to writer thread, the stages are measured there
+	TRACE_END("harvest", port);
+	t_write = lat_time();
+	if (!state->rawdev_op)
+		hist_add(&state->cnt.lat[LAT_PREPARE], t_write - state->t_harvest);
+	TRACE_BEGIN("write", port);
 	switch (state->format) {
 	case CAMOGM_FORMAT_NONE: rslt = 0; break;
 	case CAMOGM_FORMAT_OGM:  rslt = camogm_frame_ogm(state); break;
 	case CAMOGM_FORMAT_JPEG: rslt = camogm_frame_jpeg(state); break;
 	case CAMOGM_FORMAT_MOV:  rslt = camogm_frame_mov(state); break;
+	case CAMOGM_FORMAT_FMP4: rslt = camogm_frame_fmp4(state); break;
+	case CAMOGM_FORMAT_MKV:  rslt = camogm_frame_mkv(state); break;
+	case CAMOGM_FORMAT_JPACK: rslt = camogm_frame_jpack(state); break;
 	default: rslt = 0; // do nothing
 	}
+	TRACE_END("write", port);
+	t_done = lat_time();
+	if (!state->rawdev_op)
+		hist_add(&state->cnt.lat[LAT_WRITE], t_done - t_write);
 	if (rslt) {
-		D3(fprintf(debug_file, "sendImageFrame:12: camogm_frame_***() returned %d\n", rslt));
+		DB(3, "sendImageFrame:12: camogm_frame_***() returned %d\n", rslt);
 		return rslt;
 	}
+	if (!state->rawdev_op) writeback_frame(state);
 	if (state->kml_used) rslt = camogm_frame_kml(state);  // will turn on state->kml_used if it can
 	if (rslt) return rslt;
 
-	D3(fprintf(debug_file, "_14_"));
+	DB(3, "_14_");
+// this frame of current group is recorded
+	state->group.pending &= ~(1 << port);
+	flight_record(FLIGHT_FRAME, port, state->t_harvest, state->cirbuf_rp[port], getGPValue(port, G_FREECIRCBUF),
+			state->jpeg_len, t_done - t_write, __atomic_load_n(&state->writer_params.data_ready, __ATOMIC_RELAXED),
+			state->sched_reason, 0);
 // advance frame pointer
 	state->frameno++;
-	state->cirbuf_rp[port] = lseek(state->fd_circ[port], LSEEK_CIRC_NEXT, SEEK_END);
-	D3(fprintf(debug_file, "\tcompressed frame number: %li\t", lseek(state->fd_circ[port], LSEEK_CIRC_GETFRAME, SEEK_END)));
+	CNT_INC(state->cnt.frames[port]);
+	CNT_ADD(state->cnt.bytes[port], state->jpeg_len);
+	state->cirbuf_rp[port] = dev_lseek(state->fd_circ[port], LSEEK_CIRC_NEXT, SEEK_END);
+	DB(3, "\tcompressed frame number: %li\t", dev_lseek(state->fd_circ[port], LSEEK_CIRC_GETFRAME, SEEK_END));
 // optionally save it to global read pointer (i.e. for debugging with imgsrv "/pointers")
-	if (state->save_gp) lseek(state->fd_circ[port], LSEEK_CIRC_SETP, SEEK_END);
-	D3(fprintf(debug_file, "_15_\n"));
+	if (state->save_gp) dev_lseek(state->fd_circ[port], LSEEK_CIRC_SETP, SEEK_END);
+	DB(3, "_15_\n");
 	if (state->frames_skip > 0) {
 		state->frames_skip_left[port] = state->frames_skip;
 	} else if (state->frames_skip < 0) {
@@ -705,17 +827,6 @@ int sendImageFrame(camogm_state *state)
 	}
 	D3(fprintf(debug_file,"cirbuf_rp to next frame = 0x%x\n", state->cirbuf_rp[port]));
 
-//	end_time = get_fpga_time(state->fd_fparmsall[port], port);
-//	unsigned int mbps; // write speed, MB/s
-//	unsigned long long time_diff; // time elapsed, in microseconds
-//	time_diff = ((end_time.tv_sec * 1000000 + end_time.tv_usec) - (start_time.tv_sec * 1000000 + start_time.tv_usec));
-//	mbps = ((double)state->rawdev.last_jpeg_size / (double)1048576) / ((double)time_diff / (double)1000000);
-//	D6(fprintf(debug_file, "Frame start time: %ld:%ld; frame end time: %ld:%ld; last frame size: %lu\n",
-//			start_time.tv_sec, start_time.tv_usec,
-//			end_time.tv_sec, end_time.tv_usec,
-//			state->rawdev.last_jpeg_size));
-//	D6(fprintf(debug_file, "Write speed: %d MB/s\n", mbps));
-
 	return 0;
 }
 
@@ -741,17 +852,7 @@ int camogm_stop(camogm_state *state)
 		return 0;
 	}
 	D1(fprintf(debug_file, "Ending recording\n"));
-	if (state->kml_used) camogm_end_kml(state);
-	switch (state->format) {
-	case CAMOGM_FORMAT_NONE: rslt = 0; break;
-	case CAMOGM_FORMAT_OGM:  rslt = camogm_end_ogm(state); break;
-	case CAMOGM_FORMAT_JPEG: rslt = camogm_end_jpeg(state); break;
-	case CAMOGM_FORMAT_MOV:  rslt = camogm_end_mov(state); break;
-//    default: return 0; // do nothing
-	}
-// now close video file (if it is open)
-	if (state->vf) fclose(state->vf);
-	state->vf = NULL;
+	rslt = camogm_end_segment(state, false);
 	if (rslt) return rslt;
 	state->last = 1;
 	pthread_mutex_lock(&state->mutex);
@@ -760,6 +861,145 @@ int camogm_stop(camogm_state *state)
 	return 0;
 }
 
+/**
+ * @brief End current file segment. Format handlers move open files and buffers to a segment job, which is
+ * either run immediately or handed off to finalizer thread.
+ * @param[in]   state   a pointer to a structure containing current state
+ * @param[in]   async   finalize segment in background
+ * @return      0 if the segment was ended successfully and negative error code otherwise
+ */
+static int camogm_end_segment(camogm_state *state, bool async)
+{
+	int rslt = 0;
+	int job_rslt = 0;
+	struct segment_job local_job;
+	struct segment_job *job = NULL;
+
+	TRACE_BEGIN("segment_stop", state->port_num);
+	if (async)
+		job = malloc(sizeof(struct segment_job));
+	if (job == NULL) {
+		job = &local_job;
+		async = false;
+	}
+	segment_job_init(job, state->path);
+	if (state->kml_used) camogm_end_kml(state, job);
+	switch (state->format) {
+	case CAMOGM_FORMAT_NONE: rslt = 0; break;
+	case CAMOGM_FORMAT_OGM:  rslt = camogm_end_ogm(state, job); break;
+	case CAMOGM_FORMAT_JPEG: rslt = camogm_end_jpeg(state); break;
+	case CAMOGM_FORMAT_MOV:  rslt = camogm_end_mov(state, job); break;
+	case CAMOGM_FORMAT_FMP4: rslt = camogm_end_fmp4(state, job); break;
+	case CAMOGM_FORMAT_MKV:  rslt = camogm_end_mkv(state, job); break;
+	case CAMOGM_FORMAT_JPACK: rslt = camogm_end_jpack(state, job); break;
+	}
+	writeback_end(state, job);
+	if (async)
+		finalizer_submit(job);
+	else
+		job_rslt = segment_job_run(job, false);
+	TRACE_END("segment_stop", state->port_num);
+
+	return rslt ? rslt : job_rslt;
+}
+
+/**
+ * @brief Read metadata and timestamp of the frame at the specified circbuf pointer
+ * @param[in]   state    a pointer to a structure containing current state
+ * @param[in]   port     sensor port number
+ * @param[in]   fp       frame pointer in circbuf
+ * @param[out]  params   frame parameters
+ * @return      0 if the frame parameters are valid and negative error code otherwise
+ */
+static int get_frame_params(camogm_state *state, int port, int fp, struct interframe_params_t *params)
+{
+	int metadata_start, timestamp_start;
+
+	metadata_start = fp - 32;
+	if (metadata_start < 0) metadata_start += state->circ_buff_size[port];
+	memcpy(params, (unsigned long* )&ccam_dma_buf[port][metadata_start >> 2], 32);
+	if (params->signffff != 0xffff)
+		return -CAMOGM_FRAME_BROKEN;
+	timestamp_start = fp + ((params->frame_length + CCAM_MMAP_META + 3) & (~0x1f)) + 32 - CCAM_MMAP_META_SEC; // magic shift - should index first byte of the time stamp
+	if (timestamp_start >= state->circ_buff_size[port]) timestamp_start -= state->circ_buff_size[port];
+	memcpy(&params->timestamp_sec, (unsigned long* )&ccam_dma_buf[port][timestamp_start >> 2], 8);
+
+	return 0;
+}
+
+/**
+ * @brief Switch to the next file segment without restarting recording. Frame size, frame period and JPEG
+ * headers are unchanged, so the new segment starts with the frame at current read pointer and there is no
+ * need to skip frames as #camogm_start does, only this frame is waited for if it is not acquired yet.
+ * The previous segment is finalized in background.
+ * @param[in]   state   a pointer to a structure containing current state
+ * @return      0 if the new segment was started and negative error code otherwise, full restart is
+ * needed in the latter case
+ */
+static int camogm_next_segment(camogm_state *state)
+{
+	int rslt;
+	int port = state->port_num;
+	struct interframe_params_t params;
+
+	if (state->rawdev_op || state->format != state->set_format ||
+			dev_lseek(state->fd_circ[port], state->cirbuf_rp[port], SEEK_SET) < 0)
+		return -CAMOGM_FRAME_CHANGED;
+	// recording usually keeps up with compressor and the next frame is not acquired yet, wait for it here
+	if (dev_lseek(state->fd_circ[port], LSEEK_CIRC_READY, SEEK_END) < 0) {
+		if (dev_lseek(state->fd_circ[port], LSEEK_CIRC_WAIT, SEEK_END) < 0 ||
+				dev_lseek(state->fd_circ[port], state->cirbuf_rp[port], SEEK_SET) < 0 ||
+				dev_lseek(state->fd_circ[port], LSEEK_CIRC_READY, SEEK_END) < 0) {
+			D3(fprintf(debug_file, "The first frame of the next segment is not ready\n"));
+			return -CAMOGM_FRAME_CHANGED;
+		}
+	}
+	if ((rslt = get_frame_params(state, port, state->cirbuf_rp[port], &params)) < 0)
+		return rslt;
+	if ((params.width != state->frame_params[port].width) || (params.height != state->frame_params[port].height))
+		return -CAMOGM_FRAME_CHANGED;
+
+	D1(fprintf(debug_file, "Switching to the next file segment\n"));
+	rslt = camogm_end_segment(state, true);
+	if (rslt) {
+		pthread_mutex_lock(&state->mutex);
+		state->prog_state = STATE_STOPPED;
+		pthread_mutex_unlock(&state->mutex);
+		return rslt;
+	}
+
+	// the new segment starts at current frame, segment duration is counted for all ports from this frame
+	FOR_EACH_PORT(int, chn) {
+		state->frame_params[chn].timestamp_sec = params.timestamp_sec;
+		state->frame_params[chn].timestamp_usec = params.timestamp_usec;
+	}
+	state->frame_params[port] = params;
+	state->this_frame_params[port] = params;
+	state->frameno = 0;
+	state->max_frames = state->set_max_frames;
+	state->frames_per_chunk = state->set_frames_per_chunk;
+	switch (state->format) {
+	case CAMOGM_FORMAT_NONE: rslt = 0;  break;
+	case CAMOGM_FORMAT_OGM:  rslt = camogm_start_ogm(state);  break;
+	case CAMOGM_FORMAT_JPEG: rslt = camogm_start_jpeg(state); break;
+	case CAMOGM_FORMAT_MOV:  rslt = camogm_start_mov(state);  break;
+	case CAMOGM_FORMAT_FMP4: rslt = camogm_start_fmp4(state); break;
+	case CAMOGM_FORMAT_MKV:  rslt = camogm_start_mkv(state);  break;
+	case CAMOGM_FORMAT_JPACK: rslt = camogm_start_jpack(state); break;
+	default: rslt = 0; // do nothing
+	}
+	if (!rslt) writeback_start(state);
+	if (!rslt && state->kml_enable) rslt = camogm_start_kml(state);
+	if (rslt) {
+		D0(fprintf(debug_file, "camogm_next_segment() error, rslt=0x%x\n", rslt));
+		pthread_mutex_lock(&state->mutex);
+		state->prog_state = STATE_STOPPED;
+		pthread_mutex_unlock(&state->mutex);
+	}
+
+	return rslt;
+}
+
 /**
  * @brief Free all file format handlers that were used. @e camogm_free_* for
  * each format used will be called.
@@ -768,13 +1008,18 @@ int camogm_stop(camogm_state *state)
  */
 void camogm_free(camogm_state *state)
 {
+	// compiled templates and other format data may still be used by finalizer
+	finalizer_drain();
 	for (int f = 0; f < 31; f++) {
-		if (state->formats & ( 1 << (state->format))) {
+		if (state->formats & (1 << f)) {
 			switch (f) {
 			case CAMOGM_FORMAT_NONE: break;
 			case CAMOGM_FORMAT_OGM:  camogm_free_ogm(); break;
 			case CAMOGM_FORMAT_JPEG: camogm_free_jpeg(state); break;
 			case CAMOGM_FORMAT_MOV:  camogm_free_mov(); break;
+			case CAMOGM_FORMAT_FMP4: camogm_free_fmp4(); break;
+			case CAMOGM_FORMAT_MKV:  camogm_free_mkv(); break;
+			case CAMOGM_FORMAT_JPACK: camogm_free_jpack(); break;
 			}
 		}
 	}
@@ -797,72 +1042,95 @@ void camogm_reset(camogm_state *state)
 /** @brief kml parameter setter */
 void  camogm_kml_set_enable(camogm_state *state, int d)
 {
-	state->kml_enable = d;
+	state->set.kml_enable = d;
 }
 /** @brief kml parameter setter */
 void  camogm_kml_set_horHalfFov(camogm_state *state, double dd)
 {
-	state->kml_horHalfFov = dd;
+	state->set.kml_horHalfFov = dd;
 }
 /** @brief kml parameter setter */
 void  camogm_kml_set_vertHalfFov(camogm_state *state, double dd)
 {
-	state->kml_vertHalfFov = dd;
+	state->set.kml_vertHalfFov = dd;
 }
 /** @brief kml parameter setter */
 void  camogm_kml_set_height_mode(camogm_state *state, int d)
 {
-	state->kml_height_mode = d;
+	state->set.kml_height_mode = d;
 }
 /** @brief kml parameter setter */
 void  camogm_kml_set_height(camogm_state *state, double dd)
 {
-	state->kml_height = dd;
+	state->set.kml_height = dd;
 }
 /** @brief kml parameter setter */
 void  camogm_kml_set_period(camogm_state *state, int d)
 {
-	state->kml_period = d;
-	state->kml_last_ts = 0;
-	state->kml_last_uts = 0;
+	state->set.kml_period = d;
 }
 /** @brief kml parameter setter */
 void  camogm_kml_set_near(camogm_state *state, double dd)   // distance to PhotoOverlay
 {
-	state->kml_near = dd;
+	state->set.kml_near = dd;
 }
 
 
 void  camogm_set_segment_duration(camogm_state *state, int sd)
 {
-	state->segment_duration = sd;
+	state->set.segment_duration = sd;
 }
 void  camogm_set_segment_length(camogm_state *state, int sl)
 {
-	state->segment_length =   sl;
+	state->set.segment_length =   sl;
 }
 void  camogm_set_save_gp(camogm_state *state, int d)
 {
-	state->save_gp =   d;
+	state->set.save_gp =   d;
 }
 void  camogm_set_exif(camogm_state *state, int d)
 {
-	state->exif =   d;
+	state->set.exif =   d;
 }
 
 void  camogm_set_greedy(camogm_state *state, int d)
 {
-	state->greedy =   d ? 1 : 0;
+	state->set.greedy =   d ? 1 : 0;
 }
 void  camogm_set_ignore_fps(camogm_state *state, int d)
 {
-	state->ignore_fps =   d ? 1 : 0;
+	state->set.ignore_fps =   d ? 1 : 0;
 }
 
 void camogm_set_dummy_read(camogm_state *state, int d)
 {
-	state->writer_params.dummy_read = d ? true : false;
-	D6(fprintf(debug_file, "Set dummy read flag = %d\n", state->writer_params.dummy_read));
+	state->set.dummy_read = d ? true : false;
+	D6(fprintf(debug_file, "Set dummy read flag = %d\n", state->set.dummy_read));
+}
+
+/**
+ * @brief Set the size of regular file used as raw device buffer. The file will be created or extended
+ * to this size when raw device path is set.
+ * @param[in]   state   a pointer to a structure containing current state
+ * @param[in]   d       file size in megabytes
+ * @return      None
+ */
+void camogm_set_rawdev_size(camogm_state *state, uint64_t d)
+{
+	state->set.rawdev_size = d * 1048576;
+}
+
+/**
+ * @brief Set storage backend of raw device and faults injected into its writes, takes effect when raw
+ * device is opened next time
+ * @param[in]   state   a pointer to a structure containing current state
+ * @param[in]   cfg     storage configuration checked with storage_check()
+ * @return      None
+ */
+void camogm_set_rawdev_storage(camogm_state *state, const char *cfg)
+{
+	strncpy(state->set.rawdev_storage, cfg, STORAGE_CFG_LEN - 1);
+	state->set.rawdev_storage[STORAGE_CFG_LEN - 1] = '\0';
 }
 
 /**
@@ -870,16 +1138,17 @@ void camogm_set_dummy_read(camogm_state *state, int d)
  * @param[in]   state   a pointer to a structure containing current state
  * @param[in]   p       a pointer to the prefix string. The string is prepended to
  * the file name as is.
- * @param[in]   type    the type of prefix, can be one of #path_type
+ * @param[in]   type    the type of prefix, can be one of #path_type. Raw device path can be either
+ * a block device in /dev or an absolute path to a regular file.
  */
 void  camogm_set_prefix(camogm_state *state, const char * p, path_type type)
 {
 	if (type == FILE_PATH) {
-		strncpy(state->path_prefix, p, sizeof(state->path_prefix) - 1);
-		state->path_prefix[sizeof(state->path_prefix) - 1] = '\0';
-	} else if (type == RAW_PATH && (strncmp(p, "/dev/", 5) == 0)) {
-		strncpy(state->rawdev.rawdev_path, p, sizeof(state->rawdev.rawdev_path) - 1);
-		state->rawdev.rawdev_path[sizeof(state->rawdev.rawdev_path) - 1] = '\0';
+		strncpy(state->set.path_prefix, p, sizeof(state->set.path_prefix) - 1);
+		state->set.path_prefix[sizeof(state->set.path_prefix) - 1] = '\0';
+	} else if (type == RAW_PATH && p[0] == '/') {
+		strncpy(state->set.rawdev_path, p, sizeof(state->set.rawdev_path) - 1);
+		state->set.rawdev_path[sizeof(state->set.rawdev_path) - 1] = '\0';
 	}
 }
 
@@ -890,9 +1159,18 @@ void  camogm_set_prefix(camogm_state *state, const char * p, path_type type)
  */
 void get_disk_info(camogm_state *state)
 {
+	int sb_valid = 0;
+	uint64_t dev_size;
 	struct range rng = {0};
+	struct raw_superblock sb;
 
+	state->rawdev.start_pos = RAWDEV_START_OFFSET;
+	state->rawdev.rawdev_file = (strncmp(state->rawdev.rawdev_path, "/dev/", 5) != 0);
+	if (state->rawdev.rawdev_file && prep_rawdev_file(state) != 0) {
+		D0(fprintf(debug_file, "ERROR: unable to prepare raw device buffer file %s\n", state->rawdev.rawdev_path));
+	}
 	state->rawdev.end_pos = get_disk_size(state->rawdev.rawdev_path);
+	dev_size = state->rawdev.end_pos;
 	if (state->rawdev.end_pos == 0) {
 		state->rawdev_op = 0;
 		state->rawdev.end_pos = state->rawdev.start_pos;
@@ -903,11 +1181,32 @@ void get_disk_info(camogm_state *state)
 		state->rawdev_op = 1;
 	}
 
-	if (get_disk_range(state->rawdev.rawdev_path, &rng) == 0) {
+	// superblock describes buffer layout, use it if available
+	if (state->rawdev_op && superblock_read(state->rawdev.rawdev_path, &sb) == 0) {
+		sb_valid = 1;
+		state->rawdev.start_pos = sb.ring_start;
+		if (sb.ring_end < state->rawdev.end_pos)
+			state->rawdev.end_pos = sb.ring_end;
+		D0(fprintf(debug_file, "Raw device buffer superblock found: version %u, data from %llu to %llu, port mask 0x%x\n",
+				sb.version, sb.ring_start, sb.ring_end, sb.port_mask));
+	}
+
+	if (state->rawdev.rawdev_file) {
+		// regular file does not have disk geometry, use the whole file
+		state->writer_params.lba_start = 0;
+		state->writer_params.lba_end = dev_size / PHY_BLOCK_SIZE;
+		state->writer_params.lba_current = state->writer_params.lba_start + RAWDEV_START_LBA;
+	} else if (get_disk_range(state->rawdev.rawdev_path, &rng) == 0) {
 		state->writer_params.lba_start = rng.from;
 		state->writer_params.lba_end = rng.to;
-		state->writer_params.lba_current = state->writer_params.lba_start;
+		state->writer_params.lba_current = state->writer_params.lba_start + RAWDEV_START_LBA;
 		set_disk_range(&rng);
+	} else if (sb_valid) {
+		// disk image or a disk attached to other system, take geometry from superblock
+		state->writer_params.lba_start = sb.lba_start;
+		state->writer_params.lba_end = sb.lba_end;
+		state->writer_params.lba_current = state->writer_params.lba_start + RAWDEV_START_LBA;
+		D0(fprintf(debug_file, "Disk size and starting sector are taken from superblock\n"));
 	} else {
 		D0(fprintf(debug_file, "ERROR: unable to get disk size and starting sector\n"));
 	}
@@ -916,64 +1215,276 @@ void get_disk_info(camogm_state *state)
 /** @brief Set timescale @e d, default = 1,000,000 */
 void  camogm_set_timescale(camogm_state *state, double d)
 {
-	state->set_timescale =  d;
-	if (state->prog_state == STATE_STOPPED) {
-		state->timescale = state->set_timescale;
-	}
+	state->set.timescale =  d;
 }
 
 /** @brief Set the number of frames @e d to be skipped during recording. This values is common for each sensor port */
 void  camogm_set_frames_skip(camogm_state *state, int d)
 {
-	state->set_frames_skip =  d;
-	if (state->prog_state == STATE_STOPPED) {
-		state->frames_skip =      state->set_frames_skip;
-		state->frames_skip_left[state->port_num] = 0;
-	}
+	state->set.frames_skip =  d;
 }
 
-/** @brief Set file format @e d the images will be recorded to. This function calls corresponding @e camogm_init_*
- * function for the format selected.*/
+/** @brief Set file format @e d the images will be recorded to. The format is initialized when capture
+ * thread applies the settings while recording is stopped */
 void  camogm_set_format(camogm_state *state, int d)
 {
-	int rslt = 0;
-
-	state->set_format =  d;
-	if (state->prog_state == STATE_STOPPED) {
-		state->format =  state->set_format;
-		switch (state->format) {
-		case CAMOGM_FORMAT_NONE: rslt = 0; break;
-		case CAMOGM_FORMAT_OGM:  rslt = camogm_init_ogm(); break;
-		case CAMOGM_FORMAT_JPEG: rslt = camogm_init_jpeg(state); break;
-		case CAMOGM_FORMAT_MOV:  rslt = camogm_init_mov(); break;
-		}
-		if (rslt) {
-			D0(fprintf(debug_file, "%s:%d: Error setting format to=%d\n", __FILE__, __LINE__, state->format));
-		}
-		state->formats |= 1 << (state->format);
-	}
+	state->set.format =  d;
 }
 
 /** @brief Set max number of frames @e d */
 void  camogm_set_max_frames(camogm_state *state, int d)
 {
-	state->set_max_frames =  d;
-	if (state->prog_state == STATE_STOPPED)
-		state->max_frames = d;
+	state->set.max_frames =  d;
 }
 
 /** @brief Set the number of frames @e d recorded per chunk */
 void  camogm_set_frames_per_chunk(camogm_state *state, int d)
 {
-	state->set_frames_per_chunk =  d;
-	if (state->prog_state == STATE_STOPPED)
-		state->frames_per_chunk = d;
+	state->set.frames_per_chunk =  d;
+}
+/** @brief Set the maximal number of frames in one fragment of fragmented MP4 file */
+void  camogm_set_frag_frames(camogm_state *state, int d)
+{
+	if (d <= 0 || d > FMP4_MAX_FRAG_FRAMES)
+		d = FMP4_MAX_FRAG_FRAMES;
+	state->set.frag_frames = d;
+}
+/** @brief Set the maximal duration (in milliseconds) of one fragment of fragmented MP4 file, 0 - no limit */
+void  camogm_set_frag_duration(camogm_state *state, int d)
+{
+	state->set.frag_duration = (d > 0) ? d : 0;
+}
+/** @brief Record all active ports as separate tracks of one file and interleave frames by time stamp (Matroska only) */
+void  camogm_set_multitrack(camogm_state *state, int d)
+{
+	state->set.multitrack = d ? 1 : 0;
+}
+/** @brief Record time-aligned frames from all active ports as groups (raw device buffer only) */
+void  camogm_set_frame_groups(camogm_state *state, int d)
+{
+	state->set.frame_groups = d ? 1 : 0;
+}
+/** @brief Set the time (in milliseconds) to wait for the frames of a group, the group is recorded without
+ * missing frames after this time */
+void  camogm_set_group_timeout(camogm_state *state, int d)
+{
+	state->set.group_timeout = (d > 0) ? d : 0;
+}
+/** @brief Set the layout of directories for individual JPEG files, see JPEG_LAYOUT_* values */
+void  camogm_set_jpeg_layout(camogm_state *state, int d)
+{
+	if (d >= JPEG_LAYOUT_FLAT && d <= JPEG_LAYOUT_COUNT)
+		state->set.jpeg_layout = d;
+}
+/** @brief Set the number of JPEG files in one directory in counter layout */
+void  camogm_set_jpeg_dir_files(camogm_state *state, int d)
+{
+	if (d > 0)
+		state->set.jpeg_dir_files = d;
+}
+/** @brief Set writeback chunk size in MiB, recorded files are written to disk and released from page
+ * cache in chunks of this size. 0 leaves writeback to kernel */
+void  camogm_set_writeback(camogm_state *state, int d)
+{
+	if (d < 0) d = 0;
+	if (d > MAX_WRITEBACK_SIZE) d = MAX_WRITEBACK_SIZE;
+	state->set.writeback = d * 1024 * 1024;
+}
+/** @brief Preallocate segment files up to segment length */
+void  camogm_set_prealloc(camogm_state *state, int d)
+{
+	state->set.prealloc = d ? 1 : 0;
 }
 
 /** @brief Set the time stamp @e d when recording should be started */
 void  camogm_set_start_after_timestamp(camogm_state *state, double d)
 {
-	state->start_after_timestamp =  d;
+	state->set.start_after_timestamp =  d;
+}
+
+/**
+ * @brief Apply settings snapshot published by control thread. This function is called by capture thread
+ * between frames, the parameters which can not be changed during recording are saved and take effect at
+ * the next start.
+ * @param[in]   state   a pointer to a structure containing current state
+ * @param[in]   s       settings snapshot, the function takes ownership of it
+ * @return      None
+ */
+static void camogm_apply_settings(camogm_state *state, const struct camogm_settings *s)
+{
+	int rslt = 0;
+	const struct camogm_settings *prev = state->cfg;
+
+	if (!s)
+		return;
+	state->segment_duration = s->segment_duration;
+	state->segment_length = s->segment_length;
+	state->greedy = s->greedy;
+	state->ignore_fps = s->ignore_fps;
+	state->save_gp = s->save_gp;
+	state->exif = s->exif;
+	strcpy(state->path_prefix, s->path_prefix);
+	state->start_after_timestamp = s->start_after_timestamp;
+	state->frag_frames = s->frag_frames;
+	state->frag_duration = s->frag_duration;
+	state->multitrack = s->multitrack;
+	state->frame_groups = s->frame_groups;
+	state->group_timeout = s->group_timeout;
+	state->jpeg_layout = s->jpeg_layout;
+	state->jpeg_dir_files = s->jpeg_dir_files;
+	state->writeback = s->writeback;
+	state->prealloc = s->prealloc;
+	state->rawdev.file_size = s->rawdev_size;
+	strcpy(state->writer_params.storage_cfg, s->rawdev_storage);
+	state->writer_params.dummy_read = s->dummy_read;
+
+	state->kml_enable = s->kml_enable;
+	state->kml_horHalfFov = s->kml_horHalfFov;
+	state->kml_vertHalfFov = s->kml_vertHalfFov;
+	state->kml_near = s->kml_near;
+	state->kml_height_mode = s->kml_height_mode;
+	state->kml_height = s->kml_height;
+	if (!prev || prev->kml_period != s->kml_period) {
+		state->kml_period = s->kml_period;
+		state->kml_last_ts = 0;
+		state->kml_last_uts = 0;
+	}
+
+	state->set_timescale = s->timescale;
+	state->set_max_frames = s->max_frames;
+	state->set_frames_per_chunk = s->frames_per_chunk;
+	state->set_frames_skip = s->frames_skip;
+	state->set_format = s->format;
+	if (state->prog_state == STATE_STOPPED) {
+		state->timescale = state->set_timescale;
+		state->max_frames = state->set_max_frames;
+		state->frames_per_chunk = state->set_frames_per_chunk;
+		if (!prev || prev->frames_skip != s->frames_skip) {
+			state->frames_skip = state->set_frames_skip;
+			state->frames_skip_left[state->port_num] = 0;
+		}
+		if (!prev || state->format != state->set_format) {
+			state->format = state->set_format;
+			switch (state->format) {
+			case CAMOGM_FORMAT_NONE: rslt = 0; break;
+			case CAMOGM_FORMAT_OGM:  rslt = camogm_init_ogm(); break;
+			case CAMOGM_FORMAT_JPEG: rslt = camogm_init_jpeg(state); break;
+			case CAMOGM_FORMAT_MOV:  rslt = camogm_init_mov(); break;
+			case CAMOGM_FORMAT_FMP4: rslt = camogm_init_fmp4(state); break;
+			case CAMOGM_FORMAT_MKV:  rslt = camogm_init_mkv(); break;
+			case CAMOGM_FORMAT_JPACK: rslt = camogm_init_jpack(); break;
+			}
+			if (rslt) {
+				D0(fprintf(debug_file, "%s:%d: Error setting format to=%d\n", __FILE__, __LINE__, state->format));
+			}
+			state->formats |= 1 << (state->format);
+		}
+	}
+
+	state->cfg = s;
+	free((void *)prev);
+}
+
+/**
+ * @brief Publish recording counters and current segment parameters for status reports. This function is
+ * called by capture thread between frames and does not block.
+ * @param[in]   state   a pointer to a structure containing current state
+ * @return      None
+ */
+static void camogm_publish_counters(camogm_state *state)
+{
+	int64_t len = 0;
+	int dur = 0, udur = 0, dur_raw, udur_raw;
+	struct camogm_counters *cnt = &state->cnt;
+	struct camogm_seg_info *info = &cnt->info;
+
+	// status report has been read, restart the counters reported since the last report
+	if (__atomic_exchange_n(&cnt->stat_reset, 0, __ATOMIC_RELAXED)) {
+		FOR_EACH_PORT(int, chn) {
+			if (state->buf_overruns[chn] >= 0) state->buf_overruns[chn] = 0;
+			state->buf_min[chn] = getGPValue(chn, G_FREECIRCBUF);
+		}
+		state->last_error_code = 0;
+	}
+
+	FOR_EACH_PORT(int, chn) {
+		dur_raw = state->this_frame_params[chn].timestamp_sec - state->frame_params[chn].timestamp_sec;
+		udur_raw = state->this_frame_params[chn].timestamp_usec - state->frame_params[chn].timestamp_usec;
+		if (udur_raw < 0) {
+			dur_raw -= 1;
+			udur_raw += 1000000;
+		} else if (udur_raw >= 1000000) {
+			dur_raw += 1;
+			udur_raw -= 1000000;
+		}
+		dur += dur_raw;
+		udur += udur_raw;
+		if (udur > 1000000) {
+			dur += 1;
+			udur -= 1000000;
+		}
+		CNT_SET(cnt->frames_remain[chn], (state->frames_skip > 0) ? state->frames_skip_left[chn] : 0);
+		CNT_SET(cnt->sec_remain[chn], (state->frames_skip < 0) ?
+				(state->frames_skip_left[chn] - state->this_frame_params[chn].timestamp_sec) : 0);
+		CNT_SET(cnt->buf_overruns[chn], state->buf_overruns[chn]);
+		CNT_SET(cnt->buf_min[chn], state->buf_min[chn]);
+		CNT_SET(cnt->frame_period[chn], state->frame_period[chn]);
+		CNT_SET(cnt->cirbuf_rp[chn], state->cirbuf_rp[chn]);
+	}
+	if (state->rawdev_op)
+		len = state->rawdev.total_rec_len;
+	else if ((state->ivf) >= 0) len = (int64_t)lseek(state->ivf, 0, SEEK_CUR);      //for mov
+	CNT_SET(cnt->file_length, len);
+	CNT_SET(cnt->dur_sec, dur);
+	CNT_SET(cnt->dur_usec, udur);
+	CNT_SET(cnt->frameno, state->frameno);
+	CNT_SET(cnt->last_error_code, state->last_error_code);
+	CNT_SET(cnt->kml_last_ts, state->kml_last_ts);
+	CNT_SET(cnt->kml_last_uts, state->kml_last_uts);
+	CNT_SET(cnt->groups, state->group.groups);
+	CNT_SET(cnt->partial, state->group.partial);
+	CNT_SET(cnt->overrun, state->rawdev.overrun);
+	CNT_SET(cnt->pos_w, state->rawdev.curr_pos_w);
+	CNT_SET(cnt->lba_current, state->writer_params.lba_current);
+
+	counters_info_begin(cnt);
+	strcpy(info->path, state->path);
+	strcpy(info->kml_path, state->kml_path);
+	strcpy(info->rawdev_path, state->rawdev.rawdev_path);
+	info->rawdev_file = state->rawdev.rawdev_file;
+	info->start_pos = state->rawdev.start_pos;
+	info->end_pos = state->rawdev.end_pos;
+	info->lba_start = state->writer_params.lba_start;
+	info->lba_end = state->writer_params.lba_end;
+	info->format = state->format;
+	info->timescale = state->timescale;
+	info->max_frames = state->max_frames;
+	info->frames_per_chunk = state->frames_per_chunk;
+	info->frames_skip = state->frames_skip;
+	info->kml_used = state->kml_used;
+	info->active_chn = state->active_chn;
+	info->width = state->width;
+	info->height = state->height;
+	counters_info_end(cnt);
+}
+
+/**
+ * @brief Return program state name used in status reports
+ * @param[in]   prog_state   program state, one of #state_flags
+ * @return      state name
+ */
+const char *camogm_state_name(int prog_state)
+{
+	switch (prog_state) {
+	case STATE_RUNNING:
+		return "running";
+	case STATE_STARTING:
+		return "starting";
+	case STATE_READING:
+		return "reading";
+	default:
+		return "stopped";
+	}
 }
 
 /**
@@ -982,64 +1493,55 @@ void  camogm_set_start_after_timestamp(camogm_state *state, double d)
  * @param[in]   fn      a pointer to a file name which will be used for output. Can be NULL or 'stdout' for
  * output to stdout, 'stderr' for output to stderr and a file name for output to a file
  * @param[in]   xml     flag indicating that the output should be in xml format
- * @note access to state->rawdev.curr_pos_r is not locked in reading thread
+ * @param[in]   out     stream used instead of stdout when @e fn is NULL (i.e. control socket reply), can be NULL
+ * @note this function is called by control thread, recording parameters are taken from the counters published
+ * by capture thread and access to state->rawdev.curr_pos_r is not locked in reading thread
  * @return      None
  */
-void  camogm_status(camogm_state *state, char * fn, int xml)
+void  camogm_status(camogm_state *state, char * fn, int xml, FILE *out)
 {
-	int64_t _len = 0;
-	int _dur = 0, _udur = 0, _dur_raw, _udur_raw;
+	int64_t _len;
+	int _dur, _udur;
 	FILE* f;
-	char *_state, *_output_format, *_using_exif, *_using_global_pointer, *_compressor_state[SENSOR_PORTS];
+	const char *_state;
+	char *_output_format, *_using_exif, *_using_global_pointer, *_compressor_state[SENSOR_PORTS];
+	char *_jpeg_layout;
 	int _b_free[SENSOR_PORTS], _b_used[SENSOR_PORTS], _b_size[SENSOR_PORTS];
-	int _frames_remain[SENSOR_PORTS] = {0};
-	int _sec_remain[SENSOR_PORTS] = {0};
 	int _frames_skip = 0;
 	int _sec_skip = 0;
 	char *_kml_enable, *_kml_used, *_kml_height_mode;
 	unsigned int _percent_done;
-	off_t save_p;
-
-	_kml_enable =      state->kml_enable ? "yes" : "no";
-	_kml_used =        state->kml_used ? "yes" : "no";
-	_kml_height_mode = state->kml_height_mode ? "GPS altitude" : "map ground level"; // 1 - actual, 0 - ground
+	struct finalizer_stat _fin_stat;
+	struct camogm_seg_info info;
+	struct camogm_counters *cnt = &state->cnt;
+	const struct camogm_settings *set = &state->set;
+	uint64_t _bps[SENSOR_PORTS], _stuffing[SENSOR_PORTS];
+	uint64_t _lat_period = lat_time() - state->cp.lat_start;
+
+	finalizer_get_stat(&_fin_stat);
+	counters_get_info(cnt, &info);
+	_kml_enable =      set->kml_enable ? "yes" : "no";
+	_kml_used =        info.kml_used ? "yes" : "no";
+	_kml_height_mode = set->kml_height_mode ? "GPS altitude" : "map ground level"; // 1 - actual, 0 - ground
 
 	for (int chn = 0; chn < SENSOR_PORTS; chn++) {
 		_b_size[chn] = getGPValue(chn, G_FRAME_SIZE);
-		save_p = lseek(state->fd_circ[chn], 0, SEEK_CUR);
-		_b_free[chn] = lseek(state->fd_circ[chn], LSEEK_CIRC_FREE, SEEK_END);
-		lseek(state->fd_circ[chn], save_p, SEEK_SET);
-		_b_used[chn] = lseek(state->fd_circ[chn], LSEEK_CIRC_USED, SEEK_END);
-		lseek(state->fd_circ[chn], save_p, SEEK_SET);
+		_b_free[chn] = dev_lseek(state->cp.fd_circ[chn], LSEEK_CIRC_FREE, SEEK_END);
+		_b_used[chn] = dev_lseek(state->cp.fd_circ[chn], LSEEK_CIRC_USED, SEEK_END);
 		_compressor_state[chn] = (getGPValue(chn, P_COMPRESSOR_RUN) == 2) ? "running" : "stopped";
-		if (state->frames_skip > 0)
-			_frames_remain[chn] = state->frames_skip_left[chn];
-		else if (state->frames_skip < 0)
-			_sec_remain[chn] = (state->frames_skip_left[chn] - state->this_frame_params[chn].timestamp_sec);
-
-		_dur_raw = state->this_frame_params[chn].timestamp_sec - state->frame_params[chn].timestamp_sec;
-		_udur_raw = state->this_frame_params[chn].timestamp_usec - state->frame_params[chn].timestamp_usec;
-		if (_udur_raw < 0) {
-			_dur_raw -= 1;
-			_udur_raw += 1000000;
-		} else if (_udur_raw >= 1000000) {
-			_dur_raw += 1;
-			_udur_raw -= 1000000;
-		}
-		_dur += _dur_raw;
-		_udur += _udur_raw;
-		if (_udur > 1000000) {
-			_dur += 1;
-			_udur -= 1000000;
-		}
+		// recording rate and stuffing since latency statistics reset
+		_bps[chn] = _lat_period ? (CNT_GET(cnt->bytes[chn]) - state->cp.lat_bytes[chn]) * 1000000 / _lat_period : 0;
+		_stuffing[chn] = CNT_GET(cnt->stuffing[chn]) - state->cp.lat_stuffing[chn];
 	}
-	if ( state->frames_skip > 0 ) {
-		_frames_skip = state->frames_skip;
-	} else if ( state->frames_skip < 0 ) {
-		_sec_skip = -(state->frames_skip);
+	_dur = CNT_GET(cnt->dur_sec);
+	_udur = CNT_GET(cnt->dur_usec);
+	if ( info.frames_skip > 0 ) {
+		_frames_skip = info.frames_skip;
+	} else if ( info.frames_skip < 0 ) {
+		_sec_skip = -(info.frames_skip);
 	}
 
-	if (!fn) f = stdout;
+	if (!fn) f = out ? out : stdout;
 	else if (strcmp(fn, "stdout") == 0) f = stdout;
 	else if (strcmp(fn, "stderr") == 0) f = stderr;
 	else {
@@ -1048,34 +1550,21 @@ void  camogm_status(camogm_state *state, char * fn, int xml)
 			return;
 		}
 	}
-	if (state->rawdev_op)
-		_len = state->rawdev.total_rec_len;
-	else if (state->vf) _len = (int64_t)ftell(state->vf);                            // for ogm
-	else if ((state->ivf) >= 0) _len = (int64_t)lseek(state->ivf, 0, SEEK_CUR);      //for mov
-	switch (state->prog_state) {
-	case STATE_STOPPED:
-		_state = "stopped";
-		break;
-	case STATE_RUNNING:
-		_state = "running";
-		break;
-	case STATE_STARTING:
-		_state = "starting";
-		break;
-	case STATE_READING:
-		_state = "reading";
-		break;
-	default:
-		_state = "stopped";
-	}
-	_output_format = state->format ? ((state->format == CAMOGM_FORMAT_OGM) ? "ogm" :
-					  ((state->format == CAMOGM_FORMAT_JPEG) ? "jpeg" :
-					   ((state->format == CAMOGM_FORMAT_MOV) ? "mov" :
-					       "other"))) : "none";
-	_using_exif =    state->exif ? "yes" : "no";
-	_using_global_pointer = state->save_gp ? "yes" : "no";
-	if (state->rawdev.curr_pos_r != 0 && state->rawdev.curr_pos_r > state->rawdev.start_pos)
-		_percent_done = 100 * state->rawdev.curr_pos_r / (state->rawdev.end_pos - state->rawdev.start_pos);
+	_len = CNT_GET(cnt->file_length);
+	_state = camogm_state_name(state->prog_state);
+	_output_format = info.format ? ((info.format == CAMOGM_FORMAT_OGM) ? "ogm" :
+					  ((info.format == CAMOGM_FORMAT_JPEG) ? "jpeg" :
+					   ((info.format == CAMOGM_FORMAT_MOV) ? "mov" :
+					    ((info.format == CAMOGM_FORMAT_FMP4) ? "mp4" :
+					     ((info.format == CAMOGM_FORMAT_MKV) ? "mkv" :
+					      ((info.format == CAMOGM_FORMAT_JPACK) ? "jpack" :
+					        "other")))))) : "none";
+	_jpeg_layout = (set->jpeg_layout == JPEG_LAYOUT_DATE) ? "date" :
+		       ((set->jpeg_layout == JPEG_LAYOUT_COUNT) ? "count" : "flat");
+	_using_exif =    set->exif ? "yes" : "no";
+	_using_global_pointer = set->save_gp ? "yes" : "no";
+	if (state->rawdev.curr_pos_r != 0 && state->rawdev.curr_pos_r > info.start_pos)
+		_percent_done = 100 * state->rawdev.curr_pos_r / (info.end_pos - info.start_pos);
 	else
 		_percent_done = 0;
 
@@ -1116,27 +1605,46 @@ void  camogm_status(camogm_state *state, char * fn, int xml)
 			"  <kml_last_ts>%d.%06d</kml_last_ts>\n" \
 			"  <greedy>\"%s\"</greedy>\n" \
 			"  <ignore_fps>\"%s\"</ignore_fps>\n" \
+			"  <multitrack>\"%s\"</multitrack>\n" \
+			"  <frame_groups>\"%s\"</frame_groups>\n" \
+			"  <group_timeout>%d</group_timeout>\n" \
+			"  <groups_recorded>%u</groups_recorded>\n" \
+			"  <groups_partial>%u</groups_partial>\n" \
+			"  <jpeg_layout>\"%s\"</jpeg_layout>\n" \
+			"  <jpeg_dir_files>%d</jpeg_dir_files>\n" \
+			"  <writeback>%d</writeback>\n" \
+			"  <prealloc>\"%s\"</prealloc>\n" \
 			"  <raw_device_path>\"%s\"</raw_device_path>\n" \
+			"  <raw_device_storage>\"%s\"</raw_device_storage>\n" \
 			"  <raw_device_overruns>%d</raw_device_overruns>\n" \
 			"  <raw_device_pos_write>0x%llx</raw_device_pos_write>\n" \
 			"  <raw_device_pos_read>0x%llx (%d%% done)</raw_device_pos_read>\n" \
 			"  <lba_start>%llu</lba_start>\n" \
 			"  <lba_current>%llu</lba_current>\n" \
 			"  <lba_end>%llu</lba_end>\n",
-			_state,  state->path, state->frameno, state->start_after_timestamp, _dur, _udur, _len, \
+			_state,  info.path, CNT_GET(cnt->frameno), set->start_after_timestamp, _dur, _udur, _len, \
 			_frames_skip, _sec_skip, \
-			state->width, state->height, _output_format, _using_exif, \
-			state->path_prefix, state->segment_duration, state->segment_length, state->max_frames, state->timescale, \
-			state->frames_per_chunk,  state->last_error_code, \
+			info.width, info.height, _output_format, _using_exif, \
+			set->path_prefix, set->segment_duration, set->segment_length, info.max_frames, info.timescale, \
+			info.frames_per_chunk,  CNT_GET(cnt->last_error_code), \
 			state->debug_name, debug_level, _using_global_pointer, \
-			_kml_enable, _kml_used, state->kml_path, state->kml_horHalfFov, state->kml_vertHalfFov, state->kml_near, \
-			_kml_height_mode, state->kml_height, state->kml_period, state->kml_last_ts, state->kml_last_uts, \
-			state->greedy ? "yes" : "no", state->ignore_fps ? "yes" : "no", state->rawdev.rawdev_path,
-			state->rawdev.overrun, state->rawdev.curr_pos_w, state->rawdev.curr_pos_r, _percent_done,
-			state->writer_params.lba_start, state->writer_params.lba_current, state->writer_params.lba_end);
+			_kml_enable, _kml_used, info.kml_path, set->kml_horHalfFov, set->kml_vertHalfFov, set->kml_near, \
+			_kml_height_mode, set->kml_height, set->kml_period, CNT_GET(cnt->kml_last_ts), CNT_GET(cnt->kml_last_uts), \
+			set->greedy ? "yes" : "no", set->ignore_fps ? "yes" : "no", set->multitrack ? "yes" : "no",
+			set->frame_groups ? "yes" : "no", set->group_timeout, CNT_GET(cnt->groups), CNT_GET(cnt->partial),
+			_jpeg_layout, set->jpeg_dir_files, set->writeback / (1024 * 1024), set->prealloc ? "yes" : "no",
+			info.rawdev_path, set->rawdev_storage,
+			CNT_GET(cnt->overrun), CNT_GET(cnt->pos_w), state->rawdev.curr_pos_r, _percent_done,
+			info.lba_start, CNT_GET(cnt->lba_current), info.lba_end);
+		fprintf(f,
+			"  <segments_pending>%u</segments_pending>\n" \
+			"  <segments_finalized>%u</segments_finalized>\n" \
+			"  <segment_errors>%u</segment_errors>\n",
+			_fin_stat.pending, _fin_stat.done, _fin_stat.errors);
+		camogm_lat_stat(state, f, true);
 
 		FOR_EACH_PORT(int, chn) {
-			char *_active = is_chn_active(state, chn) ? "yes" : "no";
+			char *_active = (info.active_chn & (1 << chn)) ? "yes" : "no";
 			fprintf(f,
 			"\t<sensor_port_%d>\n" \
 			"\t\t<channel_active>\"%s\"</channel_active>\n" \
@@ -1149,19 +1657,23 @@ void  camogm_status(camogm_state *state, char * fn, int xml)
 			"\t\t<frame_period>%d</frame_period>\n" \
 			"\t\t<buffer_free>%d</buffer_free>\n" \
 			"\t\t<buffer_used>%d</buffer_used>\n" \
-			"\t\t<circbuf_rp>%d</circbuf_rp>\n",
+			"\t\t<circbuf_rp>%d</circbuf_rp>\n" \
+			"\t\t<bytes_per_second>%llu</bytes_per_second>\n" \
+			"\t\t<stuffing_bytes>%llu</stuffing_bytes>\n",
 				chn,
 				_active,
 				_compressor_state[chn],
 				_b_size[chn],
-				_frames_remain[chn],
-				_sec_remain[chn],
-				state->buf_overruns[chn],
-				state->buf_min[chn],
-				state->frame_period[chn],
+				CNT_GET(cnt->frames_remain[chn]),
+				CNT_GET(cnt->sec_remain[chn]),
+				CNT_GET(cnt->buf_overruns[chn]),
+				CNT_GET(cnt->buf_min[chn]),
+				CNT_GET(cnt->frame_period[chn]),
 				_b_free[chn],
 				_b_used[chn],
-				state->cirbuf_rp[chn]
+				CNT_GET(cnt->cirbuf_rp[chn]),
+				_bps[chn],
+				_stuffing[chn]
 				);
 			camogm_err_stat(state, chn, f, true);
 			fprintf(f, "\t</sensor_port_%d>\n", chn);
@@ -1169,31 +1681,47 @@ void  camogm_status(camogm_state *state, char * fn, int xml)
 		fprintf(f, "</camogm_state>\n");
 	} else {
 		fprintf(f, "state              \t%s\n",        _state);
-		fprintf(f, "file               \t%s\n",        state->path);
-		fprintf(f, "frame              \t%d\n",        state->frameno);
-		fprintf(f, "start_after_timestamp \t%f\n",     state->start_after_timestamp);
+		fprintf(f, "file               \t%s\n",        info.path);
+		fprintf(f, "frame              \t%d\n",        CNT_GET(cnt->frameno));
+		fprintf(f, "start_after_timestamp \t%f\n",     set->start_after_timestamp);
 		fprintf(f, "file duration      \t%d.%06d sec\n", _dur, _udur);
 		fprintf(f, "file length        \t%" PRId64 " B\n", _len);
-		fprintf(f, "width              \t%d (0x%x)\n", state->width, state->width);
-		fprintf(f, "height             \t%d (0x%x)\n", state->height, state->height);
+		fprintf(f, "width              \t%d (0x%x)\n", info.width, info.width);
+		fprintf(f, "height             \t%d (0x%x)\n", info.height, info.height);
 		fprintf(f, "\n");
 		fprintf(f, "output format      \t%s\n",        _output_format);
 		fprintf(f, "using exif         \t%s\n",        _using_exif);
-		fprintf(f, "path prefix        \t%s\n",        state->path_prefix);
-		fprintf(f, "raw device path    \t%s\n",        state->rawdev.rawdev_path);
-		fprintf(f, "raw device overruns\t%d\n",        state->rawdev.overrun);
-		fprintf(f, "raw write position \t0x%llx\n",    state->rawdev.curr_pos_w);
+		fprintf(f, "path prefix        \t%s\n",        set->path_prefix);
+		fprintf(f, "raw device path    \t%s\n",        info.rawdev_path);
+		fprintf(f, "raw device is file \t%s\n",        info.rawdev_file ? "yes" : "no");
+		fprintf(f, "raw device storage \t%s\n",        set->rawdev_storage);
+		fprintf(f, "raw device overruns\t%d\n",        CNT_GET(cnt->overrun));
+		fprintf(f, "raw write position \t0x%llx\n",    CNT_GET(cnt->pos_w));
 		fprintf(f, "raw read position  \t0x%llx\n",    state->rawdev.curr_pos_r);
 		fprintf(f, "   percent done    \t%d%%\n",      _percent_done);
-		fprintf(f, "max file duration  \t%d sec\n",    state->segment_duration);
-		fprintf(f, "max file length    \t%d B\n",      state->segment_length);
-		fprintf(f, "max frames         \t%d\n",        state->max_frames);
-		fprintf(f, "timescale          \t%f\n",        state->timescale);
-		fprintf(f, "frames per chunk   \t%d\n",        state->frames_per_chunk);
-		fprintf(f, "greedy             \t%s\n",        state->greedy ? "yes" : "no");
-		fprintf(f, "ignore fps         \t%s\n",        state->ignore_fps ? "yes" : "no");
+		fprintf(f, "max file duration  \t%d sec\n",    set->segment_duration);
+		fprintf(f, "max file length    \t%d B\n",      set->segment_length);
+		fprintf(f, "max frames         \t%d\n",        info.max_frames);
+		fprintf(f, "timescale          \t%f\n",        info.timescale);
+		fprintf(f, "frames per chunk   \t%d\n",        info.frames_per_chunk);
+		fprintf(f, "frames per fragment\t%d\n",        set->frag_frames);
+		fprintf(f, "fragment duration  \t%d ms\n",     set->frag_duration);
+		fprintf(f, "greedy             \t%s\n",        set->greedy ? "yes" : "no");
+		fprintf(f, "ignore fps         \t%s\n",        set->ignore_fps ? "yes" : "no");
+		fprintf(f, "multitrack         \t%s\n",        set->multitrack ? "yes" : "no");
+		fprintf(f, "frame groups       \t%s\n",        set->frame_groups ? "yes" : "no");
+		fprintf(f, "group timeout      \t%d ms\n",     set->group_timeout);
+		fprintf(f, "groups recorded    \t%u\n",        CNT_GET(cnt->groups));
+		fprintf(f, "groups partial     \t%u\n",        CNT_GET(cnt->partial));
+		fprintf(f, "jpeg layout        \t%s\n",        _jpeg_layout);
+		fprintf(f, "jpeg dir files     \t%d\n",        set->jpeg_dir_files);
+		fprintf(f, "writeback chunk    \t%d MiB\n",    set->writeback / (1024 * 1024));
+		fprintf(f, "preallocate files  \t%s\n",        set->prealloc ? "yes" : "no");
 		fprintf(f, "\n");
-		fprintf(f, "last error code    \t%d\n",        state->last_error_code);
+		fprintf(f, "last error code    \t%d\n",        CNT_GET(cnt->last_error_code));
+		fprintf(f, "segments pending   \t%u\n",        _fin_stat.pending);
+		fprintf(f, "segments finalized \t%u\n",        _fin_stat.done);
+		fprintf(f, "segment errors     \t%u\n",        _fin_stat.errors);
 		fprintf(f, "\n");
 		fprintf(f, "debug output to    \t%s\n",        state->debug_name);
 		fprintf(f, "debug level        \t%d\n",        debug_level);
@@ -1201,43 +1729,46 @@ void  camogm_status(camogm_state *state, char * fn, int xml)
 		fprintf(f, "\n\n");
 		fprintf(f, "kml_enable         \t%s\n",        _kml_enable);
 		fprintf(f, "kml_used           \t%s\n",        _kml_used);
-		fprintf(f, "kml_path           \t%s\n",        state->kml_path);
-		fprintf(f, "kml_horHalfFov     \t%f degrees\n", state->kml_horHalfFov);
-		fprintf(f, "kml_vertHalfFov    \t%f degrees\n", state->kml_vertHalfFov);
-		fprintf(f, "kml_near           \t%f m\n",      state->kml_near);
+		fprintf(f, "kml_path           \t%s\n",        info.kml_path);
+		fprintf(f, "kml_horHalfFov     \t%f degrees\n", set->kml_horHalfFov);
+		fprintf(f, "kml_vertHalfFov    \t%f degrees\n", set->kml_vertHalfFov);
+		fprintf(f, "kml_near           \t%f m\n",      set->kml_near);
 		fprintf(f, "kml height mode    \t%s\n",        _kml_height_mode);
-		fprintf(f, "kml_height (extra) \t%f m\n",      state->kml_height);
-		fprintf(f, "kml_period         \t%d\n",        state->kml_period);
-		fprintf(f, "kml_last_ts        \t%d.%06d\n",   state->kml_last_ts, state->kml_last_uts);
+		fprintf(f, "kml_height (extra) \t%f m\n",      set->kml_height);
+		fprintf(f, "kml_period         \t%d\n",        set->kml_period);
+		fprintf(f, "kml_last_ts        \t%d.%06d\n",   CNT_GET(cnt->kml_last_ts), CNT_GET(cnt->kml_last_uts));
+		fprintf(f, "\n");
+		fprintf(f, "lba_start          \t%llu\n",      info.lba_start);
+		fprintf(f, "lba_current        \t%llu\n",      CNT_GET(cnt->lba_current));
+		fprintf(f, "lba_end            \t%llu\n",      info.lba_end);
 		fprintf(f, "\n");
-		fprintf(f, "lba_start          \t%llu\n",      state->writer_params.lba_start);
-		fprintf(f, "lba_current        \t%llu\n",      state->writer_params.lba_current);
-		fprintf(f, "lba_end            \t%llu\n",      state->writer_params.lba_end);
+		camogm_lat_stat(state, f, false);
 		fprintf(f, "\n");
 		FOR_EACH_PORT(int, chn) {
-			char *_active = is_chn_active(state, chn) ? "yes" : "no";
+			char *_active = (info.active_chn & (1 << chn)) ? "yes" : "no";
 			fprintf(f, "===== Sensor port %d status =====\n", chn);
 			fprintf(f, "enabled            \t%s\n",    _active);
 			fprintf(f, "compressor state   \t%s\n",    _compressor_state[chn]);
 			fprintf(f, "frame size         \t%d\n",    _b_size[chn]);
 			if (_frames_skip > 0)
-				fprintf(f, "frames to skip \t%d (left %d)\n", _frames_skip, _frames_remain[chn]);
+				fprintf(f, "frames to skip \t%d (left %d)\n", _frames_skip, CNT_GET(cnt->frames_remain[chn]));
 			if (_sec_skip < 0 )
-				fprintf(f, "timelapse period \t%d sec (remaining %d sec)\n", _sec_skip, _sec_remain[chn]);
-			fprintf(f, "buffer overruns    \t%d\n",    state->buf_overruns[chn]);
-			fprintf(f, "buffer minimal     \t%d\n",    state->buf_min[chn]);
-			fprintf(f, "frame period       \t%d (0x%x)\n", state->frame_period[chn], state->frame_period[chn]);
+				fprintf(f, "timelapse period \t%d sec (remaining %d sec)\n", _sec_skip, CNT_GET(cnt->sec_remain[chn]));
+			fprintf(f, "buffer overruns    \t%d\n",    CNT_GET(cnt->buf_overruns[chn]));
+			fprintf(f, "buffer minimal     \t%d\n",    CNT_GET(cnt->buf_min[chn]));
+			fprintf(f, "frame period       \t%d (0x%x)\n", CNT_GET(cnt->frame_period[chn]), CNT_GET(cnt->frame_period[chn]));
 			fprintf(f, "buffer free        \t%d\n",    _b_free[chn]);
 			fprintf(f, "buffer used        \t%d\n",    _b_used[chn]);
-			fprintf(f, "circbuf_rp         \t%d (0x%x)\n", state->cirbuf_rp[chn], state->cirbuf_rp[chn]);
+			fprintf(f, "circbuf_rp         \t%d (0x%x)\n", CNT_GET(cnt->cirbuf_rp[chn]), CNT_GET(cnt->cirbuf_rp[chn]));
+			fprintf(f, "bytes per second   \t%llu\n",  _bps[chn]);
+			fprintf(f, "stuffing bytes     \t%llu\n",  _stuffing[chn]);
 			camogm_err_stat(state, chn, f, false);
 			fprintf(f, "\n");
 		}
 	}
-	if ((f != stdout) && (f != stderr)) fclose(f);
-	FOR_EACH_PORT(int, chn) {if (state->buf_overruns[chn] >= 0) state->buf_overruns[chn] = 0;}  // resets overruns after reading status , so "overruns" means since last reading status
-	state->last_error_code = 0;                             // Reset error
-	FOR_EACH_PORT(int, chn) {state->buf_min[chn] = _b_free[chn];}
+	if ((f != stdout) && (f != stderr) && (f != out)) fclose(f);
+	// capture thread resets overruns, error code and minimal buffer after reading status, so "overruns" means since last reading status
+	CNT_SET(cnt->stat_reset, 1);
 }
 
 /**
@@ -1262,31 +1793,89 @@ void camogm_err_stat(const camogm_state *state, int port, FILE *f, bool xml)
 				"\t\t<frame_too_early>%u</frame_too_early>\n" \
 				"\t\t<frame_other>%u</frame_other>\n" \
 				"\t\t<frame_nospace>%u</frame_nospace>\n",
-				state->error_stat[port][CAMOGM_FRAME_NOT_READY], state->error_stat[port][CAMOGM_FRAME_NEXTFILE],
-				state->error_stat[port][CAMOGM_FRAME_INVALID], state->error_stat[port][CAMOGM_FRAME_CHANGED],
-				state->error_stat[port][CAMOGM_FRAME_BROKEN], state->error_stat[port][CAMOGM_FRAME_FILE_ERR],
-				state->error_stat[port][CAMOGM_FRAME_MALLOC], state->error_stat[port][CAMOGM_TOO_EARLY],
-				state->error_stat[port][CAMOGM_FRAME_OTHER], state->error_stat[port][CAMOGM_NO_SPACE]);
+				CNT_GET(state->cnt.error_stat[port][CAMOGM_FRAME_NOT_READY]), CNT_GET(state->cnt.error_stat[port][CAMOGM_FRAME_NEXTFILE]),
+				CNT_GET(state->cnt.error_stat[port][CAMOGM_FRAME_INVALID]), CNT_GET(state->cnt.error_stat[port][CAMOGM_FRAME_CHANGED]),
+				CNT_GET(state->cnt.error_stat[port][CAMOGM_FRAME_BROKEN]), CNT_GET(state->cnt.error_stat[port][CAMOGM_FRAME_FILE_ERR]),
+				CNT_GET(state->cnt.error_stat[port][CAMOGM_FRAME_MALLOC]), CNT_GET(state->cnt.error_stat[port][CAMOGM_TOO_EARLY]),
+				CNT_GET(state->cnt.error_stat[port][CAMOGM_FRAME_OTHER]), CNT_GET(state->cnt.error_stat[port][CAMOGM_NO_SPACE]));
+	} else {
+		fprintf(f, "frame_not_ready    \t%u\n", CNT_GET(state->cnt.error_stat[port][CAMOGM_FRAME_NOT_READY]));
+		fprintf(f, "frame_invalid      \t%u\n", CNT_GET(state->cnt.error_stat[port][CAMOGM_FRAME_INVALID]));
+		fprintf(f, "frame_changed      \t%u\n", CNT_GET(state->cnt.error_stat[port][CAMOGM_FRAME_CHANGED]));
+		fprintf(f, "frame_nextfile     \t%u\n", CNT_GET(state->cnt.error_stat[port][CAMOGM_FRAME_NEXTFILE]));
+		fprintf(f, "frame_broken       \t%u\n", CNT_GET(state->cnt.error_stat[port][CAMOGM_FRAME_BROKEN]));
+		fprintf(f, "frame_file_err     \t%u\n", CNT_GET(state->cnt.error_stat[port][CAMOGM_FRAME_FILE_ERR]));
+		fprintf(f, "frame_malloc       \t%u\n", CNT_GET(state->cnt.error_stat[port][CAMOGM_FRAME_MALLOC]));
+		fprintf(f, "frame_too_early    \t%u\n", CNT_GET(state->cnt.error_stat[port][CAMOGM_TOO_EARLY]));
+		fprintf(f, "frame_other        \t%u\n", CNT_GET(state->cnt.error_stat[port][CAMOGM_FRAME_OTHER]));
+		fprintf(f, "frame_nospace      \t%u\n", CNT_GET(state->cnt.error_stat[port][CAMOGM_NO_SPACE]));
+	}
+}
+
+/**
+ * Print latency statistics of recording pipeline stages in xml or plain text format.
+ * All values are in microseconds, statistics are collected since the last @e latency_reset command.
+ * @param   state   pointer to a structure containing current state
+ * @param   f       file stream for output
+ * @param   xml     flag indicating that statistics should be in xml format
+ * @return  None
+ */
+static void camogm_lat_stat(camogm_state *state, FILE *f, bool xml)
+{
+	struct hist_summary hs;
+	uint64_t period = lat_time() - state->cp.lat_start;
+
+	if (xml) {
+		fprintf(f, "  <latency_period>%llu.%06llu</latency_period>\n", period / 1000000, period % 1000000);
+		fprintf(f, "  <latency>\n");
 	} else {
-		fprintf(f, "frame_not_ready    \t%u\n", state->error_stat[port][CAMOGM_FRAME_NOT_READY]);
-		fprintf(f, "frame_invalid      \t%u\n", state->error_stat[port][CAMOGM_FRAME_INVALID]);
-		fprintf(f, "frame_changed      \t%u\n", state->error_stat[port][CAMOGM_FRAME_CHANGED]);
-		fprintf(f, "frame_nextfile     \t%u\n", state->error_stat[port][CAMOGM_FRAME_NEXTFILE]);
-		fprintf(f, "frame_broken       \t%u\n", state->error_stat[port][CAMOGM_FRAME_BROKEN]);
-		fprintf(f, "frame_file_err     \t%u\n", state->error_stat[port][CAMOGM_FRAME_FILE_ERR]);
-		fprintf(f, "frame_malloc       \t%u\n", state->error_stat[port][CAMOGM_FRAME_MALLOC]);
-		fprintf(f, "frame_too_early    \t%u\n", state->error_stat[port][CAMOGM_TOO_EARLY]);
-		fprintf(f, "frame_other        \t%u\n", state->error_stat[port][CAMOGM_FRAME_OTHER]);
-		fprintf(f, "frame_nospace      \t%u\n", state->error_stat[port][CAMOGM_NO_SPACE]);
+		fprintf(f, "latency period     \t%llu.%03llu sec\n", period / 1000000, (period / 1000) % 1000);
+		fprintf(f, "latency, us        \t     count      mean       p50       p99     p99.9       max\n");
+	}
+	for (int i = 0; i < LAT_STAGES; i++) {
+		hist_summary(&state->cnt.lat[i], &hs);
+		if (xml) {
+			fprintf(f,
+					"\t<%s>\n" \
+					"\t\t<count>%u</count>\n" \
+					"\t\t<mean>%u</mean>\n" \
+					"\t\t<p50>%u</p50>\n" \
+					"\t\t<p99>%u</p99>\n" \
+					"\t\t<p99_9>%u</p99_9>\n" \
+					"\t\t<max>%u</max>\n" \
+					"\t</%s>\n",
+					lat_stage_name(i), hs.count, hs.mean, hs.p50, hs.p99, hs.p999, hs.max, lat_stage_name(i));
+		} else {
+			fprintf(f, "%-19s\t%10u %9u %9u %9u %9u %9u\n",
+					lat_stage_name(i), hs.count, hs.mean, hs.p50, hs.p99, hs.p999, hs.max);
+		}
+	}
+	if (xml)
+		fprintf(f, "  </latency>\n");
+}
+
+/**
+ * @brief Clear latency histograms and restart recording rate and stuffing statistics, called by control thread
+ * @param[in]   state   pointer to a structure containing current state
+ * @return      None
+ */
+void camogm_latency_reset(camogm_state *state)
+{
+	for (int i = 0; i < LAT_STAGES; i++)
+		hist_reset(&state->cnt.lat[i]);
+	FOR_EACH_PORT(int, chn) {
+		state->cp.lat_bytes[chn] = CNT_GET(state->cnt.bytes[chn]);
+		state->cp.lat_stuffing[chn] = CNT_GET(state->cnt.stuffing[chn]);
 	}
+	state->cp.lat_start = lat_time();
 }
 
 /**
  * @brief Read a single command from pipe
- * @param[in]   npipe   pointer to command pipe
+ * @param[in]   npipe   command pipe descriptor
  * @return Pointer to null terminated string if a command is available or NULL otherwise
  */
-char * getLineFromPipe(FILE* npipe)
+char * getLineFromPipe(int npipe)
 {
 	int fl;
 	char * nlp;
@@ -1308,6 +1897,7 @@ char * getLineFromPipe(FILE* npipe)
 		// 2019/01/16: this change is related to switching to poll()
 		//fl = fread(&cmdbuf[cmdbufp], 1, sizeof(cmdbuf) - cmdbufp - 1, npipe);
 		fl = read(npipe, &cmdbuf[cmdbufp], sizeof(cmdbuf) - cmdbufp - 1);
+		if (fl < 0) fl = 0;                     // pipe is non-blocking, nothing to read
 		cmdbuf[cmdbufp + fl] = 0;
 // is there any complete string in a buffer after reading?
 		nlp = strpbrk(&cmdbuf[cmdbufp], ";\n"); // there were no new lines before cmdbufp
@@ -1323,196 +1913,491 @@ char * getLineFromPipe(FILE* npipe)
 	}
 }
 
+/** @brief Command handler, returns positive command code */
+typedef int (*cmd_handler)(camogm_state *state, char *args, FILE *out);
+
 /**
- * @brief Read and execute commands sent over command pipe
- * @param state   pointer to a structure containing current state
- * @param npipe   pointer to command pipe
- * @return        0 if pipe was empty, positive value corresponding to a command processed or
- * -1 in case of an error
+ * @struct cmd_entry
+ * @brief Command name and its handler
  */
-int parse_cmd(camogm_state *state, FILE* npipe)
+struct cmd_entry {
+	const char *name;                            ///< command name
+	cmd_handler handler;                         ///< command handler
+};
+
+static int cmd_start(camogm_state *state, char *args, FILE *out)
 {
-	char * cmd;
-	char * args;
-	char * argse;
-	int d;
-	double dd;
+	control_post(state, ACTION_START, 0);
+	return 1;
+}
 
-//skip empty commands
-	while (((cmd = getLineFromPipe(npipe))) && !cmd[0]) ;
-	if (!cmd) return 0;  // nothing in the pipe
-	D2(fprintf(debug_file, "Got command: '%s'\n", cmd));
+/** Reset pointer to the last acquired frame (if any) */
+static int cmd_reset(camogm_state *state, char *args, FILE *out)
+{
+	control_post(state, ACTION_RESET, 0);
+	return 2;
+}
 
-// Acknowledge received command by copying frame number to per-daemon parameter
-//	GLOBALPARS(state->port_num, G_DAEMON_ERR + lastDaemonBit[state->port_num]) = GLOBALPARS(state->port_num, G_THIS_FRAME);
-	setGValue(state->port_num, G_DAEMON_ERR + lastDaemonBit[state->port_num], getGPValue(state->port_num, G_THIS_FRAME));
-	args = strpbrk(cmd, "= \t");
-// is it just a single word command or does it have parameters?
-	if (args) {
-		args[0] = 0;
-		args++;
-		while (strchr("= \t", args[0])) args++;
-		if (args[0]) {
-// ltrim (args)
-			for (argse = strchr(args, '\0') - 1; strchr("= \t", argse[0]); argse--) argse[0] = '\0';
-		}
-		if (!args[0]) args = NULL;
-	}
-// now cmd is trimmed, arg is NULL or a pointer to trimmed command arguments
-	if (strcmp(cmd, "start") == 0) {
-		check_compressors(state);
-		get_disk_info(state);
-		camogm_start(state);
-		return 1;
-	} else if (strcmp(cmd, "reset") == 0) { // will reset pointer to the last acquired frame (if any)
-		camogm_reset(state);
-		return 2;
-	} else if (strcmp(cmd, "stop") == 0) {
-		camogm_stop(state);
-		return 3;
-	} else if (strcmp(cmd, "exit") == 0) {
-		camogm_stop(state);
-		camogm_free(state);
-		clean_up(state);
-		exit(0);
-	} else if (strcmp(cmd, "duration") == 0) {
-		if (!(args) || (((d = strtol(args, NULL, 10))) <= 0)) d = DEFAULT_DURATION;
-		camogm_set_segment_duration(state, d);
-		return 4;
-	} else if (strcmp(cmd, "length") == 0) {
-		if (!(args) || (((d = strtol(args, NULL, 10))) <= 0)) d = DEFAULT_LENGTH;
-		camogm_set_segment_length(state, d);
-		return 5;
-	} else if (strcmp(cmd, "prefix") == 0) {
-		if (args) camogm_set_prefix(state, args, FILE_PATH);
-		return 6;
-	} else if (strcmp(cmd, "status") == 0) {
-		camogm_status(state, args, 0);
-		return 7;
-	} else if (strcmp(cmd, "xstatus") == 0) {
-		camogm_status(state, args, 1);
-		return 7;
-	} else if (strcmp(cmd, "save_gp") == 0) {
-		if ((args) && (((d = strtol(args, NULL, 10))) >= 0)) camogm_set_save_gp(state, d);
-		return 8;
-	} else if (strcmp(cmd, "exif") == 0) {
-		if ((args) && (((d = strtol(args, NULL, 10))) >= 0)) camogm_set_exif(state, d);
-		return 8;
-	} else if (strcmp(cmd, "debug") == 0) {
-		camogm_debug(state, args);
-		return 9;
-	} else if (strcmp(cmd, "timescale") == 0) {
-		dd = strtod(args, NULL);
-		camogm_set_timescale(state, dd ? dd : 1.0);
-		return 10;
-//TODO: fix period calculation/check for frame skipping (just disable in frame skip mode?)
-//TODO: add time period (system clock), not just frame skipping
+static int cmd_stop(camogm_state *state, char *args, FILE *out)
+{
+	control_post(state, ACTION_STOP, 0);
+	return 3;
+}
 
+static int cmd_exit(camogm_state *state, char *args, FILE *out)
+{
+	control_post(state, ACTION_EXIT, 0);
+	return 42;
+}
 
-	} else if (strcmp(cmd, "frameskip") == 0) {
-		d = strtol(args, NULL, 10);
-		camogm_set_frames_skip(state, d);
-		return 11;
-	} else if (strcmp(cmd, "timelapse") == 0) { // period (in seconds) between stored frames
-		d = strtol(args, NULL, 10);
-		camogm_set_frames_skip(state, -d);
-		return 11;
-	} else if (strcmp(cmd, "format") == 0) {
-		if (args) {
-			if (strcmp(args,  "none") == 0) camogm_set_format(state, 0);
-			else if ((strcmp(args, "ogm" ) == 0) || (strcmp(args, "ogg") == 0)) camogm_set_format(state, CAMOGM_FORMAT_OGM);
-			else if ((strcmp(args, "jpeg") == 0) || (strcmp(args, "jpg") == 0)) camogm_set_format(state, CAMOGM_FORMAT_JPEG);
-			else if (strcmp(args,  "mov" ) == 0) camogm_set_format(state, CAMOGM_FORMAT_MOV);
-		}
-		return 12;
-	} else if (strcmp(cmd, "debuglev") == 0) {
-		d = strtol(args, NULL, 10);
-		camogm_debug_level(d ? d : 0);
-		return 13;
-	} else if (strcmp(cmd, "kml") == 0) {
-		if ((args) && (((d = strtol(args, NULL, 10))) >= 0)) camogm_kml_set_enable(state, d);
-		return 14;
-	} else if (strcmp(cmd, "kml_hhf") == 0) {
-		dd = strtod(args, NULL);
-		camogm_kml_set_horHalfFov(state, dd);
-		return 15;
-	} else if (strcmp(cmd, "kml_vhf") == 0) {
-		dd = strtod(args, NULL);
-		camogm_kml_set_vertHalfFov(state, dd);
-		return 16;
-	} else if (strcmp(cmd, "kml_near") == 0) {
-		dd = strtod(args, NULL);
-		camogm_kml_set_near(state, dd);
-		return 17;
-	} else if (strcmp(cmd, "kml_alt") == 0) {
-		if (args) {
-			if (strcmp(args, "gps"   ) == 0) camogm_kml_set_height_mode(state, 1);
-			else if (strcmp(args, "ground") == 0) camogm_kml_set_height_mode(state, 0);
-		}
-		return 18;
-	} else if (strcmp(cmd, "kml_height") == 0) {
-		dd = strtod(args, NULL);
-		camogm_kml_set_height(state, dd);
-		return 19;
-	} else if (strcmp(cmd, "kml_period") == 0) {
-		d = strtol(args, NULL, 10);
-		camogm_kml_set_period(state, d ? d : 1);
-		return 20;
-	} else if (strcmp(cmd, "frames_per_chunk") == 0) {
-		d = strtol(args, NULL, 10);
-		camogm_set_frames_per_chunk(state, d);
-		return 21;
-	} else if (strcmp(cmd, "max_frames") == 0) {
-		d = strtol(args, NULL, 10);
-		camogm_set_max_frames(state, d);
-		return 22;
-	} else if (strcmp(cmd, "start_after_timestamp") == 0) {
-		dd = strtod(args, NULL);
-		camogm_set_start_after_timestamp(state, dd);
-		return 23;
-	} else if (strcmp(cmd, "greedy") == 0) {
-		dd = strtod(args, NULL);
-		camogm_set_greedy(state, dd);
-		return 24;
-	} else if (strcmp(cmd, "ignore_fps") == 0) {
-		dd = strtod(args, NULL);
-		camogm_set_ignore_fps(state, dd);
-		return 25;
-	} else if (strcmp(cmd, "port_enable") == 0) {
-		d = strtol(args, NULL, 10);
-		set_chn_state(state, d, 1);
-		return 26;
-	} else if (strcmp(cmd, "port_disable") == 0) {
-		d = strtol(args, NULL, 10);
-		set_chn_state(state, d, 0);
-		return 27;
-	} else if (strcmp(cmd, "rawdev_path") == 0) {
-		if (args) {
-			camogm_set_prefix(state, args, RAW_PATH);
-			// make disk geometry available in status xml before recording starts
-			get_disk_info(state);
-			open_state_file(&state->rawdev, &state->writer_params.lba_current);
-		} else {
-			state->rawdev_op = 0;
-			state->rawdev.rawdev_path[0] = '\0';
-		}
-		return 28;
-	} else if (strcmp(cmd, "reader_stop") == 0) {
-		if (state->prog_state == STATE_READING &&
-				state->rawdev.thread_state == STATE_RUNNING) {
-			state->rawdev.thread_state = STATE_CANCEL;
-		} else {
-			D0(fprintf(debug_file, "Reading thread is not running, nothing to stop\n"));
+static int cmd_duration(camogm_state *state, char *args, FILE *out)
+{
+	int d;
+
+	if (!(args) || (((d = strtol(args, NULL, 10))) <= 0)) d = DEFAULT_DURATION;
+	camogm_set_segment_duration(state, d);
+	return 4;
+}
+
+static int cmd_length(camogm_state *state, char *args, FILE *out)
+{
+	int d;
+
+	if (!(args) || (((d = strtol(args, NULL, 10))) <= 0)) d = DEFAULT_LENGTH;
+	camogm_set_segment_length(state, d);
+	return 5;
+}
+
+static int cmd_prefix(camogm_state *state, char *args, FILE *out)
+{
+	if (args) camogm_set_prefix(state, args, FILE_PATH);
+	return 6;
+}
+
+static int cmd_status(camogm_state *state, char *args, FILE *out)
+{
+	camogm_status(state, args, 0, out);
+	return 7;
+}
+
+static int cmd_xstatus(camogm_state *state, char *args, FILE *out)
+{
+	camogm_status(state, args, 1, out);
+	return 7;
+}
+
+static int cmd_save_gp(camogm_state *state, char *args, FILE *out)
+{
+	int d;
+
+	if ((args) && (((d = strtol(args, NULL, 10))) >= 0)) camogm_set_save_gp(state, d);
+	return 8;
+}
+
+static int cmd_exif(camogm_state *state, char *args, FILE *out)
+{
+	int d;
+
+	if ((args) && (((d = strtol(args, NULL, 10))) >= 0)) camogm_set_exif(state, d);
+	return 8;
+}
+
+static int cmd_debug(camogm_state *state, char *args, FILE *out)
+{
+	camogm_debug(state, args);
+	return 9;
+}
+
+static int cmd_timescale(camogm_state *state, char *args, FILE *out)
+{
+	double dd = args ? strtod(args, NULL) : 0;
+
+	camogm_set_timescale(state, dd ? dd : 1.0);
+	return 10;
+}
+
+//TODO: fix period calculation/check for frame skipping (just disable in frame skip mode?)
+//TODO: add time period (system clock), not just frame skipping
+static int cmd_frameskip(camogm_state *state, char *args, FILE *out)
+{
+	if (args) camogm_set_frames_skip(state, strtol(args, NULL, 10));
+	return 11;
+}
+
+/** Period (in seconds) between stored frames */
+static int cmd_timelapse(camogm_state *state, char *args, FILE *out)
+{
+	if (args) camogm_set_frames_skip(state, -strtol(args, NULL, 10));
+	return 11;
+}
+
+static int cmd_format(camogm_state *state, char *args, FILE *out)
+{
+	if (args) {
+		if (strcmp(args,  "none") == 0) camogm_set_format(state, 0);
+		else if ((strcmp(args, "ogm" ) == 0) || (strcmp(args, "ogg") == 0)) camogm_set_format(state, CAMOGM_FORMAT_OGM);
+		else if ((strcmp(args, "jpeg") == 0) || (strcmp(args, "jpg") == 0)) camogm_set_format(state, CAMOGM_FORMAT_JPEG);
+		else if (strcmp(args,  "mov" ) == 0) camogm_set_format(state, CAMOGM_FORMAT_MOV);
+		else if ((strcmp(args, "mp4" ) == 0) || (strcmp(args, "fmp4") == 0)) camogm_set_format(state, CAMOGM_FORMAT_FMP4);
+		else if ((strcmp(args, "mkv" ) == 0) || (strcmp(args, "matroska") == 0)) camogm_set_format(state, CAMOGM_FORMAT_MKV);
+		else if (strcmp(args,  "jpack") == 0) camogm_set_format(state, CAMOGM_FORMAT_JPACK);
+	}
+	return 12;
+}
+
+static int cmd_debuglev(camogm_state *state, char *args, FILE *out)
+{
+	int d = args ? strtol(args, NULL, 10) : 0;
+
+	camogm_debug_level(d ? d : 0);
+	return 13;
+}
+
+static int cmd_kml(camogm_state *state, char *args, FILE *out)
+{
+	int d;
+
+	if ((args) && (((d = strtol(args, NULL, 10))) >= 0)) camogm_kml_set_enable(state, d);
+	return 14;
+}
+
+static int cmd_kml_hhf(camogm_state *state, char *args, FILE *out)
+{
+	if (args) camogm_kml_set_horHalfFov(state, strtod(args, NULL));
+	return 15;
+}
+
+static int cmd_kml_vhf(camogm_state *state, char *args, FILE *out)
+{
+	if (args) camogm_kml_set_vertHalfFov(state, strtod(args, NULL));
+	return 16;
+}
+
+static int cmd_kml_near(camogm_state *state, char *args, FILE *out)
+{
+	if (args) camogm_kml_set_near(state, strtod(args, NULL));
+	return 17;
+}
+
+static int cmd_kml_alt(camogm_state *state, char *args, FILE *out)
+{
+	if (args) {
+		if (strcmp(args, "gps"   ) == 0) camogm_kml_set_height_mode(state, 1);
+		else if (strcmp(args, "ground") == 0) camogm_kml_set_height_mode(state, 0);
+	}
+	return 18;
+}
+
+static int cmd_kml_height(camogm_state *state, char *args, FILE *out)
+{
+	if (args) camogm_kml_set_height(state, strtod(args, NULL));
+	return 19;
+}
+
+static int cmd_kml_period(camogm_state *state, char *args, FILE *out)
+{
+	int d = args ? strtol(args, NULL, 10) : 0;
+
+	camogm_kml_set_period(state, d ? d : 1);
+	return 20;
+}
+
+static int cmd_frames_per_chunk(camogm_state *state, char *args, FILE *out)
+{
+	if (args) camogm_set_frames_per_chunk(state, strtol(args, NULL, 10));
+	return 21;
+}
+
+static int cmd_max_frames(camogm_state *state, char *args, FILE *out)
+{
+	if (args) camogm_set_max_frames(state, strtol(args, NULL, 10));
+	return 22;
+}
+
+static int cmd_start_after_timestamp(camogm_state *state, char *args, FILE *out)
+{
+	if (args) camogm_set_start_after_timestamp(state, strtod(args, NULL));
+	return 23;
+}
+
+static int cmd_greedy(camogm_state *state, char *args, FILE *out)
+{
+	if (args) camogm_set_greedy(state, strtod(args, NULL));
+	return 24;
+}
+
+static int cmd_ignore_fps(camogm_state *state, char *args, FILE *out)
+{
+	if (args) camogm_set_ignore_fps(state, strtod(args, NULL));
+	return 25;
+}
+
+static int cmd_port_enable(camogm_state *state, char *args, FILE *out)
+{
+	if (args) control_post(state, ACTION_PORT_ENABLE, strtol(args, NULL, 10));
+	return 26;
+}
+
+static int cmd_port_disable(camogm_state *state, char *args, FILE *out)
+{
+	if (args) control_post(state, ACTION_PORT_DISABLE, strtol(args, NULL, 10));
+	return 27;
+}
+
+static int cmd_rawdev_path(camogm_state *state, char *args, FILE *out)
+{
+	if (args) {
+		camogm_set_prefix(state, args, RAW_PATH);
+		control_post(state, ACTION_RAWDEV, 1);
+	} else {
+		state->set.rawdev_path[0] = '\0';
+		control_post(state, ACTION_RAWDEV, 0);
+	}
+	return 28;
+}
+
+static int cmd_reader_stop(camogm_state *state, char *args, FILE *out)
+{
+	if (state->prog_state == STATE_READING &&
+			state->rawdev.thread_state == STATE_RUNNING) {
+		state->rawdev.thread_state = STATE_CANCEL;
+	} else {
+		D0(fprintf(debug_file, "Reading thread is not running, nothing to stop\n"));
+	}
+	return 29;
+}
+
+static int cmd_dummy_read(camogm_state *state, char *args, FILE *out)
+{
+	int d;
+
+	if ((args) && ((d = strtol(args, NULL, 10)) > 0)) camogm_set_dummy_read(state, d);
+	return 30;
+}
+
+static int cmd_rawdev_size(camogm_state *state, char *args, FILE *out)
+{
+	if (args) camogm_set_rawdev_size(state, strtoull(args, NULL, 10));
+	return 31;
+}
+
+static int cmd_frag_frames(camogm_state *state, char *args, FILE *out)
+{
+	if (args) camogm_set_frag_frames(state, strtol(args, NULL, 10));
+	return 32;
+}
+
+static int cmd_frag_duration(camogm_state *state, char *args, FILE *out)
+{
+	if (args) camogm_set_frag_duration(state, strtol(args, NULL, 10));
+	return 33;
+}
+
+static int cmd_multitrack(camogm_state *state, char *args, FILE *out)
+{
+	if (args) camogm_set_multitrack(state, strtol(args, NULL, 10));
+	return 34;
+}
+
+static int cmd_frame_groups(camogm_state *state, char *args, FILE *out)
+{
+	if (args) camogm_set_frame_groups(state, strtol(args, NULL, 10));
+	return 35;
+}
+
+static int cmd_group_timeout(camogm_state *state, char *args, FILE *out)
+{
+	if (args) camogm_set_group_timeout(state, strtol(args, NULL, 10));
+	return 36;
+}
+
+static int cmd_jpeg_layout(camogm_state *state, char *args, FILE *out)
+{
+	if (args) {
+		if (strcmp(args, "flat") == 0) camogm_set_jpeg_layout(state, JPEG_LAYOUT_FLAT);
+		else if (strcmp(args, "date") == 0) camogm_set_jpeg_layout(state, JPEG_LAYOUT_DATE);
+		else if (strcmp(args, "count") == 0) camogm_set_jpeg_layout(state, JPEG_LAYOUT_COUNT);
+	}
+	return 37;
+}
+
+static int cmd_jpeg_dir_files(camogm_state *state, char *args, FILE *out)
+{
+	if (args) camogm_set_jpeg_dir_files(state, strtol(args, NULL, 10));
+	return 38;
+}
+
+static int cmd_jpack_extract(camogm_state *state, char *args, FILE *out)
+{
+	if (camogm_jpack_extract(args) < 0)
+		D0(fprintf(debug_file, "Could not extract frames, usage: jpack_extract=<pack file> [<from> [<to>]]\n"));
+	return 39;
+}
+
+static int cmd_writeback(camogm_state *state, char *args, FILE *out)
+{
+	if (args) camogm_set_writeback(state, strtol(args, NULL, 10));
+	return 40;
+}
+
+static int cmd_prealloc(camogm_state *state, char *args, FILE *out)
+{
+	if (args) camogm_set_prealloc(state, strtol(args, NULL, 10));
+	return 41;
+}
+
+/** Clear pipeline latency histograms reported by status */
+static int cmd_latency_reset(camogm_state *state, char *args, FILE *out)
+{
+	camogm_latency_reset(state);
+	return 43;
+}
+
+/** Write flight recorder to file, automatic dumps are numbered and written next to the file given */
+static int cmd_flight_dump(camogm_state *state, char *args, FILE *out)
+{
+	if (flight_dump(args) < 0)
+		D0(fprintf(debug_file, "Could not write flight recorder dump\n"));
+	return 44;
+}
+
+/** Start recording pipeline trace (trace=<file> [<seconds>]) or stop it and write the file (trace or trace=stop) */
+static int cmd_trace(camogm_state *state, char *args, FILE *out)
+{
+	char *duration;
+
+	if (args == NULL || strcmp(args, "stop") == 0) {
+		trace_stop();
+	} else {
+		if ((duration = strchr(args, ' ')) != NULL)
+			*duration++ = '\0';
+		if (trace_start(args, duration ? strtol(duration, NULL, 10) : TRACE_DEFAULT_DURATION) < 0)
+			D0(fprintf(debug_file, "Could not start tracing, usage: trace=<file> [<seconds>]\n"));
+	}
+	return 45;
+}
+
+/** Set raw device storage backend (rawdev_storage=<backend>[:<fault>=<value>,...]) */
+static int cmd_rawdev_storage(camogm_state *state, char *args, FILE *out)
+{
+	if (args && storage_check(args) == 0)
+		camogm_set_rawdev_storage(state, args);
+	else
+		D0(fprintf(debug_file, "Invalid storage, usage: rawdev_storage=auto|blockdev|file|uring|mem[:spike=<us>/<n>,rate=<MB/s>,"
+				"short=<n>,eio=<lba>[-<lba>][/...]]\n"));
+	return 46;
+}
+
+/** Command dispatch table, add new commands here */
+static const struct cmd_entry cmd_table[] = {
+	{"start",                 cmd_start},
+	{"reset",                 cmd_reset},
+	{"stop",                  cmd_stop},
+	{"exit",                  cmd_exit},
+	{"duration",              cmd_duration},
+	{"length",                cmd_length},
+	{"prefix",                cmd_prefix},
+	{"status",                cmd_status},
+	{"xstatus",               cmd_xstatus},
+	{"save_gp",               cmd_save_gp},
+	{"exif",                  cmd_exif},
+	{"debug",                 cmd_debug},
+	{"timescale",             cmd_timescale},
+	{"frameskip",             cmd_frameskip},
+	{"timelapse",             cmd_timelapse},
+	{"format",                cmd_format},
+	{"debuglev",              cmd_debuglev},
+	{"kml",                   cmd_kml},
+	{"kml_hhf",               cmd_kml_hhf},
+	{"kml_vhf",               cmd_kml_vhf},
+	{"kml_near",              cmd_kml_near},
+	{"kml_alt",               cmd_kml_alt},
+	{"kml_height",            cmd_kml_height},
+	{"kml_period",            cmd_kml_period},
+	{"frames_per_chunk",      cmd_frames_per_chunk},
+	{"max_frames",            cmd_max_frames},
+	{"start_after_timestamp", cmd_start_after_timestamp},
+	{"greedy",                cmd_greedy},
+	{"ignore_fps",            cmd_ignore_fps},
+	{"port_enable",           cmd_port_enable},
+	{"port_disable",          cmd_port_disable},
+	{"rawdev_path",           cmd_rawdev_path},
+	{"reader_stop",           cmd_reader_stop},
+	{"dummy_read",            cmd_dummy_read},
+	{"rawdev_size",           cmd_rawdev_size},
+	{"frag_frames",           cmd_frag_frames},
+	{"frag_duration",         cmd_frag_duration},
+	{"multitrack",            cmd_multitrack},
+	{"frame_groups",          cmd_frame_groups},
+	{"group_timeout",         cmd_group_timeout},
+	{"jpeg_layout",           cmd_jpeg_layout},
+	{"jpeg_dir_files",        cmd_jpeg_dir_files},
+	{"jpack_extract",         cmd_jpack_extract},
+	{"writeback",             cmd_writeback},
+	{"prealloc",              cmd_prealloc},
+	{"latency_reset",         cmd_latency_reset},
+	{"flight_dump",           cmd_flight_dump},
+	{"trace",                 cmd_trace},
+	{"rawdev_storage",        cmd_rawdev_storage},
+};
+
+/**
+ * @brief Execute a single command
+ * @param[in]   state   pointer to a structure containing current state
+ * @param[in]   cmd     command string in the form <command>[=<arguments>], modified by this function
+ * @param[in]   out     stream for command output (i.e. status) when the command is not given an output file
+ * name, NULL to use stdout
+ * @return      positive value corresponding to a command processed or -1 if the command is not recognized
+ */
+int camogm_exec_cmd(camogm_state *state, char *cmd, FILE *out)
+{
+	char * args;
+	char * argse;
+
+	D2(fprintf(debug_file, "Got command: '%s'\n", cmd));
+
+// Acknowledge received command by copying frame number to per-daemon parameter
+//	GLOBALPARS(state->port_num, G_DAEMON_ERR + lastDaemonBit[state->port_num]) = GLOBALPARS(state->port_num, G_THIS_FRAME);
+	setGValue(state->port_num, G_DAEMON_ERR + lastDaemonBit[state->port_num], getGPValue(state->port_num, G_THIS_FRAME));
+	args = strpbrk(cmd, "= \t");
+// is it just a single word command or does it have parameters?
+	if (args) {
+		args[0] = 0;
+		args++;
+		while (strchr("= \t", args[0])) args++;
+		if (args[0]) {
+// ltrim (args)
+			for (argse = strchr(args, '\0') - 1; strchr("= \t", argse[0]); argse--) argse[0] = '\0';
 		}
-		return 29;
-	} else if (strcmp(cmd, "dummy_read") == 0) {
-		if ((args) && ((d = strtol(args, NULL, 10)) > 0)) camogm_set_dummy_read(state, d);
-		return 30;
+		if (!args[0]) args = NULL;
+	}
+// now cmd is trimmed, arg is NULL or a pointer to trimmed command arguments
+	for (int i = 0; i < sizeof(cmd_table) / sizeof(cmd_table[0]); i++) {
+		if (strcmp(cmd, cmd_table[i].name) == 0)
+			return cmd_table[i].handler(state, args, out);
 	}
 
 	return -1;
 }
 
+/**
+ * @brief Read and execute commands sent over command pipe
+ * @param state   pointer to a structure containing current state
+ * @param npipe   command pipe descriptor
+ * @return        0 if pipe was empty, positive value corresponding to a command processed or
+ * -1 in case of an error
+ */
+int parse_cmd(camogm_state *state, int npipe)
+{
+	char * cmd;
+
+//skip empty commands
+	while (((cmd = getLineFromPipe(npipe))) && !cmd[0]) ;
+	if (!cmd) return 0;  // nothing in the pipe
+
+	return camogm_exec_cmd(state, cmd, NULL);
+}
+
 /**
  * @brief This function closes open files, terminates reading thread and deletes allocated memory.
  * @param[in]   state   pointer to #camogm_state structure for a particular sensor channel
@@ -1520,6 +2405,7 @@ int parse_cmd(camogm_state *state, FILE* npipe)
  */
 void clean_up(camogm_state *state)
 {
+	finalizer_drain();
 	for (int port = 0; port < SENSOR_PORTS; port++) {
 		if (is_fd_valid(state->fd_exif[port]))
 			close(state->fd_exif[port]);
@@ -1536,26 +2422,140 @@ void clean_up(camogm_state *state)
 	}
 }
 
+/**
+ * @brief Execute requests from control thread, called by capture thread between frames
+ * @param[in]   state   a pointer to a structure containing current state
+ * @return      None
+ */
+static void camogm_process_actions(camogm_state *state)
+{
+	struct ctl_action action;
+
+	while (control_take(state, &action)) {
+		switch (action.type) {
+		case ACTION_SETTINGS:
+			camogm_apply_settings(state, action.settings);
+			break;
+		case ACTION_START:
+			check_compressors(state);
+			get_disk_info(state);
+			camogm_start(state);
+			break;
+		case ACTION_STOP:
+			camogm_stop(state);
+			break;
+		case ACTION_RESET:
+			camogm_reset(state);
+			break;
+		case ACTION_EXIT:
+			camogm_stop(state);
+			camogm_free(state);
+			control_free(state);
+			clean_up(state);
+			exit(0);
+		case ACTION_PORT_ENABLE:
+			set_chn_state(state, action.arg, 1);
+			break;
+		case ACTION_PORT_DISABLE:
+			set_chn_state(state, action.arg, 0);
+			break;
+		case ACTION_RAWDEV:
+			if (action.arg) {
+				strcpy(state->rawdev.rawdev_path, state->cfg->rawdev_path);
+				// make disk geometry available in status xml before recording starts
+				get_disk_info(state);
+				open_state_file(&state->rawdev, &state->writer_params.lba_current);
+			} else {
+				state->rawdev_op = 0;
+				state->rawdev.rawdev_path[0] = '\0';
+			}
+			break;
+		}
+	}
+}
+
+/**
+ * @brief Control thread. It waits for commands from command pipe and control socket and executes them,
+ * so status reports and command parsing do not delay recording. Setters change the settings owned by this
+ * thread, the settings are published to capture thread as a snapshot after each batch of commands.
+ * This thread also forwards recording events and periodic status updates to control socket subscribers.
+ * @param[in]   arg   pointer to #camogm_state structure
+ * @return      None, the thread runs until the program exits
+ */
+static void *control_thread(void *arg)
+{
+	int cmd, nfds;
+	camogm_state *state = (camogm_state *)arg;
+	int nctl;
+	struct pollfd pfd[CTL_POLL_FDS + METRICS_POLL_FDS + 2];
+
+	// status report uses its own circbuf descriptors, the file position of capture thread descriptors must not change
+	FOR_EACH_PORT(int, chn) {
+		state->cp.fd_circ[chn] = sim_enabled ? sim_open(SIM_CIRCBUF, chn, O_RDONLY) : open(circbufFileNames[chn], O_RDONLY);
+	}
+	pfd[0].events = POLLIN;
+	pfd[0].fd     = state->cp.cmd_file;
+	pfd[1].events = POLLIN;
+	pfd[1].fd     = events_fd();            // negative descriptor is ignored by poll()
+	trace_thread_name("control");
+	if (state->ctl_path[0])
+		ctl_open(state->ctl_path);
+	if (state->metrics_addr[0])
+		metrics_open(state->metrics_addr);
+
+	while (1) {
+		nctl = ctl_poll_fds(&pfd[2]);
+		nfds = metrics_poll_fds(&pfd[2 + nctl]) + nctl + 2;
+		if (poll(pfd, nfds, ctl_timeout(DEFAULT_POLL_TIMEOUT)) > 0) {
+			if (pfd[0].revents & POLLIN) {
+				// the pipe is non-blocking, read all commands available
+				while ((cmd = parse_cmd(state, state->cp.cmd_file)) != 0) {
+					if (cmd < 0) D0(fprintf(debug_file, "Unrecognized command\n"));
+				}
+			}
+			ctl_process(state, &pfd[2], nctl);
+			control_flush(state);
+			metrics_process(state, &pfd[2 + nctl], nfds - nctl - 2);
+		} else {
+			D6(fprintf(debug_file, "Waiting for commands...\n"));
+		}
+		// flight recorder dump requested by capture thread and trace file when trace time is over
+		flight_write_pending();
+		trace_check();
+		// events and status updates for subscribers of control socket
+		ctl_push(state);
+	}
+
+	return NULL;
+}
+
+/** Add sendImageFrame() error to flight recorder */
+static void camogm_flight_error(camogm_state *state, int port, int rslt)
+{
+	flight_record(FLIGHT_ERROR, port, lat_time(), state->cirbuf_rp[port], getGPValue(port, G_FREECIRCBUF),
+			state->jpeg_len, 0, __atomic_load_n(&state->writer_params.data_ready, __ATOMIC_RELAXED),
+			state->sched_reason, rslt);
+}
+
 /**
  * @brief Main processing loop
  *
- * If recording is on, this function will check for new commands in command pipe after each frame. If recording is
- * turn off, it will poll command pipe each #COMMAND_LOOP_DELAY microseconds and then sleep.
+ * Commands are received and executed in control thread. This loop records frames and checks for new settings and
+ * requests from control thread after each frame, this check does not take any locks. If recording is turned off,
+ * it will wait for requests for up to #DEFAULT_POLL_TIMEOUT milliseconds.
  * @param[in]   state   #camogm_state structure associated with a single port
  * @return      normally this function loops indefinitely processing commands but will return negative exit code in case
  * of error and @e EXIT_SUCCESS it eventually terminates in normal way.
  */
 int listener_loop(camogm_state *state)
 {
-	FILE *cmd_file;
-	int rslt, ret, cmd, f_ok;
+	int cmd_file;
+	int rslt, ret, f_ok;
 	int fp0, fp1;
 	int process = 1;
 	int curr_port = 0;
 	const char *pipe_name = state->pipe_name;
 
-	struct pollfd pfd;
-
 	// create a named pipe
 	// always delete the pipe if it existed, start a fresh one
 	f_ok = access(pipe_name, F_OK);
@@ -1575,148 +2575,153 @@ int listener_loop(camogm_state *state)
 		}
 	}
 
-	/* old */
-	/*
-	// now open the pipe - will block until something will be written (or just open for writing,
-	// reads themselves will not block)
-	if (!((cmd_file = fopen(pipe_name, "r")))) {
-		D0(fprintf(debug_file, "Can not open command file %s\n", pipe_name));
-		clean_up(state);
-		return -5;
-	}
-	*/
-
-	/* new: 2019/01/16 */
-
-	// Adding poll() because supposedly read calls (read, fread)
-	// stopped being blocking at all
-
 	// Why O_RDWR?
 	// https://stackoverflow.com/questions/22021253/poll-on-named-pipe-returns-with-pollhup-constantly-and-immediately
-
-	if (!((cmd_file = open(pipe_name, O_RDWR|O_NONBLOCK)))) {
+	// the pipe stays in non-blocking mode: control thread reads all available commands at once
+	if ((cmd_file = open(pipe_name, O_RDWR|O_NONBLOCK)) < 0) {
 		D0(fprintf(debug_file, "Can not open command file %s\n", pipe_name));
 		clean_up(state);
 		return -5;
 	}
-	/* force(?) disable O_NONBLOCK */
-	fcntl(cmd_file, F_SETFL, 0);
-	// ready to read
-	pfd.events = POLLIN;
-	pfd.fd     = cmd_file;
-
 	D0(fprintf(debug_file, "Pipe %s open for reading\n", pipe_name)); // to make sure something is sent out
 
+	state->cp.cmd_file = cmd_file;
+	if (pthread_create(&state->cp.tid, NULL, control_thread, state) != 0) {
+		D0(fprintf(debug_file, "Can not start control thread\n"));
+		clean_up(state);
+		return -6;
+	}
+
 	// enter main processing loop
+	trace_thread_name("capture");
 	while (process) {
 		curr_port = select_port(state);
 		state->port_num = curr_port;
-		// look at command queue first
-
-		ret = poll(&pfd,1,DEFAULT_POLL_TIMEOUT);
-
-		if (ret==0){
-			D6(fprintf(debug_file, "Waiting for commands...\n"));
-		}
-
-		if (pfd.revents & POLLIN){
-			cmd = parse_cmd(state, cmd_file);
-			if (cmd) {
-				if (cmd < 0) D0(fprintf(debug_file, "Unrecognized command\n"));
-			} else if (state->prog_state == STATE_RUNNING) { // no commands in queue, started
-				switch ((rslt = -sendImageFrame(state))) {
-				case 0:
-					break;                      // frame sent OK, nothing to do (TODO: check file length/duration)
-				case CAMOGM_FRAME_NOT_READY:    // just wait for the frame to appear at the current pointer
-					// we'll wait for a frame, not to waste resources. But if the compressor is stopped this program will not respond to any commands
-					// TODO - add another wait with (short) timeout?
-					fp0 = lseek(state->fd_circ[curr_port], 0, SEEK_CUR);
-					if (fp0 < 0) {
-						D0(fprintf(debug_file, "%s:line %d got broken frame (%d) before waiting for ready\n", __FILE__, __LINE__, fp0));
-						rslt = CAMOGM_FRAME_BROKEN;
-					} else {
-						fp1 = lseek(state->fd_circ[curr_port], LSEEK_CIRC_WAIT, SEEK_END);
-						if (fp1 < 0) {
-							D0(fprintf(debug_file, "%s:line %d got broken frame (%d) while waiting for ready. Before that fp0=0x%x\n", __FILE__, __LINE__, fp1, fp0));
-							rslt = CAMOGM_FRAME_BROKEN;
-						} else {
-							break;
-						}
-					}
-					// no break
-				case  CAMOGM_FRAME_CHANGED:     // frame parameters have changed
-				case  CAMOGM_FRAME_NEXTFILE:    // next file needed (need to switch to a new file (time/size exceeded limit)
-				case  CAMOGM_FRAME_INVALID:     // invalid frame pointer
-				case  CAMOGM_FRAME_BROKEN:      // frame broken (buffer overrun)
-					// restart the file
-					D3(fprintf(debug_file,"%s:line %d - sendImageFrame() returned -%d\n", __FILE__, __LINE__, rslt));
+		// look at control queue first, settings and requests are applied between frames
+		if (control_pending(state)) {
+			camogm_process_actions(state);
+		} else if (state->prog_state == STATE_RUNNING && state->group.waiting) {
+			// waiting for the frames of the next group from other ports
+			usleep(FRAME_GROUP_WAIT_DELAY);
+		} else if (state->prog_state == STATE_RUNNING) { // no commands in queue, started
+			rslt = -sendImageFrame(state);
+			if (rslt != 0 && rslt != CAMOGM_FRAME_NOT_READY)
+				camogm_flight_error(state, curr_port, rslt);
+			switch (rslt) {
+			case 0:
+				break;                      // frame sent OK, nothing to do (TODO: check file length/duration)
+			case  CAMOGM_FRAME_NEXTFILE:    // next file needed (need to switch to a new file (time/size exceeded limit)
+				// frame parameters are the same, continue with the next segment right away and finalize this one in background
+				if (camogm_next_segment(state) != 0) {
+					D3(fprintf(debug_file,"%s:line %d - can not switch to the next segment, restarting\n", __FILE__, __LINE__));
+					flight_trigger(FLIGHT_TRIGGER_RESTART);
 					camogm_stop(state);
 					state->prog_state = STATE_RESTARTING;
 					camogm_start(state);
-					break;
-				case  CAMOGM_FRAME_FILE_ERR:    // error with file I/O
-				case  CAMOGM_FRAME_OTHER:       // other errors
-					D0(fprintf(debug_file, "%s:line %d - error=%d\n", __FILE__, __LINE__, rslt));
-					break;
-				default:
-					D0(fprintf(debug_file, "%s:line %d - should not get here (rslt=%d)\n", __FILE__, __LINE__, rslt));
-					clean_up(state);
-					exit(-1);
-				} // switch sendImageFrame()
-
-				// collect error statistics
-				if (rslt > 0 && rslt < CAMOGM_ERRNUM)
-					state->error_stat[curr_port][rslt]++;
-
-				if ((rslt != 0) && (rslt != CAMOGM_FRAME_NOT_READY) && (rslt != CAMOGM_FRAME_CHANGED))
-					// add port number to error code to facilitate debugging
-					state->last_error_code = rslt + 100 * state->port_num;
-			} else if (state->prog_state == STATE_STARTING) { // no commands in queue,starting (but not started yet)
-
-				// retry starting
-				switch ((rslt = -camogm_start(state))) {
-				case 0:
-					break;                      // file started OK, nothing to do
-				case CAMOGM_TOO_EARLY:
-					lseek(state->fd_circ[curr_port], LSEEK_CIRC_TOWP, SEEK_END);       // set pointer to the frame to wait for
-					lseek(state->fd_circ[curr_port], LSEEK_CIRC_WAIT, SEEK_END);       // It already passed CAMOGM_FRAME_NOT_READY, so compressor may be running already
-					break;                                                  // no need to wait extra
-				case CAMOGM_FRAME_NOT_READY:                                // just wait for the frame to appear at the current pointer
+				}
+				break;
+			case CAMOGM_FRAME_NOT_READY:    // just wait for the frame to appear at the current pointer
 				// we'll wait for a frame, not to waste resources. But if the compressor is stopped this program will not respond to any commands
 				// TODO - add another wait with (short) timeout?
-				case  CAMOGM_FRAME_CHANGED:     // frame parameters have changed
-				case  CAMOGM_FRAME_NEXTFILE:
-				case  CAMOGM_FRAME_INVALID:     // invalid frame pointer
-				case  CAMOGM_FRAME_BROKEN:      // frame broken (buffer overrun)
-					usleep(COMMAND_LOOP_DELAY); // it should be not too long so empty buffer will not be overrun
-					break;
-				case  CAMOGM_FRAME_FILE_ERR:    // error with file I/O
-				case  CAMOGM_FRAME_OTHER:       // other errors
-					D0(fprintf(debug_file, "%s:line %d - error=%d\n", __FILE__, __LINE__, rslt));
-					break;
-				default:
-					D0(fprintf(debug_file, "%s:line %d - should not get here (rslt=%d)\n", __FILE__, __LINE__, rslt));
-					clean_up(state);
-					exit(-1);
-				} // switch camogm_start()
-
-				// collect error statistics
-				if (rslt > 0 && rslt < CAMOGM_ERRNUM)
-					state->error_stat[curr_port][rslt]++;
-
-				if ((rslt != 0) && (rslt != CAMOGM_TOO_EARLY) && (rslt != CAMOGM_FRAME_NOT_READY) && (rslt != CAMOGM_FRAME_CHANGED) )
-					// add port number to error code to facilitate debugging
-					state->last_error_code = rslt + 100 * state->port_num;
-			} else if (state->prog_state == STATE_READING) {
-				usleep(COMMAND_LOOP_DELAY);
-			} else {                            // not running, not starting
-				state->rawdev.thread_state = STATE_RUNNING;
-				usleep(COMMAND_LOOP_DELAY);     // make it longer but interruptible by signals?
-			}
-		} // if pfd.revents & POLLIN
+				fp0 = dev_lseek(state->fd_circ[curr_port], 0, SEEK_CUR);
+				if (fp0 < 0) {
+					D0(fprintf(debug_file, "%s:line %d got broken frame (%d) before waiting for ready\n", __FILE__, __LINE__, fp0));
+					rslt = CAMOGM_FRAME_BROKEN;
+					camogm_flight_error(state, curr_port, rslt);
+				} else {
+					fp1 = dev_lseek(state->fd_circ[curr_port], LSEEK_CIRC_WAIT, SEEK_END);
+					if (fp1 < 0) {
+						D0(fprintf(debug_file, "%s:line %d got broken frame (%d) while waiting for ready. Before that fp0=0x%x\n", __FILE__, __LINE__, fp1, fp0));
+						rslt = CAMOGM_FRAME_BROKEN;
+						camogm_flight_error(state, curr_port, rslt);
+					} else {
+						break;
+					}
+				}
+				// no break
+			case  CAMOGM_FRAME_CHANGED:     // frame parameters have changed
+			case  CAMOGM_FRAME_INVALID:     // invalid frame pointer
+			case  CAMOGM_FRAME_BROKEN:      // frame broken (buffer overrun)
+				// restart the file
+				D3(fprintf(debug_file,"%s:line %d - sendImageFrame() returned -%d\n", __FILE__, __LINE__, rslt));
+				flight_trigger(FLIGHT_TRIGGER_RESTART);
+				camogm_stop(state);
+				state->prog_state = STATE_RESTARTING;
+				camogm_start(state);
+				break;
+			case  CAMOGM_FRAME_FILE_ERR:    // error with file I/O
+				if (!state->rawdev_op && errno == ENOSPC)
+					rslt = CAMOGM_NO_SPACE;
+				// report the error once, until it changes or status report clears it
+				if (state->last_error_code != rslt + 100 * state->port_num)
+					camogm_event((rslt == CAMOGM_NO_SPACE) ? EVENT_NO_SPACE : EVENT_WRITER_ERROR, curr_port, -rslt,
+							state->rawdev_op ? state->rawdev.rawdev_path : state->path);
+				D0(fprintf(debug_file, "%s:line %d - error=%d\n", __FILE__, __LINE__, rslt));
+				break;
+			case  CAMOGM_FRAME_OTHER:       // other errors
+				D0(fprintf(debug_file, "%s:line %d - error=%d\n", __FILE__, __LINE__, rslt));
+				break;
+			default:
+				D0(fprintf(debug_file, "%s:line %d - should not get here (rslt=%d)\n", __FILE__, __LINE__, rslt));
+				clean_up(state);
+				exit(-1);
+			} // switch sendImageFrame()
+
+			// collect error statistics
+			if (rslt > 0 && rslt < CAMOGM_ERRNUM)
+				CNT_INC(state->cnt.error_stat[curr_port][rslt]);
+
+			if ((rslt != 0) && (rslt != CAMOGM_FRAME_NOT_READY) && (rslt != CAMOGM_FRAME_CHANGED) && (rslt != CAMOGM_FRAME_NEXTFILE))
+				// add port number to error code to facilitate debugging
+				state->last_error_code = rslt + 100 * state->port_num;
+		} else if (state->prog_state == STATE_STARTING) { // no commands in queue,starting (but not started yet)
+
+			// retry starting
+			switch ((rslt = -camogm_start(state))) {
+			case 0:
+				break;                      // file started OK, nothing to do
+			case CAMOGM_TOO_EARLY:
+				dev_lseek(state->fd_circ[curr_port], LSEEK_CIRC_TOWP, SEEK_END);       // set pointer to the frame to wait for
+				dev_lseek(state->fd_circ[curr_port], LSEEK_CIRC_WAIT, SEEK_END);       // It already passed CAMOGM_FRAME_NOT_READY, so compressor may be running already
+				break;                                                  // no need to wait extra
+			case CAMOGM_FRAME_NOT_READY:                                // just wait for the frame to appear at the current pointer
+			// we'll wait for a frame, not to waste resources. But if the compressor is stopped this program will not respond to any commands
+			// TODO - add another wait with (short) timeout?
+			case  CAMOGM_FRAME_CHANGED:     // frame parameters have changed
+			case  CAMOGM_FRAME_NEXTFILE:
+			case  CAMOGM_FRAME_INVALID:     // invalid frame pointer
+			case  CAMOGM_FRAME_BROKEN:      // frame broken (buffer overrun)
+				usleep(COMMAND_LOOP_DELAY); // it should be not too long so empty buffer will not be overrun
+				break;
+			case  CAMOGM_FRAME_FILE_ERR:    // error with file I/O
+			case  CAMOGM_FRAME_OTHER:       // other errors
+				D0(fprintf(debug_file, "%s:line %d - error=%d\n", __FILE__, __LINE__, rslt));
+				break;
+			default:
+				D0(fprintf(debug_file, "%s:line %d - should not get here (rslt=%d)\n", __FILE__, __LINE__, rslt));
+				clean_up(state);
+				exit(-1);
+			} // switch camogm_start()
+
+			// collect error statistics
+			if (rslt > 0 && rslt < CAMOGM_ERRNUM)
+				CNT_INC(state->cnt.error_stat[curr_port][rslt]);
+
+			if ((rslt != 0) && (rslt != CAMOGM_TOO_EARLY) && (rslt != CAMOGM_FRAME_NOT_READY) && (rslt != CAMOGM_FRAME_CHANGED) )
+				// add port number to error code to facilitate debugging
+				state->last_error_code = rslt + 100 * state->port_num;
+		} else if (state->prog_state == STATE_READING) {
+			control_wait(state, DEFAULT_POLL_TIMEOUT);
+		} else {                            // not running, not starting
+			state->rawdev.thread_state = STATE_RUNNING;
+			control_wait(state, DEFAULT_POLL_TIMEOUT);
+		}
+		camogm_publish_counters(state);
 	} // while (process)
 
 	// normally, we should not be here
+	ctl_close();
+	metrics_close();
 	clean_up(state);
 	return EXIT_SUCCESS;
 }
@@ -1732,13 +2737,18 @@ static uint64_t get_disk_size(const char *name)
 {
 	int fd;
 	uint64_t dev_sz;
+	struct stat st;
 
 	if ((fd = open(name, O_RDONLY)) < 0) {
 		perror(__func__);
 		return 0;
 	}
-	if (ioctl(fd, BLKGETSIZE64, &dev_sz) < 0) {
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		// regular file, use only the part aligned to physical block size
+		dev_sz = st.st_size - st.st_size % PHY_BLOCK_SIZE;
+	} else if (ioctl(fd, BLKGETSIZE64, &dev_sz) < 0) {
 		perror(__func__);
+		close(fd);
 		return 0;
 	}
 	close(fd);
@@ -1746,6 +2756,39 @@ static uint64_t get_disk_size(const char *name)
 	return dev_sz;
 }
 
+/**
+ * @brief Create regular file used as raw device buffer or extend it to the size requested. The space for
+ * the file is allocated on disk at once, thus the file is not fragmented during recording.
+ * @param[in]   state   a pointer to a structure containing current state
+ * @return      0 if the file is ready and -1 in case of an error
+ */
+static int prep_rawdev_file(camogm_state *state)
+{
+	int fd;
+	int ret = 0;
+	int err;
+	struct stat st;
+
+	if (state->rawdev.file_size == 0)
+		return 0;
+
+	fd = open(state->rawdev.rawdev_path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		D0(fprintf(debug_file, "Unable to open %s: %s\n", state->rawdev.rawdev_path, strerror(errno)));
+		return -1;
+	}
+	if (fstat(fd, &st) == 0 && (uint64_t)st.st_size < state->rawdev.file_size) {
+		D0(fprintf(debug_file, "Allocating %llu bytes for raw device buffer file %s\n", state->rawdev.file_size, state->rawdev.rawdev_path));
+		if ((err = posix_fallocate(fd, 0, state->rawdev.file_size)) != 0) {
+			D0(fprintf(debug_file, "Unable to allocate space for %s: %s\n", state->rawdev.rawdev_path, strerror(err)));
+			ret = -1;
+		}
+	}
+	close(fd);
+
+	return ret;
+}
+
 /**
  * @brief Make sysfs path from disk name in accordance with the type provided.
  * The 'start' file does not exist for full disk path (/dev/sda) and this function
@@ -1903,11 +2946,19 @@ static int set_disk_range(const struct range *rng)
  */
 unsigned int select_port(camogm_state *state)
 {
+	int grp_chn;
 	unsigned int chn = 0;
 	off_t free_sz;
 	off_t file_pos;
 	off_t min_sz = -1;
 
+	state->group.waiting = false;
+	state->sched_reason = SCHED_GROUP;
+	if (state->frame_groups && state->rawdev_op && state->prog_state == STATE_RUNNING &&
+			(grp_chn = select_group_port(state)) >= 0)
+		return grp_chn;
+	state->sched_reason = SCHED_FIRST;
+
 	// define first active channel in case not all of them are active
 	for (int i = 0; i < SENSOR_PORTS; i++) {
 		if (is_chn_active(state, i)) {
@@ -1916,24 +2967,59 @@ unsigned int select_port(camogm_state *state)
 		}
 	}
 
+	// in multitrack mode frames from all ports go to one file, select the port with the oldest ready frame
+	// to keep the file interleaved by time stamp; fall back to buffer fill level if no frames are ready.
+	// Only Matroska files have multiple tracks, other formats ignore this setting
+	if (state->multitrack && state->format == CAMOGM_FORMAT_MKV && state->prog_state == STATE_RUNNING) {
+		int oldest = -1;
+		uint64_t ts, min_ts = UINT64_MAX;
+		struct interframe_params_t params;
+
+		for (int i = 0; i < SENSOR_PORTS; i++) {
+			if (!is_chn_active(state, i))
+				continue;
+			// broken frame pointer or frame, let sendImageFrame() take recovery actions
+			state->sched_reason = SCHED_BROKEN;
+			if (dev_lseek(state->fd_circ[i], state->cirbuf_rp[i], SEEK_SET) < 0)
+				return i;
+			if (dev_lseek(state->fd_circ[i], LSEEK_CIRC_READY, SEEK_END) < 0)
+				continue;
+			if (get_frame_params(state, i, state->cirbuf_rp[i], &params) < 0)
+				return i;
+			ts = (uint64_t)params.timestamp_sec * 1000000 + params.timestamp_usec;
+			if (ts < min_ts) {
+				min_ts = ts;
+				oldest = i;
+			}
+		}
+		if (oldest >= 0) {
+			D6(fprintf(debug_file, "Selecting sensor port by time stamp, selected port: %i\n", oldest));
+			state->sched_reason = SCHED_TIMESTAMP;
+			return oldest;
+		}
+		state->sched_reason = SCHED_FIRST;
+	}
+
 	if (state->prog_state == STATE_STARTING || state->prog_state == STATE_RUNNING)
 		D6(fprintf(debug_file, "Selecting sensor port, buffer free size: "));
 	for (int i = 0; i < SENSOR_PORTS; i++) {
 		if (is_chn_active(state, i)) {
-			file_pos = lseek(state->fd_circ[i], 0, SEEK_CUR);
+			file_pos = dev_lseek(state->fd_circ[i], 0, SEEK_CUR);
 			if (file_pos != -1) {
-				free_sz = lseek(state->fd_circ[i], LSEEK_CIRC_FREE, SEEK_END);
-				lseek(state->fd_circ[i], file_pos, SEEK_SET);
+				free_sz = dev_lseek(state->fd_circ[i], LSEEK_CIRC_FREE, SEEK_END);
+				dev_lseek(state->fd_circ[i], file_pos, SEEK_SET);
 				if (state->prog_state == STATE_STARTING || state->prog_state == STATE_RUNNING)
 					D6(fprintf(debug_file, "port %i = %li, ", i, free_sz));
 				if ((free_sz < min_sz && free_sz >= 0) || min_sz == -1) {
 					min_sz = free_sz;
 					chn = i;
+					state->sched_reason = SCHED_FREE;
 				}
 			} else {
 				// current frame pointer is possibly overwritten (buffer overflow), select
 				// this channel which will force sendImageFrame() to take recovery actions
 				chn = i;
+				state->sched_reason = SCHED_BROKEN;
 				break;
 			}
 		} else {
@@ -1947,6 +3033,90 @@ unsigned int select_port(camogm_state *state)
 	return chn;
 }
 
+/**
+ * @brief Select sensor port when time-aligned frame groups are recorded.
+ *
+ * The frames of current group are recorded first. A new group is started when all active ports have ready
+ * frames with the same time stamp. If some ports do not have ready frames, the function waits (sets
+ * #frame_group::waiting) for #camogm_state::group_timeout and then starts a group with the frames available.
+ * If all ports have ready frames but some time stamps do not match, the oldest frames are recorded as a
+ * group right away as the frames from other ports for that time are lost.
+ * @param[in,out] state   a pointer to a structure containing current state
+ * @return        sensor port number or -1 if there are no ready frames and port should be selected in
+ * a regular way
+ */
+static int select_group_port(camogm_state *state)
+{
+	unsigned int ready = 0;
+	unsigned int match = 0;
+	unsigned int missing;
+	uint64_t ts[SENSOR_PORTS];
+	uint64_t min_ts = UINT64_MAX;
+	long wait_ms;
+	struct timespec now;
+	struct interframe_params_t params;
+	struct frame_group *grp = &state->group;
+
+	FOR_EACH_PORT(int, chn) {
+		if (!is_chn_active(state, chn))
+			continue;
+		if (dev_lseek(state->fd_circ[chn], state->cirbuf_rp[chn], SEEK_SET) < 0 ||
+				(dev_lseek(state->fd_circ[chn], LSEEK_CIRC_READY, SEEK_END) >= 0 &&
+				get_frame_params(state, chn, state->cirbuf_rp[chn], &params) < 0)) {
+			// broken frame pointer or frame, drop current group and let sendImageFrame() take recovery actions
+			grp->pending = 0;
+			grp->start = false;
+			return chn;
+		}
+		if (dev_lseek(state->fd_circ[chn], LSEEK_CIRC_READY, SEEK_END) < 0)
+			continue;
+		ts[chn] = (uint64_t)params.timestamp_sec * 1000000 + params.timestamp_usec;
+		ready |= 1 << chn;
+		if (ts[chn] < min_ts)
+			min_ts = ts[chn];
+	}
+
+	// continue current group, drop the ports which frames were skipped
+	FOR_EACH_PORT(int, chn) {
+		if (grp->pending & (1 << chn)) {
+			if ((ready & (1 << chn)) && llabs((int64_t)(ts[chn] - grp->time)) <= FRAME_GROUP_TOLERANCE)
+				return chn;
+			grp->pending &= ~(1 << chn);
+		}
+	}
+	if (ready == 0)
+		return -1;
+
+	// start a new group
+	FOR_EACH_PORT(int, chn) {
+		if ((ready & (1 << chn)) && ts[chn] - min_ts <= FRAME_GROUP_TOLERANCE)
+			match |= 1 << chn;
+	}
+	missing = state->active_chn & ~ready;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (missing) {
+		if (grp->wait_start.tv_sec == 0 && grp->wait_start.tv_nsec == 0)
+			grp->wait_start = now;
+		wait_ms = (now.tv_sec - grp->wait_start.tv_sec) * 1000 + (now.tv_nsec - grp->wait_start.tv_nsec) / 1000000;
+		if (wait_ms < state->group_timeout) {
+			grp->waiting = true;
+			return __builtin_ctz(ready);
+		}
+		D3(fprintf(debug_file, "Frame group timeout, ports ready: 0x%x, active: 0x%x\n", ready, state->active_chn));
+	}
+	grp->wait_start.tv_sec = 0;
+	grp->wait_start.tv_nsec = 0;
+	grp->ports = match;
+	grp->pending = match;
+	grp->time = min_ts;
+	grp->start = true;
+	grp->groups++;
+	if (match != state->active_chn)
+		grp->partial++;
+
+	return __builtin_ctz(match);
+}
+
 /**
  * @brief Check if channel is enabled or disabled
  * @param[in]   s      a pointer to a structure containing current state
@@ -1976,7 +3146,7 @@ inline void set_chn_state(camogm_state *s, unsigned int port, unsigned int new_s
 }
 
 /**
- * @brief Open files provided by circbuf driver.
+ * @brief Open files provided by circbuf driver, or simulated device files if the simulator is enabled.
  * @param[in,out] state   a pointer to a structure containing current state
  * @return        0 on success or negative error code
  */
@@ -1986,7 +3156,7 @@ int open_files(camogm_state *state)
 
 	for (int port = 0; port < SENSOR_PORTS; port++) {
 		// open Exif header file
-		state->fd_exif[port] = open(exifFileNames[port], O_RDONLY);
+		state->fd_exif[port] = sim_enabled ? sim_open(SIM_EXIF, port, O_RDONLY) : open(exifFileNames[port], O_RDONLY);
 		if (state->fd_exif[port] < 0) { // check control OK
 			D0(fprintf(debug_file, "Error opening %s\n", exifFileNames[port]));
 			clean_up(state);
@@ -1994,13 +3164,13 @@ int open_files(camogm_state *state)
 		}
 
 		// open JPEG header file
-		state->fd_head[port] = open(headFileNames[port], O_RDWR);
+		state->fd_head[port] = sim_enabled ? sim_open(SIM_JPEGHEAD, port, O_RDWR) : open(headFileNames[port], O_RDWR);
 		if (state->fd_head[port] < 0) { // check control OK
 			D0(fprintf(debug_file, "Error opening %s\n", headFileNames[port]));
 			clean_up(state);
 			return -1;
 		}
-		state->head_size[port] = lseek(state->fd_head[port], 0, SEEK_END);
+		state->head_size[port] = dev_lseek(state->fd_head[port], 0, SEEK_END);
 		if (state->head_size[port] > JPEG_HEADER_MAXSIZE) {
 			D0(fprintf(debug_file, "%s:%d: Too big JPEG header (%d > %d)", __FILE__, __LINE__, state->head_size[port], JPEG_HEADER_MAXSIZE ));
 			clean_up(state);
@@ -2008,15 +3178,15 @@ int open_files(camogm_state *state)
 		}
 
 		// open circbuf and mmap it (once at startup)
-		state->fd_circ[port] = open(circbufFileNames[port], O_RDWR);
+		state->fd_circ[port] = sim_enabled ? sim_open(SIM_CIRCBUF, port, O_RDWR) : open(circbufFileNames[port], O_RDWR);
 		if (state->fd_circ < 0) { // check control OK
 			D0(fprintf(debug_file, "Error opening %s\n", circbufFileNames[port]));
 			clean_up(state);
 			return -2;
 		}
 		// find total buffer length (it is in defines, actually in c313a.h
-		state->circ_buff_size[port] = lseek(state->fd_circ[port], 0, SEEK_END);
-		ccam_dma_buf[port] = (unsigned long*)mmap(0, state->circ_buff_size[port], PROT_READ, MAP_SHARED, state->fd_circ[port], 0);
+		state->circ_buff_size[port] = dev_lseek(state->fd_circ[port], 0, SEEK_END);
+		ccam_dma_buf[port] = (uint32_t *)mmap(0, state->circ_buff_size[port], PROT_READ, MAP_SHARED, state->fd_circ[port], 0);
 		if ((int)ccam_dma_buf[port] == -1) {
 			D0(fprintf(debug_file, "Error in mmap of %s\n", circbufFileNames[port]));
 			clean_up(state);
@@ -2024,7 +3194,7 @@ int open_files(camogm_state *state)
 		}
 
 		// now open/mmap file to read sensor/compressor parameters (currently - just free memory in circbuf and compressor state)
-		state->fd_fparmsall[port] = open(ctlFileNames[port], O_RDWR);
+		state->fd_fparmsall[port] = sim_enabled ? sim_open(SIM_FRAMEPARS, port, O_RDWR) : open(ctlFileNames[port], O_RDWR);
 		if (state->fd_fparmsall[port] < 0) { // check control OK
 			D0(fprintf(debug_file, "%s:%d:%s: Error opening %s\n", __FILE__, __LINE__, __FUNCTION__, ctlFileNames[port]));
 			clean_up(state);
@@ -2051,7 +3221,8 @@ int main(int argc, char *argv[])
 	const char usage[] =   "This program allows recording of the video/images acquired by Elphel camera to the storage media.\n" \
 			     "It is designed to run in the background and accept commands through a named pipe or a socket.\n\n" \
 			     "Usage:\n\n" \
-			     "%s -n <named_pipe_name> -p <port_number> [-s state_file_name]\n\n"	\
+			     "%s -n <named_pipe_name> -p <port_number> [-s state_file_name] [-c control_socket_name] [-m metrics_address]\n" \
+			     "        [-S simulator_settings]\n\n"	\
 			     "i.e.:\n\n" \
 			     "%s -n /var/state/camogm_cmd -p 1234 -s /mnt/sda1/write_pos\n\n" \
 			     "When the program is running you may send commands by writing strings to the command file\n" \
@@ -2065,19 +3236,32 @@ int main(int argc, char *argv[])
 			     "information to a file /var/tmp/camogm.status in the camera file system.\n\n" \
 			     "This program does not control the process of acquisition of the video/images to the camera internal\n" \
 			     "buffer, it only retrieves that data from the buffer (waiting when needed), packages it to selected\n" \
-			     "format and stores the result files.\n\n";
+			     "format and stores the result files.\n\n" \
+			     "Commands can also be sent to Unix domain control socket (named pipe name with '" CTL_SOCKET_SUFFIX "' appended\n" \
+			     "by default), one request per line with commands separated by semicolons. Each request gets a reply\n" \
+			     "containing the code and output (i.e. status) of each command, see camogm_ctl.c for reply format.\n\n" \
+			     "Recording metrics in Prometheus text format are served on TCP port ([host:]port) or Unix domain socket\n" \
+			     "(file name) given with -m option, i.e. '-m 9100'. Metrics are disabled by default.\n\n" \
+			     "With -S option the program runs without camera drivers, frames are generated by built-in simulator of\n" \
+			     "circbuf and frame parameters drivers. Settings are comma separated key=value pairs, the value can be a list\n" \
+			     "of per port values separated by '/': dir, fps, size, jitter, width, height, buffer (see camogm_sim.c),\n" \
+			     "i.e. '-S fps=30/15,size=500000'.\n\n";
 	int ret;
 	int opt;
 	uint16_t port_num = 0;
 	size_t str_len;
 	char pipe_name_str[ELPHEL_PATH_MAX] = {0};
 	char state_name_str[ELPHEL_PATH_MAX] = {0};
+	char ctl_name_str[ELPHEL_PATH_MAX] = {0};
+	char metrics_addr_str[ELPHEL_PATH_MAX] = {0};
+	char sim_cfg_str[ELPHEL_PATH_MAX] = {0};
+	bool sim = false;
 
 	if ((argc < 5) || (argv[1][1] == '-')) {
 		printf(usage, argv[0], argv[0]);
 		return EXIT_SUCCESS;
 	}
-	while ((opt = getopt(argc, argv, "n:p:s:h")) != -1) {
+	while ((opt = getopt(argc, argv, "n:p:s:c:m:S:h")) != -1) {
 		switch (opt) {
 		case 'n':
 			strncpy(pipe_name_str, (const char *)optarg, ELPHEL_PATH_MAX - 1);
@@ -2091,14 +3275,33 @@ int main(int argc, char *argv[])
 		case 's':
 			strncpy(state_name_str, (const char *)optarg, ELPHEL_PATH_MAX - 1);
 			break;
+		case 'c':
+			strncpy(ctl_name_str, (const char *)optarg, ELPHEL_PATH_MAX - 1);
+			break;
+		case 'm':
+			strncpy(metrics_addr_str, (const char *)optarg, ELPHEL_PATH_MAX - 1);
+			break;
+		case 'S':
+			strncpy(sim_cfg_str, (const char *)optarg, ELPHEL_PATH_MAX - 1);
+			sim = true;
+			break;
 		}
 	}
+	if (ctl_name_str[0] == '\0' &&
+			snprintf(ctl_name_str, ELPHEL_PATH_MAX, "%s" CTL_SOCKET_SUFFIX, pipe_name_str) >= ELPHEL_PATH_MAX) {
+		fprintf(stderr, "Control socket name is too long, the socket is disabled; use -c option to set a shorter name\n");
+		ctl_name_str[0] = '\0';
+	}
 
+	if (log_init() < 0)
+		fprintf(stderr, "Can not start log thread, debug messages will be written synchronously\n");
 	camogm_init(&sstate, pipe_name_str, port_num);
 	if (pthread_mutex_init(&sstate.mutex, NULL) != 0) {
 		perror("Unable to initialize mutex\n");
 		return EXIT_FAILURE;
 	}
+	if (sim && sim_init(sim_cfg_str) < 0)
+		return EXIT_FAILURE;
 	ret = open_files(&sstate);
 	if (ret < 0)
 		return ret;
@@ -2110,6 +3313,9 @@ int main(int argc, char *argv[])
 		return EXIT_FAILURE;
 	}
 	sstate.rawdev.thread_state = STATE_RUNNING;
+	finalizer_start();
+	strcpy(sstate.ctl_path, ctl_name_str);
+	strcpy(sstate.metrics_addr, metrics_addr_str);
 	str_len = strlen(state_name_str);
 	if (str_len > 0) {
 		strncpy(sstate.rawdev.state_path, (const char *)state_name_str, str_len + 1);
@@ -2160,7 +3366,7 @@ int waitDaemonEnabled(unsigned int port, int daemonBit)   // <0 - use default
 	unsigned long this_frame = GLOBALPARS(port, G_THIS_FRAME);
 	// No semaphors, so it is possible to miss event and wait until the streamer will be re-enabled before sending message,
 	// but it seems not so terrible
-	lseek(state->fd_circ[port], LSEEK_DAEMON_CIRCBUF + lastDaemonBit[port], SEEK_END);
+	dev_lseek(state->fd_circ[port], LSEEK_DAEMON_CIRCBUF + lastDaemonBit[port], SEEK_END);
 	if (this_frame == GLOBALPARS(port, G_THIS_FRAME)) return 1;
 	return 0;
 }
@@ -2197,7 +3403,7 @@ struct timeval get_fpga_time(const int fd_fparsall, unsigned int port)
 	struct timeval tv;
 	unsigned long write_data[] = {FRAMEPARS_GETFPGATIME, 0};
 
-	write(fd_fparsall, write_data, sizeof(unsigned long) * 2);
+	dev_write(fd_fparsall, write_data, sizeof(unsigned long) * 2);
 	tv.tv_sec = getGPValue(port, G_SECONDS);
 	tv.tv_usec = getGPValue(port, G_MICROSECONDS);
 
@@ -21,12 +21,17 @@
 
 #include <pthread.h>
 #include <stdbool.h>
-#include <ogg/ogg.h>
+#include <stdint.h>
+#include <time.h>
 #include "ogmstreams.h"
 #include <elphel/exifa.h>
 #include <elphel/c313a.h>
 #include <elphel/x393_devices.h>
 
+#include "camogm_latency.h"
+#include "camogm_log.h"
+#include "camogm_storage.h"
+
 #define CAMOGM_FRAME_NOT_READY    1        ///< frame pointer valid, but not yet acquired
 #define CAMOGM_FRAME_INVALID      2        ///< invalid frame pointer
 #define CAMOGM_FRAME_CHANGED      3        ///< frame parameters have changed
@@ -43,23 +48,22 @@
 #define CAMOGM_FORMAT_OGM         1        ///< output as Ogg Media file
 #define CAMOGM_FORMAT_JPEG        2        ///< output as individual JPEG files
 #define CAMOGM_FORMAT_MOV         3        ///< output as Apple Quicktime
+#define CAMOGM_FORMAT_FMP4        4        ///< output as fragmented MP4 (ISO BMFF)
+#define CAMOGM_FORMAT_MKV         5        ///< output as Matroska
+#define CAMOGM_FORMAT_JPACK       6        ///< output as JPEG frames appended to pack file with sidecar index
 
-#define D(x) { if (debug_file && debug_level) { x; fflush(debug_file); } }
-#define D0(x) { if (debug_file) { pthread_mutex_lock(&print_mutex); x; fflush(debug_file); pthread_mutex_unlock(&print_mutex); } }
-#define D1(x) { if (debug_file && (debug_level > 0)) { pthread_mutex_lock(&print_mutex); x; fflush(debug_file); pthread_mutex_unlock(&print_mutex); } }
-#define D2(x) { if (debug_file && (debug_level > 1)) { pthread_mutex_lock(&print_mutex); x; fflush(debug_file); pthread_mutex_unlock(&print_mutex); } }
-#define D3(x) { if (debug_file && (debug_level > 2)) { pthread_mutex_lock(&print_mutex); x; fflush(debug_file); pthread_mutex_unlock(&print_mutex); } }
-#define D4(x) { if (debug_file && (debug_level > 3)) { pthread_mutex_lock(&print_mutex); x; fflush(debug_file); pthread_mutex_unlock(&print_mutex); } }
-#define D5(x) { if (debug_file && (debug_level > 4)) { pthread_mutex_lock(&print_mutex); x; fflush(debug_file); pthread_mutex_unlock(&print_mutex); } }
-#define D6(x) { if (debug_file && (debug_level > 5)) { pthread_mutex_lock(&print_mutex); x; fflush(debug_file); pthread_mutex_unlock(&print_mutex); } }
+#define JPEG_LAYOUT_FLAT          0        ///< all JPEG files are written to the directory of path prefix
+#define JPEG_LAYOUT_DATE          1        ///< JPEG files are written to <port>/<YYYYMMDD>/<HH> subdirectories
+#define JPEG_LAYOUT_COUNT         2        ///< JPEG files are written to <port>/<NNNNNN> subdirectories with fixed number of files
 
 //#define DD(x)
 #define DD(x)  { if (debug_file) { fprintf(debug_file, "%s:%d:", __FILE__, __LINE__); x; fflush(debug_file); } }
 
 /** @brief HEADER_SIZE is defined to be larger than actual header (with EXIF) to use compile-time buffer */
 #define JPEG_HEADER_MAXSIZE       0x300
-/** @brief Offset from the beginning of raw device buffer. Must be aligned to physical sector size */
-#define RAWDEV_START_OFFSET       1024
+/** @brief Offset from the beginning of raw device buffer. The area before this offset is reserved for
+ * write pointer checkpoints and must not be overwritten by frames. Must be aligned to physical sector size */
+#define RAWDEV_START_OFFSET       1048576
 /** @brief Maximum length of file or raw device path */
 #define ELPHEL_PATH_MAX           300
 #define MMAP_CHUNK_SIZE           10485760
@@ -67,6 +71,12 @@
 #define COMMAND_LOOP_DELAY        500000
 /** @brief File can be split up to this number of chunks */
 #define FILE_CHUNKS_NUM           8
+/** @brief The size of frame group header placed right before the first frame of a group in raw device buffer */
+#define FRAME_GROUP_HDR_SIZE      64
+/** @brief Frame group header starts with this string. The header is plain text, so it never contains JPEG markers */
+#define FRAME_GROUP_MAGIC         "ELPHGRP"
+/** @brief Frame group header format: bit mask of ports, the number of frames and group time stamp */
+#define FRAME_GROUP_HDR_FORMAT    FRAME_GROUP_MAGIC " ports=0x%02x frames=%u time=%ld.%06ld"
 
 /**
  * @enum state_flags
@@ -81,6 +91,15 @@ enum state_flags {
 	STATE_CANCEL
 };
 
+/**
+ * @brief A piece of frame data, frames are written as a set of these pieces (file header, Exif,
+ * JPEG header, frame data and so on)
+ */
+typedef struct {
+	unsigned char *chunk;                                   ///< pointer to the data
+	long bytes;                                             ///< the size of the data
+} elph_packet_chunk;
+
 /**
  * @struct rawdev_buffer
  * @brief Holds pointers related to raw device buffer operation
@@ -133,6 +152,8 @@ typedef struct {
 	unsigned char *disk_mmap;
 	int sysfs_fd;
 	char state_path[ELPHEL_PATH_MAX];
+	bool rawdev_file;
+	uint64_t file_size;
 } rawdev_buffer;
 
 /**
@@ -140,7 +161,8 @@ typedef struct {
  * @brief Contains mutexes and conditional variables associated with disk writing thread
  */
 struct writer_params {
-	int blockdev_fd;                                        ///< file descriptor for open block device where frame will be recorded
+	struct storage storage;                                 ///< raw device where frames are recorded
+	char storage_cfg[STORAGE_CFG_LEN];                      ///< storage backend configuration used when raw device is opened
 	pthread_t writer_thread;                                ///< disk writing thread
 	pthread_mutex_t writer_mutex;                           ///< synchronization mutex for main and writing threads
 	pthread_cond_t writer_cond;                             ///< conditional variable indicating that writer thread can proceed with new frame
@@ -164,7 +186,198 @@ struct writer_params {
 
 	time_t stat_update;                                     ///< time when status file was updated
 	bool dummy_read;                                        ///< inable dummy read cycle (debug feature)
+
+	int ckpt_fd;                                            ///< raw device file descriptor opened with O_DIRECT for checkpoint writes
+	unsigned char *ckpt_buff;                               ///< sector aligned buffer for checkpoint slot
+	uint64_t ckpt_seq;                                      ///< sequence number of the last checkpoint written
+	uint64_t ckpt_lba;                                      ///< write pointer saved in the last checkpoint
+	time_t ckpt_time;                                       ///< time when the last checkpoint was written
+	uint64_t frame_sec;                                     ///< time stamp of the last frame passed to writing thread, seconds
+	uint32_t frame_usec;                                    ///< time stamp of the last frame passed to writing thread, microseconds
+	struct iovec group_hdr;                                 ///< frame group header to be placed before the next frame, empty if the frame
+	                                                        ///< does not start a group
+	unsigned char group_buff[FRAME_GROUP_HDR_SIZE];         ///< buffer for frame group header
+};
+
+/**
+ * @struct frame_group
+ * @brief Time-aligned group of frames from all active ports. In raw device mode such frames are recorded
+ * one after another and the group is preceded by a header, so the group can be read back at once.
+ */
+struct frame_group {
+	unsigned int ports;                                     ///< bit mask of ports in current group
+	unsigned int pending;                                   ///< bit mask of ports which frames are not recorded yet
+	uint64_t time;                                          ///< group time stamp, in microseconds
+	bool start;                                             ///< group header should be recorded before the next frame
+	bool waiting;                                           ///< waiting for the frames of the next group from other ports
+	struct timespec wait_start;                             ///< the time when waiting started
+	unsigned int groups;                                    ///< the number of groups recorded
+	unsigned int partial;                                   ///< the number of groups recorded with some frames missing
+};
+
+/**
+ * @struct writeback
+ * @brief Rolling writeback of the file being recorded. Data is submitted for writeback in chunks as soon as
+ * the chunk is written and the chunk before it is released from page cache, so the amount of dirty data
+ * stays within two chunks.
+ */
+struct writeback {
+	int fd;                                                 ///< segment file descriptor, -1 if none
+	int64_t start;                                          ///< the first byte submitted for writeback and not yet released
+	int64_t submitted;                                      ///< data before this offset is submitted for writeback
+	bool preallocated;                                      ///< segment file has space preallocated beyond its end
+	int prev_fd;                                            ///< per-frame files - previous file, released when the next file is written
 };
+/**
+ * @struct camogm_settings
+ * @brief Recording parameters set by commands. Control thread changes its own copy of settings and publishes
+ * immutable snapshots of it, capture thread applies a snapshot between frames.
+ */
+struct camogm_settings {
+	int segment_duration;                                   ///< maximal segment duration, in seconds
+	int segment_length;                                     ///< maximal segment length, in bytes
+	int greedy;
+	int ignore_fps;
+	int save_gp;
+	int exif;
+	char path_prefix[256];                                  ///< file name prefix
+	double timescale;
+	double start_after_timestamp;
+	int max_frames;
+	int frames_per_chunk;
+	int frames_skip;
+	int format;
+	int frag_frames;
+	int frag_duration;
+	int multitrack;
+	int frame_groups;
+	int group_timeout;
+	int jpeg_layout;
+	int jpeg_dir_files;
+	int writeback;
+	int prealloc;
+	int kml_enable;
+	double kml_horHalfFov;
+	double kml_vertHalfFov;
+	double kml_near;
+	int kml_height_mode;
+	double kml_height;
+	int kml_period;
+	char rawdev_path[ELPHEL_PATH_MAX];                      ///< raw device path, used by capture thread on #ACTION_RAWDEV
+	uint64_t rawdev_size;                                   ///< the size of regular file used as raw device buffer
+	char rawdev_storage[STORAGE_CFG_LEN];                   ///< raw device storage backend configuration
+	bool dummy_read;
+};
+
+/**
+ * @struct camogm_seg_info
+ * @brief Parameters of current segment reported in status. Capture thread updates them under sequence
+ * counter, so a reader always gets a consistent copy.
+ */
+struct camogm_seg_info {
+	char path[ELPHEL_PATH_MAX];                             ///< full file name
+	char kml_path[300];                                     ///< full path for KML file (if any)
+	char rawdev_path[ELPHEL_PATH_MAX];                      ///< raw device path in use
+	int rawdev_file;                                        ///< raw device buffer is a regular file
+	uint64_t start_pos;                                     ///< the start position of raw device buffer
+	uint64_t end_pos;                                       ///< the end position of raw device buffer
+	uint64_t lba_start;                                     ///< disk starting LBA
+	uint64_t lba_end;                                       ///< disk last LBA
+	int format;                                             ///< output file format in use
+	double timescale;                                       ///< timescale in use
+	int max_frames;
+	int frames_per_chunk;
+	int frames_skip;
+	int kml_used;
+	unsigned int active_chn;                                ///< bitmask of active sensor ports
+	int width;                                              ///< image width
+	int height;                                             ///< image height
+};
+
+/**
+ * @struct camogm_counters
+ * @brief Recording counters for status reports. Capture thread is the only writer, numeric fields are
+ * updated with relaxed atomic stores at frame boundaries and can be read from any thread.
+ */
+struct camogm_counters {
+	unsigned int seq;                                       ///< sequence counter for #info, odd while it is being updated
+	struct camogm_seg_info info;                            ///< current segment parameters
+	int frameno;
+	int64_t file_length;                                    ///< current file length, in bytes
+	int dur_sec;                                            ///< current file duration, seconds
+	int dur_usec;                                           ///< current file duration, microseconds
+	int last_error_code;
+	int kml_last_ts;
+	int kml_last_uts;
+	unsigned int groups;                                    ///< the number of frame groups recorded
+	unsigned int partial;                                   ///< the number of frame groups recorded with some frames missing
+	uint32_t overrun;                                       ///< raw device buffer overruns
+	uint64_t pos_w;                                         ///< raw device buffer write position
+	uint64_t lba_current;                                   ///< current write position in LBAs
+	int frames_remain[SENSOR_PORTS];                        ///< frames left to skip
+	int sec_remain[SENSOR_PORTS];                           ///< seconds left to skip
+	int buf_overruns[SENSOR_PORTS];
+	int buf_min[SENSOR_PORTS];
+	int frame_period[SENSOR_PORTS];
+	int cirbuf_rp[SENSOR_PORTS];
+	unsigned int frames[SENSOR_PORTS];                      ///< the number of frames recorded since start, not reset by status report
+	uint64_t bytes[SENSOR_PORTS];                           ///< the number of JPEG data bytes recorded since start
+	unsigned int overruns[SENSOR_PORTS];                    ///< the number of circbuf overruns since start
+	uint64_t stuffing[SENSOR_PORTS];                        ///< stuffing bytes added to align frames recorded to raw device
+	struct latency_hist lat[LAT_STAGES];                    ///< recording pipeline latencies, cleared by @e latency_reset command
+	unsigned int error_stat[SENSOR_PORTS][CAMOGM_ERRNUM];   ///< collect statistics about errors
+	int stat_reset;                                         ///< set by status report to reset overruns, minimal buffer and error code
+};
+
+/**
+ * @enum ctl_action_type
+ * @brief Requests passed from control thread to capture thread
+ */
+enum ctl_action_type {
+	ACTION_SETTINGS,                                        ///< apply new settings snapshot
+	ACTION_START,                                           ///< start recording
+	ACTION_STOP,                                            ///< stop recording
+	ACTION_RESET,                                           ///< reset pointers to the last acquired frames
+	ACTION_EXIT,                                            ///< stop recording and exit
+	ACTION_PORT_ENABLE,                                     ///< enable sensor port given in argument
+	ACTION_PORT_DISABLE,                                    ///< disable sensor port given in argument
+	ACTION_RAWDEV                                           ///< start (argument is 1) or stop (argument is 0) using raw device
+};
+
+/** @brief The number of slots in control queue, must be a power of 2 */
+#define CTL_QUEUE_SIZE            64
+
+/**
+ * @struct ctl_action
+ * @brief Single request in control queue
+ */
+struct ctl_action {
+	int type;                                               ///< one of #ctl_action_type
+	int arg;                                                ///< action argument
+	struct camogm_settings *settings;                       ///< settings snapshot for #ACTION_SETTINGS, owned by receiver
+};
+
+/**
+ * @struct control_plane
+ * @brief Control thread and the queue of requests to capture thread. The queue has single producer and
+ * single consumer and needs no locks, the mutex is only used to wake capture thread when it is idle.
+ */
+struct control_plane {
+	pthread_t tid;                                          ///< control thread
+	int cmd_file;                                           ///< command pipe descriptor
+	struct ctl_action queue[CTL_QUEUE_SIZE];                ///< requests to capture thread
+	unsigned int head;                                      ///< the next slot to fill, changed by control thread only
+	unsigned int tail;                                      ///< the next slot to take, changed by capture thread only
+	pthread_mutex_t mutex;                                  ///< protects waiting on #cond
+	pthread_cond_t cond;                                    ///< signalled when a request is queued
+	struct camogm_settings published;                       ///< the last published settings
+	int fd_circ[SENSOR_PORTS];                              ///< circbuf descriptors used for status, the file position of
+	                                                        ///< capture thread descriptors must not be changed
+	uint64_t lat_start;                                     ///< the time latency statistics were reset, see #lat_time
+	uint64_t lat_bytes[SENSOR_PORTS];                       ///< counters::bytes at the moment of reset
+	uint64_t lat_stuffing[SENSOR_PORTS];                    ///< counters::stuffing at the moment of reset
+};
+
 /**
  * @struct camogm_state
  * @brief Holds current state of the running program
@@ -188,20 +401,17 @@ typedef struct {
 	struct interframe_params_t frame_params[SENSOR_PORTS];
 	struct interframe_params_t this_frame_params[SENSOR_PORTS];
 	int jpeg_len;
+	uint64_t t_harvest;                                     ///< the time current frame was taken from circbuf, see #lat_time
+	int sched_reason;                                       ///< the reason current port was selected, one of #flight_sched
 	int frame_period[SENSOR_PORTS];                         ///< in microseconds (1/10 of what is needed for the Ogm header)
 	int width;                                              ///< image width
 	int height;                                             ///< image height
 	volatile int prog_state;                                ///< program state flag, can be one of #state_flags
 	pthread_mutex_t mutex;                                  ///< mutex for @e prog_state variable; all modifications to the variable must be using this mutex
 	int last_error_code;
-	ogg_stream_state os;
-	ogg_page og;
-	ogg_packet op;
-	elph_ogg_packet eop;
 	int serialno;
-	ogg_int64_t packetno;
-	ogg_int64_t granulepos;
-	FILE*                 vf;                               ///< video file (ogm, fopen)
+	int64_t packetno;
+	int64_t granulepos;
 	int ivf;                                                ///< video file (jpeg, mov - open)
 	int last;                                               ///< last packet in a file
 
@@ -219,9 +429,20 @@ typedef struct {
 	int frames_per_chunk;
 	int set_frames_per_chunk;                               ///< quicktime -  index for fast forward?
 	int frameno;
+	int frag_frames;                                        ///< fragmented MP4 - maximal number of frames in one fragment
+	int frag_duration;                                      ///< fragmented MP4 - maximal fragment duration, in milliseconds
+	int multitrack;                                         ///< record all active ports as separate tracks of one file
+	int frame_groups;                                       ///< raw device - record time-aligned frames from all active ports as groups
+	int group_timeout;                                      ///< raw device - time to wait for the frames of a group, in milliseconds
+	struct frame_group group;                               ///< current frame group
+	int jpeg_layout;                                        ///< JPEG files - directory layout, one of JPEG_LAYOUT_* values
+	int jpeg_dir_files;                                     ///< JPEG files - the number of files in one directory in counter layout
+	int writeback;                                          ///< writeback chunk size in bytes, 0 to leave writeback to kernel
+	int prealloc;                                           ///< preallocate segment files up to segment length
+	struct writeback wb;                                    ///< writeback of current segment file
 	int *frame_lengths;
 	off_t frame_data_start;                                 ///< Quicktime (and else?) - frame data start (0xff 0xd8...)
-	ogg_int64_t time_unit;
+	int64_t time_unit;
 	int formats;                                            ///< bitmask of used (initialized) formats
 	int format;                                             ///< output file format
 	int set_format;                                         ///< output format to set (will be updated after stop)
@@ -251,25 +472,30 @@ typedef struct {
 
 	unsigned int port_num;                                  ///< sensor port we are currently working with
 	char *pipe_name;                                        ///< command pipe name
+	char ctl_path[ELPHEL_PATH_MAX];                         ///< control socket name
+	char metrics_addr[ELPHEL_PATH_MAX];                     ///< metrics socket address, file name or [host:]port, empty if disabled
 	int rawdev_op;                                          ///< flag indicating writing to raw device
 	rawdev_buffer rawdev;                                   ///< contains pointers to raw device buffer
 	unsigned int active_chn;                                ///< bitmask of active sensor ports
 	uint16_t sock_port; 									///< command socket port number
 	struct writer_params writer_params;                     ///< contains control parameters for writing thread
-	unsigned int error_stat[SENSOR_PORTS][CAMOGM_ERRNUM];   ///< collect statistics about errors
+	struct camogm_settings set;                             ///< settings changed by commands, owned by control thread
+	const struct camogm_settings *cfg;                      ///< settings snapshot applied by capture thread
+	struct camogm_counters cnt;                             ///< counters published by capture thread
+	struct control_plane cp;                                ///< control thread and its requests
 } camogm_state;
 
-extern int debug_level;
-extern FILE* debug_file;
-extern pthread_mutex_t print_mutex;
-
 void put_uint16(void *buf, u_int16_t val);
 void put_uint32(void *buf, u_int32_t val);
 void put_uint64(void *buf, u_int64_t val);
+u_int32_t get_uint32(const void *buf);
+u_int64_t get_uint64(const void *buf);
 unsigned long getGPValue(unsigned int port, unsigned long GPNumber);
 void setGValue(unsigned int port, unsigned long GNumber, unsigned long value);
 int waitDaemonEnabled(unsigned int port, int daemonBit);
 int isDaemonEnabled(unsigned int port, int daemonBit);
 int is_fd_valid(int fd);
+int camogm_exec_cmd(camogm_state *state, char *cmd, FILE *out);
+const char *camogm_state_name(int prog_state);
 
 #endif /* _CAMOGM_H */
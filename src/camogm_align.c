@@ -25,8 +25,10 @@
 #include <sys/uio.h>
 
 #include "camogm_align.h"
+#include "camogm_control.h"
 
-static unsigned char app15[ALIGNMENT_SIZE] = {0xff, 0xef};
+/** APP15 marker used for stuffing, stuffing can be up to (ALIGNMENT_SIZE + JPEG_MARKER_LEN + JPEG_SIZE_LEN - 1) bytes long */
+static unsigned char app15[2 * ALIGNMENT_SIZE] = {0xff, 0xef};
 
 static inline size_t get_size_from(const struct iovec *vects, int index, size_t offset, int all);
 static inline size_t align_bytes_num(size_t data_len, size_t align_len);
@@ -181,7 +183,8 @@ static size_t get_blocks_num(struct iovec *sgl, size_t n_elem)
 /** Allocate and initialize buffers for frame alignment */
 int init_align_buffers(camogm_state *state)
 {
-	state->writer_params.data_chunks = (struct iovec *)malloc(MAX_DATA_CHUNKS * sizeof(struct iovec));
+	// vectors which are not used by the first frame must be empty
+	state->writer_params.data_chunks = (struct iovec *)calloc(MAX_DATA_CHUNKS, sizeof(struct iovec));
 	if (state->writer_params.data_chunks == NULL) {
 		return -1;
 	}
@@ -248,6 +251,12 @@ void align_frame(camogm_state *state)
 
 	remap_vectors(state, chunks);
 
+	/* frame group header goes right before JPEG marker, treat it as a part of previous frame remainder */
+	if (state->writer_params.group_hdr.iov_len != 0) {
+		vectcpy(rbuff, state->writer_params.group_hdr.iov_base, state->writer_params.group_hdr.iov_len);
+		state->writer_params.group_hdr.iov_len = 0;
+	}
+
 	total_sz = get_size_from(chunks, 0, 0, INCLUDE_REM) + rbuff->iov_len;
 	if (total_sz < PHY_BLOCK_SIZE) {
 		/* the frame length is less than sector size, delay this frame */
@@ -303,6 +312,7 @@ void align_frame(camogm_state *state)
 	dev_dbg(dev, "total number of stuffing bytes in APP15 marker: %u\n", len);
 	app15[3] = len - JPEG_MARKER_LEN;
 	vectcpy(cbuff, app15, len);
+	CNT_ADD(state->cnt.stuffing[state->port_num], len);
 
 	/* copy JPEG header */
 	len = chunks[CHUNK_HEADER].iov_len;
@@ -459,7 +469,7 @@ int update_lba(camogm_state *state)
 	if (state->writer_params.lba_current + total_sz <= state->writer_params.lba_end) {
 		state->writer_params.lba_current += total_sz;
 	} else {
-		state->writer_params.lba_current = state->writer_params.lba_start + total_sz;
+		state->writer_params.lba_current = state->writer_params.lba_start + RAWDEV_START_LBA + total_sz;
 		ret = 1;
 	}
 
@@ -504,6 +514,7 @@ int prep_last_block(camogm_state *state)
 		src = vectrpos(rvect, 0);
 		memset(src, 0, stuff_len);
 		rvect->iov_len += stuff_len;
+		CNT_ADD(state->cnt.stuffing[state->port_num], stuff_len);
 		ret = rvect->iov_len;
 		vectcpy(cvect, rvect->iov_base, rvect->iov_len);
 		vectshrink(rvect, rvect->iov_len);
@@ -24,6 +24,7 @@
 #include "camogm.h"
 
 #define PHY_BLOCK_SIZE            512            ///< Physical disk block size
+#define RAWDEV_START_LBA          (RAWDEV_START_OFFSET / PHY_BLOCK_SIZE) ///< The first LBA of frame data relative to raw device buffer start
 #define JPEG_MARKER_LEN           2              ///< The size in bytes of JPEG marker
 #define JPEG_SIZE_LEN             2              ///< The size in bytes of JPEG marker length field
 #define INCLUDE_REM               1              ///< Include REM buffer to total size calculation
@@ -35,8 +36,9 @@
                                                  ///< trailing marker, and pointer to a buffer containing the remainder of a
                                                  ///< frame. Nine chunks of data in total.
 #define ALIGNMENT_SIZE            32             ///< Align buffers length to this amount of bytes
-/** Common buffer should be large enough to contain JPEG header, Exif, some alignment bytes and remainder from previous frame */
-#define COMMON_BUFF_SZ            MAX_EXIF_SIZE + JPEG_HEADER_MAXSIZE + ALIGNMENT_SIZE + 2 * PHY_BLOCK_SIZE
+/** Common buffer should be large enough to contain JPEG header, Exif, some alignment bytes, remainder from previous frame
+ * and frame group header */
+#define COMMON_BUFF_SZ            MAX_EXIF_SIZE + JPEG_HEADER_MAXSIZE + ALIGNMENT_SIZE + 2 * PHY_BLOCK_SIZE + FRAME_GROUP_HDR_SIZE
 #define REM_BUFF_SZ               2 * PHY_BLOCK_SIZE
 
 ///** This structure holds raw device buffer pointers */
@@ -0,0 +1,776 @@
+/** @file camogm_bench.c
+ * @brief End-to-end recording benchmark of @e camogm running with frame simulator
+ * @copyright Copyright (C) 2017 Elphel, Inc.
+ *
+ * @par <b>License</b>
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Each benchmark run starts @e camogm with built-in simulator (-S option), so frames go through the same
+ * capture, muxer and writer code as on camera. The program is controlled through its control socket and
+ * measured through metrics socket: after warm-up, frame and byte counters, simulator frame counters and
+ * CPU time of camogm threads are taken at the beginning and at the end of measurement period, and latency
+ * percentiles are taken from status report. CPU time is read from scheduler statistics in nanoseconds, as
+ * clock ticks are too coarse for short runs, and CPU time of simulator threads is not counted. Runs cover all combinations
+ * of targets, formats, port counts, frame rates and frame sizes given in command line.
+ *
+ * Results are written in JSON, one run per line. When a baseline file written by previous benchmark is
+ * given, runs with the same names are compared and the program exits with non-zero code if throughput,
+ * CPU time per frame, dropped frames or write latency are worse than in baseline by more than threshold.
+ */
+
+/** @brief Needed for nftw */
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <ftw.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <elphel/c313a.h>
+
+/** @brief The maximal number of values in one matrix dimension */
+#define BENCH_MAX_VALUES          16
+/** @brief The maximal number of latency stages reported */
+#define BENCH_STAGES              8
+/** @brief Time to wait for camogm control socket after start, in milliseconds */
+#define BENCH_START_TIMEOUT       10000
+/** @brief Time to wait for camogm to exit after exit command, in milliseconds */
+#define BENCH_EXIT_TIMEOUT        5000
+/** @brief The size of buffer for metrics page and control socket replies */
+#define BENCH_BUFF_SIZE           (256 * 1024)
+/** @brief Name of simulator threads, their CPU time is not counted */
+#define BENCH_SIM_THREAD          "camogm_sim"
+/** @brief Subdirectory of directory target where files are recorded, it is removed after each run */
+#define BENCH_SUBDIR              "camogm_bench"
+/** @brief Frame size in the simulator */
+#define BENCH_WIDTH               2592
+#define BENCH_HEIGHT              1936
+
+static const char usage[] =
+"Usage: %s [options]\n\n"
+"Run camogm with frame simulator for all combinations of the values below and report throughput,\n"
+"dropped frames, CPU time per frame and latency percentiles in JSON.\n"
+"  -t targets   comma separated list of dir:<directory> for file formats or raw:<device or file> for raw\n"
+"               device recording (a block device, i.e. loop device, or a regular file), dir:/dev/shm/camogm_bench/out\n"
+"               by default; files are recorded to " BENCH_SUBDIR " subdirectory which is removed after each run\n"
+"  -F formats   comma separated list of file formats (jpeg, mov, ogm, mp4, mkv, jpack), jpeg by default;\n"
+"               raw targets are always recorded in raw device format\n"
+"  -P ports     comma separated list of the numbers of running sensor ports, 1 by default\n"
+"  -f fps       comma separated list of frame rates, 30 by default\n"
+"  -s sizes     comma separated list of average frame sizes in bytes, 1000000 by default\n"
+"  -d seconds   measurement period of each run, 10 by default\n"
+"  -u seconds   warm-up period of each run, 2 by default\n"
+"  -r MiB       raw device buffer size for regular file targets, 1024 by default\n"
+"  -x program   camogm executable, camogm from PATH by default\n"
+"  -w dir       working directory for sockets, logs and simulated device files, /dev/shm/camogm_bench by default\n"
+"  -o file      output file, standard output by default\n"
+"  -b file      baseline file written by previous benchmark to compare results with\n"
+"  -T percent   regression threshold, 10 by default\n"
+"i.e.:\n"
+"%s -t dir:/dev/shm/bench,raw:/dev/loop0 -F jpeg,mov -P 1,4 -s 500000,2000000 -o bench.json -b baseline.json\n";
+
+/**
+ * @struct bench_config
+ * @brief Benchmark matrix and common settings
+ */
+struct bench_config {
+	char *targets[BENCH_MAX_VALUES];             ///< recording targets
+	int num_targets;                             ///< the number of targets
+	char *formats[BENCH_MAX_VALUES];             ///< file formats
+	int num_formats;                             ///< the number of formats
+	int ports[BENCH_MAX_VALUES];                 ///< the numbers of running ports
+	int num_ports;                               ///< the number of port counts
+	int fps[BENCH_MAX_VALUES];                   ///< frame rates
+	int num_fps;                                 ///< the number of frame rates
+	int sizes[BENCH_MAX_VALUES];                 ///< average frame sizes
+	int num_sizes;                               ///< the number of frame sizes
+	int duration;                                ///< measurement period, in seconds
+	int warmup;                                  ///< warm-up period, in seconds
+	unsigned long long raw_size;                 ///< raw device buffer size for regular files, in MiB
+	const char *program;                         ///< camogm executable
+	const char *work_dir;                        ///< working directory
+	double threshold;                            ///< regression threshold, in percent
+};
+
+/**
+ * @struct bench_lat
+ * @brief Latency percentiles of one pipeline stage, in microseconds
+ */
+struct bench_lat {
+	char name[32];                               ///< stage name
+	unsigned int p50;                            ///< median
+	unsigned int p99;                            ///< 99th percentile
+	unsigned int p999;                           ///< 99.9th percentile
+	unsigned int max;                            ///< maximal value
+};
+
+/**
+ * @struct bench_snapshot
+ * @brief Counters taken at the beginning and at the end of measurement period
+ */
+struct bench_snapshot {
+	double time;                                 ///< monotonic time, in seconds
+	unsigned long long frames;                   ///< frames recorded
+	unsigned long long bytes;                    ///< bytes recorded
+	unsigned long long overruns;                 ///< circbuf overruns
+	unsigned long long generated;                ///< frames put to circbuf by simulator
+	unsigned long long cpu;                      ///< CPU time of camogm threads, in nanoseconds
+	unsigned long long sim_cpu;                  ///< CPU time of simulator threads, in nanoseconds
+};
+
+/**
+ * @struct bench_result
+ * @brief Results of one run
+ */
+struct bench_result {
+	char name[PATH_MAX];                         ///< run name, used to find it in baseline
+	const char *format;                          ///< file format or "raw"
+	const char *target;                          ///< recording target
+	int ports;                                   ///< the number of running ports
+	int fps;                                     ///< frame rate
+	int size;                                    ///< average frame size
+	double time;                                 ///< measurement period, in seconds
+	unsigned long long frames;                   ///< frames recorded
+	unsigned long long generated;                ///< frames generated
+	unsigned long long dropped;                  ///< frames generated but not recorded
+	unsigned long long overruns;                 ///< circbuf overruns
+	double mbps;                                 ///< throughput, in MB/s
+	double fps_recorded;                         ///< recorded frame rate
+	double cpu_us;                               ///< CPU time per recorded frame, in microseconds
+	struct bench_lat lat[BENCH_STAGES];          ///< latency percentiles
+	int num_lat;                                 ///< the number of latency stages
+	int last_error;                              ///< last error code reported in status
+	bool raw_open;                               ///< raw device was in use at the end of run
+	char raw_path[PATH_MAX];                     ///< raw device path reported in status
+};
+
+/** Return monotonic time in seconds */
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Split comma separated list, the string is modified */
+static int split_list(char *str, char **vals, int max)
+{
+	int num = 0;
+	char *save;
+
+	for (char *s = strtok_r(str, ",", &save); s != NULL && num < max; s = strtok_r(NULL, ",", &save))
+		vals[num++] = s;
+	return num;
+}
+
+/** Split comma separated list of integers */
+static int split_int_list(char *str, int *vals, int max)
+{
+	int num;
+	char *strs[BENCH_MAX_VALUES];
+
+	num = split_list(str, strs, (max < BENCH_MAX_VALUES) ? max : BENCH_MAX_VALUES);
+	for (int i = 0; i < num; i++)
+		vals[i] = strtol(strs[i], NULL, 10);
+	return num;
+}
+
+/** Connect to Unix domain socket, retrying for @e timeout milliseconds */
+static int connect_unix(const char *path, int timeout)
+{
+	int fd;
+	struct sockaddr_un addr;
+	double deadline = now() + timeout / 1000.0;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	do {
+		if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+			return -1;
+		if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+			return fd;
+		close(fd);
+		usleep(100000);
+	} while (now() < deadline);
+
+	return -1;
+}
+
+/** Send request to control socket and read one line reply (JSON reply format is set on connection) */
+static int ctl_request(int fd, const char *req, char *reply, size_t size)
+{
+	size_t len = 0;
+	ssize_t ret;
+	char *line = malloc(strlen(req) + 2);
+
+	if (line == NULL)
+		return -1;
+	sprintf(line, "%s\n", req);
+	ret = write(fd, line, strlen(line));
+	free(line);
+	if (ret < 0)
+		return -1;
+	while (len < size - 1) {
+		if ((ret = read(fd, reply + len, 1)) <= 0)
+			return -1;
+		if (reply[len] == '\n')
+			break;
+		len++;
+	}
+	reply[len] = '\0';
+
+	return 0;
+}
+
+/** Get metrics page and sum per port counters */
+static int get_metrics(const char *path, struct bench_snapshot *snap)
+{
+	int fd, port;
+	size_t len = 0;
+	ssize_t ret;
+	unsigned long long val;
+	char *buff, *line, *save;
+	const char req[] = "GET /metrics HTTP/1.0\r\n\r\n";
+
+	if ((fd = connect_unix(path, 0)) < 0)
+		return -1;
+	if ((buff = malloc(BENCH_BUFF_SIZE)) == NULL || write(fd, req, sizeof(req) - 1) < 0) {
+		free(buff);
+		close(fd);
+		return -1;
+	}
+	while (len < BENCH_BUFF_SIZE - 1 && (ret = read(fd, buff + len, BENCH_BUFF_SIZE - 1 - len)) > 0)
+		len += ret;
+	buff[len] = '\0';
+	close(fd);
+
+	snap->frames = snap->bytes = snap->overruns = 0;
+	for (line = strtok_r(buff, "\n", &save); line != NULL; line = strtok_r(NULL, "\n", &save)) {
+		if (sscanf(line, "camogm_frames_total{port=\"%d\"} %llu", &port, &val) == 2)
+			snap->frames += val;
+		else if (sscanf(line, "camogm_bytes_total{port=\"%d\"} %llu", &port, &val) == 2)
+			snap->bytes += val;
+		else if (sscanf(line, "camogm_drops_total{port=\"%d\"} %llu", &port, &val) == 2)
+			snap->overruns += val;
+	}
+	free(buff);
+
+	return 0;
+}
+
+/** Read time spent on CPU, in nanoseconds, from /proc schedstat file of a thread */
+static unsigned long long read_cpu(const char *path)
+{
+	FILE *f;
+	unsigned long long ns = 0;
+
+	if ((f = fopen(path, "r")) == NULL)
+		return 0;
+	if (fscanf(f, "%llu", &ns) != 1)
+		ns = 0;
+	fclose(f);
+
+	return ns;
+}
+
+/** Get CPU time of all camogm threads and of its simulator threads */
+static void get_cpu(pid_t pid, struct bench_snapshot *snap)
+{
+	DIR *dir;
+	FILE *f;
+	struct dirent *ent;
+	char path[PATH_MAX];
+	char comm[32];
+	unsigned long long ns;
+
+	snap->cpu = 0;
+	snap->sim_cpu = 0;
+	snprintf(path, PATH_MAX, "/proc/%d/task", pid);
+	if ((dir = opendir(path)) == NULL)
+		return;
+	while ((ent = readdir(dir)) != NULL) {
+		if (ent->d_name[0] == '.')
+			continue;
+		snprintf(path, PATH_MAX, "/proc/%d/task/%s/schedstat", pid, ent->d_name);
+		ns = read_cpu(path);
+		snap->cpu += ns;
+		snprintf(path, PATH_MAX, "/proc/%d/task/%s/comm", pid, ent->d_name);
+		if ((f = fopen(path, "r")) == NULL)
+			continue;
+		if (fgets(comm, sizeof(comm), f) != NULL && strncmp(comm, BENCH_SIM_THREAD, strlen(BENCH_SIM_THREAD)) == 0)
+			snap->sim_cpu += ns;
+		fclose(f);
+	}
+	closedir(dir);
+}
+
+/** Sum frame counters of simulated ports, taken from G_THIS_FRAME in simulated frame parameters files */
+static unsigned long long get_generated(const char *sim_dir, int ports)
+{
+	int fd;
+	unsigned long val;
+	unsigned long long sum = 0;
+	char path[PATH_MAX];
+	off_t offset = offsetof(struct framepars_all_t, globalPars) + (G_THIS_FRAME - FRAMEPAR_GLOBALS) * sizeof(unsigned long);
+
+	for (int port = 0; port < ports; port++) {
+		snprintf(path, PATH_MAX, "%s/framepars%d", sim_dir, port);
+		if ((fd = open(path, O_RDONLY)) < 0)
+			continue;
+		if (pread(fd, &val, sizeof(val), offset) == sizeof(val))
+			sum += val;
+		close(fd);
+	}
+
+	return sum;
+}
+
+/** Take all counters */
+static int take_snapshot(pid_t pid, const char *metrics_path, const char *sim_dir, int ports, struct bench_snapshot *snap)
+{
+	snap->time = now();
+	get_cpu(pid, snap);
+	snap->generated = get_generated(sim_dir, ports);
+	return get_metrics(metrics_path, snap);
+}
+
+/** Read raw device path, last error code and latency table from text status report */
+static void get_status(const char *path, struct bench_result *res)
+{
+	FILE *f;
+	bool table = false;
+	char line[256];
+	struct bench_lat *lat;
+	unsigned int count, mean;
+
+	res->num_lat = 0;
+	res->raw_open = false;
+	if ((f = fopen(path, "r")) == NULL)
+		return;
+	while (fgets(line, sizeof(line), f) != NULL && res->num_lat < BENCH_STAGES) {
+		if (strncmp(line, "raw device path", strlen("raw device path")) == 0) {
+			res->raw_open = sscanf(line, "raw device path %s", res->raw_path) == 1;
+			continue;
+		}
+		if (sscanf(line, "last error code %d", &res->last_error) == 1)
+			continue;
+		if (strncmp(line, "latency, us", strlen("latency, us")) == 0) {
+			table = true;
+			continue;
+		}
+		if (!table)
+			continue;
+		lat = &res->lat[res->num_lat];
+		if (sscanf(line, "%31s %u %u %u %u %u %u", lat->name, &count, &mean, &lat->p50, &lat->p99, &lat->p999, &lat->max) != 7)
+			break;
+		res->num_lat++;
+	}
+	fclose(f);
+}
+
+/** Remove one file or directory, used with nftw() */
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+	return remove(path);
+}
+
+/** Start camogm with simulator, wait for its control socket and return its PID, or -1 on error */
+static pid_t start_camogm(const struct bench_config *cfg, const char *sim_cfg, int *ctl_fd)
+{
+	pid_t pid;
+	int fd;
+	char pipe_path[PATH_MAX], ctl_path[PATH_MAX], metrics_path[PATH_MAX], log_path[PATH_MAX];
+	char reply[256];
+
+	snprintf(pipe_path, PATH_MAX, "%s/cmd", cfg->work_dir);
+	snprintf(ctl_path, PATH_MAX, "%s/ctl.sock", cfg->work_dir);
+	snprintf(metrics_path, PATH_MAX, "%s/metrics.sock", cfg->work_dir);
+	snprintf(log_path, PATH_MAX, "%s/camogm.log", cfg->work_dir);
+	unlink(ctl_path);
+	unlink(metrics_path);
+
+	if ((pid = fork()) < 0)
+		return -1;
+	if (pid == 0) {
+		if ((fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND, 0644)) >= 0) {
+			dup2(fd, STDOUT_FILENO);
+			dup2(fd, STDERR_FILENO);
+			close(fd);
+		}
+		execlp(cfg->program, cfg->program, "-n", pipe_path, "-p", "3456", "-c", ctl_path, "-m", metrics_path,
+				"-S", sim_cfg, (char *)NULL);
+		fprintf(stderr, "Can not start %s: %s\n", cfg->program, strerror(errno));
+		_exit(EXIT_FAILURE);
+	}
+	if ((*ctl_fd = connect_unix(ctl_path, BENCH_START_TIMEOUT)) < 0 ||
+			ctl_request(*ctl_fd, "reply=json", reply, sizeof(reply)) < 0) {
+		fprintf(stderr, "camogm did not start, see %s\n", log_path);
+		if (*ctl_fd >= 0)
+			close(*ctl_fd);
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		return -1;
+	}
+
+	return pid;
+}
+
+/** Stop recording, ask camogm to exit and kill it if it does not */
+static void stop_camogm(pid_t pid, int ctl_fd)
+{
+	char reply[256];
+	double deadline = now() + BENCH_EXIT_TIMEOUT / 1000.0;
+
+	ctl_request(ctl_fd, "stop", reply, sizeof(reply));
+	ctl_request(ctl_fd, "exit", reply, sizeof(reply));
+	close(ctl_fd);
+	while (waitpid(pid, NULL, WNOHANG) == 0) {
+		if (now() > deadline) {
+			kill(pid, SIGKILL);
+			waitpid(pid, NULL, 0);
+			break;
+		}
+		usleep(100000);
+	}
+}
+
+/** Make one benchmark run */
+static int bench_run(const struct bench_config *cfg, struct bench_result *res)
+{
+	int ctl_fd;
+	pid_t pid;
+	bool raw = strncmp(res->target, "raw:", 4) == 0;
+	const char *target = res->target + (raw ? 4 : 4 * (strncmp(res->target, "dir:", 4) == 0));
+	char sim_dir[PATH_MAX], sim_cfg[PATH_MAX], req[PATH_MAX + 128], reply[4096];
+	char rec_dir[PATH_MAX];
+	char metrics_path[PATH_MAX], status_path[PATH_MAX];
+	struct bench_snapshot start, end;
+	unsigned long long sim_cpu;
+	int len;
+
+	snprintf(sim_dir, PATH_MAX, "%s/sim", cfg->work_dir);
+	snprintf(metrics_path, PATH_MAX, "%s/metrics.sock", cfg->work_dir);
+	snprintf(status_path, PATH_MAX, "%s/status.txt", cfg->work_dir);
+	len = snprintf(sim_cfg, PATH_MAX, "dir=%s,size=%d,width=%d,height=%d,fps=", sim_dir, res->size, BENCH_WIDTH, BENCH_HEIGHT);
+	for (int port = 0; port < SENSOR_PORTS; port++)
+		len += snprintf(sim_cfg + len, PATH_MAX - len, "%s%d", port ? "/" : "", (port < res->ports) ? res->fps : 0);
+
+	if (raw) {
+		// raw device is written by JPEG format writer
+		snprintf(req, sizeof(req), "format=jpeg;rawdev_size=%llu;rawdev_path=%s;start", cfg->raw_size, target);
+	} else {
+		snprintf(rec_dir, PATH_MAX, "%s/%s", target, BENCH_SUBDIR);
+		nftw(rec_dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+		if ((mkdir(target, 0777) < 0 && errno != EEXIST) || mkdir(rec_dir, 0777) < 0) {
+			fprintf(stderr, "Can not create %s: %s\n", rec_dir, strerror(errno));
+			return -1;
+		}
+		snprintf(req, sizeof(req), "format=%s;prefix=%s/;start", res->format, rec_dir);
+	}
+	if ((pid = start_camogm(cfg, sim_cfg, &ctl_fd)) < 0)
+		return -1;
+	if (ctl_request(ctl_fd, req, reply, sizeof(reply)) < 0) {
+		stop_camogm(pid, ctl_fd);
+		return -1;
+	}
+	sleep(cfg->warmup);
+	ctl_request(ctl_fd, "latency_reset", reply, sizeof(reply));
+	if (take_snapshot(pid, metrics_path, sim_dir, res->ports, &start) < 0) {
+		fprintf(stderr, "Can not read metrics from %s\n", metrics_path);
+		stop_camogm(pid, ctl_fd);
+		return -1;
+	}
+	sleep(cfg->duration);
+	take_snapshot(pid, metrics_path, sim_dir, res->ports, &end);
+	snprintf(req, sizeof(req), "status=%s", status_path);
+	ctl_request(ctl_fd, req, reply, sizeof(reply));
+	stop_camogm(pid, ctl_fd);
+	if (!raw)
+		nftw(rec_dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+
+	res->time = end.time - start.time;
+	res->frames = end.frames - start.frames;
+	res->generated = end.generated - start.generated;
+	res->dropped = (res->generated > res->frames) ? res->generated - res->frames : 0;
+	res->overruns = end.overruns - start.overruns;
+	res->mbps = (end.bytes - start.bytes) / res->time / 1000000;
+	res->fps_recorded = res->frames / res->time;
+	sim_cpu = end.sim_cpu - start.sim_cpu;
+	res->cpu_us = res->frames ? ((end.cpu - start.cpu) - sim_cpu) / 1000.0 / res->frames : 0;
+	get_status(status_path, res);
+	if (raw && !res->raw_open) {
+		// camogm falls back to file recording if raw device can not be opened
+		fprintf(stderr, "Raw device %s was not used, see %s/camogm.log\n", target, cfg->work_dir);
+		return -1;
+	}
+	if (res->frames == 0) {
+		fprintf(stderr, "Nothing was recorded, see %s/camogm.log\n", cfg->work_dir);
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Write one run result as a single line JSON object */
+static void write_result(FILE *f, const struct bench_result *res)
+{
+	fprintf(f, "{\"name\":\"%s\",\"format\":\"%s\",\"target\":\"%s\",\"ports\":%d,\"fps\":%d,\"size\":%d,"
+			"\"time\":%.3f,\"frames\":%llu,\"frames_generated\":%llu,\"frames_dropped\":%llu,\"overruns\":%llu,"
+			"\"last_error\":%d,\"throughput_mbps\":%.3f,\"fps_recorded\":%.3f,\"cpu_us_per_frame\":%.1f,\"latency_us\":{",
+			res->name, res->format, res->target, res->ports, res->fps, res->size,
+			res->time, res->frames, res->generated, res->dropped, res->overruns, res->last_error,
+			res->mbps, res->fps_recorded, res->cpu_us);
+	for (int i = 0; i < res->num_lat; i++)
+		fprintf(f, "%s\"%s\":{\"p50\":%u,\"p99\":%u,\"p99_9\":%u,\"max\":%u}", i ? "," : "",
+				res->lat[i].name, res->lat[i].p50, res->lat[i].p99, res->lat[i].p999, res->lat[i].max);
+	fprintf(f, "}}");
+	fflush(f);
+}
+
+/** Find numeric value of @e key in JSON line, starting after @e from if it is not NULL */
+static bool json_value(const char *line, const char *from, const char *key, double *val)
+{
+	char pattern[64];
+	const char *p = line;
+
+	if (from != NULL) {
+		snprintf(pattern, sizeof(pattern), "\"%s\":", from);
+		if ((p = strstr(line, pattern)) == NULL)
+			return false;
+	}
+	snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+	if ((p = strstr(p, pattern)) == NULL)
+		return false;
+	*val = strtod(p + strlen(pattern), NULL);
+	return true;
+}
+
+/** Report regression if @e cur is worse than @e base by more than threshold, @e higher tells that higher is better */
+static int check_value(const struct bench_result *res, const char *what, double cur, double base, bool higher, double threshold)
+{
+	double change;
+
+	if (base == 0)
+		return 0;
+	change = (cur - base) / base * 100;
+	if ((higher && change < -threshold) || (!higher && change > threshold)) {
+		fprintf(stderr, "REGRESSION %s: %s %.3f, baseline %.3f (%+.1f%%)\n", res->name, what, cur, base, change);
+		return 1;
+	}
+	return 0;
+}
+
+/** Compare run results with baseline, return the number of regressions */
+static int compare_baseline(const char *path, const struct bench_result *results, int num, double threshold)
+{
+	FILE *f;
+	char *line = NULL;
+	size_t line_size = 0;
+	char name[PATH_MAX + 16];
+	double base, cur;
+	int regressions = 0;
+	bool found;
+
+	if ((f = fopen(path, "r")) == NULL) {
+		fprintf(stderr, "Can not open baseline %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	for (int i = 0; i < num; i++) {
+		const struct bench_result *res = &results[i];
+
+		snprintf(name, sizeof(name), "\"name\":\"%s\"", res->name);
+		rewind(f);
+		found = false;
+		while (getline(&line, &line_size, f) > 0) {
+			if (strstr(line, name) == NULL)
+				continue;
+			found = true;
+			if (json_value(line, NULL, "throughput_mbps", &base))
+				regressions += check_value(res, "throughput, MB/s", res->mbps, base, true, threshold);
+			if (json_value(line, NULL, "cpu_us_per_frame", &base))
+				regressions += check_value(res, "CPU per frame, us", res->cpu_us, base, false, threshold);
+			if (json_value(line, NULL, "frames_dropped", &base) && res->dropped > base &&
+					res->dropped - base > res->generated * threshold / 100) {
+				fprintf(stderr, "REGRESSION %s: frames dropped %llu, baseline %.0f\n", res->name, res->dropped, base);
+				regressions++;
+			}
+			for (int j = 0; j < res->num_lat; j++) {
+				if (strcmp(res->lat[j].name, "write") != 0 || !json_value(line, res->lat[j].name, "p99", &base))
+					continue;
+				cur = res->lat[j].p99;
+				regressions += check_value(res, "write latency p99, us", cur, base, false, threshold);
+			}
+			break;
+		}
+		if (!found)
+			fprintf(stderr, "%s: not in baseline\n", res->name);
+	}
+	free(line);
+	fclose(f);
+
+	return regressions;
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, num = 0, total, ret = 0;
+	char targets[] = "dir:/dev/shm/camogm_bench/out";
+	char formats[] = "jpeg";
+	const char *out_path = NULL, *baseline = NULL;
+	FILE *out = stdout;
+	struct bench_result *results, *res;
+	struct bench_config cfg = {
+		.ports = {1}, .num_ports = 1,
+		.fps = {30}, .num_fps = 1,
+		.sizes = {1000000}, .num_sizes = 1,
+		.duration = 10,
+		.warmup = 2,
+		.raw_size = 1024,
+		.program = "camogm",
+		.work_dir = "/dev/shm/camogm_bench",
+		.threshold = 10
+	};
+
+	// camogm which has crashed is reported as failed run
+	signal(SIGPIPE, SIG_IGN);
+	cfg.num_targets = split_list(targets, cfg.targets, BENCH_MAX_VALUES);
+	cfg.num_formats = split_list(formats, cfg.formats, BENCH_MAX_VALUES);
+	while ((opt = getopt(argc, argv, "t:F:P:f:s:d:u:r:x:w:o:b:T:h")) != -1) {
+		switch (opt) {
+		case 't':
+			cfg.num_targets = split_list(optarg, cfg.targets, BENCH_MAX_VALUES);
+			break;
+		case 'F':
+			cfg.num_formats = split_list(optarg, cfg.formats, BENCH_MAX_VALUES);
+			break;
+		case 'P':
+			cfg.num_ports = split_int_list(optarg, cfg.ports, BENCH_MAX_VALUES);
+			break;
+		case 'f':
+			cfg.num_fps = split_int_list(optarg, cfg.fps, BENCH_MAX_VALUES);
+			break;
+		case 's':
+			cfg.num_sizes = split_int_list(optarg, cfg.sizes, BENCH_MAX_VALUES);
+			break;
+		case 'd':
+			cfg.duration = strtol(optarg, NULL, 10);
+			break;
+		case 'u':
+			cfg.warmup = strtol(optarg, NULL, 10);
+			break;
+		case 'r':
+			cfg.raw_size = strtoull(optarg, NULL, 10);
+			break;
+		case 'x':
+			cfg.program = optarg;
+			break;
+		case 'w':
+			cfg.work_dir = optarg;
+			break;
+		case 'o':
+			out_path = optarg;
+			break;
+		case 'b':
+			baseline = optarg;
+			break;
+		case 'T':
+			cfg.threshold = strtod(optarg, NULL);
+			break;
+		default:
+			printf(usage, argv[0], argv[0]);
+			return (opt == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+	for (int i = 0; i < cfg.num_ports; i++) {
+		if (cfg.ports[i] < 1 || cfg.ports[i] > SENSOR_PORTS) {
+			fprintf(stderr, "The number of ports should be from 1 to %d\n", SENSOR_PORTS);
+			return EXIT_FAILURE;
+		}
+	}
+	if (cfg.duration <= 0 || cfg.warmup < 0) {
+		fprintf(stderr, "Invalid measurement or warm-up period\n");
+		return EXIT_FAILURE;
+	}
+	if (mkdir(cfg.work_dir, 0777) < 0 && errno != EEXIST) {
+		fprintf(stderr, "Can not create %s: %s\n", cfg.work_dir, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	if (out_path != NULL && (out = fopen(out_path, "w")) == NULL) {
+		fprintf(stderr, "Can not open %s: %s\n", out_path, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	total = cfg.num_targets * cfg.num_formats * cfg.num_ports * cfg.num_fps * cfg.num_sizes;
+	if ((results = calloc(total, sizeof(struct bench_result))) == NULL)
+		return EXIT_FAILURE;
+
+	fprintf(out, "{\"duration\":%d,\"warmup\":%d,\"width\":%d,\"height\":%d,\"results\":[\n",
+			cfg.duration, cfg.warmup, BENCH_WIDTH, BENCH_HEIGHT);
+	for (int t = 0; t < cfg.num_targets; t++) {
+		bool raw = strncmp(cfg.targets[t], "raw:", 4) == 0;
+
+		// raw device has its own format, formats are not iterated
+		for (int fmt = 0; fmt < (raw ? 1 : cfg.num_formats); fmt++)
+		for (int p = 0; p < cfg.num_ports; p++)
+		for (int r = 0; r < cfg.num_fps; r++)
+		for (int s = 0; s < cfg.num_sizes; s++) {
+			res = &results[num];
+			res->format = raw ? "raw" : cfg.formats[fmt];
+			res->target = cfg.targets[t];
+			res->ports = cfg.ports[p];
+			res->fps = cfg.fps[r];
+			res->size = cfg.sizes[s];
+			snprintf(res->name, sizeof(res->name), "%s %s size=%d fps=%d ports=%d",
+					res->format, res->target, res->size, res->fps, res->ports);
+			fprintf(stderr, "Running %s\n", res->name);
+			if (bench_run(&cfg, res) < 0) {
+				fprintf(stderr, "Run %s failed\n", res->name);
+				ret = EXIT_FAILURE;
+				continue;
+			}
+			if (num > 0)
+				fprintf(out, ",\n");
+			write_result(out, res);
+			num++;
+		}
+	}
+	fprintf(out, "\n]}\n");
+	if (out != stdout)
+		fclose(out);
+
+	if (baseline != NULL && num > 0) {
+		int regressions = compare_baseline(baseline, results, num, cfg.threshold);
+
+		if (regressions != 0) {
+			fprintf(stderr, "%d regression(s) against %s\n", (regressions > 0) ? regressions : 0, baseline);
+			ret = EXIT_FAILURE;
+		}
+	}
+	free(results);
+
+	return ret;
+}
@@ -0,0 +1,421 @@
+/** @file camogm_checkpoint.c
+ * @brief Provides write pointer checkpoints stored in the reserved area of raw device buffer
+ * @copyright Copyright (C) 2017 Elphel, Inc.
+ *
+ * @par <b>License</b>
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @addtogroup SPECIAL_INCLUDES Special includes
+ * These defines are needed to use O_DIRECT, pread64, pwrite64 and timegm and should be set before includes
+ * @{
+ */
+/** Needed for O_DIRECT and timegm */
+#define _GNU_SOURCE
+/** Needed for pread64 and pwrite64 */
+#define _LARGEFILE64_SOURCE
+/** @} */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#include "camogm_checkpoint.h"
+#include "camogm_align.h"
+
+/** @brief The offset of CRC field in checkpoint slot, CRC is calculated over all preceding bytes */
+#define SLOT_CRC_OFFSET           64
+/** @brief Offset in Exif where TIFF header starts */
+#define TIFF_HDR_OFFSET           12
+/** @brief Exif tag of Exif sub-IFD pointer */
+#define EXIF_TAG_SUBIFD           0x8769
+/** @brief Exif tag of original date and time */
+#define EXIF_TAG_DATE_TIME        0x9003
+
+/**
+ * @struct checkpoint_slot
+ * @brief Write pointer checkpoint. The slot is stored on disk in little-endian byte order,
+ * field offsets are given in comments.
+ */
+struct checkpoint_slot {
+	uint32_t magic;                              ///< 0: slot signature, #CHECKPOINT_MAGIC
+	uint32_t version;                            ///< 4: slot format version, #CHECKPOINT_VERSION
+	uint64_t seq;                                ///< 8: sequence number, incremented with each checkpoint
+	uint64_t lba_start;                          ///< 16: raw device buffer starting LBA
+	uint64_t lba_end;                            ///< 24: raw device buffer ending LBA
+	uint64_t lba_current;                        ///< 32: write pointer
+	uint64_t frame_sec;                          ///< 40: time stamp of the last frame recorded, seconds
+	uint32_t frame_usec;                         ///< 48: time stamp of the last frame recorded, microseconds
+	uint64_t wall_time;                          ///< 56: system time when the checkpoint was written
+	uint32_t crc;                                ///< 64: CRC32 of the preceding fields
+};
+
+static uint32_t crc32_table[256];
+static pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+
+/** Fill CRC32 lookup table, reflected polynomial 0xedb88320 */
+static void crc32_init(void)
+{
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t c = i;
+		for (int j = 0; j < 8; j++)
+			c = (c & 1) ? (0xedb88320 ^ (c >> 1)) : (c >> 1);
+		crc32_table[i] = c;
+	}
+}
+
+/**
+ * @brief Calculate CRC32 (the one used in Ethernet, gzip and PNG) of a data buffer
+ * @param[in]   crc    initial value, 0 for a new calculation or the result of previous call to continue
+ * @param[in]   buff   data buffer
+ * @param[in]   len    the length of data buffer
+ * @return      Updated CRC value
+ */
+uint32_t crc32_calc(uint32_t crc, const void *buff, size_t len)
+{
+	const unsigned char *ptr = buff;
+
+	pthread_once(&crc32_once, crc32_init);
+	crc = ~crc;
+	while (len--)
+		crc = crc32_table[(crc ^ *ptr++) & 0xff] ^ (crc >> 8);
+
+	return ~crc;
+}
+
+/** Serialize checkpoint slot to a buffer and calculate its CRC */
+static void slot_to_buff(struct checkpoint_slot *slot, unsigned char *buff)
+{
+	memset(buff, 0, CHECKPOINT_SLOT_SIZE);
+	put_uint32(&buff[0], slot->magic);
+	put_uint32(&buff[4], slot->version);
+	put_uint64(&buff[8], slot->seq);
+	put_uint64(&buff[16], slot->lba_start);
+	put_uint64(&buff[24], slot->lba_end);
+	put_uint64(&buff[32], slot->lba_current);
+	put_uint64(&buff[40], slot->frame_sec);
+	put_uint32(&buff[48], slot->frame_usec);
+	put_uint64(&buff[56], slot->wall_time);
+	slot->crc = crc32_calc(0, buff, SLOT_CRC_OFFSET);
+	put_uint32(&buff[SLOT_CRC_OFFSET], slot->crc);
+}
+
+/** Restore checkpoint slot from a buffer, return 0 if the slot is valid and -1 otherwise */
+static int buff_to_slot(const unsigned char *buff, struct checkpoint_slot *slot)
+{
+	slot->magic = get_uint32(&buff[0]);
+	slot->version = get_uint32(&buff[4]);
+	slot->crc = get_uint32(&buff[SLOT_CRC_OFFSET]);
+	if (slot->magic != CHECKPOINT_MAGIC || slot->version != CHECKPOINT_VERSION ||
+			slot->crc != crc32_calc(0, buff, SLOT_CRC_OFFSET))
+		return -1;
+	slot->seq = get_uint64(&buff[8]);
+	slot->lba_start = get_uint64(&buff[16]);
+	slot->lba_end = get_uint64(&buff[24]);
+	slot->lba_current = get_uint64(&buff[32]);
+	slot->frame_sec = get_uint64(&buff[40]);
+	slot->frame_usec = get_uint32(&buff[48]);
+	slot->wall_time = get_uint64(&buff[56]);
+
+	return 0;
+}
+
+/**
+ * @brief Open raw device for checkpoint writes and allocate aligned slot buffer. Checkpoints are written
+ * with O_DIRECT and O_DSYNC bypassing page cache, each checkpoint is on disk when the write returns.
+ * @param[in,out]   state   a pointer to a structure containing current state
+ * @return          0 if the device was opened and -1 otherwise
+ */
+int checkpoint_open(camogm_state *state)
+{
+	struct writer_params *params = &state->writer_params;
+
+	if (posix_memalign((void **)&params->ckpt_buff, CHECKPOINT_SLOT_SIZE, CHECKPOINT_SLOT_SIZE) != 0) {
+		params->ckpt_buff = NULL;
+		return -1;
+	}
+	params->ckpt_fd = open(state->rawdev.rawdev_path, O_WRONLY | O_DIRECT | O_DSYNC);
+	if (params->ckpt_fd < 0) {
+		D0(fprintf(debug_file, "Unable to open %s for checkpoint writes: %s\n", state->rawdev.rawdev_path, strerror(errno)));
+		free(params->ckpt_buff);
+		params->ckpt_buff = NULL;
+		return -1;
+	}
+	params->ckpt_lba = params->lba_current;
+	params->ckpt_time = time(NULL);
+
+	return 0;
+}
+
+/**
+ * @brief Close checkpoint file descriptor and free slot buffer
+ * @param[in,out]   state   a pointer to a structure containing current state
+ * @return          None
+ */
+void checkpoint_close(camogm_state *state)
+{
+	struct writer_params *params = &state->writer_params;
+
+	if (is_fd_valid(params->ckpt_fd))
+		close(params->ckpt_fd);
+	params->ckpt_fd = -1;
+	free(params->ckpt_buff);
+	params->ckpt_buff = NULL;
+}
+
+/**
+ * @brief Write current write pointer to the next slot of checkpoint ring if the time has come.
+ *
+ * A checkpoint is written every #CHECKPOINT_PERIOD seconds or every #CHECKPOINT_DATA_LIMIT bytes recorded,
+ * whichever comes first. This function is called from disk writing thread after each successful write.
+ * @param[in,out]   state   a pointer to a structure containing current state
+ * @param[in]       force   write checkpoint regardless of time and data amount passed since the last one
+ * @return          1 if the checkpoint was written, 0 if it is not needed yet and -1 in case of an error
+ */
+int checkpoint_update(camogm_state *state, bool force)
+{
+	off64_t offset;
+	time_t now;
+	struct checkpoint_slot slot;
+	struct writer_params *params = &state->writer_params;
+
+	if (params->ckpt_fd < 0 || params->ckpt_buff == NULL)
+		return -1;
+
+	now = time(NULL);
+	if (!force &&
+			params->lba_current >= params->ckpt_lba &&
+			lba_to_offset(params->lba_current - params->ckpt_lba) < CHECKPOINT_DATA_LIMIT &&
+			difftime(now, params->ckpt_time) < CHECKPOINT_PERIOD)
+		return 0;
+
+	memset(&slot, 0, sizeof(slot));
+	slot.magic = CHECKPOINT_MAGIC;
+	slot.version = CHECKPOINT_VERSION;
+	slot.seq = params->ckpt_seq + 1;
+	slot.lba_start = params->lba_start;
+	slot.lba_end = params->lba_end;
+	slot.lba_current = params->lba_current;
+	slot.frame_sec = params->frame_sec;
+	slot.frame_usec = params->frame_usec;
+	slot.wall_time = now;
+	slot_to_buff(&slot, params->ckpt_buff);
+
+	offset = CHECKPOINT_OFFSET + (slot.seq % CHECKPOINT_SLOTS) * CHECKPOINT_SLOT_SIZE;
+	if (pwrite64(params->ckpt_fd, params->ckpt_buff, CHECKPOINT_SLOT_SIZE, offset) != CHECKPOINT_SLOT_SIZE) {
+		D0(fprintf(debug_file, "Checkpoint write error: %s\n", strerror(errno)));
+		return -1;
+	}
+	params->ckpt_seq = slot.seq;
+	params->ckpt_lba = slot.lba_current;
+	params->ckpt_time = now;
+	D6(fprintf(debug_file, "Checkpoint %llu saved, current LBA = %llu\n", slot.seq, slot.lba_current));
+
+	return 1;
+}
+
+/** Read 16 bit value from TIFF structure */
+static inline uint32_t tiff_get16(const unsigned char *buf, bool big)
+{
+	return big ? ((buf[0] << 8) | buf[1]) : (buf[0] | (buf[1] << 8));
+}
+
+/** Read 32 bit value from TIFF structure */
+static inline uint32_t tiff_get32(const unsigned char *buf, bool big)
+{
+	return big ? (((uint32_t)buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3]) : get_uint32(buf);
+}
+
+/** Find a tag in TIFF image file directory and return its value/offset field, 0 if the tag is not found */
+static uint32_t tiff_find_tag(const unsigned char *tiff, size_t len, uint32_t ifd, uint16_t tag, bool big)
+{
+	uint32_t num;
+
+	if (ifd + 2 > len)
+		return 0;
+	num = tiff_get16(&tiff[ifd], big);
+	for (uint32_t i = 0; i < num && ifd + 2 + 12 * (i + 1) <= len; i++) {
+		const unsigned char *entry = &tiff[ifd + 2 + 12 * i];
+		if (tiff_get16(entry, big) == tag)
+			return tiff_get32(&entry[8], big);
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Get frame time stamp (seconds) from Exif DateTimeOriginal field
+ * @param[in]   buff   pointer to frame start, SOI marker
+ * @param[in]   len    the number of bytes available in buffer
+ * @param[out]  sec    time stamp in UNIX format
+ * @return      0 if the time stamp was found and -1 otherwise
+ */
+static int frame_time(const unsigned char *buff, size_t len, time_t *sec)
+{
+	bool big;
+	uint32_t ifd, offset;
+	size_t tiff_len;
+	const unsigned char *tiff = buff + TIFF_HDR_OFFSET;
+	struct tm tm = {0};
+
+	if (len < TIFF_HDR_OFFSET + 8 || buff[2] != 0xff || buff[3] != 0xe1 || memcmp(&buff[6], "Exif", 4) != 0)
+		return -1;
+	tiff_len = ((buff[4] << 8) | buff[5]) - 8;
+	if (tiff_len > len - TIFF_HDR_OFFSET)
+		return -1;
+	big = (tiff[0] == 'M');
+
+	ifd = tiff_find_tag(tiff, tiff_len, tiff_get32(&tiff[4], big), EXIF_TAG_SUBIFD, big);
+	if (ifd == 0)
+		return -1;
+	offset = tiff_find_tag(tiff, tiff_len, ifd, EXIF_TAG_DATE_TIME, big);
+	if (offset == 0 || offset + 19 > tiff_len)
+		return -1;
+	if (sscanf((const char *)&tiff[offset], "%d:%d:%d %d:%d:%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+			&tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6)
+		return -1;
+	tm.tm_year -= 1900;
+	tm.tm_mon -= 1;
+	*sec = timegm(&tm);
+
+	return 0;
+}
+
+/** Find two byte marker in a buffer, return its offset or -1 if not found */
+static ssize_t find_pattern(const unsigned char *buff, size_t len, size_t from, const unsigned char *pattern, size_t pt_len)
+{
+	for (size_t i = from; i + pt_len <= len; i++) {
+		if (buff[i] == pattern[0] && memcmp(&buff[i], pattern, pt_len) == 0)
+			return i;
+	}
+
+	return -1;
+}
+
+/**
+ * @brief Find the real write pointer after a checkpoint.
+ *
+ * Frames written after the checkpoint are located by scanning the region following it. A frame is
+ * considered fresh if its Exif time stamp is not older than the reference time, which is updated with each
+ * frame found. The scan stops at the first stale, broken or incomplete frame.
+ * @param[in]   fd       raw device file descriptor
+ * @param[in]   pos      checkpoint offset in raw device buffer, in bytes
+ * @param[in]   end      raw device buffer size, in bytes
+ * @param[in]   ref      reference time, the time stamp of the last frame recorded before checkpoint
+ * @return      The offset following the last complete fresh frame
+ */
+static uint64_t find_write_tip(int fd, uint64_t pos, uint64_t end, time_t ref)
+{
+	const unsigned char soi[] = {0xff, 0xd8, 0xff, 0xe1};
+	const unsigned char eoi[] = {0xff, 0xd9};
+	size_t len = CHECKPOINT_SCAN_SIZE;
+	size_t rd = 0;
+	size_t tip = 0;
+	ssize_t ret, start, stop;
+	time_t ts;
+	unsigned char *buff;
+
+	if (pos >= end)
+		return pos;
+	if (end - pos < len)
+		len = end - pos;
+	buff = malloc(len);
+	if (buff == NULL)
+		return pos;
+	while (rd < len && (ret = pread64(fd, &buff[rd], len - rd, pos + rd)) > 0)
+		rd += ret;
+
+	while ((start = find_pattern(buff, rd, tip, soi, sizeof(soi))) >= 0) {
+		if (frame_time(&buff[start], rd - start, &ts) != 0)
+			break;
+		if (ref != 0 && ts + CHECKPOINT_TIME_SLACK < ref)
+			break;
+		stop = find_pattern(buff, rd, start + sizeof(soi), eoi, sizeof(eoi));
+		if (stop < 0)
+			break;
+		tip = stop + sizeof(eoi);
+		if (ts > ref)
+			ref = ts;
+	}
+	free(buff);
+
+	return pos + tip;
+}
+
+/**
+ * @brief Restore write pointer from checkpoint ring.
+ *
+ * All slots of the ring are read and the valid slot with the highest sequence number is selected. Only the
+ * slots saved for the current raw device buffer geometry are considered. Frames recorded after the checkpoint
+ * are then located by #find_write_tip and the write pointer is moved past them.
+ * @param[in,out]   state         a pointer to a structure containing current state
+ * @param[out]      lba_current   restored write pointer
+ * @return          0 if the write pointer was restored and -1 if there are no valid checkpoints
+ */
+int checkpoint_recover(camogm_state *state, uint64_t *lba_current)
+{
+	int fd;
+	int ret = -1;
+	uint64_t offset, tip;
+	unsigned char *buff;
+	struct checkpoint_slot slot, newest = {0};
+	struct writer_params *params = &state->writer_params;
+	const size_t ring_sz = CHECKPOINT_SLOTS * CHECKPOINT_SLOT_SIZE;
+
+	if (posix_memalign((void **)&buff, CHECKPOINT_SLOT_SIZE, ring_sz) != 0)
+		return -1;
+	fd = open(state->rawdev.rawdev_path, O_RDONLY | O_DIRECT);
+	if (fd < 0) {
+		free(buff);
+		return -1;
+	}
+	if (pread64(fd, buff, ring_sz, CHECKPOINT_OFFSET) == ring_sz) {
+		for (int i = 0; i < CHECKPOINT_SLOTS; i++) {
+			if (buff_to_slot(&buff[i * CHECKPOINT_SLOT_SIZE], &slot) == 0 &&
+					slot.lba_start == params->lba_start &&
+					slot.lba_end == params->lba_end &&
+					slot.seq > newest.seq) {
+				newest = slot;
+			}
+		}
+	}
+	close(fd);
+	free(buff);
+
+	if (newest.seq != 0 && newest.lba_current >= params->lba_start + RAWDEV_START_LBA && newest.lba_current < params->lba_end) {
+		D0(fprintf(debug_file, "Got write pointer from checkpoint %llu: %llu\n", newest.seq, newest.lba_current));
+		params->ckpt_seq = newest.seq;
+		*lba_current = newest.lba_current;
+		ret = 0;
+
+		fd = open(state->rawdev.rawdev_path, O_RDONLY);
+		if (fd >= 0) {
+			offset = lba_to_offset(newest.lba_current - params->lba_start);
+			tip = find_write_tip(fd, offset, lba_to_offset(params->lba_end - params->lba_start), newest.frame_sec);
+			close(fd);
+			if (tip > offset) {
+				*lba_current = params->lba_start + (tip + PHY_BLOCK_SIZE - 1) / PHY_BLOCK_SIZE;
+				if (*lba_current >= params->lba_end)
+					*lba_current = params->lba_start + RAWDEV_START_LBA;
+				D0(fprintf(debug_file, "Frames found after checkpoint, write pointer moved to %llu\n", *lba_current));
+			}
+		}
+	}
+
+	return ret;
+}
@@ -0,0 +1,48 @@
+/** @file camogm_checkpoint.h
+ * @brief Provides write pointer checkpoints stored in the reserved area of raw device buffer
+ * @copyright Copyright (C) 2017 Elphel, Inc.
+ *
+ * @par <b>License</b>
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CAMOGM_CHECKPOINT_H
+#define _CAMOGM_CHECKPOINT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "camogm.h"
+
+#define CHECKPOINT_OFFSET         65536          ///< Offset of the first checkpoint slot from the beginning of raw device buffer, in bytes
+#define CHECKPOINT_SLOT_SIZE      4096           ///< The size of one checkpoint slot. Each slot is written with a single O_DIRECT
+                                                 ///< write, so this size must be a multiple of logical sector size of the disk
+#define CHECKPOINT_SLOTS          64             ///< The number of slots in checkpoint ring
+#define CHECKPOINT_MAGIC          0x50434c45     ///< Checkpoint slot signature, 'ELCP'
+#define CHECKPOINT_VERSION        1              ///< Checkpoint slot format version
+#define CHECKPOINT_PERIOD         2              ///< Write checkpoint at least this often while recording, in seconds
+#define CHECKPOINT_DATA_LIMIT     (16 * 1048576) ///< Write checkpoint every time this amount of data (in bytes) is recorded
+#define CHECKPOINT_SCAN_SIZE      (8 * 1048576)  ///< The size of the region after the newest checkpoint scanned for frames during recovery
+#define CHECKPOINT_TIME_SLACK     1              ///< Frames older than the reference time by this amount of seconds are considered stale
+
+/* Sanity check, checkpoint ring must fit into reserved area */
+#if (CHECKPOINT_OFFSET + CHECKPOINT_SLOTS * CHECKPOINT_SLOT_SIZE) > RAWDEV_START_OFFSET
+#error "Checkpoint ring does not fit into raw device buffer reserved area"
+#endif
+
+int checkpoint_open(camogm_state *state);
+void checkpoint_close(camogm_state *state);
+int checkpoint_update(camogm_state *state, bool force);
+int checkpoint_recover(camogm_state *state, uint64_t *lba_current);
+uint32_t crc32_calc(uint32_t crc, const void *buff, size_t len);
+
+#endif /* _CAMOGM_CHECKPOINT_H */
@@ -0,0 +1,236 @@
+/** @file camogm_control.c
+ * @brief Requests from control thread to capture thread and status counters
+ * @copyright Copyright (C) 2017 Elphel, Inc.
+ *
+ * @par <b>License</b>
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+
+#include "camogm_control.h"
+
+/** @brief Time to wait (in microseconds) for capture thread to free a slot in control queue */
+#define QUEUE_FULL_DELAY          1000
+
+/**
+ * @brief Initialize control queue. Current settings are considered published, capture thread
+ * is expected to apply them at start up.
+ * @param[in]   state   a pointer to a structure containing current state
+ * @return      None
+ */
+void control_init(camogm_state *state)
+{
+	struct control_plane *cp = &state->cp;
+
+	cp->head = 0;
+	cp->tail = 0;
+	cp->cmd_file = -1;
+	pthread_mutex_init(&cp->mutex, NULL);
+	pthread_cond_init(&cp->cond, NULL);
+	cp->published = state->set;
+	for (int i = 0; i < SENSOR_PORTS; i++)
+		cp->fd_circ[i] = -1;
+	cp->lat_start = lat_time();
+}
+
+/**
+ * @brief Free settings snapshots left in control queue and the snapshot in use
+ * @param[in]   state   a pointer to a structure containing current state
+ * @return      None
+ */
+void control_free(camogm_state *state)
+{
+	struct ctl_action action;
+
+	while (control_take(state, &action)) {
+		if (action.type == ACTION_SETTINGS)
+			free(action.settings);
+	}
+	free((void *)state->cfg);
+	state->cfg = NULL;
+}
+
+/**
+ * @brief Make immutable copy of settings
+ * @param[in]   set   settings to copy
+ * @return      pointer to a new snapshot or NULL if memory could not be allocated
+ */
+struct camogm_settings *control_snapshot(const struct camogm_settings *set)
+{
+	struct camogm_settings *snap = malloc(sizeof(struct camogm_settings));
+
+	if (snap)
+		memcpy(snap, set, sizeof(struct camogm_settings));
+	return snap;
+}
+
+/**
+ * @brief Put a request to control queue and wake capture thread. Blocks while the queue is full.
+ * @param[in]   state   a pointer to a structure containing current state
+ * @param[in]   action  request to add
+ * @return      None
+ */
+static void control_push(camogm_state *state, const struct ctl_action *action)
+{
+	struct control_plane *cp = &state->cp;
+	unsigned int head = cp->head;
+
+	while (head - __atomic_load_n(&cp->tail, __ATOMIC_ACQUIRE) >= CTL_QUEUE_SIZE)
+		usleep(QUEUE_FULL_DELAY);
+	cp->queue[head & (CTL_QUEUE_SIZE - 1)] = *action;
+	__atomic_store_n(&cp->head, head + 1, __ATOMIC_RELEASE);
+
+	pthread_mutex_lock(&cp->mutex);
+	pthread_cond_signal(&cp->cond);
+	pthread_mutex_unlock(&cp->mutex);
+}
+
+/**
+ * @brief Publish settings snapshot if settings have changed since the last snapshot. Called by control
+ * thread after a batch of commands and before any other request, so the requests are processed
+ * with the settings given before them.
+ * @param[in]   state   a pointer to a structure containing current state
+ * @return      None
+ */
+void control_flush(camogm_state *state)
+{
+	struct ctl_action action = {.type = ACTION_SETTINGS};
+
+	if (memcmp(&state->set, &state->cp.published, sizeof(struct camogm_settings)) == 0)
+		return;
+	if ((action.settings = control_snapshot(&state->set)) == NULL) {
+		D0(fprintf(debug_file, "Can not allocate memory for settings snapshot, settings are not applied\n"));
+		return;
+	}
+	state->cp.published = state->set;
+	control_push(state, &action);
+}
+
+/**
+ * @brief Send request to capture thread
+ * @param[in]   state   a pointer to a structure containing current state
+ * @param[in]   type    request type, one of #ctl_action_type
+ * @param[in]   arg     request argument
+ * @return      None
+ */
+void control_post(camogm_state *state, int type, int arg)
+{
+	struct ctl_action action = {.type = type, .arg = arg};
+
+	control_flush(state);
+	control_push(state, &action);
+}
+
+/**
+ * @brief Check if there are requests in control queue, this is lock free and can be called before each frame
+ * @param[in]   state   a pointer to a structure containing current state
+ * @return      True if a request is waiting
+ */
+bool control_pending(camogm_state *state)
+{
+	return __atomic_load_n(&state->cp.head, __ATOMIC_ACQUIRE) != state->cp.tail;
+}
+
+/**
+ * @brief Take the next request from control queue, called by capture thread
+ * @param[in]   state   a pointer to a structure containing current state
+ * @param[out]  action  request taken from queue
+ * @return      True if a request was taken and false if the queue is empty
+ */
+bool control_take(camogm_state *state, struct ctl_action *action)
+{
+	struct control_plane *cp = &state->cp;
+	unsigned int tail = cp->tail;
+
+	if (__atomic_load_n(&cp->head, __ATOMIC_ACQUIRE) == tail)
+		return false;
+	*action = cp->queue[tail & (CTL_QUEUE_SIZE - 1)];
+	__atomic_store_n(&cp->tail, tail + 1, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+/**
+ * @brief Wait for a request from control thread, used by capture thread when it has nothing to record
+ * @param[in]   state   a pointer to a structure containing current state
+ * @param[in]   timeout maximal time to wait, in milliseconds
+ * @return      None
+ */
+void control_wait(camogm_state *state, int timeout)
+{
+	struct control_plane *cp = &state->cp;
+	struct timeval now;
+	struct timespec until;
+
+	gettimeofday(&now, NULL);
+	until.tv_sec = now.tv_sec + timeout / 1000;
+	until.tv_nsec = (now.tv_usec + (timeout % 1000) * 1000) * 1000;
+	if (until.tv_nsec >= 1000000000) {
+		until.tv_sec++;
+		until.tv_nsec -= 1000000000;
+	}
+	pthread_mutex_lock(&cp->mutex);
+	while (!control_pending(state)) {
+		if (pthread_cond_timedwait(&cp->cond, &cp->mutex, &until) == ETIMEDOUT)
+			break;
+	}
+	pthread_mutex_unlock(&cp->mutex);
+}
+
+/**
+ * @brief Start updating segment parameters in status counters, called by capture thread
+ * @param[in]   cnt   status counters
+ * @return      None
+ */
+void counters_info_begin(struct camogm_counters *cnt)
+{
+	__atomic_store_n(&cnt->seq, cnt->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Finish updating segment parameters in status counters, called by capture thread
+ * @param[in]   cnt   status counters
+ * @return      None
+ */
+void counters_info_end(struct camogm_counters *cnt)
+{
+	__atomic_store_n(&cnt->seq, cnt->seq + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Get consistent copy of segment parameters from status counters. Retries the copy if capture
+ * thread has changed the parameters in the meantime.
+ * @param[in]   cnt   status counters
+ * @param[out]  info  a copy of segment parameters
+ * @return      None
+ */
+void counters_get_info(struct camogm_counters *cnt, struct camogm_seg_info *info)
+{
+	unsigned int seq;
+
+	do {
+		while ((seq = __atomic_load_n(&cnt->seq, __ATOMIC_ACQUIRE)) & 1)
+			sched_yield();
+		memcpy(info, &cnt->info, sizeof(struct camogm_seg_info));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&cnt->seq, __ATOMIC_RELAXED) != seq);
+}
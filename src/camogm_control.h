@@ -0,0 +1,44 @@
+/** @file camogm_control.h
+ * @brief Requests from control thread to capture thread and status counters
+ * @copyright Copyright (C) 2017 Elphel, Inc.
+ *
+ * @par <b>License</b>
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CAMOGM_CONTROL_H
+#define _CAMOGM_CONTROL_H
+
+#include "camogm.h"
+
+/** @brief Store a status counter, used by capture thread */
+#define CNT_SET(field, val)       __atomic_store_n(&(field), (val), __ATOMIC_RELAXED)
+/** @brief Read a status counter */
+#define CNT_GET(field)            __atomic_load_n(&(field), __ATOMIC_RELAXED)
+/** @brief Increment a status counter */
+#define CNT_INC(field)            __atomic_fetch_add(&(field), 1, __ATOMIC_RELAXED)
+/** @brief Add a value to a status counter */
+#define CNT_ADD(field, val)       __atomic_fetch_add(&(field), (val), __ATOMIC_RELAXED)
+
+void control_init(camogm_state *state);
+void control_free(camogm_state *state);
+struct camogm_settings *control_snapshot(const struct camogm_settings *set);
+void control_flush(camogm_state *state);
+void control_post(camogm_state *state, int type, int arg);
+bool control_pending(camogm_state *state);
+bool control_take(camogm_state *state, struct ctl_action *action);
+void control_wait(camogm_state *state, int timeout);
+void counters_info_begin(struct camogm_counters *cnt);
+void counters_info_end(struct camogm_counters *cnt);
+void counters_get_info(struct camogm_counters *cnt, struct camogm_seg_info *info);
+
+#endif /* _CAMOGM_CONTROL_H */
@@ -0,0 +1,608 @@
+/** @file camogm_ctl.c
+ * @brief Control socket accepting commands and returning replies on the same connection
+ * @copyright Copyright (C) 2017 Elphel, Inc.
+ *
+ * @par <b>License</b>
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * A client connects to Unix domain stream socket and sends requests, one request per line. A request
+ * contains one or several commands separated by semicolons, the same commands as accepted by command pipe.
+ * Each request gets one reply with the results of all its commands, in the order they were executed.
+ *
+ * Text reply (default), terminated by an empty line:
+ * @verbatim
+   command=<name>
+   code=<command code, -1 if the command is not recognized>
+   output=<N>
+   <N bytes of command output (i.e. status) followed by new line, only if N > 0>
+   ...
+   @endverbatim
+ * JSON reply, one line:
+ * @verbatim
+   {"replies":[{"command":"<name>","code":<code>,"output":"<command output>"},...]}
+   @endverbatim
+ * The reply format is selected per connection with @e reply=json or @e reply=text command.
+ *
+ * A connection can also subscribe to status updates and events with @e subscribe[=interval] command, the
+ * interval is in milliseconds (#CTL_STATUS_INTERVAL by default, not less than #CTL_MIN_INTERVAL), and stop
+ * them with @e unsubscribe. Updates are sent as JSON lines regardless of reply format. The first status
+ * update after subscription has all the fields, the next ones only have the fields that have changed.
+ * Per port values are sent as arrays of #SENSOR_PORTS elements, rates are in MB/s.
+ * @verbatim
+   {"type":"status","time":<us>,"state":"running","frames":[...],"rate":[...],"buf_min":[...],"overruns":[...],
+    "lba_current":<LBA>,"last_error":<code>,"dropped_events":<N>}
+   {"type":"event","event":"segment|overrun|no_space|writer_error|flight_dump","port":<port or -1>,"value":<N>,"time":<us>,"text":"..."}
+   @endverbatim
+ * A subscriber which does not read updates is disconnected when its socket buffer is full.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "camogm_ctl.h"
+#include "camogm_control.h"
+#include "camogm_events.h"
+
+/** @brief The size of request buffer, longer requests are discarded */
+#define CTL_BUFF_SIZE             1024
+/** @brief The maximal number of commands in one request, the rest are ignored */
+#define CTL_MAX_RESULTS           64
+/** @brief Default status update interval for subscribers, in milliseconds */
+#define CTL_STATUS_INTERVAL       1000
+/** @brief Minimal status update interval for subscribers, in milliseconds */
+#define CTL_MIN_INTERVAL          100
+
+/**
+ * @struct ctl_result
+ * @brief The result of one command in request
+ */
+struct ctl_result {
+	const char *name;                            ///< command name
+	int code;                                    ///< command code
+	char *output;                                ///< command output, NULL if none
+	size_t len;                                  ///< output length
+};
+
+/**
+ * @struct ctl_status
+ * @brief Status values sent to subscribers
+ */
+struct ctl_status {
+	const char *state;                           ///< program state name
+	unsigned int frames[SENSOR_PORTS];           ///< the number of frames recorded since start
+	int rate[SENSOR_PORTS];                      ///< recording rate since the previous update, in 1/100 MB/s
+	unsigned int buf_min[SENSOR_PORTS];          ///< minimal free space in circbuf
+	unsigned int overruns[SENSOR_PORTS];         ///< the number of circbuf overruns since start
+	uint64_t lba_current;                        ///< current write position in raw device buffer
+	int last_error;                              ///< last error code
+	unsigned int dropped;                        ///< the number of events dropped
+};
+
+/**
+ * @struct ctl_client
+ * @brief Control connection
+ */
+struct ctl_client {
+	int fd;                                      ///< connection socket, -1 if the slot is free
+	bool json;                                   ///< reply in JSON format
+	int len;                                     ///< the number of bytes in request buffer
+	char buff[CTL_BUFF_SIZE];                    ///< request buffer
+	bool subscribed;                             ///< send status updates and events to this connection
+	bool full;                                   ///< the next status update should have all the fields
+	int interval;                                ///< status update interval, in milliseconds
+	uint64_t next_update;                        ///< the time of the next status update, in microseconds
+	uint64_t last_time;                          ///< the time of the previous status update, in microseconds
+	uint64_t last_bytes[SENSOR_PORTS];           ///< the number of bytes recorded at the previous status update
+	struct ctl_status last;                      ///< the values sent with the previous status update
+};
+
+/**
+ * @struct ctl_server
+ * @brief Listening socket and its connections
+ */
+struct ctl_server {
+	int fd;                                      ///< listening socket, -1 if control socket is not open
+	char path[ELPHEL_PATH_MAX];                  ///< socket file name
+	struct ctl_client clients[CTL_MAX_CLIENTS];  ///< active connections
+};
+
+static struct ctl_server ctl = {
+	.fd = -1,
+	.clients = {[0 ... CTL_MAX_CLIENTS - 1] = {.fd = -1}}
+};
+
+/**
+ * @brief Create control socket
+ * @param[in]   path   socket file name, existing file is replaced
+ * @return      0 if the socket is ready and -1 otherwise
+ */
+int ctl_open(const char *path)
+{
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		D0(fprintf(debug_file, "Control socket name is too long: %s\n", path));
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	ctl.fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (ctl.fd < 0) {
+		D0(fprintf(debug_file, "Can not create control socket: %s\n", strerror(errno)));
+		return -1;
+	}
+	if (bind(ctl.fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(ctl.fd, CTL_MAX_CLIENTS) < 0) {
+		D0(fprintf(debug_file, "Can not bind control socket to %s: %s\n", path, strerror(errno)));
+		close(ctl.fd);
+		ctl.fd = -1;
+		return -1;
+	}
+	fcntl(ctl.fd, F_SETFL, O_NONBLOCK);
+	strncpy(ctl.path, path, ELPHEL_PATH_MAX - 1);
+	D0(fprintf(debug_file, "Control socket %s open\n", path));
+
+	return 0;
+}
+
+/**
+ * @brief Close control socket and all connections
+ * @return      None
+ */
+void ctl_close(void)
+{
+	for (int i = 0; i < CTL_MAX_CLIENTS; i++) {
+		if (ctl.clients[i].fd >= 0)
+			close(ctl.clients[i].fd);
+		ctl.clients[i].fd = -1;
+	}
+	if (ctl.fd >= 0) {
+		close(ctl.fd);
+		unlink(ctl.path);
+	}
+	ctl.fd = -1;
+}
+
+/**
+ * @brief Fill poll descriptors for listening socket and connections
+ * @param[out]  pfd   array of at least #CTL_POLL_FDS poll descriptors
+ * @return      the number of descriptors filled
+ */
+int ctl_poll_fds(struct pollfd *pfd)
+{
+	int num = 0;
+
+	if (ctl.fd < 0)
+		return 0;
+	pfd[num].fd = ctl.fd;
+	pfd[num++].events = POLLIN;
+	for (int i = 0; i < CTL_MAX_CLIENTS; i++) {
+		if (ctl.clients[i].fd >= 0) {
+			pfd[num].fd = ctl.clients[i].fd;
+			pfd[num++].events = POLLIN;
+		}
+	}
+	return num;
+}
+
+static void close_client(struct ctl_client *cl)
+{
+	close(cl->fd);
+	cl->fd = -1;
+	cl->len = 0;
+	cl->subscribed = false;
+}
+
+/** Return monotonic time in microseconds */
+static uint64_t ctl_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Check if command is a connection option with the given name
+ * @return  pointer to option argument (can be empty string) or NULL if the command is not this option
+ */
+static const char *conn_option(const char *cmd, const char *name)
+{
+	size_t len = strlen(name);
+
+	if (strncmp(cmd, name, len) != 0)
+		return NULL;
+	if (cmd[len] == '\0')
+		return &cmd[len];
+	if (strchr("= \t", cmd[len]) == NULL)
+		return NULL;
+	return &cmd[len + 1];
+}
+
+/** Write string to stream as JSON string literal */
+static void put_json_str(FILE *f, const char *str, size_t len)
+{
+	fputc('"', f);
+	for (size_t i = 0; i < len; i++) {
+		unsigned char c = str[i];
+		switch (c) {
+		case '"':  fputs("\\\"", f); break;
+		case '\\': fputs("\\\\", f); break;
+		case '\n': fputs("\\n", f); break;
+		case '\t': fputs("\\t", f); break;
+		case '\r': fputs("\\r", f); break;
+		default:
+			if (c < 0x20)
+				fprintf(f, "\\u%04x", c);
+			else
+				fputc(c, f);
+		}
+	}
+	fputc('"', f);
+}
+
+/** Add the result of one command to reply */
+static void put_result(FILE *f, bool json, bool first, const char *name, int code, const char *output, size_t len)
+{
+	if (json) {
+		if (!first)
+			fputc(',', f);
+		fputs("{\"command\":", f);
+		put_json_str(f, name, strlen(name));
+		fprintf(f, ",\"code\":%d,\"output\":", code);
+		put_json_str(f, output ? output : "", len);
+		fputc('}', f);
+	} else {
+		fprintf(f, "command=%s\ncode=%d\noutput=%zu\n", name, code, len);
+		if (len > 0) {
+			fwrite(output, 1, len, f);
+			fputc('\n', f);
+		}
+	}
+}
+
+/**
+ * Send the whole buffer, the connection is closed in case of error. Updates are sent with MSG_DONTWAIT
+ * in @e flags, so a subscriber which does not read them can not block control thread.
+ */
+static int send_reply(struct ctl_client *cl, const char *buff, size_t len, int flags)
+{
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = send(cl->fd, buff, len, MSG_NOSIGNAL | flags);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			D1(fprintf(debug_file, "Error sending control reply: %s\n", strerror(errno)));
+			close_client(cl);
+			return -1;
+		}
+		buff += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/**
+ * @brief Execute all commands of one request and send reply. The results are collected first, so reply
+ * format set by the request itself applies to the whole reply.
+ * @param[in]   state   a pointer to a structure containing current state
+ * @param[in]   cl      client connection
+ * @param[in]   req     request string, modified by this function
+ * @return      the number of commands executed
+ */
+static int process_request(camogm_state *state, struct ctl_client *cl, char *req)
+{
+	int num = 0;
+	int res_num = 0;
+	long interval;
+	char *cmd, *saveptr;
+	const char *arg;
+	char *reply = NULL;
+	size_t reply_len = 0;
+	struct ctl_result res[CTL_MAX_RESULTS];
+	FILE *f, *out;
+
+	for (cmd = strtok_r(req, ";", &saveptr); cmd != NULL && res_num < CTL_MAX_RESULTS; cmd = strtok_r(NULL, ";", &saveptr)) {
+		cmd += strspn(cmd, " \t\r");
+		if (!cmd[0])
+			continue;
+		res[res_num].output = NULL;
+		res[res_num].len = 0;
+		// connection options, not commands
+		if ((arg = conn_option(cmd, "reply")) != NULL && arg[0] != '\0') {
+			cl->json = strstr(arg, "json") != NULL;
+			res[res_num].name = "reply";
+			res[res_num++].code = 0;
+			continue;
+		}
+		if ((arg = conn_option(cmd, "subscribe")) != NULL) {
+			interval = (arg[0] != '\0') ? strtol(arg, NULL, 10) : CTL_STATUS_INTERVAL;
+			cl->interval = (interval < CTL_MIN_INTERVAL) ? CTL_MIN_INTERVAL : interval;
+			cl->subscribed = true;
+			cl->full = true;
+			cl->next_update = ctl_time();
+			res[res_num].name = "subscribe";
+			res[res_num++].code = 0;
+			continue;
+		}
+		if (conn_option(cmd, "unsubscribe") != NULL) {
+			cl->subscribed = false;
+			res[res_num].name = "unsubscribe";
+			res[res_num++].code = 0;
+			continue;
+		}
+		out = open_memstream(&res[res_num].output, &res[res_num].len);
+		res[res_num].code = camogm_exec_cmd(state, cmd, out);
+		if (out != NULL)
+			fclose(out);
+		// command string is truncated to command name by now
+		res[res_num++].name = cmd;
+		num++;
+	}
+
+	if ((f = open_memstream(&reply, &reply_len)) != NULL) {
+		if (cl->json)
+			fputs("{\"replies\":[", f);
+		for (int i = 0; i < res_num; i++)
+			put_result(f, cl->json, i == 0, res[i].name, res[i].code, res[i].output, res[i].len);
+		if (cl->json)
+			fputs("]}\n", f);
+		else
+			fputc('\n', f);
+		fclose(f);
+		send_reply(cl, reply, reply_len, 0);
+		free(reply);
+	}
+	for (int i = 0; i < res_num; i++)
+		free(res[i].output);
+
+	return num;
+}
+
+/** Read available data from client and process complete requests */
+static int read_client(camogm_state *state, struct ctl_client *cl)
+{
+	int num = 0;
+	ssize_t ret;
+	char *nl;
+
+	ret = recv(cl->fd, &cl->buff[cl->len], CTL_BUFF_SIZE - cl->len - 1, MSG_DONTWAIT);
+	if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+		return 0;
+	if (ret <= 0) {
+		// connection closed, the last request may be not terminated by new line
+		if (cl->len > 0) {
+			cl->buff[cl->len] = '\0';
+			num = process_request(state, cl, cl->buff);
+		}
+		if (cl->fd >= 0)
+			close_client(cl);
+		return num;
+	}
+	cl->len += ret;
+	cl->buff[cl->len] = '\0';
+	while (cl->fd >= 0 && (nl = strchr(cl->buff, '\n')) != NULL) {
+		nl[0] = '\0';
+		num += process_request(state, cl, cl->buff);
+		if (cl->fd < 0)
+			break;
+		cl->len -= nl + 1 - cl->buff;
+		memmove(cl->buff, nl + 1, cl->len + 1);
+	}
+	if (cl->fd >= 0 && cl->len >= CTL_BUFF_SIZE - 1) {
+		D0(fprintf(debug_file, "Control request is too long, discarded\n"));
+		cl->len = 0;
+	}
+
+	return num;
+}
+
+/**
+ * @brief Accept new connections and process requests of the connections that have data
+ * @param[in]   state   a pointer to a structure containing current state
+ * @param[in]   pfd     poll descriptors filled by #ctl_poll_fds after poll()
+ * @param[in]   num     the number of poll descriptors
+ * @return      the number of commands executed
+ */
+int ctl_process(camogm_state *state, const struct pollfd *pfd, int num)
+{
+	int fd, i, j;
+	int cmds = 0;
+
+	for (i = 0; i < num; i++) {
+		if (!(pfd[i].revents & (POLLIN | POLLHUP | POLLERR)))
+			continue;
+		if (pfd[i].fd == ctl.fd) {
+			fd = accept(ctl.fd, NULL, NULL);
+			if (fd < 0)
+				continue;
+			for (j = 0; j < CTL_MAX_CLIENTS && ctl.clients[j].fd >= 0; j++);
+			if (j == CTL_MAX_CLIENTS) {
+				D1(fprintf(debug_file, "Too many control connections, new connection refused\n"));
+				close(fd);
+				continue;
+			}
+			ctl.clients[j].fd = fd;
+			ctl.clients[j].len = 0;
+			ctl.clients[j].json = false;
+			ctl.clients[j].subscribed = false;
+		} else {
+			for (j = 0; j < CTL_MAX_CLIENTS; j++) {
+				if (ctl.clients[j].fd == pfd[i].fd) {
+					cmds += read_client(state, &ctl.clients[j]);
+					break;
+				}
+			}
+		}
+	}
+	return cmds;
+}
+
+/** Collect current status values, the rates are calculated since the previous update of this connection */
+static void get_status(camogm_state *state, struct ctl_client *cl, uint64_t now, struct ctl_status *st)
+{
+	uint64_t bytes;
+	struct camogm_counters *cnt = &state->cnt;
+
+	st->state = camogm_state_name(state->prog_state);
+	for (int chn = 0; chn < SENSOR_PORTS; chn++) {
+		bytes = CNT_GET(cnt->bytes[chn]);
+		if (cl->full || now <= cl->last_time)
+			st->rate[chn] = 0;
+		else
+			st->rate[chn] = (int)((double)(bytes - cl->last_bytes[chn]) * 100.0 / 1048576.0 /
+					((double)(now - cl->last_time) / 1000000.0) + 0.5);
+		cl->last_bytes[chn] = bytes;
+		st->frames[chn] = CNT_GET(cnt->frames[chn]);
+		st->buf_min[chn] = CNT_GET(cnt->buf_min[chn]);
+		st->overruns[chn] = CNT_GET(cnt->overruns[chn]);
+	}
+	st->lba_current = CNT_GET(cnt->lba_current);
+	st->last_error = CNT_GET(cnt->last_error_code);
+	st->dropped = events_dropped();
+	cl->last_time = now;
+}
+
+/** Write per port array if any of its elements has changed or all fields are needed */
+static void put_port_uint(FILE *f, const char *name, const unsigned int *val, const unsigned int *prev, bool full)
+{
+	if (!full && memcmp(val, prev, SENSOR_PORTS * sizeof(val[0])) == 0)
+		return;
+	fprintf(f, ",\"%s\":[", name);
+	for (int chn = 0; chn < SENSOR_PORTS; chn++)
+		fprintf(f, "%s%u", chn ? "," : "", val[chn]);
+	fputc(']', f);
+}
+
+/** Send status update to subscribed connection */
+static void push_status(camogm_state *state, struct ctl_client *cl, uint64_t now)
+{
+	struct ctl_status st;
+	struct ctl_status *prev = &cl->last;
+	struct timeval tv;
+	char *buff = NULL;
+	size_t len = 0;
+	bool full = cl->full;
+	FILE *f;
+
+	get_status(state, cl, now, &st);
+	if ((f = open_memstream(&buff, &len)) == NULL)
+		return;
+	gettimeofday(&tv, NULL);
+	fprintf(f, "{\"type\":\"status\",\"time\":%llu", (unsigned long long)tv.tv_sec * 1000000 + tv.tv_usec);
+	if (full || strcmp(st.state, prev->state) != 0)
+		fprintf(f, ",\"state\":\"%s\"", st.state);
+	put_port_uint(f, "frames", st.frames, prev->frames, full);
+	if (full || memcmp(st.rate, prev->rate, sizeof(st.rate)) != 0) {
+		fputs(",\"rate\":[", f);
+		for (int chn = 0; chn < SENSOR_PORTS; chn++)
+			fprintf(f, "%s%d.%02d", chn ? "," : "", st.rate[chn] / 100, st.rate[chn] % 100);
+		fputc(']', f);
+	}
+	put_port_uint(f, "buf_min", st.buf_min, prev->buf_min, full);
+	put_port_uint(f, "overruns", st.overruns, prev->overruns, full);
+	if (full || st.lba_current != prev->lba_current)
+		fprintf(f, ",\"lba_current\":%llu", (unsigned long long)st.lba_current);
+	if (full || st.last_error != prev->last_error)
+		fprintf(f, ",\"last_error\":%d", st.last_error);
+	if (full || st.dropped != prev->dropped)
+		fprintf(f, ",\"dropped_events\":%u", st.dropped);
+	fputs("}\n", f);
+	fclose(f);
+
+	cl->last = st;
+	cl->full = false;
+	send_reply(cl, buff, len, MSG_DONTWAIT);
+	free(buff);
+}
+
+/** Send event to all subscribed connections */
+static void push_event(const struct camogm_event *ev)
+{
+	char *buff = NULL;
+	size_t len = 0;
+	FILE *f;
+
+	if ((f = open_memstream(&buff, &len)) == NULL)
+		return;
+	fprintf(f, "{\"type\":\"event\",\"event\":\"%s\",\"port\":%d,\"value\":%lld,\"time\":%llu,\"text\":",
+			event_name(ev->type), ev->port, (long long)ev->value, (unsigned long long)ev->time);
+	put_json_str(f, ev->text, strlen(ev->text));
+	fputs("}\n", f);
+	fclose(f);
+
+	for (int i = 0; i < CTL_MAX_CLIENTS; i++) {
+		if (ctl.clients[i].fd >= 0 && ctl.clients[i].subscribed)
+			send_reply(&ctl.clients[i], buff, len, MSG_DONTWAIT);
+	}
+	free(buff);
+}
+
+/**
+ * @brief Send pending events and due status updates to subscribed connections. Events are taken from
+ * event queue even if there are no subscribers.
+ * @param[in]   state   a pointer to a structure containing current state
+ * @return      None
+ */
+void ctl_push(camogm_state *state)
+{
+	uint64_t now;
+	struct camogm_event ev;
+	struct ctl_client *cl;
+
+	events_clear();
+	while (events_get(&ev))
+		push_event(&ev);
+
+	now = ctl_time();
+	for (int i = 0; i < CTL_MAX_CLIENTS; i++) {
+		cl = &ctl.clients[i];
+		if (cl->fd < 0 || !cl->subscribed || now < cl->next_update)
+			continue;
+		push_status(state, cl, now);
+		// keep the schedule, but do not try to catch up missed updates
+		cl->next_update += (uint64_t)cl->interval * 1000;
+		if (cl->next_update <= now)
+			cl->next_update = now + (uint64_t)cl->interval * 1000;
+	}
+}
+
+/**
+ * @brief Limit poll timeout by the time left to the nearest status update
+ * @param[in]   timeout   default timeout, in milliseconds
+ * @return      timeout to use, in milliseconds
+ */
+int ctl_timeout(int timeout)
+{
+	uint64_t now = ctl_time();
+	int left;
+
+	for (int i = 0; i < CTL_MAX_CLIENTS; i++) {
+		if (ctl.clients[i].fd < 0 || !ctl.clients[i].subscribed)
+			continue;
+		if (ctl.clients[i].next_update <= now)
+			return 0;
+		left = (ctl.clients[i].next_update - now + 999) / 1000;
+		if (left < timeout)
+			timeout = left;
+	}
+	return timeout;
+}
@@ -0,0 +1,39 @@
+/** @file camogm_ctl.h
+ * @brief Control socket accepting commands and returning replies on the same connection
+ * @copyright Copyright (C) 2017 Elphel, Inc.
+ *
+ * @par <b>License</b>
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CAMOGM_CTL_H
+#define _CAMOGM_CTL_H
+
+#include <poll.h>
+
+#include "camogm.h"
+
+/** @brief Control socket name suffix, the socket is created next to command pipe by default */
+#define CTL_SOCKET_SUFFIX         ".sock"
+/** @brief The maximal number of simultaneous control connections */
+#define CTL_MAX_CLIENTS           4
+/** @brief The number of poll descriptors used by control socket */
+#define CTL_POLL_FDS              (CTL_MAX_CLIENTS + 1)
+
+int ctl_open(const char *path);
+int ctl_poll_fds(struct pollfd *pfd);
+int ctl_process(camogm_state *state, const struct pollfd *pfd, int num);
+void ctl_push(camogm_state *state);
+int ctl_timeout(int timeout);
+void ctl_close(void);
+
+#endif /* _CAMOGM_CTL_H */
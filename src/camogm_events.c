@@ -0,0 +1,195 @@
+/** @file camogm_events.c
+ * @brief Recording events delivered to control socket subscribers
+ * @copyright Copyright (C) 2017 Elphel, Inc.
+ *
+ * @par <b>License</b>
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Events are raised by capture, writer and finalizer threads and consumed by control thread, which
+ * forwards them to subscribed control connections. The queue is a bounded multiple producer, single
+ * consumer ring where each slot carries a sequence number, so producers never take locks and never wait:
+ * if the ring is full the event is counted as dropped. Control thread is woken up through eventfd.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+
+#include "camogm_events.h"
+
+/**
+ * @struct event_slot
+ * @brief Event queue slot
+ */
+struct event_slot {
+	unsigned int seq;                            ///< slot sequence number, equals the position of the next event it can take
+	struct camogm_event ev;                      ///< event data
+};
+
+/**
+ * @struct event_queue
+ * @brief Event queue and its notification descriptor
+ */
+struct event_queue {
+	int fd;                                      ///< eventfd used to wake up consumer, -1 if not created
+	unsigned int enq_pos;                        ///< the position of the next event to put
+	unsigned int deq_pos;                        ///< the position of the next event to take, used by consumer only
+	unsigned int dropped;                        ///< the number of events dropped because the queue was full
+	struct event_slot slots[EVENT_QUEUE_SIZE];   ///< queue slots
+};
+
+static struct event_queue evq = {.fd = -1};
+
+/** Event names, in the order of #camogm_event_type */
+static const char *event_names[EVENT_TYPES] = {
+	[EVENT_SEGMENT]      = "segment",
+	[EVENT_OVERRUN]      = "overrun",
+	[EVENT_NO_SPACE]     = "no_space",
+	[EVENT_WRITER_ERROR] = "writer_error",
+	[EVENT_FLIGHT_DUMP]  = "flight_dump"
+};
+
+/**
+ * @brief Initialize event queue, should be called before any thread can raise events
+ * @return      eventfd descriptor which becomes readable when there are new events, or -1 in case of error
+ * (events are still queued in this case but the consumer is not notified)
+ */
+int events_init(void)
+{
+	for (unsigned int i = 0; i < EVENT_QUEUE_SIZE; i++)
+		evq.slots[i].seq = i;
+	evq.enq_pos = 0;
+	evq.deq_pos = 0;
+	evq.dropped = 0;
+	if (evq.fd < 0) {
+		evq.fd = eventfd(0, EFD_NONBLOCK);
+		if (evq.fd < 0)
+			D0(fprintf(debug_file, "Can not create event notification descriptor: %s\n", strerror(errno)));
+	}
+
+	return evq.fd;
+}
+
+/**
+ * @brief Return event notification descriptor
+ * @return      eventfd descriptor or -1 if it was not created
+ */
+int events_fd(void)
+{
+	return evq.fd;
+}
+
+/**
+ * @brief Raise an event. This function does not block and can be called from any thread.
+ * @param[in]   type    event type, one of #camogm_event_type
+ * @param[in]   port    sensor port or -1
+ * @param[in]   value   event specific value
+ * @param[in]   text    event specific text, can be NULL
+ * @return      None
+ */
+void camogm_event(int type, int port, int64_t value, const char *text)
+{
+	int diff;
+	unsigned int pos, seq;
+	uint64_t one = 1;
+	struct timeval tv;
+	struct event_slot *slot;
+
+	pos = __atomic_load_n(&evq.enq_pos, __ATOMIC_RELAXED);
+	while (true) {
+		slot = &evq.slots[pos & (EVENT_QUEUE_SIZE - 1)];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		diff = (int)(seq - pos);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&evq.enq_pos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			// the slot still holds an event consumer has not taken yet
+			__atomic_fetch_add(&evq.dropped, 1, __ATOMIC_RELAXED);
+			return;
+		} else {
+			pos = __atomic_load_n(&evq.enq_pos, __ATOMIC_RELAXED);
+		}
+	}
+
+	gettimeofday(&tv, NULL);
+	slot->ev.type = type;
+	slot->ev.port = port;
+	slot->ev.value = value;
+	slot->ev.time = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+	if (text != NULL) {
+		strncpy(slot->ev.text, text, ELPHEL_PATH_MAX - 1);
+		slot->ev.text[ELPHEL_PATH_MAX - 1] = '\0';
+	} else {
+		slot->ev.text[0] = '\0';
+	}
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+	if (evq.fd >= 0)
+		write(evq.fd, &one, sizeof(one));
+}
+
+/**
+ * @brief Take the next event from queue, called by control thread only
+ * @param[out]  ev   event taken from queue
+ * @return      True if an event was taken and false if the queue is empty
+ */
+bool events_get(struct camogm_event *ev)
+{
+	unsigned int pos = evq.deq_pos;
+	struct event_slot *slot = &evq.slots[pos & (EVENT_QUEUE_SIZE - 1)];
+
+	if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1)
+		return false;
+	*ev = slot->ev;
+	__atomic_store_n(&slot->seq, pos + EVENT_QUEUE_SIZE, __ATOMIC_RELEASE);
+	evq.deq_pos = pos + 1;
+
+	return true;
+}
+
+/**
+ * @brief Reset event notification, called by control thread before it takes events from queue
+ * @return      None
+ */
+void events_clear(void)
+{
+	uint64_t cntr;
+
+	if (evq.fd >= 0)
+		read(evq.fd, &cntr, sizeof(cntr));
+}
+
+/**
+ * @brief Return the number of events dropped since start
+ * @return      the number of dropped events
+ */
+unsigned int events_dropped(void)
+{
+	return __atomic_load_n(&evq.dropped, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Return event name used in reports
+ * @param[in]   type   event type, one of #camogm_event_type
+ * @return      event name
+ */
+const char *event_name(int type)
+{
+	if (type < 0 || type >= EVENT_TYPES)
+		return "unknown";
+	return event_names[type];
+}
@@ -0,0 +1,62 @@
+/** @file camogm_events.h
+ * @brief Recording events delivered to control socket subscribers
+ * @copyright Copyright (C) 2017 Elphel, Inc.
+ *
+ * @par <b>License</b>
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CAMOGM_EVENTS_H
+#define _CAMOGM_EVENTS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "camogm.h"
+
+/** @brief The number of slots in event queue, must be a power of 2 */
+#define EVENT_QUEUE_SIZE          64
+
+/**
+ * @enum camogm_event_type
+ * @brief Discrete events reported to subscribers
+ */
+enum camogm_event_type {
+	EVENT_SEGMENT,                               ///< file segment closed, text is the segment file name
+	EVENT_OVERRUN,                               ///< circbuf overrun, frames were lost; value is the number of overruns
+	EVENT_NO_SPACE,                              ///< no free space left on file system
+	EVENT_WRITER_ERROR,                          ///< write or finalization error; value is error code
+	EVENT_FLIGHT_DUMP,                           ///< flight recorder dump written, text is the file name; value is the number of records
+	EVENT_TYPES                                  ///< the number of event types
+};
+
+/**
+ * @struct camogm_event
+ * @brief One event
+ */
+struct camogm_event {
+	int type;                                    ///< event type, one of #camogm_event_type
+	int port;                                    ///< sensor port or -1 if the event is not related to a port
+	int64_t value;                               ///< event specific value
+	uint64_t time;                               ///< event time, microseconds since the Epoch
+	char text[ELPHEL_PATH_MAX];                  ///< event specific text, can be empty
+};
+
+int events_init(void);
+int events_fd(void);
+void camogm_event(int type, int port, int64_t value, const char *text);
+bool events_get(struct camogm_event *ev);
+void events_clear(void);
+unsigned int events_dropped(void);
+const char *event_name(int type);
+
+#endif /* _CAMOGM_EVENTS_H */
@@ -0,0 +1,236 @@
+/** @file camogm_finalize.c
+ * @brief Provides background finalization of closed file segments for @e camogm
+ * @copyright Copyright (C) 2017 Elphel, Inc.
+ *
+ * @par <b>License</b>
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** @brief This define is needed to use ftruncate64 and should be set before includes */
+#define _LARGEFILE64_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+
+#include "camogm_finalize.h"
+#include "camogm_events.h"
+#include "camogm_trace.h"
+
+/**
+ * @struct finalizer
+ * @brief Finalizer thread and its queue of closed segments
+ */
+struct finalizer {
+	pthread_t tid;                               ///< finalizer thread ID
+	bool running;                                ///< the thread is running and accepts jobs
+	pthread_mutex_t mutex;                       ///< protects queue and statistics
+	pthread_cond_t job_cond;                     ///< signaled when a new job is added to queue
+	pthread_cond_t done_cond;                    ///< signaled when a job is done
+	struct segment_job *head;                    ///< the first job in queue
+	struct segment_job *tail;                    ///< the last job in queue
+	struct finalizer_stat stat;                  ///< statistics
+};
+
+static struct finalizer fin = {
+		.mutex = PTHREAD_MUTEX_INITIALIZER,
+		.job_cond = PTHREAD_COND_INITIALIZER,
+		.done_cond = PTHREAD_COND_INITIALIZER
+};
+
+/**
+ * @brief Initialize segment job structure
+ * @param[out]  job    job structure to initialize
+ * @param[in]   path   segment file name
+ * @return      None
+ */
+void segment_job_init(struct segment_job *job, const char *path)
+{
+	memset(job, 0, sizeof(struct segment_job));
+	job->fd = -1;
+	if (path != NULL)
+		strncpy(job->path, path, ELPHEL_PATH_MAX - 1);
+}
+
+/** Release file space preallocated beyond the end of file, truncating to the current size does that */
+static void trim_file(struct segment_job *job)
+{
+	int fd = job->fd;
+	struct stat64 st;
+
+	if (fd < 0)
+		return;
+	if (fstat64(fd, &st) < 0 || ftruncate64(fd, st.st_size) < 0) {
+		D1(fprintf(debug_file, "Could not release preallocated space of %s: %s\n", job->path, strerror(errno)));
+	}
+}
+
+/**
+ * @brief Complete file segment: run format specific finalization and close all files.
+ * Format specific data is freed, the job structure itself is not. Subscribers are notified when
+ * the segment is complete or finalization fails.
+ * @param[in]   job         segment to finalize
+ * @param[in]   sync_data   flush file data to disk before closing files
+ * @return      0 if the segment was finalized successfully and negative error code otherwise
+ */
+int segment_job_run(struct segment_job *job, bool sync_data)
+{
+	int ret = 0;
+
+	TRACE_BEGIN("finalize", -1);
+	if (job->finish != NULL)
+		ret = job->finish(job);
+	if (job->trim)
+		trim_file(job);
+	if (job->fd >= 0) {
+		if (sync_data && fsync(job->fd) < 0 && errno != EINVAL && ret == 0)
+			ret = -CAMOGM_FRAME_FILE_ERR;
+		close(job->fd);
+		job->fd = -1;
+	}
+	if (job->kml_file != NULL) {
+		fclose(job->kml_file);
+		job->kml_file = NULL;
+	}
+	free(job->data);
+	job->data = NULL;
+
+	if (ret)
+		camogm_event(EVENT_WRITER_ERROR, -1, ret, job->path);
+	else if (job->path[0] != '\0')
+		camogm_event(EVENT_SEGMENT, -1, 0, job->path);
+	TRACE_END("finalize", -1);
+
+	return ret;
+}
+
+/** Finalizer thread function, takes segments from queue one by one */
+static void *finalizer_thread(void *arg)
+{
+	int ret;
+	struct segment_job *job;
+
+	trace_thread_name("finalizer");
+	while (true) {
+		pthread_mutex_lock(&fin.mutex);
+		while (fin.head == NULL)
+			pthread_cond_wait(&fin.job_cond, &fin.mutex);
+		job = fin.head;
+		fin.head = job->next;
+		if (fin.head == NULL)
+			fin.tail = NULL;
+		pthread_mutex_unlock(&fin.mutex);
+
+		ret = segment_job_run(job, true);
+		if (ret) {
+			D0(fprintf(debug_file, "Error %d while finalizing %s\n", ret, job->path));
+		} else {
+			D3(fprintf(debug_file, "Segment %s finalized\n", job->path));
+		}
+		free(job);
+
+		pthread_mutex_lock(&fin.mutex);
+		fin.stat.pending--;
+		fin.stat.done++;
+		if (ret) {
+			fin.stat.errors++;
+			fin.stat.last_error = ret;
+		}
+		pthread_cond_broadcast(&fin.done_cond);
+		pthread_mutex_unlock(&fin.mutex);
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Start finalizer thread
+ * @return      0 if the thread was started and -1 otherwise, segments are finalized synchronously in the latter case
+ */
+int finalizer_start(void)
+{
+	if (fin.running)
+		return 0;
+	if (pthread_create(&fin.tid, NULL, finalizer_thread, NULL) != 0 ||
+			pthread_detach(fin.tid) != 0) {
+		D0(fprintf(debug_file, "%s:line %d: Can not start finalizer thread, segments will be closed synchronously\n", __FILE__, __LINE__));
+		return -1;
+	}
+	fin.running = true;
+
+	return 0;
+}
+
+/**
+ * @brief Add segment to finalizer queue. The job should be allocated with malloc, it is freed when done.
+ * If finalizer thread is not running, the segment is finalized immediately.
+ * @param[in]   job   segment to finalize
+ * @return      0 if the segment was queued and the result of finalization otherwise
+ */
+int finalizer_submit(struct segment_job *job)
+{
+	int ret = 0;
+
+	job->next = NULL;
+	pthread_mutex_lock(&fin.mutex);
+	if (fin.running) {
+		if (fin.tail != NULL)
+			fin.tail->next = job;
+		else
+			fin.head = job;
+		fin.tail = job;
+		fin.stat.pending++;
+		pthread_cond_signal(&fin.job_cond);
+		pthread_mutex_unlock(&fin.mutex);
+	} else {
+		pthread_mutex_unlock(&fin.mutex);
+		ret = segment_job_run(job, false);
+		free(job);
+		pthread_mutex_lock(&fin.mutex);
+		fin.stat.done++;
+		if (ret) {
+			fin.stat.errors++;
+			fin.stat.last_error = ret;
+		}
+		pthread_mutex_unlock(&fin.mutex);
+	}
+
+	return ret;
+}
+
+/**
+ * @brief Wait until all queued segments are finalized
+ * @return      None
+ */
+void finalizer_drain(void)
+{
+	pthread_mutex_lock(&fin.mutex);
+	while (fin.stat.pending > 0)
+		pthread_cond_wait(&fin.done_cond, &fin.mutex);
+	pthread_mutex_unlock(&fin.mutex);
+}
+
+/**
+ * @brief Get a copy of finalizer statistics
+ * @param[out]  stat   statistics
+ * @return      None
+ */
+void finalizer_get_stat(struct finalizer_stat *stat)
+{
+	pthread_mutex_lock(&fin.mutex);
+	*stat = fin.stat;
+	pthread_mutex_unlock(&fin.mutex);
+}
@@ -0,0 +1,59 @@
+/** @file camogm_finalize.h
+ * @brief Provides background finalization of closed file segments for @e camogm
+ * @copyright Copyright (C) 2017 Elphel, Inc.
+ *
+ * @par <b>License</b>
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CAMOGM_FINALIZE_H
+#define _CAMOGM_FINALIZE_H
+
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "camogm.h"
+
+/**
+ * @struct segment_job
+ * @brief Everything needed to complete a file segment after recording has switched to the next one.
+ * Format handlers move their open files and buffers here instead of closing them.
+ */
+struct segment_job {
+	char path[ELPHEL_PATH_MAX];                  ///< segment file name, used in log messages
+	int fd;                                      ///< file descriptor to close, -1 if not used
+	FILE *kml_file;                              ///< KML stream to close, NULL if not used
+	bool trim;                                   ///< release space preallocated beyond the end of file
+	int (*finish)(struct segment_job *job);      ///< format specific finalization (i.e. header write), called before files are closed
+	void *data;                                  ///< format specific data, freed when the job is done
+	struct segment_job *next;                    ///< next job in queue
+};
+
+/**
+ * @struct finalizer_stat
+ * @brief Finalizer statistics reported in status
+ */
+struct finalizer_stat {
+	unsigned int pending;                        ///< the number of segments waiting in queue or being finalized
+	unsigned int done;                           ///< the number of segments finalized
+	unsigned int errors;                         ///< the number of segments finalized with errors
+	int last_error;                              ///< last error code returned by format specific finalization
+};
+
+void segment_job_init(struct segment_job *job, const char *path);
+int segment_job_run(struct segment_job *job, bool sync_data);
+int finalizer_start(void);
+int finalizer_submit(struct segment_job *job);
+void finalizer_drain(void);
+void finalizer_get_stat(struct finalizer_stat *stat);
+
+#endif /* _CAMOGM_FINALIZE_H */
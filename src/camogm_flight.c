@@ -0,0 +1,190 @@
+/** @file camogm_flight.c
+ * @brief Flight recorder of per frame events for overrun and error post-mortems
+ * @copyright Copyright (C) 2017 Elphel, Inc.
+ *
+ * @par <b>License</b>
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Capture thread adds a record for each frame and error to a fixed ring. On restart or overrun it copies
+ * the ring to a snapshot buffer, which is written to dump file by control thread, so the capture thread
+ * does not wait for file I/O. Dumps requested by command are copied by control thread while capture
+ * thread keeps adding records; the records overwritten during copying are skipped.
+ * Each automatic dump is written to its own file, the dump file name is appended with the reason and
+ * sequence number, so that repeated restarts do not overwrite the first dump.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/uio.h>
+
+#include "camogm_flight.h"
+#include "camogm_events.h"
+
+/**
+ * @struct flight_snapshot
+ * @brief Copy of flight recorder ring taken by capture thread and waiting to be written
+ */
+struct flight_snapshot {
+	int pending;                                 ///< snapshot is taken and not written yet
+	int reason;                                  ///< dump reason, one of #flight_trigger
+	uint32_t head;                               ///< ring head at the moment the snapshot was taken
+	uint64_t time;                               ///< the time the snapshot was taken, in microseconds
+	uint64_t last;                               ///< the time of the last automatic snapshot, used by capture thread only
+	struct flight_rec recs[FLIGHT_RECORDS];      ///< records
+};
+
+struct flight_ring flight;
+static struct flight_snapshot snap;
+/** Dump file name, used by control thread only */
+static char flight_path[ELPHEL_PATH_MAX] = FLIGHT_DEFAULT_PATH;
+/** The number of automatic dumps written to files named after #flight_path, used by control thread only */
+static int flight_seq;
+
+static const char *event_names[FLIGHT_EVENTS] = {
+	[FLIGHT_FRAME]   = "frame",
+	[FLIGHT_ERROR]   = "error",
+	[FLIGHT_OVERRUN] = "overrun"
+};
+
+static const char *sched_names[SCHED_REASONS] = {
+	[SCHED_FIRST]     = "first",
+	[SCHED_GROUP]     = "group",
+	[SCHED_TIMESTAMP] = "timestamp",
+	[SCHED_FREE]      = "free",
+	[SCHED_BROKEN]    = "broken"
+};
+
+static const char *trigger_names[FLIGHT_TRIGGERS] = {
+	[FLIGHT_TRIGGER_RESTART] = "restart",
+	[FLIGHT_TRIGGER_OVERRUN] = "overrun",
+	[FLIGHT_TRIGGER_COMMAND] = "command"
+};
+
+/**
+ * Write records to dump file, the oldest record first. Times are relative to the moment
+ * the dump was requested.
+ */
+static int flight_write(const char *path, const struct flight_rec *recs, uint32_t head, uint32_t num, int reason, uint64_t time)
+{
+	FILE *f;
+	const struct flight_rec *rec;
+
+	if ((f = fopen(path, "w")) == NULL) {
+		D0(fprintf(debug_file, "Can not open flight recorder dump file %s: %s\n", path, strerror(errno)));
+		return -1;
+	}
+	fprintf(f, "# camogm flight recorder, reason: %s, records: %u\n", trigger_names[reason], num);
+	fprintf(f, "# time_us\tevent\tport\tcirbuf_rp\tfree\tsize\tlatency_us\tqueue\tsched\tresult\n");
+	for (uint32_t i = head - num; i != head; i++) {
+		rec = &recs[i & (FLIGHT_RECORDS - 1)];
+		fprintf(f, "%lld\t%s\t%u\t0x%08x\t%u\t%u\t%u\t%u\t%s\t%d\n",
+				(long long)rec->time - (long long)time,
+				(rec->type < FLIGHT_EVENTS) ? event_names[rec->type] : "unknown",
+				rec->port, rec->cirbuf_rp, rec->free, rec->size, rec->latency, rec->queue,
+				(rec->sched < SCHED_REASONS) ? sched_names[rec->sched] : "unknown",
+				rec->result);
+	}
+	fclose(f);
+	D1(fprintf(debug_file, "Flight recorder dump (%s) written to %s\n", trigger_names[reason], path));
+
+	return 0;
+}
+
+/**
+ * @brief Take a snapshot of flight recorder to be written by control thread, called by capture thread on
+ * restart or overrun. The request is ignored if the previous snapshot has not been written yet or it was
+ * taken less than #FLIGHT_MIN_INTERVAL ago, so that repeated restarts do not produce a dump per frame.
+ * @param[in]   reason   dump reason, one of #flight_trigger
+ * @return      None
+ */
+void flight_trigger(int reason)
+{
+	uint64_t now = lat_time();
+
+	if (__atomic_load_n(&snap.pending, __ATOMIC_ACQUIRE) || (snap.last != 0 && now - snap.last < FLIGHT_MIN_INTERVAL))
+		return;
+	memcpy(snap.recs, flight.recs, sizeof(snap.recs));
+	snap.head = flight.head;
+	snap.reason = reason;
+	snap.time = now;
+	snap.last = now;
+	__atomic_store_n(&snap.pending, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Write the snapshot taken by capture thread to dump file, called by control thread
+ * @return      None
+ */
+void flight_write_pending(void)
+{
+	int len;
+	uint32_t num;
+	char path[ELPHEL_PATH_MAX];
+
+	if (!__atomic_load_n(&snap.pending, __ATOMIC_ACQUIRE))
+		return;
+	if (flight_seq >= FLIGHT_MAX_DUMPS) {
+		D1(fprintf(debug_file, "Flight recorder dump (%s) skipped, %d dumps are already written\n",
+				trigger_names[snap.reason], flight_seq));
+	} else {
+		len = snprintf(path, ELPHEL_PATH_MAX, "%s.%s.%d", flight_path, trigger_names[snap.reason], flight_seq);
+		num = (snap.head < FLIGHT_RECORDS) ? snap.head : FLIGHT_RECORDS;
+		if (len >= ELPHEL_PATH_MAX) {
+			D0(fprintf(debug_file, "Flight recorder dump file name is too long: %s\n", flight_path));
+		} else if (flight_write(path, snap.recs, snap.head, num, snap.reason, snap.time) == 0) {
+			camogm_event(EVENT_FLIGHT_DUMP, -1, num, path);
+		}
+		flight_seq++;
+	}
+	__atomic_store_n(&snap.pending, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Write flight recorder to dump file now, called by control thread
+ * @param[in]   path   dump file name, the following automatic dumps are written next to it and numbered
+ * from zero again; current file name is used if it is NULL or empty
+ * @return      0 if the dump was written and -1 otherwise
+ */
+int flight_dump(const char *path)
+{
+	int ret;
+	uint32_t head, tail, num;
+	struct flight_rec *recs;
+
+	if (path != NULL && path[0] != '\0') {
+		strncpy(flight_path, path, ELPHEL_PATH_MAX - 1);
+		flight_path[ELPHEL_PATH_MAX - 1] = '\0';
+		flight_seq = 0;
+	}
+	if ((recs = malloc(sizeof(flight.recs))) == NULL)
+		return -1;
+	head = __atomic_load_n(&flight.head, __ATOMIC_ACQUIRE);
+	memcpy(recs, flight.recs, sizeof(flight.recs));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	tail = __atomic_load_n(&flight.head, __ATOMIC_RELAXED);
+
+	// skip the records overwritten while copying, and one more as capture thread can start
+	// the next record before its head update is visible
+	num = (head < FLIGHT_RECORDS) ? head : FLIGHT_RECORDS;
+	if (tail - head + 2 >= FLIGHT_RECORDS)
+		num = 0;
+	else if (num > FLIGHT_RECORDS - 2 - (tail - head))
+		num = FLIGHT_RECORDS - 2 - (tail - head);
+	ret = flight_write(flight_path, recs, head, num, FLIGHT_TRIGGER_COMMAND, lat_time());
+	if (ret == 0)
+		camogm_event(EVENT_FLIGHT_DUMP, -1, num, flight_path);
+	free(recs);
+
+	return ret;
+}
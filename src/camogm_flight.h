@@ -0,0 +1,121 @@
+/** @file camogm_flight.h
+ * @brief Flight recorder of per frame events for overrun and error post-mortems
+ * @copyright Copyright (C) 2017 Elphel, Inc.
+ *
+ * @par <b>License</b>
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CAMOGM_FLIGHT_H
+#define _CAMOGM_FLIGHT_H
+
+#include <stdint.h>
+
+/** @brief The number of records kept by flight recorder, must be a power of 2 */
+#define FLIGHT_RECORDS            1024
+/** @brief Default flight recorder dump file */
+#define FLIGHT_DEFAULT_PATH       "/var/tmp/camogm_flight.txt"
+/** @brief Minimal interval between automatic dumps, in microseconds */
+#define FLIGHT_MIN_INTERVAL       1000000
+/** @brief The maximal number of automatic dump files, the following dumps are skipped */
+#define FLIGHT_MAX_DUMPS          100
+
+/**
+ * @enum flight_event
+ * @brief Flight recorder event types
+ */
+enum flight_event {
+	FLIGHT_FRAME,                                ///< frame recorded
+	FLIGHT_ERROR,                                ///< sendImageFrame() error, result is the error code
+	FLIGHT_OVERRUN,                              ///< circbuf read pointer was lost and moved to the latest frames
+	FLIGHT_EVENTS                                ///< the number of event types
+};
+
+/**
+ * @enum flight_sched
+ * @brief The reason sensor port was selected for the next frame
+ */
+enum flight_sched {
+	SCHED_FIRST,                                 ///< the first active port
+	SCHED_GROUP,                                 ///< the next port of frame group
+	SCHED_TIMESTAMP,                             ///< the port with the oldest frame in multitrack mode
+	SCHED_FREE,                                  ///< the port with the least free space in circbuf
+	SCHED_BROKEN,                                ///< the port with invalid read pointer, to let it recover
+	SCHED_REASONS                                ///< the number of reasons
+};
+
+/**
+ * @enum flight_trigger
+ * @brief The reasons of flight recorder dumps
+ */
+enum flight_trigger {
+	FLIGHT_TRIGGER_RESTART,                      ///< recording restarted after broken or changed frame
+	FLIGHT_TRIGGER_OVERRUN,                      ///< circbuf overrun
+	FLIGHT_TRIGGER_COMMAND,                      ///< flight_dump command
+	FLIGHT_TRIGGERS                              ///< the number of triggers
+};
+
+/**
+ * @struct flight_rec
+ * @brief One flight recorder record
+ */
+struct flight_rec {
+	uint64_t time;                               ///< monotonic time of the event, in microseconds
+	uint32_t cirbuf_rp;                          ///< circbuf read pointer
+	uint32_t free;                               ///< free space in circbuf, in bytes
+	uint32_t size;                               ///< frame size, in bytes
+	uint32_t latency;                            ///< time spent in format write function (for raw device includes waiting for writer thread), in microseconds
+	uint8_t type;                                ///< event type, one of #flight_event
+	uint8_t port;                                ///< sensor port
+	uint8_t queue;                               ///< the number of frames waiting for raw device writer thread
+	uint8_t sched;                               ///< the reason the port was selected, one of #flight_sched
+	int8_t result;                               ///< sendImageFrame() result
+};
+
+/**
+ * @struct flight_ring
+ * @brief Flight recorder ring, written by capture thread only
+ */
+struct flight_ring {
+	uint32_t head;                               ///< the index of the next record
+	struct flight_rec recs[FLIGHT_RECORDS];      ///< records
+};
+
+extern struct flight_ring flight;
+
+/**
+ * @brief Add a record to flight recorder, called by capture thread only. The cost is a few stores, older
+ * records are overwritten.
+ */
+static inline void flight_record(int type, int port, uint64_t time, uint32_t cirbuf_rp, uint32_t free,
+		uint32_t size, uint32_t latency, int queue, int sched, int result)
+{
+	struct flight_rec *rec = &flight.recs[flight.head & (FLIGHT_RECORDS - 1)];
+
+	rec->time = time;
+	rec->cirbuf_rp = cirbuf_rp;
+	rec->free = free;
+	rec->size = size;
+	rec->latency = latency;
+	rec->type = type;
+	rec->port = port;
+	rec->queue = queue;
+	rec->sched = sched;
+	rec->result = result;
+	__atomic_store_n(&flight.head, flight.head + 1, __ATOMIC_RELEASE);
+}
+
+void flight_trigger(int reason);
+int flight_dump(const char *path);
+void flight_write_pending(void);
+
+#endif /* _CAMOGM_FLIGHT_H */
@@ -0,0 +1,540 @@
+/** @file camogm_fmp4.c
+ * @brief Provides writing to fragmented MP4 (ISO BMFF) files for @e camogm
+ * @copyright Copyright (C) 2017 Elphel, Inc.
+ *
+ * @par <b>License</b>
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The file consists of an initialization segment (ftyp and moov boxes without samples) followed by
+ * a sequence of moof/mdat fragments. The space for moof box is reserved when a fragment is opened and
+ * the box is filled in when the fragment is closed. Until then the reserved space is a 'free' box and
+ * the mdat box has zero size which means that it extends to the end of file, thus all closed fragments
+ * can be read while recording is still in progress. Sample data offsets are relative to moof box
+ * (default-base-is-moof), so there are no absolute file offsets and the file size is not limited.
+ */
+
+/** @brief This define is needed to use pwrite64 and should be set before includes */
+#define _LARGEFILE64_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "camogm_fmp4.h"
+
+/** @brief The size of buffer for initialization segment */
+#define FMP4_INIT_SIZE            1024
+/** @brief The size of box header */
+#define BOX_HDR_SIZE              8
+/** @brief The size of mdat box header */
+#define MDAT_HDR_SIZE             8
+/** @brief The size of one trun box entry: sample duration and sample size */
+#define TRUN_ENTRY_SIZE           8
+/** @brief The size of moof box without trun entries: moof(8) + mfhd(16) + traf(8) + tfhd(16) + tfdt(20) + trun(20) */
+#define MOOF_BASE_SIZE            88
+/** @brief The space reserved for moof box and a 'free' box filling unused trun entries */
+#define MOOF_RESERVED_SIZE(n)     (MOOF_BASE_SIZE + TRUN_ENTRY_SIZE * (n) + BOX_HDR_SIZE)
+/** @brief Close fragment if its data is about to exceed this size, mdat uses 32 bit size field */
+#define MDAT_MAX_SIZE             0xf0000000ULL
+/** @brief Track ID of the video track */
+#define FMP4_TRACK_ID             1
+/** @brief tfhd flag: default-base-is-moof */
+#define TFHD_DEFAULT_BASE_IS_MOOF 0x020000
+/** @brief trun flags: data-offset-present, sample-duration-present, sample-size-present */
+#define TRUN_FLAGS                0x000301
+
+/**
+ * @struct fmp4_sample
+ * @brief Sample table entry of the current fragment
+ */
+struct fmp4_sample {
+	uint32_t size;                               ///< frame size in bytes
+	uint64_t time;                               ///< frame time stamp relative to file start, in microseconds
+};
+
+/**
+ * @struct fmp4_buff
+ * @brief Buffer used to build boxes
+ */
+struct fmp4_buff {
+	unsigned char *data;                         ///< pointer to buffer
+	size_t pos;                                  ///< current write position
+};
+
+/**
+ * @struct fmp4_writer
+ * @brief Fragmented MP4 writer state
+ */
+struct fmp4_writer {
+	struct fmp4_sample *samples;                 ///< sample table of the current fragment
+	unsigned char *moof;                         ///< buffer for moof box
+	int frag_frames;                             ///< the number of frames the current fragment has space for
+	int count;                                   ///< the number of frames in the current fragment
+	uint32_t seq;                                ///< sequence number of the current fragment
+	uint64_t frag_offset;                        ///< file offset of the current fragment
+	uint64_t file_pos;                           ///< current file write position
+	uint64_t data_len;                           ///< the size of frame data in the current fragment
+	uint64_t start_time;                         ///< time stamp of the first frame in file, in microseconds
+	uint32_t last_duration;                      ///< the duration of the last sample in previous fragment
+};
+
+static struct fmp4_writer fmp4;
+
+static void put_be16(struct fmp4_buff *b, uint16_t val)
+{
+	b->data[b->pos++] = (val >> 8) & 0xff;
+	b->data[b->pos++] = val & 0xff;
+}
+
+static void put_be32(struct fmp4_buff *b, uint32_t val)
+{
+	b->data[b->pos++] = (val >> 24) & 0xff;
+	b->data[b->pos++] = (val >> 16) & 0xff;
+	b->data[b->pos++] = (val >> 8) & 0xff;
+	b->data[b->pos++] = val & 0xff;
+}
+
+static void put_be64(struct fmp4_buff *b, uint64_t val)
+{
+	put_be32(b, val >> 32);
+	put_be32(b, val & 0xffffffff);
+}
+
+static void put_bytes(struct fmp4_buff *b, const void *data, size_t len)
+{
+	memcpy(&b->data[b->pos], data, len);
+	b->pos += len;
+}
+
+static void put_zeros(struct fmp4_buff *b, size_t len)
+{
+	memset(&b->data[b->pos], 0, len);
+	b->pos += len;
+}
+
+/** Start a new box, return its offset which is needed to close the box */
+static size_t box_start(struct fmp4_buff *b, const char *type)
+{
+	size_t start = b->pos;
+
+	put_be32(b, 0);
+	put_bytes(b, type, 4);
+
+	return start;
+}
+
+/** Start a new full box with version and flags */
+static size_t full_box_start(struct fmp4_buff *b, const char *type, uint8_t version, uint32_t flags)
+{
+	size_t start = box_start(b, type);
+
+	put_be32(b, (version << 24) | (flags & 0xffffff));
+
+	return start;
+}
+
+/** Close the box started at @e start offset by filling in its size */
+static void box_end(struct fmp4_buff *b, size_t start)
+{
+	size_t pos = b->pos;
+
+	b->pos = start;
+	put_be32(b, pos - start);
+	b->pos = pos;
+}
+
+/** Unity transformation matrix used in mvhd and tkhd boxes */
+static void put_matrix(struct fmp4_buff *b)
+{
+	put_be32(b, 0x00010000);
+	put_be32(b, 0);
+	put_be32(b, 0);
+	put_be32(b, 0);
+	put_be32(b, 0x00010000);
+	put_be32(b, 0);
+	put_be32(b, 0);
+	put_be32(b, 0);
+	put_be32(b, 0x40000000);
+}
+
+/** Build initialization segment: ftyp and moov boxes */
+static void build_init_segment(camogm_state *state, struct fmp4_buff *b)
+{
+	size_t moov, trak, mdia, minf, dinf, dref, stbl, stsd, entry, mvex, box;
+	uint32_t timescale = (uint32_t)(1000000 / state->timescale);
+	char compressor[32] = {0};
+
+	box = box_start(b, "ftyp");
+	put_bytes(b, "iso6", 4);
+	put_be32(b, 0);
+	put_bytes(b, "iso6", 4);
+	put_bytes(b, "isom", 4);
+	put_bytes(b, "mp41", 4);
+	box_end(b, box);
+
+	moov = box_start(b, "moov");
+
+	box = full_box_start(b, "mvhd", 0, 0);
+	put_be32(b, 0);                              // creation time
+	put_be32(b, 0);                              // modification time
+	put_be32(b, 1000);                           // movie timescale
+	put_be32(b, 0);                              // duration, unknown for fragmented file
+	put_be32(b, 0x00010000);                     // rate
+	put_be16(b, 0x0100);                         // volume
+	put_zeros(b, 10);                            // reserved
+	put_matrix(b);
+	put_zeros(b, 24);                            // pre defined
+	put_be32(b, FMP4_TRACK_ID + 1);              // next track ID
+	box_end(b, box);
+
+	trak = box_start(b, "trak");
+	box = full_box_start(b, "tkhd", 0, 0x000003); // track enabled and used in movie
+	put_be32(b, 0);                              // creation time
+	put_be32(b, 0);                              // modification time
+	put_be32(b, FMP4_TRACK_ID);
+	put_be32(b, 0);                              // reserved
+	put_be32(b, 0);                              // duration
+	put_zeros(b, 8);                             // reserved
+	put_be16(b, 0);                              // layer
+	put_be16(b, 0);                              // alternate group
+	put_be16(b, 0);                              // volume
+	put_be16(b, 0);                              // reserved
+	put_matrix(b);
+	put_be32(b, state->width << 16);
+	put_be32(b, state->height << 16);
+	box_end(b, box);
+
+	mdia = box_start(b, "mdia");
+	box = full_box_start(b, "mdhd", 0, 0);
+	put_be32(b, 0);                              // creation time
+	put_be32(b, 0);                              // modification time
+	put_be32(b, timescale);
+	put_be32(b, 0);                              // duration
+	put_be16(b, 0x55c4);                         // language, 'und'
+	put_be16(b, 0);                              // pre defined
+	box_end(b, box);
+
+	box = full_box_start(b, "hdlr", 0, 0);
+	put_be32(b, 0);                              // pre defined
+	put_bytes(b, "vide", 4);
+	put_zeros(b, 12);                            // reserved
+	put_bytes(b, "VideoHandler", 13);
+	box_end(b, box);
+
+	minf = box_start(b, "minf");
+	box = full_box_start(b, "vmhd", 0, 0x000001);
+	put_zeros(b, 8);                             // graphics mode and opcolor
+	box_end(b, box);
+
+	dinf = box_start(b, "dinf");
+	dref = full_box_start(b, "dref", 0, 0);
+	put_be32(b, 1);                              // entry count
+	box = full_box_start(b, "url ", 0, 0x000001); // data is in the same file
+	box_end(b, box);
+	box_end(b, dref);
+	box_end(b, dinf);
+
+	stbl = box_start(b, "stbl");
+	stsd = full_box_start(b, "stsd", 0, 0);
+	put_be32(b, 1);                              // entry count
+	entry = box_start(b, "jpeg");
+	put_zeros(b, 6);                             // reserved
+	put_be16(b, 1);                              // data reference index
+	put_zeros(b, 16);                            // pre defined and reserved
+	put_be16(b, state->width);
+	put_be16(b, state->height);
+	put_be32(b, 0x00480000);                     // horizontal resolution, 72 dpi
+	put_be32(b, 0x00480000);                     // vertical resolution, 72 dpi
+	put_be32(b, 0);                              // reserved
+	put_be16(b, 1);                              // frame count
+	compressor[0] = strlen("Photo - JPEG");
+	memcpy(&compressor[1], "Photo - JPEG", compressor[0]);
+	put_bytes(b, compressor, sizeof(compressor));
+	put_be16(b, 0x0018);                         // depth
+	put_be16(b, 0xffff);                         // pre defined
+	box_end(b, entry);
+	box_end(b, stsd);
+	// empty sample tables, all samples are in fragments
+	box = full_box_start(b, "stts", 0, 0);
+	put_be32(b, 0);
+	box_end(b, box);
+	box = full_box_start(b, "stsc", 0, 0);
+	put_be32(b, 0);
+	box_end(b, box);
+	box = full_box_start(b, "stsz", 0, 0);
+	put_be32(b, 0);
+	put_be32(b, 0);
+	box_end(b, box);
+	box = full_box_start(b, "stco", 0, 0);
+	put_be32(b, 0);
+	box_end(b, box);
+	box_end(b, stbl);
+	box_end(b, minf);
+	box_end(b, mdia);
+	box_end(b, trak);
+
+	mvex = box_start(b, "mvex");
+	box = full_box_start(b, "trex", 0, 0);
+	put_be32(b, FMP4_TRACK_ID);
+	put_be32(b, 1);                              // default sample description index
+	put_be32(b, 0);                              // default sample duration
+	put_be32(b, 0);                              // default sample size
+	put_be32(b, 0);                              // default sample flags, all samples are sync samples
+	box_end(b, box);
+	box_end(b, mvex);
+
+	box_end(b, moov);
+}
+
+/** Build moof box for the current fragment followed by a 'free' box filling the rest of reserved space */
+static void build_moof(struct fmp4_buff *b, uint64_t end_time)
+{
+	size_t moof, traf, box;
+	uint32_t duration;
+	size_t reserved = MOOF_RESERVED_SIZE(fmp4.frag_frames);
+
+	moof = box_start(b, "moof");
+	box = full_box_start(b, "mfhd", 0, 0);
+	put_be32(b, fmp4.seq);
+	box_end(b, box);
+
+	traf = box_start(b, "traf");
+	box = full_box_start(b, "tfhd", 0, TFHD_DEFAULT_BASE_IS_MOOF);
+	put_be32(b, FMP4_TRACK_ID);
+	box_end(b, box);
+	box = full_box_start(b, "tfdt", 1, 0);
+	put_be64(b, fmp4.samples[0].time);
+	box_end(b, box);
+	box = full_box_start(b, "trun", 0, TRUN_FLAGS);
+	put_be32(b, fmp4.count);
+	put_be32(b, reserved + MDAT_HDR_SIZE);       // data offset relative to moof
+	for (int i = 0; i < fmp4.count; i++) {
+		if (i < fmp4.count - 1)
+			duration = fmp4.samples[i + 1].time - fmp4.samples[i].time;
+		else if (end_time > fmp4.samples[i].time)
+			duration = end_time - fmp4.samples[i].time;
+		else
+			duration = fmp4.last_duration;
+		fmp4.last_duration = duration;
+		put_be32(b, duration);
+		put_be32(b, fmp4.samples[i].size);
+	}
+	box_end(b, box);
+	box_end(b, traf);
+	box_end(b, moof);
+
+	// fill unused space
+	box = box_start(b, "free");
+	put_zeros(b, reserved - b->pos);
+	box_end(b, box);
+}
+
+/**
+ * @brief Fill in moof and mdat boxes of the current fragment. mdat size is written first,
+ * so the file remains valid if the recording is interrupted in between.
+ * @param[in]   state      a pointer to a structure containing current state
+ * @param[in]   end_time   the time stamp of the frame following the fragment or 0 if it is unknown
+ * @return      0 if the fragment was written successfully and negative error code otherwise
+ */
+static int close_fragment(camogm_state *state, uint64_t end_time)
+{
+	unsigned char mdat_hdr[MDAT_HDR_SIZE];
+	size_t reserved = MOOF_RESERVED_SIZE(fmp4.frag_frames);
+	struct fmp4_buff b = {.data = mdat_hdr, .pos = 0};
+
+	if (fmp4.count == 0)
+		return 0;
+
+	put_be32(&b, MDAT_HDR_SIZE + fmp4.data_len);
+	put_bytes(&b, "mdat", 4);
+	if (pwrite64(state->ivf, mdat_hdr, MDAT_HDR_SIZE, fmp4.frag_offset + reserved) != MDAT_HDR_SIZE) {
+		D0(fprintf(debug_file, "Error writing mdat header: %s\n", strerror(errno)));
+		return -CAMOGM_FRAME_FILE_ERR;
+	}
+
+	b.data = fmp4.moof;
+	b.pos = 0;
+	build_moof(&b, end_time);
+	if (pwrite64(state->ivf, fmp4.moof, reserved, fmp4.frag_offset) != reserved) {
+		D0(fprintf(debug_file, "Error writing moof box: %s\n", strerror(errno)));
+		return -CAMOGM_FRAME_FILE_ERR;
+	}
+	D4(fprintf(debug_file, "Fragment %u closed: %d frames, %llu bytes of data\n", fmp4.seq, fmp4.count, fmp4.data_len));
+
+	fmp4.seq++;
+	fmp4.count = 0;
+	fmp4.data_len = 0;
+
+	return 0;
+}
+
+/**
+ * @brief Called when format is changed to fragmented MP4. Allocate memory for sample table and moof box,
+ * this memory does not depend on segment length.
+ * @param[in]   state   a pointer to a structure containing current state
+ * @return      0 if initialization was successful and negative error code otherwise
+ */
+int camogm_init_fmp4(camogm_state *state)
+{
+	if (fmp4.samples == NULL) {
+		fmp4.samples = malloc(FMP4_MAX_FRAG_FRAMES * sizeof(struct fmp4_sample));
+		fmp4.moof = malloc(MOOF_RESERVED_SIZE(FMP4_MAX_FRAG_FRAMES));
+		if (fmp4.samples == NULL || fmp4.moof == NULL) {
+			D0(fprintf(debug_file, "Could not allocate memory for fragmented MP4 sample table\n"));
+			camogm_free_fmp4();
+			return -CAMOGM_FRAME_MALLOC;
+		}
+	}
+
+	return 0;
+}
+
+/** Free memory allocated for sample table */
+void camogm_free_fmp4(void)
+{
+	free(fmp4.samples);
+	free(fmp4.moof);
+	fmp4.samples = NULL;
+	fmp4.moof = NULL;
+}
+
+/**
+ * @brief Start fragmented MP4 recording: open a new file and write initialization segment
+ * @param[in]   state   a pointer to a structure containing current state
+ * @return      0 if recording started successfully and negative error code otherwise
+ */
+int camogm_start_fmp4(camogm_state *state)
+{
+	unsigned char init[FMP4_INIT_SIZE];
+	struct fmp4_buff b = {.data = init, .pos = 0};
+
+	if (fmp4.samples == NULL)
+		return -CAMOGM_FRAME_MALLOC;
+
+	sprintf(state->path, "%s%010ld_%06ld.mp4", state->path_prefix, state->frame_params[state->port_num].timestamp_sec, state->frame_params[state->port_num].timestamp_usec);
+	if (((state->ivf = open(state->path, O_RDWR | O_CREAT | O_TRUNC, 0777))) < 0) {
+		D0(fprintf(debug_file, "Error opening %s for writing, returned %d, errno=%d\n", state->path, state->ivf, errno));
+		return -CAMOGM_FRAME_FILE_ERR;
+	}
+	build_init_segment(state, &b);
+	if (write(state->ivf, init, b.pos) != b.pos) {
+		D0(fprintf(debug_file, "Error writing initialization segment to %s: %s\n", state->path, strerror(errno)));
+		close(state->ivf);
+		state->ivf = -1;
+		return -CAMOGM_FRAME_FILE_ERR;
+	}
+	fmp4.file_pos = b.pos;
+	fmp4.seq = 1;
+	fmp4.count = 0;
+	fmp4.data_len = 0;
+	fmp4.last_duration = state->frame_period[state->port_num];
+
+	return 0;
+}
+
+/**
+ * @brief Write a frame to file. A new fragment is opened when the current one reaches its
+ * frame or duration limit.
+ * @param[in]   state   a pointer to a structure containing current state
+ * @return      0 if frame was saved successfully and negative error code otherwise
+ */
+int camogm_frame_fmp4(camogm_state *state)
+{
+	int i, j;
+	int ret;
+	int port = state->port_num;
+	ssize_t iovlen, l;
+	uint64_t ts;
+	struct iovec chunks_iovec[FILE_CHUNKS_NUM + 1];
+	unsigned char frag_hdr[MOOF_RESERVED_SIZE(FMP4_MAX_FRAG_FRAMES) + MDAT_HDR_SIZE];
+	struct fmp4_buff b = {.data = frag_hdr, .pos = 0};
+	size_t box;
+
+	ts = (uint64_t)state->this_frame_params[port].timestamp_sec * 1000000 + state->this_frame_params[port].timestamp_usec;
+	if (state->frameno == 0)
+		fmp4.start_time = ts;
+	ts = (ts > fmp4.start_time) ? ts - fmp4.start_time : 0;
+
+	l = 0;
+	for (i = 0; i < (state->chunk_index) - 1; i++)
+		l += state->packetchunks[i + 1].bytes;
+
+	if (fmp4.count > 0 &&
+			(fmp4.count >= fmp4.frag_frames ||
+			(state->frag_duration > 0 && ts - fmp4.samples[0].time >= (uint64_t)state->frag_duration * 1000) ||
+			fmp4.data_len + l > MDAT_MAX_SIZE)) {
+		if ((ret = close_fragment(state, ts)) != 0)
+			return ret;
+	}
+
+	j = 0;
+	if (fmp4.count == 0) {
+		// open new fragment, reserve space for moof and write mdat header extending to the end of file
+		fmp4.frag_frames = state->frag_frames;
+		if (fmp4.frag_frames <= 0 || fmp4.frag_frames > FMP4_MAX_FRAG_FRAMES)
+			fmp4.frag_frames = FMP4_MAX_FRAG_FRAMES;
+		fmp4.frag_offset = fmp4.file_pos;
+		box = box_start(&b, "free");
+		put_zeros(&b, MOOF_RESERVED_SIZE(fmp4.frag_frames) - BOX_HDR_SIZE);
+		box_end(&b, box);
+		put_be32(&b, 0);
+		put_bytes(&b, "mdat", 4);
+		chunks_iovec[j].iov_base = frag_hdr;
+		chunks_iovec[j++].iov_len = b.pos;
+	}
+	for (i = 0; i < (state->chunk_index) - 1; i++, j++) {
+		chunks_iovec[j].iov_base = state->packetchunks[i + 1].chunk;
+		chunks_iovec[j].iov_len = state->packetchunks[i + 1].bytes;
+	}
+	iovlen = writev(state->ivf, chunks_iovec, j);
+	if (iovlen < l + (ssize_t)b.pos) {
+		j = errno;
+		D0(fprintf(debug_file, "writev error %d (returned %d, expected %d, file descriptor %d, chn %d)\n", j, iovlen, l + b.pos, state->ivf, state->port_num));
+		close(state->ivf);
+		state->ivf = -1;
+		return -CAMOGM_FRAME_FILE_ERR;
+	}
+	fmp4.file_pos += iovlen;
+	fmp4.samples[fmp4.count].size = l;
+	fmp4.samples[fmp4.count].time = ts;
+	fmp4.count++;
+	fmp4.data_len += l;
+
+	return 0;
+}
+
+/**
+ * @brief Close the last fragment and move the file to segment job, it is closed when the job is run
+ * @param[in]   state   a pointer to a structure containing current state
+ * @param[out]  job     segment job to be finalized
+ * @return      0 if the last fragment was written successfully and negative error code otherwise
+ */
+int camogm_end_fmp4(camogm_state *state, struct segment_job *job)
+{
+	int ret = 0;
+
+	if (state->ivf >= 0) {
+		ret = close_fragment(state, 0);
+		job->fd = state->ivf;
+		state->ivf = -1;
+	}
+
+	return ret;
+}
@@ -0,0 +1,34 @@
+/** @file camogm_fmp4.h
+ * @brief Provides writing to fragmented MP4 (ISO BMFF) files for @e camogm
+ * @copyright Copyright (C) 2017 Elphel, Inc.
+ *
+ * @par <b>License</b>
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CAMOGM_FMP4_H
+#define _CAMOGM_FMP4_H
+
+#include "camogm.h"
+#include "camogm_finalize.h"
+
+#define FMP4_MAX_FRAG_FRAMES      1024           ///< The maximum number of frames in one fragment, defines memory used for sample table
+#define FMP4_DEFAULT_FRAG_FRAMES  30             ///< Default number of frames in one fragment
+#define FMP4_DEFAULT_FRAG_DURATION 1000          ///< Default fragment duration, in milliseconds
+
+int camogm_init_fmp4(camogm_state *state);
+int camogm_start_fmp4(camogm_state *state);
+int camogm_frame_fmp4(camogm_state *state);
+int camogm_end_fmp4(camogm_state *state, struct segment_job *job);
+void camogm_free_fmp4(void);
+
+#endif /* _CAMOGM_FMP4_H */
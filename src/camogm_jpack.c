@@ -0,0 +1,319 @@
+/** @file camogm_jpack.c
+ * @brief Provides writing of JPEG frames to pack files with sidecar index for @e camogm
+ * @copyright Copyright (C) 2017 Elphel, Inc.
+ *
+ * @par <b>License</b>
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Frames are appended to a pack file one after another as complete JPEG images, so the pack file
+ * can be recorded as fast as Quicktime file. Each frame gets an entry in sidecar index file
+ * (see jpack_index.h), which gives random access to individual frames. Pack files are preallocated
+ * in large steps to keep the file contiguous and avoid block allocation on each write.
+ */
+
+/** @brief This define is needed to use lseek64 and should be set before includes */
+#define _LARGEFILE64_SOURCE
+/** @brief Needed for fallocate */
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "camogm_jpack.h"
+#include "jpack_index.h"
+
+/** @brief The number of index entries buffered in memory before they are written to index file */
+#define JPACK_INDEX_ENTRIES       256
+/** @brief Pack file is preallocated in steps of this size, in bytes */
+#define JPACK_PREALLOC_STEP       (64 * 1024 * 1024)
+
+/**
+ * @struct jpack_segment
+ * @brief Index data passed to finalizer with pack file descriptor
+ */
+struct jpack_segment {
+	int index_fd;                                           ///< index file descriptor
+	off64_t file_pos;                                       ///< the size of data in pack file
+	int entries_num;                                        ///< the number of buffered index entries
+	struct jpack_index_entry entries[JPACK_INDEX_ENTRIES];  ///< index entries not yet written to index file
+};
+
+/**
+ * @struct jpack_writer
+ * @brief Current pack file
+ */
+struct jpack_writer {
+	off64_t file_pos;                                       ///< current write position in pack file
+	off64_t allocated;                                      ///< the size of preallocated pack file space
+	bool prealloc;                                          ///< preallocation is supported by file system
+	int index_fd;                                           ///< index file descriptor
+	char index_path[ELPHEL_PATH_MAX];                       ///< index file name, used in log messages
+	int entries_num;                                        ///< the number of buffered index entries
+	struct jpack_index_entry entries[JPACK_INDEX_ENTRIES];  ///< index entries not yet written to index file
+};
+
+static struct jpack_writer jpack = {.index_fd = -1};
+
+/** Write buffered index entries to index file */
+static int flush_index(int fd, const struct jpack_index_entry *entries, int num)
+{
+	ssize_t len = num * sizeof(struct jpack_index_entry);
+
+	if (num > 0 && write(fd, entries, len) != len) {
+		D0(fprintf(debug_file, "Error writing JPEG pack index: %s\n", strerror(errno)));
+		return -CAMOGM_FRAME_FILE_ERR;
+	}
+	return 0;
+}
+
+/**
+ * @brief Write the rest of index and trim preallocated space beyond the last frame. This function
+ * is called by finalizer.
+ * @param[in]   job   segment job
+ * @return      0 on success and negative error code otherwise
+ */
+static int jpack_finish(struct segment_job *job)
+{
+	int ret;
+	struct jpack_segment *seg = job->data;
+
+	ret = flush_index(seg->index_fd, seg->entries, seg->entries_num);
+	if (ftruncate64(job->fd, seg->file_pos) < 0) {
+		D0(fprintf(debug_file, "Error truncating %s: %s\n", job->path, strerror(errno)));
+		ret = -CAMOGM_FRAME_FILE_ERR;
+	}
+	if (close(seg->index_fd) < 0)
+		ret = -CAMOGM_FRAME_FILE_ERR;
+	seg->index_fd = -1;
+
+	return ret;
+}
+
+/** @brief Nothing to initialize, for consistency with other formats */
+int camogm_init_jpack(void)
+{
+	return 0;
+}
+
+/** @brief Nothing to free, for consistency with other formats */
+void camogm_free_jpack(void)
+{
+}
+
+/**
+ * @brief Open new pack file and its index file
+ * @param[in]   state   a pointer to a structure containing current state
+ * @return      0 if the files were opened successfully and negative error code otherwise
+ */
+int camogm_start_jpack(camogm_state *state)
+{
+	struct jpack_index_hdr hdr = {
+			.version = JPACK_INDEX_VERSION,
+			.entry_size = sizeof(struct jpack_index_entry)
+	};
+
+	sprintf(state->path, "%s%010ld_%06ld" JPACK_PACK_EXT, state->path_prefix,
+			state->frame_params[state->port_num].timestamp_sec, state->frame_params[state->port_num].timestamp_usec);
+	jpack_index_path(state->path, jpack.index_path, sizeof(jpack.index_path));
+	if (((state->ivf = open(state->path, O_RDWR | O_CREAT | O_TRUNC, 0777))) < 0) {
+		D0(fprintf(debug_file, "Error opening %s for writing, returned %d, errno=%d\n", state->path, state->ivf, errno));
+		return -CAMOGM_FRAME_FILE_ERR;
+	}
+	if (((jpack.index_fd = open(jpack.index_path, O_WRONLY | O_CREAT | O_TRUNC, 0777))) < 0) {
+		D0(fprintf(debug_file, "Error opening %s for writing, errno=%d\n", jpack.index_path, errno));
+		close(state->ivf);
+		state->ivf = -1;
+		return -CAMOGM_FRAME_FILE_ERR;
+	}
+	memcpy(hdr.magic, JPACK_INDEX_MAGIC, sizeof(hdr.magic));
+	if (write(jpack.index_fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+		D0(fprintf(debug_file, "Error writing %s: %s\n", jpack.index_path, strerror(errno)));
+		close(jpack.index_fd);
+		jpack.index_fd = -1;
+		close(state->ivf);
+		state->ivf = -1;
+		return -CAMOGM_FRAME_FILE_ERR;
+	}
+	jpack.file_pos = 0;
+	jpack.allocated = 0;
+	jpack.prealloc = true;
+	jpack.entries_num = 0;
+
+	return 0;
+}
+
+/**
+ * @brief Append a frame to pack file and add it to index
+ * @param[in]   state   a pointer to a structure containing current state
+ * @return      0 if frame was saved successfully and negative error code otherwise
+ */
+int camogm_frame_jpack(camogm_state *state)
+{
+	int i, j;
+	int ret;
+	int port = state->port_num;
+	ssize_t iovlen, l;
+	struct iovec chunks_iovec[FILE_CHUNKS_NUM];
+	struct jpack_index_entry *entry;
+
+	l = 0;
+	for (i = 0; i < (state->chunk_index) - 1; i++) {
+		chunks_iovec[i].iov_base = state->packetchunks[i + 1].chunk;
+		chunks_iovec[i].iov_len = state->packetchunks[i + 1].bytes;
+		l += chunks_iovec[i].iov_len;
+	}
+	if (jpack.prealloc && jpack.file_pos + l > jpack.allocated) {
+		if (fallocate64(state->ivf, 0, jpack.allocated, JPACK_PREALLOC_STEP) == 0) {
+			jpack.allocated += JPACK_PREALLOC_STEP;
+		} else {
+			D1(fprintf(debug_file, "Pack file preallocation is disabled: %s\n", strerror(errno)));
+			jpack.prealloc = false;
+		}
+	}
+	iovlen = writev(state->ivf, chunks_iovec, (state->chunk_index) - 1);
+	if (iovlen < l) {
+		j = errno;
+		D0(fprintf(debug_file, "writev error %d (returned %d, expected %d, file descriptor %d, chn %d)\n", j, iovlen, l, state->ivf, port));
+		close(state->ivf);
+		state->ivf = -1;
+		return -CAMOGM_FRAME_FILE_ERR;
+	}
+
+	entry = &jpack.entries[jpack.entries_num++];
+	entry->offset = jpack.file_pos;
+	entry->size = l;
+	entry->port = port;
+	entry->timestamp = (uint64_t)state->this_frame_params[port].timestamp_sec * 1000000 + state->this_frame_params[port].timestamp_usec;
+	jpack.file_pos += l;
+	if (jpack.entries_num == JPACK_INDEX_ENTRIES) {
+		ret = flush_index(jpack.index_fd, jpack.entries, jpack.entries_num);
+		jpack.entries_num = 0;
+		if (ret != 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Move pack file and the rest of index to segment job, they are written and closed when the job is run
+ * @param[in]   state   a pointer to a structure containing current state
+ * @param[out]  job     segment job to be finalized
+ * @return      0 on success and negative error code otherwise
+ */
+int camogm_end_jpack(camogm_state *state, struct segment_job *job)
+{
+	int ret = 0;
+	struct jpack_segment *seg;
+
+	if (state->ivf < 0) {
+		if (jpack.index_fd >= 0)
+			close(jpack.index_fd);
+		jpack.index_fd = -1;
+		return 0;
+	}
+	seg = malloc(sizeof(struct jpack_segment));
+	if (seg != NULL) {
+		seg->index_fd = jpack.index_fd;
+		seg->file_pos = jpack.file_pos;
+		seg->entries_num = jpack.entries_num;
+		memcpy(seg->entries, jpack.entries, jpack.entries_num * sizeof(struct jpack_index_entry));
+		job->finish = jpack_finish;
+		job->data = seg;
+	} else {
+		// write index now, the file will have preallocated tail
+		ret = flush_index(jpack.index_fd, jpack.entries, jpack.entries_num);
+		close(jpack.index_fd);
+		if (ret == 0)
+			ret = -CAMOGM_FRAME_MALLOC;
+	}
+	jpack.index_fd = -1;
+	jpack.entries_num = 0;
+	job->fd = state->ivf;
+	state->ivf = -1;
+
+	return ret;
+}
+
+/** Extraction request passed to extraction thread */
+struct jpack_request {
+	char pack_path[ELPHEL_PATH_MAX];                        ///< pack file name
+	char out_dir[ELPHEL_PATH_MAX];                          ///< output directory
+	struct jpack_filter filter;                             ///< frames to extract
+};
+
+static void *jpack_extract_thread(void *arg)
+{
+	int ret;
+	struct jpack_request *req = arg;
+
+	ret = jpack_extract(req->pack_path, req->out_dir, &req->filter);
+	if (ret < 0) {
+		D0(fprintf(debug_file, "Error extracting frames from %s: %s\n", req->pack_path, strerror(errno)));
+	} else {
+		D1(fprintf(debug_file, "%d frames extracted from %s to %s\n", ret, req->pack_path, req->out_dir));
+	}
+	free(req);
+
+	return NULL;
+}
+
+/**
+ * @brief Extract frames from pack file to individual JPEG files in background. The files are written to
+ * a directory named after pack file without extension.
+ * @param[in]   args   command arguments: <pack file> [<from> [<to>]], @e from and @e to are time stamps in
+ * seconds limiting the frames extracted
+ * @return      0 if extraction was started and -1 otherwise
+ */
+int camogm_jpack_extract(const char *args)
+{
+	int len;
+	char *ext;
+	double from = 0, to = 0;
+	pthread_t thread;
+	struct jpack_request *req;
+
+	if (args == NULL || (req = malloc(sizeof(struct jpack_request))) == NULL)
+		return -1;
+	len = strcspn(args, " \t");
+	if (len == 0 || len >= ELPHEL_PATH_MAX) {
+		free(req);
+		return -1;
+	}
+	memcpy(req->pack_path, args, len);
+	req->pack_path[len] = '\0';
+	sscanf(args + len, "%lf %lf", &from, &to);
+	req->filter.port = -1;
+	req->filter.from = (from > 0) ? (uint64_t)(from * 1000000) : 0;
+	req->filter.to = (to > 0) ? (uint64_t)(to * 1000000) : 0;
+	strcpy(req->out_dir, req->pack_path);
+	ext = strrchr(req->out_dir, '.');
+	if (ext != NULL && strcmp(ext, JPACK_PACK_EXT) == 0)
+		ext[0] = '\0';
+	else
+		strcat(req->out_dir, ".d");
+
+	if (pthread_create(&thread, NULL, jpack_extract_thread, req) != 0) {
+		D0(fprintf(debug_file, "Can not start frame extraction thread\n"));
+		free(req);
+		return -1;
+	}
+	pthread_detach(thread);
+
+	return 0;
+}
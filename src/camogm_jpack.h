@@ -0,0 +1,31 @@
+/** @file camogm_jpack.h
+ * @brief Provides writing of JPEG frames to pack files with sidecar index for @e camogm
+ * @copyright Copyright (C) 2017 Elphel, Inc.
+ *
+ * @par <b>License</b>
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CAMOGM_JPACK_H
+#define _CAMOGM_JPACK_H
+
+#include "camogm.h"
+#include "camogm_finalize.h"
+
+int camogm_init_jpack(void);
+int camogm_start_jpack(camogm_state *state);
+int camogm_frame_jpack(camogm_state *state);
+int camogm_end_jpack(camogm_state *state, struct segment_job *job);
+void camogm_free_jpack(void);
+int camogm_jpack_extract(const char *args);
+
+#endif /* _CAMOGM_JPACK_H */
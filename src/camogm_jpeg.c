@@ -28,21 +28,65 @@
 #include <sys/types.h>
 #include <string.h>
 #include <time.h>
+#include <dirent.h>
 #include <elphel/c313a.h>
 #include <elphel/ahci_cmd.h>
 
 #include "camogm_jpeg.h"
 #include "camogm_read.h"
 #include "camogm_align.h"
+#include "camogm_trace.h"
+#include "camogm_checkpoint.h"
+#include "camogm_superblock.h"
+#include "camogm_writeback.h"
 
 /** State file record format. It includes device path in /dev, starting, current and ending LBAs */
 #define STATE_FILE_FORMAT         "%s\t%llu\t%llu\t%llu\n"
 /** Status file update period, in seconds */
 #define STAT_UPDATE_PERIOD        60
+/** The maximal length of subdirectory name relative to the directory of path prefix */
+#define JPEG_SUBDIR_LEN           32
+
+/** Directory descriptors used to create individual JPEG files with openat(), directory lookup is done once
+ * per subdirectory instead of once per file */
+struct jpeg_dirs {
+	int base_fd;                                 ///< descriptor of the directory of path prefix
+	char base_path[ELPHEL_PATH_MAX];             ///< the directory of path prefix
+	char path_prefix[ELPHEL_PATH_MAX];           ///< path prefix the directories were opened for
+	char name_prefix[ELPHEL_PATH_MAX];           ///< file name part of path prefix
+	int dir_fd[SENSOR_PORTS];                    ///< descriptor of current subdirectory of each port
+	char dir_name[SENSOR_PORTS][JPEG_SUBDIR_LEN];///< current subdirectory name relative to #base_path
+	int layout;                                  ///< directory layout #seq and #files are counted for, -1 if none
+	int seq[SENSOR_PORTS];                       ///< counter layout - current subdirectory number, -1 if not known yet
+	int files[SENSOR_PORTS];                     ///< counter layout - the number of files in current subdirectory
+};
+
+/** Subdirectories which will be needed next, they are created by a background thread before the first file
+ * is written to them */
+struct dir_maker {
+	pthread_mutex_t mutex;                       ///< protects #path
+	pthread_cond_t cond;                         ///< signals new request to the thread
+	pthread_once_t once;                         ///< starts the thread on first request
+	char path[SENSOR_PORTS][ELPHEL_PATH_MAX];    ///< full path of a directory to create, empty string if none
+};
+
+static struct jpeg_dirs jdirs = {
+	.base_fd = -1,
+	.dir_fd = {[0 ... SENSOR_PORTS - 1] = -1},
+	.layout = -1,
+	.seq = {[0 ... SENSOR_PORTS - 1] = -1}
+};
+static struct dir_maker dmaker = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.once = PTHREAD_ONCE_INIT
+};
 
 /* forward declarations */
 static void *jpeg_writer(void *thread_args);
 static int save_state_file(const camogm_state *state);
+static void close_dirs(void);
+static void reset_dirs_seq(void);
 
 /** Get starting and endign LBAs of the partition specified as raw device buffer */
 static int get_disk_range(struct range *range)
@@ -80,7 +124,11 @@ static int find_state(FILE *f, uint64_t *pos, const rawdev_buffer *rawdev)
 
 	if (f == NULL || pos == NULL)
 		return -1;
-	if (get_disk_range(&range) != 0) {
+	if (rawdev->rawdev_file) {
+		// regular file buffer always starts from the beginning of the file
+		range.from = 0;
+		range.to = rawdev->end_pos / PHY_BLOCK_SIZE;
+	} else if (get_disk_range(&range) != 0) {
 		return -1;
 	}
 
@@ -202,11 +250,7 @@ int camogm_init_jpeg(camogm_state *state)
  */
 void camogm_free_jpeg(camogm_state *state)
 {
-	pthread_cond_destroy(&state->writer_params.main_cond);
-	pthread_cond_destroy(&state->writer_params.writer_cond);
-	pthread_mutex_destroy(&state->writer_params.writer_mutex);
-
-	// terminate writing thread
+	// terminate writing thread, synchronization objects can be destroyed only when nobody waits on them
 	pthread_mutex_lock(&state->writer_params.writer_mutex);
 	state->writer_params.exit_thread = true;
 	pthread_cond_signal(&state->writer_params.writer_cond);
@@ -214,7 +258,13 @@ void camogm_free_jpeg(camogm_state *state)
 	pthread_join(state->writer_params.writer_thread, NULL);
 	state->writer_params.exit_thread = false;
 
+	pthread_cond_destroy(&state->writer_params.main_cond);
+	pthread_cond_destroy(&state->writer_params.writer_cond);
+	pthread_mutex_destroy(&state->writer_params.writer_mutex);
+
 	deinit_align_buffers(state);
+	close_dirs();
+	reset_dirs_seq();
 }
 
 /** Calculate the total length of current frame */
@@ -229,6 +279,242 @@ int64_t camogm_get_jpeg_size(camogm_state *state)
 	return len;
 }
 
+/**
+ * @brief Create all missing directories of a path
+ * @param[in]   dirfd   directory descriptor relative paths are resolved from, or AT_FDCWD
+ * @param[in]   path    directory path
+ * @return      0 if the directory exists or was created and -1 otherwise
+ */
+static int make_dirs(int dirfd, const char *path)
+{
+	char buff[ELPHEL_PATH_MAX];
+	char *slash;
+
+	strncpy(buff, path, ELPHEL_PATH_MAX - 1);
+	buff[ELPHEL_PATH_MAX - 1] = '\0';
+	for (slash = strchr(buff + 1, '/'); ; slash = strchr(slash + 1, '/')) {
+		if (slash)
+			slash[0] = '\0';
+		if (mkdirat(dirfd, buff, 0777) < 0 && errno != EEXIST)
+			return -1;
+		if (!slash)
+			break;
+		slash[0] = '/';
+	}
+	return 0;
+}
+
+/** Background thread creating subdirectories requested by #request_dir */
+static void *dir_maker_thread(void *arg)
+{
+	int i;
+	char path[ELPHEL_PATH_MAX];
+
+	pthread_mutex_lock(&dmaker.mutex);
+	while (true) {
+		for (i = 0; i < SENSOR_PORTS && dmaker.path[i][0] == '\0'; i++);
+		if (i == SENSOR_PORTS) {
+			pthread_cond_wait(&dmaker.cond, &dmaker.mutex);
+			continue;
+		}
+		strcpy(path, dmaker.path[i]);
+		dmaker.path[i][0] = '\0';
+		pthread_mutex_unlock(&dmaker.mutex);
+		if (make_dirs(AT_FDCWD, path) < 0)
+			D1(fprintf(debug_file, "Could not create directory %s in advance: %s\n", path, strerror(errno)));
+		pthread_mutex_lock(&dmaker.mutex);
+	}
+	return NULL;
+}
+
+static void start_dir_maker(void)
+{
+	pthread_t thread;
+
+	if (pthread_create(&thread, NULL, dir_maker_thread, NULL) == 0)
+		pthread_detach(thread);
+	else
+		D0(fprintf(debug_file, "Can not start directory creation thread, directories will be created on demand\n"));
+}
+
+/** Ask background thread to create the subdirectory the port will need next. Only the last request
+ * of each port is kept. */
+static void request_dir(int port, const char *name)
+{
+	pthread_once(&dmaker.once, start_dir_maker);
+	pthread_mutex_lock(&dmaker.mutex);
+	if (snprintf(dmaker.path[port], ELPHEL_PATH_MAX, "%s/%s", jdirs.base_path, name) >= ELPHEL_PATH_MAX) {
+		// the directory will be created on demand
+		D1(fprintf(debug_file, "Directory path is too long: %s/%s\n", jdirs.base_path, name));
+		dmaker.path[port][0] = '\0';
+	}
+	pthread_cond_signal(&dmaker.cond);
+	pthread_mutex_unlock(&dmaker.mutex);
+}
+
+/** Close cached directory descriptors */
+static void close_dirs(void)
+{
+	for (int port = 0; port < SENSOR_PORTS; port++) {
+		if (jdirs.dir_fd[port] >= 0 && jdirs.dir_fd[port] != jdirs.base_fd)
+			close(jdirs.dir_fd[port]);
+		jdirs.dir_fd[port] = -1;
+		jdirs.dir_name[port][0] = '\0';
+	}
+	if (jdirs.base_fd >= 0)
+		close(jdirs.base_fd);
+	jdirs.base_fd = -1;
+	jdirs.path_prefix[0] = '\0';
+}
+
+/** Forget subdirectory counters of counter layout, the last subdirectory number will be searched for again */
+static void reset_dirs_seq(void)
+{
+	for (int port = 0; port < SENSOR_PORTS; port++) {
+		jdirs.seq[port] = -1;
+		jdirs.files[port] = 0;
+	}
+	jdirs.layout = -1;
+	jdirs.base_path[0] = '\0';
+}
+
+/** Find the largest subdirectory number of a port in counter layout, new files will be written to the next one.
+ * This is done once per port when recording starts in a new directory. */
+static int find_last_seq(int port)
+{
+	int fd;
+	int seq = -1;
+	char name[JPEG_SUBDIR_LEN];
+	char *end;
+	long val;
+	DIR *dir;
+	struct dirent *entry;
+
+	snprintf(name, JPEG_SUBDIR_LEN, "%d", port);
+	fd = openat(jdirs.base_fd, name, O_RDONLY | O_DIRECTORY);
+	if (fd < 0)
+		return -1;
+	dir = fdopendir(fd);
+	if (dir == NULL) {
+		close(fd);
+		return -1;
+	}
+	while ((entry = readdir(dir)) != NULL) {
+		val = strtol(entry->d_name, &end, 10);
+		if (end != entry->d_name && *end == '\0' && val > seq)
+			seq = val;
+	}
+	closedir(dir);
+
+	return seq;
+}
+
+/**
+ * @brief Get the descriptor of a directory where current frame should be written
+ *
+ * The descriptor of current subdirectory is kept open and reused until the frame goes to a different
+ * subdirectory. A new subdirectory is created if it was not prepared in advance, the next one is requested
+ * from the background thread at the moment the new subdirectory is opened.
+ * @param[in]   state   a pointer to a structure containing current state
+ * @param[in]   port    sensor port number
+ * @return      directory descriptor or -1 in case of error
+ */
+static int get_dir_fd(camogm_state *state, int port)
+{
+	int fd;
+	char name[JPEG_SUBDIR_LEN];
+	char next[JPEG_SUBDIR_LEN];
+	time_t sec = state->this_frame_params[port].timestamp_sec;
+	struct tm tm;
+
+	switch (state->jpeg_layout) {
+	case JPEG_LAYOUT_DATE:
+		gmtime_r(&sec, &tm);
+		snprintf(name, JPEG_SUBDIR_LEN, "%d/%04d%02d%02d/%02d", port, tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour);
+		sec = (sec / 3600 + 1) * 3600;
+		gmtime_r(&sec, &tm);
+		snprintf(next, JPEG_SUBDIR_LEN, "%d/%04d%02d%02d/%02d", port, tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour);
+		break;
+	case JPEG_LAYOUT_COUNT:
+		if (jdirs.seq[port] < 0) {
+			jdirs.seq[port] = find_last_seq(port) + 1;
+			jdirs.files[port] = 0;
+		} else if (jdirs.files[port] >= state->jpeg_dir_files) {
+			jdirs.seq[port]++;
+			jdirs.files[port] = 0;
+		}
+		jdirs.files[port]++;
+		snprintf(name, JPEG_SUBDIR_LEN, "%d/%06d", port, jdirs.seq[port]);
+		snprintf(next, JPEG_SUBDIR_LEN, "%d/%06d", port, jdirs.seq[port] + 1);
+		break;
+	default:
+		return jdirs.base_fd;
+	}
+	if (jdirs.dir_fd[port] >= 0 && strcmp(name, jdirs.dir_name[port]) == 0)
+		return jdirs.dir_fd[port];
+
+	if (jdirs.dir_fd[port] >= 0 && jdirs.dir_fd[port] != jdirs.base_fd)
+		close(jdirs.dir_fd[port]);
+	jdirs.dir_name[port][0] = '\0';
+	fd = openat(jdirs.base_fd, name, O_RDONLY | O_DIRECTORY);
+	if (fd < 0 && errno == ENOENT) {
+		D3(fprintf(debug_file, "Directory %s/%s was not created in advance\n", jdirs.base_path, name));
+		if (make_dirs(jdirs.base_fd, name) == 0)
+			fd = openat(jdirs.base_fd, name, O_RDONLY | O_DIRECTORY);
+	}
+	jdirs.dir_fd[port] = fd;
+	if (fd < 0) {
+		D0(fprintf(debug_file, "Error opening directory %s/%s: %s\n", jdirs.base_path, name, strerror(errno)));
+		return -1;
+	}
+	strcpy(jdirs.dir_name[port], name);
+	request_dir(port, next);
+
+	return fd;
+}
+
+/**
+ * @brief Open the directory of path prefix, files and subdirectories are created relative to it. This is done
+ * when recording starts and each time path prefix is changed during recording.
+ * @param[in]   state   a pointer to a structure containing current state
+ * @return      0 if the directory was opened successfully and negative error code otherwise
+ */
+static int open_dirs(camogm_state *state)
+{
+	char * slash;
+	int rslt;
+
+	strcpy(state->path, state->path_prefix);   // make state->path a directory name (will be replaced when the frames will be written)
+	slash = strrchr(state->path, '/');
+	if (slash) {
+		D3(fprintf(debug_file, "Full path %s\n", state->path));
+		slash[0] = '\0';                       // truncate path to the directory name
+		D3(fprintf(debug_file, "directory path %s\n", state->path));
+		rslt = mkdir(state->path, 0777);
+		D3(fprintf(debug_file, "mkdir (%s, 0777) returned %d, errno=%d\n", state->path, rslt, errno));
+		if ((rslt < 0) && (errno != EEXIST)) { // already exists is OK
+			D0(fprintf(debug_file, "Error creating directory %s, errno=%d\n", state->path, errno));
+			return -CAMOGM_FRAME_FILE_ERR;
+		}
+	}
+	close_dirs();
+	// file segments continue filling the same subdirectories, counters are reset only if the directory or layout changes
+	if (strcmp(jdirs.base_path, slash ? state->path : ".") != 0 || jdirs.layout != state->jpeg_layout) {
+		reset_dirs_seq();
+		strcpy(jdirs.base_path, slash ? state->path : ".");
+		jdirs.layout = state->jpeg_layout;
+	}
+	strcpy(jdirs.name_prefix, slash ? &state->path_prefix[slash - state->path + 1] : state->path_prefix);
+	jdirs.base_fd = open(jdirs.base_path, O_RDONLY | O_DIRECTORY);
+	if (jdirs.base_fd < 0) {
+		D0(fprintf(debug_file, "Error opening directory %s: %s\n", jdirs.base_path, strerror(errno)));
+		return -CAMOGM_FRAME_FILE_ERR;
+	}
+	strcpy(jdirs.path_prefix, state->path_prefix);
+
+	return 0;
+}
+
 /**
  * @brief Called every time the JPEG files recording is started.
  *
@@ -239,44 +525,61 @@ int64_t camogm_get_jpeg_size(camogm_state *state)
  */
 int camogm_start_jpeg(camogm_state *state)
 {
-	char * slash;
-	int rslt;
 	off64_t offset;
 
 	if (!state->rawdev_op) {
-		strcpy(state->path, state->path_prefix);   // make state->path a directory name (will be replaced when the frames will be written)
-		slash = strrchr(state->path, '/');
 		D2(fprintf(debug_file, "camogm_start_jpeg\n"));
-		if (slash) {
-			D3(fprintf(debug_file, "Full path %s\n", state->path));
-			slash[0] = '\0';                       // truncate path to the directory name
-			D3(fprintf(debug_file, "directory path %s\n", state->path));
-			rslt = mkdir(state->path, 0777);
-			D3(fprintf(debug_file, "mkdir (%s, 0777) returned %d, errno=%d\n", state->path, rslt, errno));
-			if ((rslt < 0) && (errno != EEXIST)) { // already exists is OK
-				D0(fprintf(debug_file, "Error creating directory %s, errno=%d\n", state->path, errno));
-				return -CAMOGM_FRAME_FILE_ERR;
-			}
-		}
+		// keep the directory open, files and subdirectories are created relative to it
+		if (open_dirs(state) < 0)
+			return -CAMOGM_FRAME_FILE_ERR;
 	} else {
-		if (open_state_file(&state->rawdev, &state->writer_params.lba_current) != 0) {
+		// checkpoints are written more often than state file, use state file only if there are no valid checkpoints
+		if (checkpoint_recover(state, &state->writer_params.lba_current) != 0 &&
+				open_state_file(&state->rawdev, &state->writer_params.lba_current) != 0) {
 			D0(fprintf(debug_file, "Could not get write pointer from state file, recording will start from the beginning of partition: "
 					"%s\n", state->rawdev.rawdev_path));
 		}
-		state->writer_params.blockdev_fd = open(state->rawdev.rawdev_path, O_RDWR);
-		if (state->writer_params.blockdev_fd < 0) {
+		if (state->writer_params.lba_current < state->writer_params.lba_start + RAWDEV_START_LBA ||
+				state->writer_params.lba_current >= state->writer_params.lba_end) {
+			// the pointer could be saved by previous version which did not reserve space for checkpoints
+			state->writer_params.lba_current = state->writer_params.lba_start + RAWDEV_START_LBA;
+		}
+		if (storage_open(&state->writer_params.storage, state->writer_params.storage_cfg, state->rawdev.rawdev_path,
+				lba_to_offset(state->writer_params.lba_end - state->writer_params.lba_start)) != 0) {
 			D0(fprintf(debug_file, "Error opening block device: %s\n", state->rawdev.rawdev_path));
 			return -CAMOGM_FRAME_FILE_ERR;
 		}
 		offset = lba_to_offset(state->writer_params.lba_current - state->writer_params.lba_start);
-		lseek64(state->writer_params.blockdev_fd, offset, SEEK_SET);
+		storage_seek(&state->writer_params.storage, offset);
 		D3(fprintf(debug_file, "Open block device: %s, offset in bytes: %llu\n", state->rawdev.rawdev_path, offset));
 		state->writer_params.stat_update = time(NULL);
+		if (superblock_write(state) != 0) {
+			D0(fprintf(debug_file, "Could not write raw device buffer superblock\n"));
+		}
+		if (checkpoint_open(state) != 0) {
+			D0(fprintf(debug_file, "Write pointer checkpoints are disabled\n"));
+		}
 	}
 
 	return 0;
 }
 
+/** Prepare frame group header for current group, the header is padded with spaces and terminated with new line */
+static void put_group_hdr(camogm_state *state)
+{
+	int len;
+	unsigned char *buff = state->writer_params.group_buff;
+
+	len = snprintf((char *)buff, FRAME_GROUP_HDR_SIZE, FRAME_GROUP_HDR_FORMAT, state->group.ports,
+			__builtin_popcount(state->group.ports), (long)(state->group.time / 1000000), (long)(state->group.time % 1000000));
+	if (len < 0 || len > FRAME_GROUP_HDR_SIZE - 1)
+		len = FRAME_GROUP_HDR_SIZE - 1;
+	memset(&buff[len], ' ', FRAME_GROUP_HDR_SIZE - 1 - len);
+	buff[FRAME_GROUP_HDR_SIZE - 1] = '\n';
+	state->writer_params.group_hdr.iov_base = buff;
+	state->writer_params.group_hdr.iov_len = FRAME_GROUP_HDR_SIZE;
+}
+
 /**
  * @brief Write single JPEG frame
  *
@@ -290,57 +593,106 @@ int camogm_frame_jpeg(camogm_state *state)
 	ssize_t iovlen, l = 0;
 	struct iovec chunks_iovec[8];
 	int port = state->port_num;
+	int dir_fd;
+	int ret = 0;
+	int len;
+	char name[ELPHEL_PATH_MAX];
 	time_t curr_time;
+	uint64_t t_queue, t_ready;
 
-	sprintf(state->path, "%s%d_%010ld_%06ld.jpeg", state->path_prefix, port, state->this_frame_params[port].timestamp_sec, state->this_frame_params[port].timestamp_usec);
 	if (!state->rawdev_op) {
+		// path prefix can be changed during recording
+		if (strcmp(jdirs.path_prefix, state->path_prefix) != 0 && open_dirs(state) < 0)
+			return -CAMOGM_FRAME_FILE_ERR;
+		dir_fd = get_dir_fd(state, port);
+		if (dir_fd < 0)
+			return -CAMOGM_FRAME_FILE_ERR;
+		len = snprintf(name, ELPHEL_PATH_MAX, "%s%d_%010ld_%06ld.jpeg", jdirs.name_prefix, port,
+				state->this_frame_params[port].timestamp_sec, state->this_frame_params[port].timestamp_usec);
+		if (len < ELPHEL_PATH_MAX) {
+			if (jdirs.dir_name[port][0] != '\0')
+				len = snprintf(state->path, ELPHEL_PATH_MAX, "%s/%s/%s", jdirs.base_path, jdirs.dir_name[port], name);
+			else
+				len = snprintf(state->path, ELPHEL_PATH_MAX, "%s/%s", jdirs.base_path, name);
+		}
+		if (len >= ELPHEL_PATH_MAX) {
+			D0(fprintf(debug_file, "File name is too long, path prefix: %s\n", state->path_prefix));
+			return -CAMOGM_FRAME_FILE_ERR;
+		}
 		l = 0;
 		for (i = 0; i < (state->chunk_index) - 1; i++) {
 			chunks_iovec[i].iov_base = state->packetchunks[i + 1].chunk;
 			chunks_iovec[i].iov_len = state->packetchunks[i + 1].bytes;
 			l += chunks_iovec[i].iov_len;
 		}
-		if (((state->ivf = open(state->path, O_RDWR | O_CREAT, 0777))) < 0) {
+		if (((state->ivf = openat(dir_fd, name, O_RDWR | O_CREAT, 0777))) < 0) {
 			D0(fprintf(debug_file, "Error opening %s for writing, returned %d, errno=%d\n", state->path, state->ivf, errno));
 			return -CAMOGM_FRAME_FILE_ERR;
 		}
+		TRACE_BEGIN("writev", port);
 		iovlen = writev(state->ivf, chunks_iovec, (state->chunk_index) - 1);
+		TRACE_END("writev", port);
 		if (iovlen < l) {
 			j = errno;
-			D0(fprintf(debug_file, "writev error %d (returned %d, expected %d)\n", j, iovlen, l));
+			DB(0, "writev error %d (returned %d, expected %d)\n", j, iovlen, l);
 			close(state->ivf);
 			return -CAMOGM_FRAME_FILE_ERR;
 		}
 		state->rawdev.last_jpeg_size = l;
-		close(state->ivf);
+		writeback_file(state, state->ivf);
 	} else {
-		D6(fprintf(debug_file, "\ndump iovect array for port %u\n", state->port_num));
+		sprintf(state->path, "%s%d_%010ld_%06ld.jpeg", state->path_prefix, port, state->this_frame_params[port].timestamp_sec, state->this_frame_params[port].timestamp_usec);
+		DB(6, "\ndump iovect array for port %u\n", state->port_num);
 		for (int i = 0; i < state->chunk_index - 1; i++) {
 			D6(fprintf(debug_file, "ptr: %p, length: %ld\n", state->packetchunks[i + 1].chunk, state->packetchunks[i + 1].bytes));
 		}
 		// next frame is ready for recording, signal this to the writer thread
+		t_queue = lat_time();
+		TRACE_BEGIN("queue", port);
 		pthread_mutex_lock(&state->writer_params.writer_mutex);
 		while (state->writer_params.data_ready)
 			pthread_cond_wait(&state->writer_params.main_cond, &state->writer_params.writer_mutex);
-		D6(fprintf(debug_file, "_13a_"));
-
-		D6(fprintf(debug_file, "\n"));
+		TRACE_END("queue", port);
+		t_ready = lat_time();
+		hist_add(&state->cnt.lat[LAT_QUEUE], t_ready - t_queue);
+		DB(6, "_13a_");
+
+		DB(6, "\n");
+		if (state->group.start) {
+			// the first frame of time-aligned group, group header is recorded right before it
+			put_group_hdr(state);
+			state->group.start = false;
+		}
+		TRACE_BEGIN("align", port);
 		align_frame(state);
+		TRACE_END("align", port);
+		hist_add(&state->cnt.lat[LAT_PREPARE], (t_queue - state->t_harvest) + (lat_time() - t_ready));
 		if (update_lba(state) == 1) {
-			D0(fprintf(debug_file, "The end of block device reached, continue recording from start\n"));
-			lseek(state->writer_params.blockdev_fd, 0, SEEK_SET);
+			DB(0, "The end of block device reached, continue recording from start\n");
+			state->rawdev.overrun++;
+			storage_seek(&state->writer_params.storage, RAWDEV_START_OFFSET);
 		}
-		D6(fprintf(debug_file, "Block device positions: start = %llu, current = %llu, end = %llu\n",
-				state->writer_params.lba_start, state->writer_params.lba_current, state->writer_params.lba_end));
+		state->writer_params.frame_sec = state->this_frame_params[port].timestamp_sec;
+		state->writer_params.frame_usec = state->this_frame_params[port].timestamp_usec;
+		DB(6, "Block device positions: start = %llu, current = %llu, end = %llu\n",
+				state->writer_params.lba_start, state->writer_params.lba_current, state->writer_params.lba_end);
 
 		// proceed if last frame was recorded without errors
 		if (state->writer_params.last_ret_val == 0) {
 			state->writer_params.data_ready = true;
 			pthread_cond_signal(&state->writer_params.writer_cond);
+		} else {
+			// report the error once and drop this frame, the writer is idle so its data and position can be reset here;
+			// the blocks of failed write are skipped and recording continues with the next frame
+			ret = state->writer_params.last_ret_val;
+			state->writer_params.last_ret_val = 0;
+			reset_chunks(state->writer_params.data_chunks, 1);
+			storage_seek(&state->writer_params.storage,
+					lba_to_offset(state->writer_params.lba_current - state->writer_params.lba_start));
 		}
 		pthread_mutex_unlock(&state->writer_params.writer_mutex);
-		if (state->writer_params.last_ret_val != 0) {
-			return state->writer_params.last_ret_val;
+		if (ret != 0) {
+			return ret;
 		}
 
 		// update status file if time has come
@@ -376,7 +728,7 @@ int camogm_end_jpeg(camogm_state *state)
 		if (bytes > 0) {
 			D6(fprintf(debug_file, "Write last block of data, size = %d\n", bytes));
 			// the remaining data block is placed in CHUNK_COMMON buffer, write just this buffer
-			iovlen = writev(state->writer_params.blockdev_fd, &state->writer_params.data_chunks[CHUNK_COMMON], 1);
+			iovlen = storage_writev(&state->writer_params.storage, &state->writer_params.data_chunks[CHUNK_COMMON], 1);
 			if (iovlen < bytes) {
 				D0(fprintf(debug_file, "writev error: %s (returned %i, expected %i)\n", strerror(errno), iovlen, bytes));
 				state->writer_params.last_ret_val = -CAMOGM_FRAME_FILE_ERR;
@@ -387,14 +739,18 @@ int camogm_end_jpeg(camogm_state *state)
 			}
 			reset_chunks(state->writer_params.data_chunks, 1);
 		}
+		checkpoint_update(state, true);
+		checkpoint_close(state);
 		pthread_mutex_unlock(&state->writer_params.writer_mutex);
 
 		D6(fprintf(debug_file, "Closing block device %s\n", state->rawdev.rawdev_path));
-		ret = close(state->writer_params.blockdev_fd);
+		ret = storage_close(&state->writer_params.storage);
 		if (ret == -1)
 			D0(fprintf(debug_file, "Error: %s\n", strerror(errno)));
 
 		save_state_file(state);
+	} else {
+		close_dirs();
 	}
 	return ret;
 }
@@ -410,6 +766,7 @@ void *jpeg_writer(void *thread_args)
 	int reset_rem;
 	int chunk_index;
 	ssize_t iovlen, l;
+	uint64_t t_write;
 	bool process = true;
 	struct iovec chunks_iovec[FILE_CHUNKS_NUM];
 	camogm_state *state = (camogm_state *)thread_args;
@@ -417,6 +774,7 @@ void *jpeg_writer(void *thread_args)
 	unsigned char dummy_buff[PHY_BLOCK_SIZE];
 
 	memset((void *)chunks_iovec, 0, sizeof(struct iovec) * FILE_CHUNKS_NUM);
+	trace_thread_name("writer");
 	pthread_mutex_lock(&params->writer_mutex);
 	params->state = STATE_RUNNING;
 	while (process) {
@@ -431,15 +789,12 @@ void *jpeg_writer(void *thread_args)
 			 * this is a debug feature used to find disk errors */
 			if (state->writer_params.dummy_read) {
 				ssize_t data_len;
-				off64_t curr_offset = lseek64(state->writer_params.blockdev_fd, 0, SEEK_CUR);
 				off64_t offset = lba_to_offset(state->writer_params.lba_current - state->writer_params.lba_start) - state->rawdev.last_jpeg_size;
 				offset = offset / PHY_BLOCK_SIZE;
-				lseek64(state->writer_params.blockdev_fd, offset, SEEK_SET);
-				data_len = read(state->writer_params.blockdev_fd, dummy_buff, PHY_BLOCK_SIZE);
+				data_len = storage_pread(&state->writer_params.storage, dummy_buff, PHY_BLOCK_SIZE, offset);
 				if (data_len < PHY_BLOCK_SIZE) {
 					D6(fprintf(debug_file, "Dummy read error: requested %d, read %d, %s\n", PHY_BLOCK_SIZE, data_len, strerror(errno)));
 				}
-				lseek64(state->writer_params.blockdev_fd, curr_offset, SEEK_SET);
 			}
 			/* end of dummy read cycle */
 
@@ -450,7 +805,11 @@ void *jpeg_writer(void *thread_args)
 			if (chunk_index > 0) {
 				for (int i = 0; i < chunk_index; i++)
 					l += chunks_iovec[i].iov_len;
-				iovlen = writev(state->writer_params.blockdev_fd, chunks_iovec, chunk_index);
+				t_write = lat_time();
+				TRACE_BEGIN("writev", -1);
+				iovlen = storage_writev(&state->writer_params.storage, chunks_iovec, chunk_index);
+				TRACE_END("writev", -1);
+				hist_add(&state->cnt.lat[LAT_WRITE], lat_time() - t_write);
 				if (iovlen < l) {
 					D0(fprintf(debug_file, "writev error: %s (returned %i, expected %i)\n", strerror(errno), iovlen, l));
 					state->writer_params.last_ret_val = -CAMOGM_FRAME_FILE_ERR;
@@ -459,10 +818,11 @@ void *jpeg_writer(void *thread_args)
 					// update statistic
 					state->rawdev.last_jpeg_size = l;
 					state->rawdev.total_rec_len += state->rawdev.last_jpeg_size;
-					D6(fprintf(debug_file, "Current position in block device: %lld\n", lseek64(state->writer_params.blockdev_fd, 0, SEEK_CUR)));
+					DB(6, "Current position in block device: %lld\n", storage_tell(&state->writer_params.storage));
+					checkpoint_update(state, false);
 				}
 			} else {
-				D0(fprintf(debug_file, "data vector mapping error: %d)\n", chunk_index));
+				DB(0, "data vector mapping error: %d)\n", chunk_index);
 				state->writer_params.last_ret_val = -CAMOGM_FRAME_FILE_ERR;
 				reset_rem = 1;
 			}
@@ -475,7 +835,7 @@ void *jpeg_writer(void *thread_args)
 	}
 	params->state = STATE_STOPPED;
 	pthread_mutex_unlock(&state->writer_params.writer_mutex);
-	D5(fprintf(debug_file, "Exit from recording thread\n"));
+	DB(5, "Exit from recording thread\n");
 
 	return NULL;
 }
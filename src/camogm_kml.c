@@ -274,17 +274,18 @@ int camogm_frame_kml(camogm_state *state)
 /**
  * @brief Finish KML file write operation
  *
- * This function writes trailing XML tags and closes KML file
+ * This function writes trailing XML tags and moves KML file to segment job, it is closed when the job is run
  * @param[in]   state   a pointer to a structure containing current state
+ * @param[out]  job     segment job to be finalized
  * @return      always 0
  */
-int camogm_end_kml(camogm_state *state)
+int camogm_end_kml(camogm_state *state, struct segment_job *job)
 {
 
 	if (state->kml_file) {
 		fprintf(state->kml_file, "</Document>\n");
 		fprintf(state->kml_file, "</kml>\n");
-		fclose(state->kml_file);
+		job->kml_file = state->kml_file;
 		state->kml_file = NULL;
 	}
 	return 0;
@@ -19,11 +19,12 @@
 #define _CAMOGM_KML_H
 
 #include "camogm.h"
+#include "camogm_finalize.h"
 
 int camogm_init_kml(void);
 int camogm_start_kml(camogm_state *state);
 int camogm_frame_kml(camogm_state *state);
-int camogm_end_kml(camogm_state *state);
+int camogm_end_kml(camogm_state *state, struct segment_job *job);
 void camogm_free_kml(void);
 
 #endif /* _CAMOGM_KML_H */
@@ -0,0 +1,162 @@
+/** @file camogm_latency.c
+ * @brief Log-linear histograms for recording pipeline latencies
+ * @copyright Copyright (C) 2017 Elphel, Inc.
+ *
+ * @par <b>License</b>
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include "camogm_latency.h"
+
+/** @brief The largest value that can be counted, larger values go to the last bucket */
+#define HIST_MAX_VALUE            ((1ULL << (HIST_SUB_BITS + HIST_RANGES)) - 1)
+
+/** Stage names used in status reports, in the order of #latency_stage */
+static const char *stage_names[LAT_STAGES] = {
+	[LAT_CAPTURE] = "capture_to_harvest",
+	[LAT_PREPARE] = "harvest_to_aligned",
+	[LAT_QUEUE]   = "queue_wait",
+	[LAT_WRITE]   = "write"
+};
+
+/**
+ * @brief Return monotonic time used for latency measurements
+ * @return      time in microseconds
+ */
+uint64_t lat_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/** Return bucket index of a value */
+static int hist_index(uint32_t val)
+{
+	int msb;
+
+	if (val < HIST_SUB)
+		return val;
+	msb = 31 - __builtin_clz(val);
+	return HIST_SUB * (msb - HIST_SUB_BITS + 1) + ((val >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/**
+ * @brief Return the largest value counted in a bucket
+ * @param[in]   idx   bucket index
+ * @return      upper limit of the bucket, in microseconds
+ */
+uint32_t hist_bucket_limit(int idx)
+{
+	int range, sub;
+
+	if (idx < HIST_SUB)
+		return idx;
+	range = idx / HIST_SUB - 1;
+	sub = idx % HIST_SUB;
+	return ((uint32_t)(HIST_SUB + sub + 1) << range) - 1;
+}
+
+/**
+ * @brief Add a value to histogram. Negative values (i.e. from unsynchronized clocks) are ignored.
+ * @param[in]   h      histogram
+ * @param[in]   usec   value in microseconds
+ * @return      None
+ */
+void hist_add(struct latency_hist *h, int64_t usec)
+{
+	uint32_t val;
+
+	if (usec < 0)
+		return;
+	val = (usec > HIST_MAX_VALUE) ? HIST_MAX_VALUE : usec;
+	__atomic_fetch_add(&h->count[hist_index(val)], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->sum, val, __ATOMIC_RELAXED);
+	if (val > __atomic_load_n(&h->max, __ATOMIC_RELAXED))
+		__atomic_store_n(&h->max, val, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Clear histogram. Values added concurrently by other threads can be lost.
+ * @param[in]   h      histogram
+ * @return      None
+ */
+void hist_reset(struct latency_hist *h)
+{
+	for (int i = 0; i < HIST_BUCKETS; i++)
+		__atomic_store_n(&h->count[i], 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&h->sum, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&h->max, 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Calculate the number of values, mean, maximum and percentiles. Percentiles are reported as
+ * the upper limit of the bucket they fall into.
+ * @param[in]   h      histogram
+ * @param[out]  s      summary
+ * @return      None
+ */
+void hist_summary(const struct latency_hist *h, struct hist_summary *s)
+{
+	uint32_t count[HIST_BUCKETS];
+	uint64_t total = 0;
+	uint64_t sum, acc = 0;
+	uint64_t rank50, rank99, rank999;
+
+	memset(s, 0, sizeof(struct hist_summary));
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		count[i] = __atomic_load_n(&h->count[i], __ATOMIC_RELAXED);
+		total += count[i];
+	}
+	if (total == 0)
+		return;
+	sum = __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+	s->count = total;
+	s->mean = sum / total;
+	s->max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+	// the rank of a percentile, rounded up so that p99.9 of less than 1000 values is the maximum
+	rank50 = (total * 500 + 999) / 1000;
+	rank99 = (total * 990 + 999) / 1000;
+	rank999 = (total * 999 + 999) / 1000;
+	for (int i = 0; i < HIST_BUCKETS && acc < rank999; i++) {
+		if (count[i] == 0)
+			continue;
+		if (acc < rank50 && acc + count[i] >= rank50)
+			s->p50 = hist_bucket_limit(i);
+		if (acc < rank99 && acc + count[i] >= rank99)
+			s->p99 = hist_bucket_limit(i);
+		if (acc + count[i] >= rank999)
+			s->p999 = hist_bucket_limit(i);
+		acc += count[i];
+	}
+	// bucket limit can exceed the largest value seen
+	if (s->p50 > s->max) s->p50 = s->max;
+	if (s->p99 > s->max) s->p99 = s->max;
+	if (s->p999 > s->max) s->p999 = s->max;
+}
+
+/**
+ * @brief Return stage name used in status reports
+ * @param[in]   stage   pipeline stage, one of #latency_stage
+ * @return      stage name
+ */
+const char *lat_stage_name(int stage)
+{
+	if (stage < 0 || stage >= LAT_STAGES)
+		return "unknown";
+	return stage_names[stage];
+}
@@ -0,0 +1,76 @@
+/** @file camogm_latency.h
+ * @brief Log-linear histograms for recording pipeline latencies
+ * @copyright Copyright (C) 2017 Elphel, Inc.
+ *
+ * @par <b>License</b>
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CAMOGM_LATENCY_H
+#define _CAMOGM_LATENCY_H
+
+#include <stdint.h>
+
+/** @brief The number of bits in histogram sub-bucket index, the precision of a bucket is 1/(2^HIST_SUB_BITS) */
+#define HIST_SUB_BITS             4
+/** @brief The number of sub-buckets in each power of 2 range */
+#define HIST_SUB                  (1 << HIST_SUB_BITS)
+/** @brief The number of power of 2 ranges above linear range, values up to 2^(HIST_SUB_BITS + HIST_RANGES) us are counted */
+#define HIST_RANGES               24
+/** @brief Total number of histogram buckets */
+#define HIST_BUCKETS              (HIST_SUB * (HIST_RANGES + 1))
+
+/**
+ * @enum latency_stage
+ * @brief Recording pipeline stages with latency histograms
+ */
+enum latency_stage {
+	LAT_CAPTURE,                                 ///< from frame timestamp to the moment it is taken from circbuf
+	LAT_PREPARE,                                 ///< from taking the frame to the moment it is aligned (raw device) or passed to muxer
+	LAT_QUEUE,                                   ///< waiting for writer thread to accept the frame (raw device only)
+	LAT_WRITE,                                   ///< writev() to raw device or muxer write call
+	LAT_STAGES                                   ///< the number of stages
+};
+
+/**
+ * @struct latency_hist
+ * @brief Histogram of values in microseconds. Buckets are exact below #HIST_SUB and then each power of 2
+ * range is split into #HIST_SUB buckets. Updated with relaxed atomic operations, so it can be read
+ * and reset from any thread.
+ */
+struct latency_hist {
+	uint32_t count[HIST_BUCKETS];                ///< the number of values in each bucket
+	uint32_t max;                                ///< maximal value
+	uint64_t sum;                                ///< sum of all values
+};
+
+/**
+ * @struct hist_summary
+ * @brief Histogram summary for status reports, all values are in microseconds
+ */
+struct hist_summary {
+	uint32_t count;                              ///< the number of values
+	uint32_t mean;                               ///< mean value
+	uint32_t p50;                                ///< median
+	uint32_t p99;                                ///< 99th percentile
+	uint32_t p999;                               ///< 99.9th percentile
+	uint32_t max;                                ///< maximal value
+};
+
+uint64_t lat_time(void);
+void hist_add(struct latency_hist *h, int64_t usec);
+void hist_reset(struct latency_hist *h);
+void hist_summary(const struct latency_hist *h, struct hist_summary *s);
+uint32_t hist_bucket_limit(int idx);
+const char *lat_stage_name(int stage);
+
+#endif /* _CAMOGM_LATENCY_H */
@@ -0,0 +1,449 @@
+/** @file camogm_log.c
+ * @brief Asynchronous debug output
+ * @copyright Copyright (C) 2017 Elphel, Inc.
+ *
+ * @par <b>License</b>
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Each thread puts its debug messages to its own single producer, single consumer ring buffer, so
+ * recording threads never take locks or wait for debug file. Text messages are formatted by the thread
+ * to a thread local memory stream, binary messages keep format string pointer and integer arguments
+ * and are formatted later. Log thread periodically takes messages from all buffers in the order they were
+ * put and writes them to debug file. If a buffer is full the message is dropped and counted. Buffers
+ * of finished threads are released when they are empty and can be taken by new threads.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "camogm_log.h"
+
+/** @brief Message buffer states */
+enum log_ring_state {
+	RING_FREE,                                   ///< buffer is not used
+	RING_USED,                                   ///< buffer is used by a thread
+	RING_ORPHANED                                ///< the thread has finished, buffer is released when it is empty
+};
+
+/** @brief Message record types */
+enum log_rec_type {
+	REC_SKIP,                                    ///< the rest of buffer is not used, the next record is at buffer start
+	REC_TEXT,                                    ///< formatted text
+	REC_BINARY                                   ///< format string and integer arguments
+};
+
+/**
+ * @struct log_rec
+ * @brief Message record header, followed by nul terminated text or integer arguments
+ */
+struct log_rec {
+	uint32_t seq;                                ///< message sequence number used to merge messages from different threads
+	uint16_t len;                                ///< record length including header, multiple of 8 bytes
+	uint8_t type;                                ///< record type, one of #log_rec_type
+	uint8_t nargs;                               ///< the number of arguments of binary message
+	const char *fmt;                             ///< format string of binary message
+};
+
+/** @brief Record header length, records are aligned to 8 bytes */
+#define REC_HDR_LEN               ((sizeof(struct log_rec) + 7) & ~7)
+
+/**
+ * @struct log_ring
+ * @brief Message buffer of one thread
+ */
+struct log_ring {
+	int state;                                   ///< buffer state, one of #log_ring_state
+	uint32_t head;                               ///< the position of the next record to put, changed by producer only
+	uint32_t tail;                               ///< the position of the next record to take, changed by consumer only
+	uint32_t dropped;                            ///< the number of messages dropped because the buffer was full
+	uint32_t dropped_reported;                   ///< the number of dropped messages already reported, used by consumer only
+	uint64_t data[LOG_RING_SIZE / sizeof(uint64_t)]; ///< records
+};
+
+/**
+ * @struct log_local
+ * @brief Thread local data
+ */
+struct log_local {
+	struct log_ring *ring;                       ///< message buffer of the thread, NULL if not taken yet
+	FILE *f;                                     ///< memory stream used to format text messages
+	int depth;                                   ///< nesting depth of text messages
+	char buf[LOG_LINE_MAX];                      ///< memory stream buffer
+};
+
+/**
+ * @struct log_cursor
+ * @brief Read position of one buffer used while merging messages
+ */
+struct log_cursor {
+	struct log_ring *ring;                       ///< message buffer
+	uint32_t pos;                                ///< current read position
+	uint32_t end;                                ///< buffer head at the moment the merging started
+};
+
+static struct log_ring rings[LOG_MAX_THREADS];
+static __thread struct log_local loc;
+static pthread_key_t log_key;
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static uint32_t log_seq;
+static uint32_t no_ring_dropped;
+static uint32_t no_ring_reported;
+static bool log_async;
+
+/** Release thread buffer and memory stream when the thread exits */
+static void log_thread_exit(void *arg)
+{
+	struct log_local *l = arg;
+
+	if (l->f != NULL) {
+		fclose(l->f);
+		l->f = NULL;
+	}
+	if (l->ring != NULL) {
+		__atomic_store_n(&l->ring->state, RING_ORPHANED, __ATOMIC_RELEASE);
+		l->ring = NULL;
+	}
+}
+
+/** Create the key used to get notified when threads exit */
+static void log_key_create(void)
+{
+	pthread_key_create(&log_key, log_thread_exit);
+}
+
+/** Register thread local data so that it is released when the thread exits */
+static void log_register(void)
+{
+	pthread_once(&log_once, log_key_create);
+	pthread_setspecific(log_key, &loc);
+}
+
+/** Return thread buffer, take a free one if the thread does not have it yet */
+static struct log_ring *log_ring(void)
+{
+	int state;
+
+	if (loc.ring != NULL)
+		return loc.ring;
+	for (int i = 0; i < LOG_MAX_THREADS; i++) {
+		state = RING_FREE;
+		if (__atomic_compare_exchange_n(&rings[i].state, &state, RING_USED, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			loc.ring = &rings[i];
+			log_register();
+			break;
+		}
+	}
+	return loc.ring;
+}
+
+/** Return a pointer to record at given buffer position */
+static inline struct log_rec *rec_ptr(struct log_ring *ring, uint32_t pos)
+{
+	return (struct log_rec *)((char *)ring->data + (pos & (LOG_RING_SIZE - 1)));
+}
+
+/** Put a record to thread buffer, the record is dropped if there is not enough space */
+static void log_put(int type, const char *fmt, const void *payload, size_t size, int nargs)
+{
+	uint32_t head, tail, len, skip = 0;
+	struct log_rec *rec;
+	struct log_ring *ring = log_ring();
+
+	if (ring == NULL) {
+		__atomic_fetch_add(&no_ring_dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	len = REC_HDR_LEN + ((size + 7) & ~7);
+	head = ring->head;
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	// records are not split, the rest of buffer is skipped if the record does not fit
+	if ((head & (LOG_RING_SIZE - 1)) + len > LOG_RING_SIZE)
+		skip = LOG_RING_SIZE - (head & (LOG_RING_SIZE - 1));
+	if (head + skip + len - tail > LOG_RING_SIZE) {
+		__atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+		return;
+	}
+	if (skip) {
+		// only the first 8 bytes of header are used in skip record
+		rec = rec_ptr(ring, head);
+		rec->len = skip;
+		rec->type = REC_SKIP;
+		head += skip;
+	}
+	rec = rec_ptr(ring, head);
+	rec->seq = __atomic_fetch_add(&log_seq, 1, __ATOMIC_RELAXED);
+	rec->len = len;
+	rec->type = type;
+	rec->nargs = nargs;
+	rec->fmt = fmt;
+	memcpy((char *)rec + REC_HDR_LEN, payload, size);
+	__atomic_store_n(&ring->head, head + len, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Start text message, called by #DL macro. Messages can be nested, i.e. if the message
+ * statement calls a function with its own debug output, the output is appended to the outer message.
+ * @return      thread local stream the message should be written to or NULL if it can not be created
+ */
+FILE *log_begin(void)
+{
+	if (loc.depth++ == 0) {
+		if (loc.f == NULL) {
+			loc.f = fmemopen(loc.buf, LOG_LINE_MAX, "w");
+			log_register();
+		} else {
+			rewind(loc.f);
+		}
+	}
+	return loc.f;
+}
+
+/**
+ * @brief Finish text message and put it to thread buffer, called by #DL macro
+ * @return      None
+ */
+void log_end(void)
+{
+	long len;
+
+	if (--loc.depth > 0 || loc.f == NULL)
+		return;
+	fflush(loc.f);
+	len = ftell(loc.f);
+	if (len < 0 || len >= LOG_LINE_MAX)
+		len = LOG_LINE_MAX - 1;
+	if (len > 0) {
+		loc.buf[len] = '\0';
+		log_put(REC_TEXT, NULL, loc.buf, len + 1, 0);
+	}
+	if (!log_async)
+		log_flush();
+}
+
+/**
+ * @brief Put binary message to thread buffer, called by #DB macro
+ * @param[in]   fmt     format string, should not be freed or changed as it is used later
+ * @param[in]   args    integer arguments
+ * @param[in]   nargs   the number of arguments, only first #LOG_MAX_ARGS are used
+ * @return      None
+ */
+void log_binary(const char *fmt, const int64_t *args, int nargs)
+{
+	if (nargs > LOG_MAX_ARGS)
+		nargs = LOG_MAX_ARGS;
+	log_put(REC_BINARY, fmt, args, nargs * sizeof(int64_t), nargs);
+	if (!log_async)
+		log_flush();
+}
+
+/** Convert integer argument according to length modifier and conversion type, as it would be passed to printf */
+static long long log_arg(int64_t val, const char *mod, char conv)
+{
+	bool is_signed = (conv == 'd' || conv == 'i');
+
+	if (strcmp(mod, "hh") == 0)
+		return is_signed ? (long long)(signed char)val : (long long)(unsigned char)val;
+	if (strcmp(mod, "h") == 0)
+		return is_signed ? (long long)(short)val : (long long)(unsigned short)val;
+	if (strcmp(mod, "l") == 0)
+		return is_signed ? (long long)(long)val : (long long)(unsigned long)val;
+	if (strcmp(mod, "z") == 0)
+		return is_signed ? (long long)(ssize_t)val : (long long)(size_t)val;
+	if (strcmp(mod, "ll") == 0 || strcmp(mod, "j") == 0 || strcmp(mod, "q") == 0 || strcmp(mod, "t") == 0)
+		return val;
+	return is_signed ? (long long)(int)val : (long long)(unsigned int)val;
+}
+
+/**
+ * Format binary message. Only integer conversions are supported, as all the arguments are stored as integers;
+ * other conversions are printed as '?' and consume an argument.
+ */
+static void log_format(FILE *f, const char *fmt, const int64_t *args, int nargs)
+{
+	int n, arg = 0;
+	char spec[32];
+	char mod[4];
+	const char *p = fmt;
+	const char *start;
+
+	while (*p) {
+		if (*p != '%') {
+			n = strcspn(p, "%");
+			fwrite(p, 1, n, f);
+			p += n;
+			continue;
+		}
+		start = p++;
+		if (*p == '%') {
+			fputc('%', f);
+			p++;
+			continue;
+		}
+		p += strspn(p, "-+ #0");
+		p += strspn(p, "0123456789.");
+		n = strspn(p, "hljztq");
+		if (n >= sizeof(mod) || p[n] == '\0' || (p - start) + 3 >= sizeof(spec)) {
+			// malformed or too long specification, print the rest as is
+			fputs(start, f);
+			break;
+		}
+		memcpy(mod, p, n);
+		mod[n] = '\0';
+		// copy flags, width and precision and print the argument as long long
+		memcpy(spec, start, p - start);
+		sprintf(spec + (p - start), "ll%c", p[n]);
+		if (strchr("diouxXc", p[n]) != NULL) {
+			if (p[n] == 'c')
+				fputc((int)(arg < nargs ? args[arg] : 0), f);
+			else
+				fprintf(f, spec, arg < nargs ? log_arg(args[arg], mod, p[n]) : 0LL);
+		} else {
+			fputc('?', f);
+		}
+		arg++;
+		p += n + 1;
+	}
+}
+
+/** Return the next record of the buffer or NULL if there are no more records */
+static struct log_rec *log_peek(struct log_cursor *c)
+{
+	struct log_rec *rec;
+
+	while (c->pos != c->end) {
+		rec = rec_ptr(c->ring, c->pos);
+		if (rec->type != REC_SKIP)
+			return rec;
+		c->pos += rec->len;
+		__atomic_store_n(&c->ring->tail, c->pos, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+/**
+ * @brief Write messages from all thread buffers to debug file in the order they were put. Called by log
+ * thread periodically, at exit and when debug file is changed, and by the thread which puts a message
+ * if log thread is not running.
+ * @return      None
+ */
+void log_flush(void)
+{
+	int num = 0;
+	int state;
+	uint32_t dropped;
+	struct log_cursor cursors[LOG_MAX_THREADS];
+	struct log_cursor *next;
+	struct log_rec *rec, *next_rec;
+
+	pthread_mutex_lock(&print_mutex);
+	for (int i = 0; i < LOG_MAX_THREADS; i++) {
+		if (__atomic_load_n(&rings[i].state, __ATOMIC_ACQUIRE) == RING_FREE)
+			continue;
+		cursors[num].ring = &rings[i];
+		cursors[num].pos = rings[i].tail;
+		cursors[num].end = __atomic_load_n(&rings[i].head, __ATOMIC_ACQUIRE);
+		num++;
+	}
+
+	while (true) {
+		next = NULL;
+		next_rec = NULL;
+		for (int i = 0; i < num; i++) {
+			rec = log_peek(&cursors[i]);
+			if (rec != NULL && (next_rec == NULL || (int32_t)(rec->seq - next_rec->seq) < 0)) {
+				next = &cursors[i];
+				next_rec = rec;
+			}
+		}
+		if (next == NULL)
+			break;
+		if (debug_file) {
+			if (next_rec->type == REC_TEXT)
+				fputs((char *)next_rec + REC_HDR_LEN, debug_file);
+			else
+				log_format(debug_file, next_rec->fmt, (int64_t *)((char *)next_rec + REC_HDR_LEN), next_rec->nargs);
+		}
+		next->pos += next_rec->len;
+		__atomic_store_n(&next->ring->tail, next->pos, __ATOMIC_RELEASE);
+	}
+
+	for (int i = 0; i < num; i++) {
+		dropped = __atomic_load_n(&cursors[i].ring->dropped, __ATOMIC_RELAXED);
+		if (dropped != cursors[i].ring->dropped_reported && debug_file)
+			fprintf(debug_file, "%u debug messages dropped\n", dropped - cursors[i].ring->dropped_reported);
+		cursors[i].ring->dropped_reported = dropped;
+		// buffers of finished threads are released when all their messages are written
+		state = RING_ORPHANED;
+		if (cursors[i].pos == __atomic_load_n(&cursors[i].ring->head, __ATOMIC_ACQUIRE))
+			__atomic_compare_exchange_n(&cursors[i].ring->state, &state, RING_FREE, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+	}
+	dropped = __atomic_load_n(&no_ring_dropped, __ATOMIC_RELAXED);
+	if (dropped != no_ring_reported && debug_file)
+		fprintf(debug_file, "%u debug messages dropped, too many threads\n", dropped - no_ring_reported);
+	no_ring_reported = dropped;
+
+	if (debug_file)
+		fflush(debug_file);
+	pthread_mutex_unlock(&print_mutex);
+}
+
+/** Log thread, writes messages to debug file periodically */
+static void *log_thread(void *arg)
+{
+	struct timespec ts = {.tv_sec = 0, .tv_nsec = LOG_FLUSH_PERIOD * 1000000};
+
+	while (true) {
+		nanosleep(&ts, NULL);
+		log_flush();
+	}
+	return NULL;
+}
+
+/**
+ * @brief Start log thread. Debug messages are written synchronously by the threads which put
+ * them until log thread is started or if it can not be started.
+ * @return      0 if log thread was started and -1 otherwise
+ */
+int log_init(void)
+{
+	pthread_t tid;
+	pthread_attr_t attr;
+
+	if (log_async)
+		return 0;
+	if (pthread_attr_init(&attr) != 0)
+		return -1;
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&tid, &attr, log_thread, NULL) == 0) {
+		log_async = true;
+		atexit(log_flush);
+	}
+	pthread_attr_destroy(&attr);
+
+	return log_async ? 0 : -1;
+}
+
+/**
+ * @brief Return the number of debug messages dropped since start
+ * @return      the number of dropped messages
+ */
+unsigned int log_dropped(void)
+{
+	unsigned int dropped = __atomic_load_n(&no_ring_dropped, __ATOMIC_RELAXED);
+
+	for (int i = 0; i < LOG_MAX_THREADS; i++)
+		dropped += __atomic_load_n(&rings[i].dropped, __ATOMIC_RELAXED);
+	return dropped;
+}
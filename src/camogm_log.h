@@ -0,0 +1,79 @@
+/** @file camogm_log.h
+ * @brief Asynchronous debug output
+ * @copyright Copyright (C) 2017 Elphel, Inc.
+ *
+ * @par <b>License</b>
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CAMOGM_LOG_H
+#define _CAMOGM_LOG_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/** @brief Debug messages with levels above this one are removed at compile time, i.e. build with -DLOG_MAX_LEVEL=2 */
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL             6
+#endif
+/** @brief The maximal number of threads which can have debug message buffers at the same time */
+#define LOG_MAX_THREADS           16
+/** @brief The size of debug message buffer of each thread, must be a power of 2 */
+#define LOG_RING_SIZE             16384
+/** @brief The maximal length of one text message, longer messages are truncated */
+#define LOG_LINE_MAX              1024
+/** @brief The maximal number of arguments of binary message */
+#define LOG_MAX_ARGS              8
+/** @brief Debug output flush period, in milliseconds */
+#define LOG_FLUSH_PERIOD          20
+
+/** @brief True if messages of given level should be output */
+#define LOG_ON(level) ((level) <= LOG_MAX_LEVEL && debug_file && ((level) == 0 || debug_level >= (level)))
+
+/**
+ * @brief Output debug message of given level. The statement @e x writes to @e debug_file which is replaced
+ * by thread local memory stream here, the message is then put to thread buffer and written to the real
+ * debug file by log thread. The statement is not executed if the level is disabled.
+ */
+#define DL(level, x) { if (LOG_ON(level)) { FILE *debug_file = log_begin(); if (debug_file) { x; } log_end(); } }
+
+/**
+ * @brief Output debug message with integer arguments without formatting. Format string must be
+ * a string literal, the arguments are formatted by log thread. The call of fprintf is never executed,
+ * it lets compiler check the format string against the arguments.
+ */
+#define DB(level, fmt, ...) { if (0) fprintf(stderr, fmt, ##__VA_ARGS__); \
+	if (LOG_ON(level)) { const int64_t _log_args[] = {0, ##__VA_ARGS__}; \
+	log_binary(fmt, &_log_args[1], sizeof(_log_args) / sizeof(_log_args[0]) - 1); } }
+
+#define D(x)  DL(1, x)
+#define D0(x) DL(0, x)
+#define D1(x) DL(1, x)
+#define D2(x) DL(2, x)
+#define D3(x) DL(3, x)
+#define D4(x) DL(4, x)
+#define D5(x) DL(5, x)
+#define D6(x) DL(6, x)
+
+extern int debug_level;
+extern FILE* debug_file;
+extern pthread_mutex_t print_mutex;
+
+int log_init(void);
+FILE *log_begin(void);
+void log_end(void);
+void log_binary(const char *fmt, const int64_t *args, int nargs);
+void log_flush(void);
+unsigned int log_dropped(void);
+
+#endif /* _CAMOGM_LOG_H */
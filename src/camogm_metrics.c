@@ -0,0 +1,430 @@
+/** @file camogm_metrics.c
+ * @brief Recording metrics in Prometheus text format served on local socket
+ * @copyright Copyright (C) 2017 Elphel, Inc.
+ *
+ * @par <b>License</b>
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Metrics socket is either a TCP socket (address given as @e [host:]port) or a Unix domain socket
+ * (address is a file name). A client sends HTTP GET request (any path) and gets metrics page in Prometheus
+ * text exposition format, then the connection is closed. Requests that are not HTTP get just the page.
+ * The page is built from status counters published by capture thread and does not take any locks.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "camogm_metrics.h"
+#include "camogm_control.h"
+#include "camogm_events.h"
+#include "camogm_finalize.h"
+
+/** @brief The size of request buffer, only request line is needed and the rest is discarded */
+#define METRICS_BUFF_SIZE         512
+/** @brief Time to wait for a client to read the page, in seconds */
+#define METRICS_SEND_TIMEOUT      1
+/** @brief Histogram bucket limits in Prometheus output are powers of 2 microseconds, from 2^METRICS_LE_FIRST */
+#define METRICS_LE_FIRST          5
+/** @brief The last histogram bucket limit power of 2 */
+#define METRICS_LE_LAST           25
+/** @brief Step between histogram bucket limit powers of 2 */
+#define METRICS_LE_STEP           2
+
+/**
+ * @struct metrics_client
+ * @brief Metrics connection waiting for request
+ */
+struct metrics_client {
+	int fd;                                      ///< connection socket, -1 if the slot is free
+	int len;                                     ///< the number of bytes in request buffer
+	char buff[METRICS_BUFF_SIZE];                ///< request buffer
+};
+
+/**
+ * @struct metrics_server
+ * @brief Listening socket and its connections
+ */
+struct metrics_server {
+	int fd;                                      ///< listening socket, -1 if metrics socket is not open
+	char path[ELPHEL_PATH_MAX];                  ///< socket file name, empty for TCP socket
+	struct metrics_client clients[METRICS_MAX_CLIENTS];  ///< active connections
+};
+
+static struct metrics_server mtr = {
+	.fd = -1,
+	.clients = {[0 ... METRICS_MAX_CLIENTS - 1] = {.fd = -1}}
+};
+
+/** Error names used as label values, in the order of error codes */
+static const char *error_names[CAMOGM_ERRNUM] = {
+	[CAMOGM_FRAME_NOT_READY] = "frame_not_ready",
+	[CAMOGM_FRAME_INVALID]   = "frame_invalid",
+	[CAMOGM_FRAME_CHANGED]   = "frame_changed",
+	[CAMOGM_FRAME_NEXTFILE]  = "frame_nextfile",
+	[CAMOGM_FRAME_BROKEN]    = "frame_broken",
+	[CAMOGM_FRAME_FILE_ERR]  = "frame_file_err",
+	[CAMOGM_FRAME_MALLOC]    = "frame_malloc",
+	[CAMOGM_TOO_EARLY]       = "frame_too_early",
+	[CAMOGM_FRAME_OTHER]     = "frame_other",
+	[CAMOGM_NO_SPACE]        = "frame_nospace"
+};
+
+/** Bind TCP socket to [host:]port address */
+static int open_tcp(const char *addr)
+{
+	int fd;
+	int on = 1;
+	const char *port = strrchr(addr, ':');
+	struct sockaddr_in sa = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_ANY)};
+	char host[INET_ADDRSTRLEN];
+
+	if (port != NULL) {
+		if (port - addr >= INET_ADDRSTRLEN)
+			return -1;
+		memcpy(host, addr, port - addr);
+		host[port - addr] = '\0';
+		if (host[0] != '\0' && inet_pton(AF_INET, host, &sa.sin_addr) != 1)
+			return -1;
+		port++;
+	} else {
+		port = addr;
+	}
+	sa.sin_port = htons(strtol(port, NULL, 10));
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		return -1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/** Bind Unix domain socket to file name, existing file is replaced */
+static int open_unix(const char *path)
+{
+	int fd;
+	struct sockaddr_un sa = {.sun_family = AF_UNIX};
+
+	if (strlen(path) >= sizeof(sa.sun_path))
+		return -1;
+	strcpy(sa.sun_path, path);
+	unlink(path);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return -1;
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+		close(fd);
+		return -1;
+	}
+	strncpy(mtr.path, path, ELPHEL_PATH_MAX - 1);
+	return fd;
+}
+
+/**
+ * @brief Create metrics socket
+ * @param[in]   addr   file name of Unix domain socket or [host:]port of TCP socket
+ * @return      0 if the socket is ready and -1 otherwise
+ */
+int metrics_open(const char *addr)
+{
+	bool tcp = strchr(addr, '/') == NULL && strspn(addr, "0123456789.:") == strlen(addr);
+
+	mtr.path[0] = '\0';
+	mtr.fd = tcp ? open_tcp(addr) : open_unix(addr);
+	if (mtr.fd < 0 || listen(mtr.fd, METRICS_MAX_CLIENTS) < 0) {
+		D0(fprintf(debug_file, "Can not open metrics socket %s: %s\n", addr, strerror(errno)));
+		if (mtr.fd >= 0)
+			close(mtr.fd);
+		mtr.fd = -1;
+		return -1;
+	}
+	fcntl(mtr.fd, F_SETFL, O_NONBLOCK);
+	D0(fprintf(debug_file, "Metrics socket %s open\n", addr));
+
+	return 0;
+}
+
+/**
+ * @brief Close metrics socket and all connections
+ * @return      None
+ */
+void metrics_close(void)
+{
+	for (int i = 0; i < METRICS_MAX_CLIENTS; i++) {
+		if (mtr.clients[i].fd >= 0)
+			close(mtr.clients[i].fd);
+		mtr.clients[i].fd = -1;
+	}
+	if (mtr.fd >= 0) {
+		close(mtr.fd);
+		if (mtr.path[0] != '\0')
+			unlink(mtr.path);
+	}
+	mtr.fd = -1;
+}
+
+/**
+ * @brief Fill poll descriptors for listening socket and connections
+ * @param[out]  pfd   array of at least #METRICS_POLL_FDS poll descriptors
+ * @return      the number of descriptors filled
+ */
+int metrics_poll_fds(struct pollfd *pfd)
+{
+	int num = 0;
+
+	if (mtr.fd < 0)
+		return 0;
+	pfd[num].fd = mtr.fd;
+	pfd[num++].events = POLLIN;
+	for (int i = 0; i < METRICS_MAX_CLIENTS; i++) {
+		if (mtr.clients[i].fd >= 0) {
+			pfd[num].fd = mtr.clients[i].fd;
+			pfd[num++].events = POLLIN;
+		}
+	}
+	return num;
+}
+
+/** Write metric description */
+static void put_header(FILE *f, const char *name, const char *type, const char *help)
+{
+	fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/** Write per port metric */
+static void put_port_metric(FILE *f, const char *name, const char *type, const char *help, const uint64_t *val)
+{
+	put_header(f, name, type, help);
+	for (int chn = 0; chn < SENSOR_PORTS; chn++)
+		fprintf(f, "%s{port=\"%d\"} %llu\n", name, chn, (unsigned long long)val[chn]);
+}
+
+/** Write metric without labels */
+static void put_metric(FILE *f, const char *name, const char *type, const char *help, uint64_t val)
+{
+	put_header(f, name, type, help);
+	fprintf(f, "%s %llu\n", name, (unsigned long long)val);
+}
+
+/** Write latency histogram of one pipeline stage, bucket limits are converted to seconds */
+static void put_histogram(FILE *f, const char *name, const char *stage, const struct latency_hist *h)
+{
+	int idx = 0;
+	uint64_t acc = 0;
+	uint64_t limit;
+
+	for (int p = METRICS_LE_FIRST; p <= METRICS_LE_LAST; p += METRICS_LE_STEP) {
+		// bucket limits are one less than a power of 2 at power of 2 boundaries
+		limit = 1ULL << p;
+		for (; idx < HIST_BUCKETS && hist_bucket_limit(idx) < limit; idx++)
+			acc += __atomic_load_n(&h->count[idx], __ATOMIC_RELAXED);
+		fprintf(f, "%s_bucket{stage=\"%s\",le=\"%llu.%06llu\"} %llu\n", name, stage,
+				(unsigned long long)(limit / 1000000), (unsigned long long)(limit % 1000000), (unsigned long long)acc);
+	}
+	for (; idx < HIST_BUCKETS; idx++)
+		acc += __atomic_load_n(&h->count[idx], __ATOMIC_RELAXED);
+	fprintf(f, "%s_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n", name, stage, (unsigned long long)acc);
+	limit = __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+	fprintf(f, "%s_sum{stage=\"%s\"} %llu.%06llu\n", name, stage,
+			(unsigned long long)(limit / 1000000), (unsigned long long)(limit % 1000000));
+	fprintf(f, "%s_count{stage=\"%s\"} %llu\n", name, stage, (unsigned long long)acc);
+}
+
+/**
+ * @brief Write metrics page in Prometheus text format. Called by control thread, values are taken
+ * from status counters.
+ * @param[in]   state   a pointer to a structure containing current state
+ * @param[in]   f       output stream
+ * @return      None
+ */
+void metrics_write(camogm_state *state, FILE *f)
+{
+	const char *states[] = {"stopped", "starting", "running", "reading"};
+	const char *curr_state = camogm_state_name(state->prog_state);
+	uint64_t val[SENSOR_PORTS];
+	struct camogm_counters *cnt = &state->cnt;
+	struct camogm_seg_info info;
+	struct finalizer_stat fin_stat;
+
+	counters_get_info(cnt, &info);
+	finalizer_get_stat(&fin_stat);
+
+	put_header(f, "camogm_state", "gauge", "Program state, 1 for current state");
+	for (int i = 0; i < sizeof(states) / sizeof(states[0]); i++)
+		fprintf(f, "camogm_state{state=\"%s\"} %d\n", states[i], strcmp(states[i], curr_state) == 0);
+
+	for (int chn = 0; chn < SENSOR_PORTS; chn++)
+		val[chn] = (info.active_chn >> chn) & 1;
+	put_port_metric(f, "camogm_port_active", "gauge", "Sensor port is enabled for recording", val);
+	for (int chn = 0; chn < SENSOR_PORTS; chn++)
+		val[chn] = CNT_GET(cnt->frames[chn]);
+	put_port_metric(f, "camogm_frames_total", "counter", "Frames recorded", val);
+	for (int chn = 0; chn < SENSOR_PORTS; chn++)
+		val[chn] = CNT_GET(cnt->bytes[chn]);
+	put_port_metric(f, "camogm_bytes_total", "counter", "JPEG data bytes recorded", val);
+	for (int chn = 0; chn < SENSOR_PORTS; chn++)
+		val[chn] = CNT_GET(cnt->stuffing[chn]);
+	put_port_metric(f, "camogm_stuffing_bytes_total", "counter", "Bytes added to align frames on raw device", val);
+	for (int chn = 0; chn < SENSOR_PORTS; chn++)
+		val[chn] = CNT_GET(cnt->overruns[chn]);
+	put_port_metric(f, "camogm_drops_total", "counter", "Circbuf overruns, recording skipped to the latest frames", val);
+	for (int chn = 0; chn < SENSOR_PORTS; chn++)
+		val[chn] = CNT_GET(cnt->buf_min[chn]);
+	put_port_metric(f, "camogm_circbuf_free_min_bytes", "gauge", "Minimal free space in circbuf since the last status report", val);
+
+	put_header(f, "camogm_errors_total", "counter", "Frame errors by error code");
+	for (int chn = 0; chn < SENSOR_PORTS; chn++) {
+		for (int i = 1; i < CAMOGM_ERRNUM; i++)
+			fprintf(f, "camogm_errors_total{port=\"%d\",error=\"%s\"} %u\n", chn, error_names[i],
+					CNT_GET(cnt->error_stat[chn][i]));
+	}
+	put_metric(f, "camogm_last_error_code", "gauge", "Last error code, port number times 100 is added", CNT_GET(cnt->last_error_code));
+
+	put_metric(f, "camogm_writer_queue_depth", "gauge", "Frames waiting for raw device writer thread",
+			__atomic_load_n(&state->writer_params.data_ready, __ATOMIC_RELAXED) ? 1 : 0);
+	put_metric(f, "camogm_segments_pending", "gauge", "File segments waiting for finalization", fin_stat.pending);
+	put_metric(f, "camogm_segments_finalized_total", "counter", "File segments finalized", fin_stat.done);
+	put_metric(f, "camogm_segment_errors_total", "counter", "File segments finalized with errors", fin_stat.errors);
+	put_metric(f, "camogm_events_dropped_total", "counter", "Events not delivered to subscribers because event queue was full",
+			events_dropped());
+	put_metric(f, "camogm_log_dropped_total", "counter", "Debug messages dropped because thread log buffer was full", log_dropped());
+	put_metric(f, "camogm_file_length_bytes", "gauge", "Current file length", CNT_GET(cnt->file_length));
+
+	put_metric(f, "camogm_rawdev_lba_start", "gauge", "The first LBA of raw device buffer", info.lba_start);
+	put_metric(f, "camogm_rawdev_lba_end", "gauge", "The last LBA of raw device buffer", info.lba_end);
+	put_metric(f, "camogm_rawdev_lba_current", "gauge", "Current write position in raw device buffer", CNT_GET(cnt->lba_current));
+	put_metric(f, "camogm_rawdev_wraps_total", "counter", "Raw device buffer wrap arounds", CNT_GET(cnt->overrun));
+
+	put_header(f, "camogm_latency_seconds", "histogram", "Recording pipeline stage latency");
+	for (int i = 0; i < LAT_STAGES; i++)
+		put_histogram(f, "camogm_latency_seconds", lat_stage_name(i), &cnt->lat[i]);
+}
+
+/** Send the whole buffer, errors are ignored as the connection is closed anyway */
+static void send_page(int fd, const char *buff, size_t len)
+{
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = send(fd, buff, len, MSG_NOSIGNAL);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			D1(fprintf(debug_file, "Error sending metrics: %s\n", strerror(errno)));
+			return;
+		}
+		buff += ret;
+		len -= ret;
+	}
+}
+
+/** Send metrics page to client and close the connection */
+static void serve_client(camogm_state *state, struct metrics_client *cl)
+{
+	char *page = NULL;
+	size_t page_len = 0;
+	char hdr[128];
+	FILE *f;
+	struct timeval tv = {.tv_sec = METRICS_SEND_TIMEOUT};
+
+	if ((f = open_memstream(&page, &page_len)) != NULL) {
+		metrics_write(state, f);
+		fclose(f);
+		setsockopt(cl->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		if (strncmp(cl->buff, "GET ", 4) == 0 || strncmp(cl->buff, "HEAD ", 5) == 0) {
+			snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+					"Content-Length: %zu\r\nConnection: close\r\n\r\n", page_len);
+			send_page(cl->fd, hdr, strlen(hdr));
+			if (cl->buff[0] == 'G')
+				send_page(cl->fd, page, page_len);
+		} else {
+			send_page(cl->fd, page, page_len);
+		}
+		free(page);
+	}
+	close(cl->fd);
+	cl->fd = -1;
+}
+
+/** Read request from client, the page is sent when the request headers are complete */
+static void read_client(camogm_state *state, struct metrics_client *cl)
+{
+	ssize_t ret;
+
+	ret = recv(cl->fd, &cl->buff[cl->len], METRICS_BUFF_SIZE - cl->len - 1, MSG_DONTWAIT);
+	if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (ret <= 0) {
+		// connection closed by client, reply anyway if there was a request
+		if (cl->len > 0) {
+			serve_client(state, cl);
+		} else {
+			close(cl->fd);
+			cl->fd = -1;
+		}
+		return;
+	}
+	cl->len += ret;
+	cl->buff[cl->len] = '\0';
+	// HTTP request ends with an empty line, other requests are one line
+	if (strstr(cl->buff, "\r\n\r\n") != NULL || strstr(cl->buff, "\n\n") != NULL ||
+			(strncmp(cl->buff, "GET ", 4) != 0 && strncmp(cl->buff, "HEAD ", 5) != 0 && strchr(cl->buff, '\n') != NULL) ||
+			cl->len >= METRICS_BUFF_SIZE - 1)
+		serve_client(state, cl);
+}
+
+/**
+ * @brief Accept new connections and serve requests of the connections that have data
+ * @param[in]   state   a pointer to a structure containing current state
+ * @param[in]   pfd     poll descriptors filled by #metrics_poll_fds after poll()
+ * @param[in]   num     the number of poll descriptors
+ * @return      None
+ */
+void metrics_process(camogm_state *state, const struct pollfd *pfd, int num)
+{
+	int fd, i, j;
+
+	for (i = 0; i < num; i++) {
+		if (!(pfd[i].revents & (POLLIN | POLLHUP | POLLERR)))
+			continue;
+		if (pfd[i].fd == mtr.fd) {
+			fd = accept(mtr.fd, NULL, NULL);
+			if (fd < 0)
+				continue;
+			for (j = 0; j < METRICS_MAX_CLIENTS && mtr.clients[j].fd >= 0; j++);
+			if (j == METRICS_MAX_CLIENTS) {
+				D1(fprintf(debug_file, "Too many metrics connections, new connection refused\n"));
+				close(fd);
+				continue;
+			}
+			mtr.clients[j].fd = fd;
+			mtr.clients[j].len = 0;
+			mtr.clients[j].buff[0] = '\0';
+		} else {
+			for (j = 0; j < METRICS_MAX_CLIENTS; j++) {
+				if (mtr.clients[j].fd == pfd[i].fd) {
+					read_client(state, &mtr.clients[j]);
+					break;
+				}
+			}
+		}
+	}
+}
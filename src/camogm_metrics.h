@@ -0,0 +1,36 @@
+/** @file camogm_metrics.h
+ * @brief Recording metrics in Prometheus text format served on local socket
+ * @copyright Copyright (C) 2017 Elphel, Inc.
+ *
+ * @par <b>License</b>
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CAMOGM_METRICS_H
+#define _CAMOGM_METRICS_H
+
+#include <poll.h>
+
+#include "camogm.h"
+
+/** @brief The maximal number of simultaneous metrics connections */
+#define METRICS_MAX_CLIENTS       4
+/** @brief The number of poll descriptors used by metrics socket */
+#define METRICS_POLL_FDS          (METRICS_MAX_CLIENTS + 1)
+
+int metrics_open(const char *addr);
+int metrics_poll_fds(struct pollfd *pfd);
+void metrics_process(camogm_state *state, const struct pollfd *pfd, int num);
+void metrics_close(void);
+void metrics_write(camogm_state *state, FILE *f);
+
+#endif /* _CAMOGM_METRICS_H */
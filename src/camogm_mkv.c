@@ -0,0 +1,705 @@
+/** @file camogm_mkv.c
+ * @brief Provides writing to Matroska (MKV) files for @e camogm
+ * @copyright Copyright (C) 2017 Elphel, Inc.
+ *
+ * @par <b>License</b>
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The file starts with EBML header and a Segment of unknown size. The Segment begins with a SeekHead
+ * in reserved space of fixed size, followed by Info and Tracks. Frames are written as SimpleBlocks
+ * in Clusters of unknown size, the size is filled in when the Cluster is closed. Timestamp scale is 1 ms,
+ * frame time stamps are stored as they are, so variable frame rate (frames skipping, timelapse)
+ * needs no special handling. Block timestamps are 16 bit values relative to Cluster, a Cluster is closed
+ * after #MKV_CLUSTER_DURATION or when it grows over #MKV_CLUSTER_MAX_SIZE. SeekHead is updated periodically
+ * to point to the last closed Cluster, so an interrupted file can be scanned from there. A CuePoint is added
+ * at Cluster start not more often than #MKV_CUE_INTERVAL, so Cues table size depends on file duration only.
+ * Cues are written when the file is closed, then SeekHead, Segment size and Duration are filled in.
+ * In multitrack mode each active sensor port is written as a separate track and the frames from all ports
+ * are interleaved by time stamp, so the frames of one instant share a Cluster and can be read at once.
+ * Cues then contain a CuePoint for each track present in a Cluster.
+ */
+
+/** @brief This define is needed to use pwrite64 and should be set before includes */
+#define _LARGEFILE64_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "camogm_mkv.h"
+
+/** EBML and Matroska element IDs */
+#define MKV_ID_EBML               0x1a45dfa3
+#define MKV_ID_EBML_VERSION       0x4286
+#define MKV_ID_EBML_READ_VERSION  0x42f7
+#define MKV_ID_EBML_MAX_ID_LEN    0x42f2
+#define MKV_ID_EBML_MAX_SIZE_LEN  0x42f3
+#define MKV_ID_DOCTYPE            0x4282
+#define MKV_ID_DOCTYPE_VERSION    0x4287
+#define MKV_ID_DOCTYPE_READ_VER   0x4285
+#define MKV_ID_SEGMENT            0x18538067
+#define MKV_ID_SEEKHEAD           0x114d9b74
+#define MKV_ID_SEEK               0x4dbb
+#define MKV_ID_SEEK_ID            0x53ab
+#define MKV_ID_SEEK_POSITION      0x53ac
+#define MKV_ID_INFO               0x1549a966
+#define MKV_ID_TIMESTAMP_SCALE    0x2ad7b1
+#define MKV_ID_DURATION           0x4489
+#define MKV_ID_DATE_UTC           0x4461
+#define MKV_ID_MUXING_APP         0x4d80
+#define MKV_ID_WRITING_APP        0x5741
+#define MKV_ID_TRACKS             0x1654ae6b
+#define MKV_ID_TRACK_ENTRY        0xae
+#define MKV_ID_TRACK_NUMBER       0xd7
+#define MKV_ID_TRACK_UID          0x73c5
+#define MKV_ID_TRACK_TYPE         0x83
+#define MKV_ID_FLAG_LACING        0x9c
+#define MKV_ID_DEFAULT_DURATION   0x23e383
+#define MKV_ID_CODEC_ID           0x86
+#define MKV_ID_VIDEO              0xe0
+#define MKV_ID_PIXEL_WIDTH        0xb0
+#define MKV_ID_PIXEL_HEIGHT       0xba
+#define MKV_ID_CLUSTER            0x1f43b675
+#define MKV_ID_CLUSTER_TIMESTAMP  0xe7
+#define MKV_ID_SIMPLE_BLOCK       0xa3
+#define MKV_ID_CUES               0x1c53bb6b
+#define MKV_ID_CUE_POINT          0xbb
+#define MKV_ID_CUE_TIME           0xb3
+#define MKV_ID_CUE_TRACK_POS      0xb7
+#define MKV_ID_CUE_TRACK          0xf7
+#define MKV_ID_CUE_CLUSTER_POS    0xf1
+#define MKV_ID_VOID               0xec
+
+/** @brief The space reserved for one TrackEntry in file header */
+#define MKV_TRACK_ENTRY_SIZE      96
+/** @brief The size of buffer for file header: EBML header, Segment header, SeekHead, Info and Tracks */
+#define MKV_HEADER_SIZE           (384 + SENSOR_PORTS * MKV_TRACK_ENTRY_SIZE)
+/** @brief The space reserved for SeekHead at the beginning of Segment, unused space is filled with Void element */
+#define MKV_SEEKHEAD_SIZE         128
+/** @brief The size of element header with 4 byte ID and 8 byte size */
+#define MKV_ELEM_HDR_SIZE         12
+/** @brief The size of SimpleBlock header: ID, 8 byte size, track number, relative time stamp and flags */
+#define MKV_BLOCK_HDR_SIZE        13
+/** @brief The size of Cluster header: ID, 8 byte size and Cluster time stamp element */
+#define MKV_CLUSTER_HDR_SIZE      (MKV_ELEM_HDR_SIZE + 10)
+/** @brief The size of one CuePoint element */
+#define MKV_CUE_POINT_SIZE        27
+/** @brief Time stamp unit, in us; Segment timestamp scale is this value in ns divided by timescale */
+#define MKV_TICK                  1000
+/** @brief The maximum time stamp difference between a block and its Cluster, in #MKV_TICK units */
+#define MKV_CLUSTER_MAX_TIME      32767
+/** @brief Close Cluster after this time, in #MKV_TICK units */
+#define MKV_CLUSTER_DURATION      1000
+/** @brief Close Cluster if its size exceeds this limit */
+#define MKV_CLUSTER_MAX_SIZE      (4 * 1024 * 1024)
+/** @brief The minimal time between CuePoints, in #MKV_TICK units */
+#define MKV_CUE_INTERVAL          1000
+/** @brief SeekHead update interval, in #MKV_TICK units */
+#define MKV_SEEKHEAD_INTERVAL     10000
+/** @brief Initial size of Cues table, it grows as needed */
+#define MKV_CUES_SIZE             1024
+/** @brief Track number of the video track in single track mode, in multitrack mode track number is sensor port + 1 */
+#define MKV_TRACK_NUM             1
+/** @brief SimpleBlock flags: key frame */
+#define MKV_BLOCK_KEYFRAME        0x80
+/** @brief The value of 8 byte element size meaning 'unknown' */
+#define MKV_SIZE_UNKNOWN          0x00ffffffffffffffULL
+/** @brief The difference between Unix epoch and Matroska epoch (2001-01-01), in seconds */
+#define MKV_EPOCH_OFFSET          978307200LL
+
+/**
+ * @struct mkv_cue
+ * @brief Cues table entry
+ */
+struct mkv_cue {
+	uint64_t time;                               ///< Cluster time stamp, in #MKV_TICK units
+	uint64_t pos;                                ///< Cluster position relative to Segment data
+	unsigned int track;                          ///< track number
+};
+
+/**
+ * @struct mkv_buff
+ * @brief Buffer used to build elements
+ */
+struct mkv_buff {
+	unsigned char *data;                         ///< pointer to buffer
+	size_t size;                                 ///< buffer size
+	size_t pos;                                  ///< current write position
+	bool overflow;                               ///< data did not fit in buffer and was dropped
+};
+
+/**
+ * @struct mkv_layout
+ * @brief Positions of top level elements needed to update SeekHead and finalize the file.
+ * All positions except @e segment_data are relative to Segment data.
+ */
+struct mkv_layout {
+	uint64_t segment_data;                       ///< file offset of Segment data
+	uint64_t info;                               ///< Info position
+	uint64_t tracks;                             ///< Tracks position
+	uint64_t duration;                           ///< Duration value position
+	uint64_t cluster;                            ///< the last closed Cluster position, 0 if there is none
+	uint64_t cues;                               ///< Cues position, 0 if Cues are not written yet
+};
+
+/**
+ * @struct mkv_writer
+ * @brief Matroska writer state
+ */
+struct mkv_writer {
+	struct mkv_layout layout;                    ///< positions of top level elements
+	struct mkv_cue *cues;                        ///< Cues table
+	int cues_sz;                                 ///< the size of Cues table
+	int cues_num;                                ///< the number of entries in Cues table
+	bool multitrack;                             ///< all active ports are recorded as separate tracks
+	bool cluster_open;                           ///< Cluster is open
+	bool cluster_cued;                           ///< CuePoints are added for the current Cluster
+	unsigned int cluster_tracks;                 ///< bit mask of tracks which have CuePoints in the current Cluster
+	uint64_t cluster_offset;                     ///< file offset of the current Cluster
+	uint64_t cluster_time;                       ///< time stamp of the current Cluster, in #MKV_TICK units
+	uint64_t cue_time;                           ///< time stamp of the last Cluster with CuePoints, in #MKV_TICK units
+	uint64_t file_pos;                           ///< current file write position
+	uint64_t start_time;                         ///< time stamp of the first frame in file, in us
+	uint64_t last_time;                          ///< time stamp of the last frame relative to file start, in #MKV_TICK units
+	uint64_t track_time[SENSOR_PORTS];           ///< time stamp of the last frame in each track relative to file start, in #MKV_TICK units
+	uint64_t seekhead_time;                      ///< the time when SeekHead was last updated, in #MKV_TICK units
+	uint32_t frame_period;                       ///< nominal frame period, in us
+};
+
+/**
+ * @struct mkv_segment
+ * @brief Data needed to finalize a closed file
+ */
+struct mkv_segment {
+	struct mkv_layout layout;                    ///< positions of top level elements
+	struct mkv_cue *cues;                        ///< Cues table
+	int cues_num;                                ///< the number of entries in Cues table
+	uint64_t file_pos;                           ///< file size
+	double duration;                             ///< file duration, in time stamp scale units
+};
+
+static struct mkv_writer mkv;
+
+/** Return track number for the frames from sensor port @e port */
+static inline unsigned int mkv_track(int port)
+{
+	return mkv.multitrack ? port + 1 : MKV_TRACK_NUM;
+}
+
+static void put_be(struct mkv_buff *b, uint64_t val, int len)
+{
+	if (b->pos + len > b->size) {
+		b->overflow = true;
+		return;
+	}
+	for (int i = len - 1; i >= 0; i--)
+		b->data[b->pos++] = (val >> (8 * i)) & 0xff;
+}
+
+static void put_bytes(struct mkv_buff *b, const void *data, size_t len)
+{
+	if (b->pos + len > b->size) {
+		b->overflow = true;
+		return;
+	}
+	memcpy(&b->data[b->pos], data, len);
+	b->pos += len;
+}
+
+/** Put element ID, the length of ID is defined by its value */
+static void put_id(struct mkv_buff *b, uint32_t id)
+{
+	int len = (id > 0xffffff) ? 4 : (id > 0xffff) ? 3 : (id > 0xff) ? 2 : 1;
+
+	put_be(b, id, len);
+}
+
+/** Put element size as 8 byte variable size integer */
+static void put_size8(struct mkv_buff *b, uint64_t size)
+{
+	put_be(b, 0x0100000000000000ULL | (size & MKV_SIZE_UNKNOWN), 8);
+}
+
+/** Put unsigned integer element using the minimal number of bytes */
+static void put_uint(struct mkv_buff *b, uint32_t id, uint64_t val)
+{
+	int len = 1;
+
+	while (len < 8 && (val >> (8 * len)) != 0)
+		len++;
+	put_id(b, id);
+	put_be(b, 0x80 | len, 1);
+	put_be(b, val, len);
+}
+
+/** Put unsigned integer element using 8 bytes, such elements can be updated in place */
+static void put_uint8(struct mkv_buff *b, uint32_t id, uint64_t val)
+{
+	put_id(b, id);
+	put_be(b, 0x88, 1);
+	put_be(b, val, 8);
+}
+
+/** Put 8 byte floating point element */
+static void put_float(struct mkv_buff *b, uint32_t id, double val)
+{
+	uint64_t u;
+
+	memcpy(&u, &val, sizeof(u));
+	put_id(b, id);
+	put_be(b, 0x88, 1);
+	put_be(b, u, 8);
+}
+
+/** Put string element, the string should be shorter than 127 bytes */
+static void put_string(struct mkv_buff *b, uint32_t id, const char *str)
+{
+	size_t len = strlen(str);
+
+	put_id(b, id);
+	put_be(b, 0x80 | len, 1);
+	put_bytes(b, str, len);
+}
+
+/** Start a new master element, return its offset which is needed to close the element */
+static size_t elem_start(struct mkv_buff *b, uint32_t id)
+{
+	put_id(b, id);
+	put_size8(b, 0);
+
+	return b->pos;
+}
+
+/** Close master element which data starts at @e start offset by filling in its size */
+static void elem_end(struct mkv_buff *b, size_t start)
+{
+	size_t pos = b->pos;
+
+	b->pos = start - 8;
+	put_size8(b, pos - start);
+	b->pos = pos;
+}
+
+/** Put Seek entry with 1 byte sizes */
+static void put_seek(struct mkv_buff *b, uint32_t id, uint64_t pos)
+{
+	put_id(b, MKV_ID_SEEK);
+	put_be(b, 0x80 | 18, 1);
+	put_id(b, MKV_ID_SEEK_ID);
+	put_be(b, 0x84, 1);
+	put_be(b, id, 4);
+	put_uint8(b, MKV_ID_SEEK_POSITION, pos);
+}
+
+/** Build SeekHead of #MKV_SEEKHEAD_SIZE bytes, the space left is filled with Void element */
+static void build_seekhead(struct mkv_buff *b, const struct mkv_layout *layout)
+{
+	size_t start = b->pos;
+	size_t seekhead, len;
+
+	seekhead = elem_start(b, MKV_ID_SEEKHEAD);
+	put_seek(b, MKV_ID_INFO, layout->info);
+	put_seek(b, MKV_ID_TRACKS, layout->tracks);
+	if (layout->cues)
+		put_seek(b, MKV_ID_CUES, layout->cues);
+	if (layout->cluster)
+		put_seek(b, MKV_ID_CLUSTER, layout->cluster);
+	elem_end(b, seekhead);
+
+	len = MKV_SEEKHEAD_SIZE - (b->pos - start) - 9;
+	put_id(b, MKV_ID_VOID);
+	put_size8(b, len);
+	if (b->pos + len > b->size) {
+		b->overflow = true;
+		return;
+	}
+	memset(&b->data[b->pos], 0, len);
+	b->pos += len;
+}
+
+/** Build file header: EBML header, Segment header, SeekHead, Info and Tracks */
+static void build_header(camogm_state *state, struct mkv_buff *b)
+{
+	size_t elem, track, video;
+	int port = state->port_num;
+	int64_t date;
+	uint64_t scale;
+
+	elem = elem_start(b, MKV_ID_EBML);
+	put_uint(b, MKV_ID_EBML_VERSION, 1);
+	put_uint(b, MKV_ID_EBML_READ_VERSION, 1);
+	put_uint(b, MKV_ID_EBML_MAX_ID_LEN, 4);
+	put_uint(b, MKV_ID_EBML_MAX_SIZE_LEN, 8);
+	put_string(b, MKV_ID_DOCTYPE, "matroska");
+	put_uint(b, MKV_ID_DOCTYPE_VERSION, 4);
+	put_uint(b, MKV_ID_DOCTYPE_READ_VER, 2);
+	elem_end(b, elem);
+
+	// Segment size is unknown until the file is closed
+	put_id(b, MKV_ID_SEGMENT);
+	put_size8(b, MKV_SIZE_UNKNOWN);
+	mkv.layout.segment_data = b->pos;
+	mkv.layout.info = MKV_SEEKHEAD_SIZE;
+	build_seekhead(b, &mkv.layout);
+
+	scale = (state->timescale > 0) ? (uint64_t)(1000 * MKV_TICK / state->timescale) : 1000 * MKV_TICK;
+	date = ((int64_t)state->frame_params[port].timestamp_sec - MKV_EPOCH_OFFSET) * 1000000000LL +
+			(int64_t)state->frame_params[port].timestamp_usec * 1000;
+	elem = elem_start(b, MKV_ID_INFO);
+	put_uint(b, MKV_ID_TIMESTAMP_SCALE, scale);
+	mkv.layout.duration = b->pos + 3 - mkv.layout.segment_data;
+	put_float(b, MKV_ID_DURATION, 0);
+	put_uint8(b, MKV_ID_DATE_UTC, date);
+	put_string(b, MKV_ID_MUXING_APP, "camogm");
+	put_string(b, MKV_ID_WRITING_APP, "camogm");
+	elem_end(b, elem);
+
+	mkv.layout.tracks = b->pos - mkv.layout.segment_data;
+	elem = elem_start(b, MKV_ID_TRACKS);
+	for (int chn = 0; chn < SENSOR_PORTS; chn++) {
+		if (mkv.multitrack ? !((state->active_chn >> chn) & 1) : chn != port)
+			continue;
+		track = elem_start(b, MKV_ID_TRACK_ENTRY);
+		put_uint(b, MKV_ID_TRACK_NUMBER, mkv_track(chn));
+		put_uint(b, MKV_ID_TRACK_UID, mkv_track(chn));
+		put_uint(b, MKV_ID_TRACK_TYPE, 1);           // video
+		put_uint(b, MKV_ID_FLAG_LACING, 0);
+		if (state->frame_period[chn] > 0)
+			put_uint(b, MKV_ID_DEFAULT_DURATION, (uint64_t)state->frame_period[chn] * 1000);
+		put_string(b, MKV_ID_CODEC_ID, "V_MJPEG");
+		video = elem_start(b, MKV_ID_VIDEO);
+		put_uint(b, MKV_ID_PIXEL_WIDTH, state->frame_params[chn].width);
+		put_uint(b, MKV_ID_PIXEL_HEIGHT, state->frame_params[chn].height);
+		elem_end(b, video);
+		elem_end(b, track);
+	}
+	elem_end(b, elem);
+}
+
+/** Write SeekHead to its reserved space */
+static int write_seekhead(int fd, const struct mkv_layout *layout)
+{
+	unsigned char buff[MKV_SEEKHEAD_SIZE];
+	struct mkv_buff b = {.data = buff, .size = sizeof(buff), .pos = 0};
+
+	build_seekhead(&b, layout);
+	if (pwrite64(fd, buff, MKV_SEEKHEAD_SIZE, layout->segment_data) != MKV_SEEKHEAD_SIZE) {
+		D0(fprintf(debug_file, "Error writing SeekHead: %s\n", strerror(errno)));
+		return -CAMOGM_FRAME_FILE_ERR;
+	}
+
+	return 0;
+}
+
+/** Close the current Cluster by filling in its size */
+static int close_cluster(int fd)
+{
+	unsigned char buff[8];
+	struct mkv_buff b = {.data = buff, .size = sizeof(buff), .pos = 0};
+
+	if (!mkv.cluster_open)
+		return 0;
+	put_size8(&b, mkv.file_pos - mkv.cluster_offset - MKV_ELEM_HDR_SIZE);
+	if (pwrite64(fd, buff, sizeof(buff), mkv.cluster_offset + 4) != sizeof(buff)) {
+		D0(fprintf(debug_file, "Error writing Cluster size: %s\n", strerror(errno)));
+		return -CAMOGM_FRAME_FILE_ERR;
+	}
+	mkv.cluster_open = false;
+	mkv.layout.cluster = mkv.cluster_offset - mkv.layout.segment_data;
+
+	return 0;
+}
+
+/** Add Cues entry for the first block of a track in the current Cluster, Cluster time is in #MKV_TICK units */
+static int add_cue(uint64_t time, uint64_t pos, unsigned int track)
+{
+	struct mkv_cue *cues;
+
+	if (mkv.cues_num >= mkv.cues_sz) {
+		int sz = mkv.cues_sz ? 2 * mkv.cues_sz : MKV_CUES_SIZE;
+		if ((cues = realloc(mkv.cues, sz * sizeof(struct mkv_cue))) == NULL)
+			return -CAMOGM_FRAME_MALLOC;
+		mkv.cues = cues;
+		mkv.cues_sz = sz;
+	}
+	mkv.cues[mkv.cues_num].time = time;
+	mkv.cues[mkv.cues_num].pos = pos;
+	mkv.cues[mkv.cues_num].track = track;
+	mkv.cues_num++;
+
+	return 0;
+}
+
+/**
+ * @brief Write Cues, final SeekHead, Segment size and Duration. This function can be called from finalizer thread,
+ * all the data it needs is in the segment job.
+ * @param[in]   job   segment job prepared by #camogm_end_mkv
+ * @return      0 if the file was finalized successfully and negative error code otherwise
+ */
+static int mkv_finish(struct segment_job *job)
+{
+	int ret = 0;
+	size_t cues;
+	uint64_t u;
+	unsigned char hdr[8];
+	struct mkv_segment *seg = job->data;
+	struct mkv_buff b = {0};
+
+	b.size = MKV_ELEM_HDR_SIZE + seg->cues_num * MKV_CUE_POINT_SIZE;
+	b.data = malloc(b.size);
+	if (b.data == NULL) {
+		free(seg->cues);
+		seg->cues = NULL;
+		return -CAMOGM_FRAME_MALLOC;
+	}
+	b.pos = 0;
+	cues = elem_start(&b, MKV_ID_CUES);
+	for (int i = 0; i < seg->cues_num; i++) {
+		put_id(&b, MKV_ID_CUE_POINT);
+		put_be(&b, 0x80 | 25, 1);
+		put_uint8(&b, MKV_ID_CUE_TIME, seg->cues[i].time);
+		put_id(&b, MKV_ID_CUE_TRACK_POS);
+		put_be(&b, 0x80 | 13, 1);
+		put_be(&b, MKV_ID_CUE_TRACK, 1);
+		put_be(&b, 0x81, 1);
+		put_be(&b, seg->cues[i].track, 1);
+		put_uint8(&b, MKV_ID_CUE_CLUSTER_POS, seg->cues[i].pos);
+	}
+	elem_end(&b, cues);
+	if (seg->cues_num > 0) {
+		if (pwrite64(job->fd, b.data, b.pos, seg->file_pos) != b.pos) {
+			D0(fprintf(debug_file, "Error writing Cues to %s: %s\n", job->path, strerror(errno)));
+			ret = -CAMOGM_FRAME_FILE_ERR;
+		} else {
+			seg->layout.cues = seg->file_pos - seg->layout.segment_data;
+			seg->file_pos += b.pos;
+		}
+	}
+	free(b.data);
+	free(seg->cues);
+	seg->cues = NULL;
+
+	if (ret == 0)
+		ret = write_seekhead(job->fd, &seg->layout);
+	if (ret == 0) {
+		b.data = hdr;
+		b.size = sizeof(hdr);
+		b.pos = 0;
+		put_size8(&b, seg->file_pos - seg->layout.segment_data);
+		if (pwrite64(job->fd, hdr, sizeof(hdr), seg->layout.segment_data - 8) != sizeof(hdr))
+			ret = -CAMOGM_FRAME_FILE_ERR;
+		b.pos = 0;
+		memcpy(&u, &seg->duration, sizeof(u));
+		put_be(&b, u, 8);
+		if (pwrite64(job->fd, &hdr[0], 8, seg->layout.segment_data + seg->layout.duration) != 8)
+			ret = -CAMOGM_FRAME_FILE_ERR;
+		if (ret)
+			D0(fprintf(debug_file, "Error writing Segment size and Duration to %s: %s\n", job->path, strerror(errno)));
+	}
+
+	return ret;
+}
+
+/**
+ * @brief Called when format is changed to MKV. Cues table is allocated on demand when recording starts.
+ * @return      0
+ */
+int camogm_init_mkv(void)
+{
+	camogm_free_mkv();
+
+	return 0;
+}
+
+/** Free memory allocated for Cues table */
+void camogm_free_mkv(void)
+{
+	free(mkv.cues);
+	mkv.cues = NULL;
+	mkv.cues_sz = 0;
+	mkv.cues_num = 0;
+}
+
+/**
+ * @brief Start MKV recording: open a new file and write file header
+ * @param[in]   state   a pointer to a structure containing current state
+ * @return      0 if recording started successfully and negative error code otherwise
+ */
+int camogm_start_mkv(camogm_state *state)
+{
+	unsigned char hdr[MKV_HEADER_SIZE];
+	struct mkv_buff b = {.data = hdr, .size = sizeof(hdr), .pos = 0};
+
+	sprintf(state->path, "%s%010ld_%06ld.mkv", state->path_prefix, state->frame_params[state->port_num].timestamp_sec, state->frame_params[state->port_num].timestamp_usec);
+	if (((state->ivf = open(state->path, O_RDWR | O_CREAT | O_TRUNC, 0777))) < 0) {
+		D0(fprintf(debug_file, "Error opening %s for writing, returned %d, errno=%d\n", state->path, state->ivf, errno));
+		return -CAMOGM_FRAME_FILE_ERR;
+	}
+	memset(&mkv.layout, 0, sizeof(mkv.layout));
+	mkv.cues_num = 0;
+	mkv.cluster_open = false;
+	mkv.last_time = 0;
+	memset(mkv.track_time, 0, sizeof(mkv.track_time));
+	mkv.multitrack = state->multitrack ? true : false;
+	mkv.seekhead_time = 0;
+	mkv.frame_period = (state->frame_period[state->port_num] > 0) ? state->frame_period[state->port_num] : 0;
+	build_header(state, &b);
+	if (b.overflow) {
+		D0(fprintf(debug_file, "Matroska header does not fit in %d bytes\n", MKV_HEADER_SIZE));
+		close(state->ivf);
+		state->ivf = -1;
+		return -CAMOGM_FRAME_OTHER;
+	}
+	if (write(state->ivf, hdr, b.pos) != b.pos) {
+		D0(fprintf(debug_file, "Error writing Matroska header to %s: %s\n", state->path, strerror(errno)));
+		close(state->ivf);
+		state->ivf = -1;
+		return -CAMOGM_FRAME_FILE_ERR;
+	}
+	mkv.file_pos = b.pos;
+
+	return 0;
+}
+
+/**
+ * @brief Write a frame to file as a SimpleBlock. A new Cluster is opened when the current Cluster is
+ * long enough, the frame time stamp can not be represented relative to it or the Cluster is too big.
+ * @param[in]   state   a pointer to a structure containing current state
+ * @return      0 if frame was saved successfully and negative error code otherwise
+ */
+int camogm_frame_mkv(camogm_state *state)
+{
+	int i, j;
+	int ret;
+	int port = state->port_num;
+	unsigned int track = mkv_track(port);
+	int64_t rel_time;
+	ssize_t iovlen, l;
+	uint64_t ts;
+	struct iovec chunks_iovec[FILE_CHUNKS_NUM + 1];
+	unsigned char hdr[MKV_CLUSTER_HDR_SIZE + MKV_BLOCK_HDR_SIZE];
+	struct mkv_buff b = {.data = hdr, .size = sizeof(hdr), .pos = 0};
+
+	ts = (uint64_t)state->this_frame_params[port].timestamp_sec * 1000000 + state->this_frame_params[port].timestamp_usec;
+	if (state->frameno == 0)
+		mkv.start_time = ts;
+	ts = (ts > mkv.start_time) ? (ts - mkv.start_time + MKV_TICK / 2) / MKV_TICK : 0;
+	// time stamps are expected to grow within a track
+	if (ts < mkv.track_time[port])
+		ts = mkv.track_time[port];
+	rel_time = ts - mkv.cluster_time;
+
+	l = 0;
+	for (i = 0; i < (state->chunk_index) - 1; i++)
+		l += state->packetchunks[i + 1].bytes;
+
+	if (mkv.cluster_open &&
+			(rel_time >= MKV_CLUSTER_DURATION || rel_time < -MKV_CLUSTER_MAX_TIME ||
+			mkv.file_pos - mkv.cluster_offset + l > MKV_CLUSTER_MAX_SIZE)) {
+		if ((ret = close_cluster(state->ivf)) != 0)
+			return ret;
+		if (ts >= mkv.seekhead_time + MKV_SEEKHEAD_INTERVAL) {
+			if ((ret = write_seekhead(state->ivf, &mkv.layout)) != 0)
+				return ret;
+			mkv.seekhead_time = ts;
+		}
+	}
+	if (!mkv.cluster_open) {
+		mkv.cluster_offset = mkv.file_pos;
+		mkv.cluster_time = ts;
+		mkv.cluster_tracks = 0;
+		mkv.cluster_cued = (mkv.cues_num == 0 || ts >= mkv.cue_time + MKV_CUE_INTERVAL);
+		if (mkv.cluster_cued)
+			mkv.cue_time = ts;
+		rel_time = 0;
+		// Cluster size is unknown until the Cluster is closed, files cut short by power loss stay readable
+		put_id(&b, MKV_ID_CLUSTER);
+		put_size8(&b, MKV_SIZE_UNKNOWN);
+		put_uint8(&b, MKV_ID_CLUSTER_TIMESTAMP, ts);
+		mkv.cluster_open = true;
+	}
+	if (mkv.cluster_cued && !(mkv.cluster_tracks & (1 << track))) {
+		if ((ret = add_cue(ts, mkv.cluster_offset - mkv.layout.segment_data, track)) != 0)
+			return ret;
+		mkv.cluster_tracks |= 1 << track;
+	}
+	put_id(&b, MKV_ID_SIMPLE_BLOCK);
+	put_size8(&b, l + 4);
+	put_be(&b, 0x80 | track, 1);
+	put_be(&b, (uint16_t)rel_time, 2);
+	put_be(&b, MKV_BLOCK_KEYFRAME, 1);
+
+	j = 0;
+	chunks_iovec[j].iov_base = hdr;
+	chunks_iovec[j++].iov_len = b.pos;
+	for (i = 0; i < (state->chunk_index) - 1; i++, j++) {
+		chunks_iovec[j].iov_base = state->packetchunks[i + 1].chunk;
+		chunks_iovec[j].iov_len = state->packetchunks[i + 1].bytes;
+	}
+	iovlen = writev(state->ivf, chunks_iovec, j);
+	if (iovlen < l + (ssize_t)b.pos) {
+		j = errno;
+		D0(fprintf(debug_file, "writev error %d (returned %d, expected %d, file descriptor %d, chn %d)\n", j, iovlen, l + b.pos, state->ivf, state->port_num));
+		close(state->ivf);
+		state->ivf = -1;
+		return -CAMOGM_FRAME_FILE_ERR;
+	}
+	mkv.file_pos += iovlen;
+	mkv.track_time[port] = ts;
+	if (ts > mkv.last_time)
+		mkv.last_time = ts;
+
+	return 0;
+}
+
+/**
+ * @brief Close the last Cluster and move the file and Cues table to segment job, Cues are written
+ * when the job is run
+ * @param[in]   state   a pointer to a structure containing current state
+ * @param[out]  job     segment job to be finalized
+ * @return      0 if the last Cluster was closed successfully and negative error code otherwise
+ */
+int camogm_end_mkv(camogm_state *state, struct segment_job *job)
+{
+	int ret;
+	struct mkv_segment *seg;
+
+	if (state->ivf < 0)
+		return 0;
+	ret = close_cluster(state->ivf);
+	if (ret == 0 && (seg = malloc(sizeof(struct mkv_segment))) != NULL) {
+		seg->layout = mkv.layout;
+		seg->cues = mkv.cues;
+		seg->cues_num = mkv.cues_num;
+		seg->file_pos = mkv.file_pos;
+		seg->duration = mkv.last_time + (double)mkv.frame_period / MKV_TICK;
+		job->finish = mkv_finish;
+		job->data = seg;
+		// Cues table now belongs to the job
+		mkv.cues = NULL;
+		mkv.cues_sz = 0;
+		mkv.cues_num = 0;
+	} else if (ret == 0) {
+		ret = -CAMOGM_FRAME_MALLOC;
+	}
+	job->fd = state->ivf;
+	state->ivf = -1;
+
+	return ret;
+}
@@ -15,6 +15,9 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+/** @brief This define is needed to use pwritev and should be set before includes */
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
@@ -24,58 +27,472 @@
 #include <string.h>
 #include <time.h>
 #include <sys/types.h>
+#include <arpa/inet.h>
 
 #include "camogm_mov.h"
 
 /** @brief Quicktime header length (w/o index tables) enough to accommodate static data */
 #define QUICKTIME_MIN_HEADER 0x300
+/** @brief The maximum number of vectors in header write: index table is written directly from frame size array */
+#define QT_HDR_VECTORS       4
+/** @brief The maximum nesting level of atoms in header template */
+#define QT_ATOM_DEPTH        16
+
+/**
+ * @enum qt_node_type
+ * @brief The types of nodes in compiled header template
+ * @var qt_node_type::QT_LITERAL
+ * Constant data copied to the header as is
+ * @var qt_node_type::QT_ATOM_START
+ * Atom start, the size of atom is filled in when the atom is closed
+ * @var qt_node_type::QT_ATOM_END
+ * Atom end
+ * @var qt_node_type::QT_SPECIAL
+ * Special field filled in when the header is built, one of #qt_special
+ */
+enum qt_node_type {
+	QT_LITERAL,
+	QT_ATOM_START,
+	QT_ATOM_END,
+	QT_SPECIAL
+};
+
+/**
+ * @enum qt_special
+ * @brief Special fields of header template, these are marked with '!' in template
+ */
+enum qt_special {
+	QT_MDATA,                                    ///< header size (frame data start)
+	QT_HEIGHT,                                   ///< frame height, 2 bytes
+	QT_WIDTH,                                    ///< frame width, 2 bytes
+	QT_NFRAMES,                                  ///< the number of frames
+	QT_TIMESCALE,                                ///< time units per second
+	QT_DURATION,                                 ///< total duration in time units
+	QT_FRAME_DURATION,                           ///< frame duration in time units
+	QT_SAMPLES_CHUNK,                            ///< the number of samples (frames) per chunk
+	QT_SAMPLE_SIZES,                             ///< sample size table
+	QT_CHUNK_OFFSETS,                            ///< the number of chunks followed by chunk offset table
+	QT_DATA_SIZE,                                ///< 'skip' atom filling the gap before frame data and the size of frame data
+	QT_TIME                                      ///< current time in Quicktime format
+};
+
+/**
+ * @struct qt_node
+ * @brief Compiled header template node
+ */
+struct qt_node {
+	int type;                                    ///< node type, one of #qt_node_type
+	int special;                                 ///< special field type for #QT_SPECIAL nodes
+	size_t offset;                               ///< offset of literal data in #qt_literals
+	size_t len;                                  ///< the length of literal data
+};
+
+/**
+ * @struct qt_params
+ * @brief Parameters used to fill in special fields of the header
+ */
+struct qt_params {
+	int width;                                   ///< width in pixels
+	int height;                                  ///< height in pixels
+	int nframes;                                 ///< the number of frames
+	int sample_dur;                              ///< frame duration in time units
+	int samples_chunk;                           ///< the number of frames per chunk
+	int timescale;                               ///< time units per second
+	const uint32_t *sizes;                       ///< frame sizes, big endian
+	long header_size;                            ///< frame data start, the gap after the header is filled with 'skip' atom
+};
+
+/**
+ * @struct qt_builder
+ * @brief Header build state. The header is built in memory buffer, sample size table is not copied
+ * but referenced from a separate vector.
+ */
+struct qt_builder {
+	unsigned char *buff;                         ///< header buffer
+	size_t buff_sz;                              ///< the size of header buffer
+	size_t buff_pos;                             ///< current position in header buffer
+	size_t seg_start;                            ///< the start of current buffer segment
+	long pos;                                    ///< current position in output file
+	struct iovec vect[QT_HDR_VECTORS];           ///< output vectors
+	int vect_num;                                ///< the number of output vectors used
+};
+
+/**
+ * @struct mov_segment
+ * @brief Data needed to write the header of a closed file segment
+ */
+struct mov_segment {
+	struct qt_params params;                     ///< header parameters
+	int *frame_lengths;                          ///< frame size array, big endian
+	unsigned char *hdr_buff;                     ///< header buffer
+};
 
 // for the parser
 const char hexStr[] = "0123456789abcdef";
 const char qtSourceFileName[] = "/etc/qt_source";
-char comStr[1024];
-int width = 1280;
-int height = 1024;
-int nframes = 100;
-int sample_dur = 80;
-int samplesPerChunk = 10;
-int framesize = 80000;
-int timescale = 600;
-int * sizes;    // array of frame sizes
-int iPos;       // position in the string "iFile"
-int ofd;        // output file descriptor (file opened by the caller)
-int iFileLen;
-char * q_template = NULL;
-long headerSize = 0;
-const char *iFile = NULL;
-
-
-int quicktime_template_parser(camogm_state *state,
-		const char * i_iFile,     // now - string containing header template
-		int i_ofd,                // output file descriptor (opened)
-		int i_width,              // width in pixels
-		int i_height,
-		int i_nframes,
-		int i_sample_dur,
-		int i_samplesPerChunk,
-		int i_framesize,
-		int i_timescale,
-		int * i_sizes,
-		int data_start            // put zero if the header is written before data (no gap)
-);
-void putBigEndian(unsigned long d, int l);
-int parse_special(void);
-int parse(camogm_state *state, int top);
+static struct qt_node *qt_nodes = NULL;          // compiled header template
+static int qt_nodes_num = 0;
+static int qt_nodes_sz = 0;
+static unsigned char *qt_literals = NULL;        // literal data of compiled header template
+static size_t qt_literals_len = 0;
+static size_t qt_literals_sz = 0;
+static unsigned char *qt_hdr_buff = NULL;        // header buffer of currently recorded file
+
+static int qt_compile(const char *src, int *pos, int len, int top);
+static int qt_build(const struct qt_params *params, struct qt_builder *b);
+
+/** @brief Temporary replacement for fgets to read from string */
+static char * sfgets(char * str, int size, const char * stream, int * pos)
+{
+	int l;
+	const char * eol = strchr(&stream[*pos], '\n');
+
+	if (!eol) eol = stream + (strlen(stream) - 1);  // pointer to last before '\0'
+	l = (eol - stream) - (*pos);
+	if (l >= size) l = size - 1;
+	memcpy(str, &stream[*pos], l);
+	str[l] = '\0';
+	*pos += l;
+	return str;
+}
+
+/** Add a new node to compiled template */
+static struct qt_node *add_node(int type)
+{
+	struct qt_node *node;
+
+	if (qt_nodes_num >= qt_nodes_sz) {
+		int sz = qt_nodes_sz ? 2 * qt_nodes_sz : 64;
+		node = realloc(qt_nodes, sz * sizeof(struct qt_node));
+		if (node == NULL)
+			return NULL;
+		qt_nodes = node;
+		qt_nodes_sz = sz;
+	}
+	node = &qt_nodes[qt_nodes_num++];
+	memset(node, 0, sizeof(struct qt_node));
+	node->type = type;
+
+	return node;
+}
+
+/** Append literal data to compiled template, adjacent literals are merged into a single node */
+static int add_literal(const void *data, size_t len)
+{
+	struct qt_node *node;
+
+	if (qt_literals_len + len > qt_literals_sz) {
+		size_t sz = qt_literals_sz ? 2 * qt_literals_sz : 1024;
+		unsigned char *ptr;
+		while (sz < qt_literals_len + len)
+			sz *= 2;
+		ptr = realloc(qt_literals, sz);
+		if (ptr == NULL)
+			return -1;
+		qt_literals = ptr;
+		qt_literals_sz = sz;
+	}
+	if (qt_nodes_num > 0 && qt_nodes[qt_nodes_num - 1].type == QT_LITERAL) {
+		node = &qt_nodes[qt_nodes_num - 1];
+	} else {
+		if ((node = add_node(QT_LITERAL)) == NULL)
+			return -1;
+		node->offset = qt_literals_len;
+	}
+	memcpy(&qt_literals[qt_literals_len], data, len);
+	qt_literals_len += len;
+	node->len += len;
+
+	return 0;
+}
+
+/** Append big endian value of @e l bytes to compiled template */
+static int add_big_endian(unsigned long d, int l)
+{
+	unsigned char od[4];
+
+	od[3] = d;
+	od[2] = d >> 8;
+	od[1] = d >> 16;
+	od[0] = d >> 24;
+	return l ? add_literal(&od[4 - l], l) : 0;
+}
+
+/** Compile special field, the input position is just after the opening "!" */
+static int qt_compile_special(const char *src, int *pos, int len)
+{
+	const char *names[] = {
+			[QT_MDATA] = "mdata", [QT_HEIGHT] = "height", [QT_WIDTH] = "width", [QT_NFRAMES] = "nframes",
+			[QT_TIMESCALE] = "timescale", [QT_DURATION] = "duration", [QT_FRAME_DURATION] = "frame_duration",
+			[QT_SAMPLES_CHUNK] = "samples_chunk", [QT_SAMPLE_SIZES] = "sample_sizes", [QT_CHUNK_OFFSETS] = "chunk_offsets",
+			[QT_DATA_SIZE] = "data_size", [QT_TIME] = "time"
+	};
+	struct qt_node *node;
+	char str[256];
+	char c;
+	int i = 0;
+
+	while (((c = src[(*pos)++]) != 0x20) && (c != 0x09) && (c != 0x0a) && (c != 0x0d) && (c != 0x0) && (i < 255) && (*pos < len)) str[i++] = c;
+	str[i] = 0;
+
+	D4(fprintf(debug_file, "qt_compile_special, str=!%s\n", str));
+
+	for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		if (strcmp(str, names[i]) == 0) {
+			if ((node = add_node(QT_SPECIAL)) == NULL)
+				return -1;
+			node->special = i;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * @brief Compile header template. Starts with the input position just after the opening "{",
+ * on exit - input position is after closing "}".
+ * @param[in]       src   header template
+ * @param[in,out]   pos   current position in template
+ * @param[in]       len   template length
+ * @param[in]       top   if set, the atom size is not included (top level)
+ * @return          0 if the template was compiled successfully and -1 otherwise
+ */
+static int qt_compile(const char *src, int *pos, int len, int top)
+{
+	char c;
+	unsigned long d, l;
+	char * cp;
+	char comStr[1024];
+
+	c = src[(*pos)++];
+	if (!top && add_node(QT_ATOM_START) == NULL) return -1;
+	while ((*pos < len) && (c != '}')) {
+		// skip white spaces
+		if ((c != ' ') && (c != 0x9) && (c != 0xa) && (c != 0xd)) {
+			if (c == '!') {
+				if (qt_compile_special(src, pos, len) < 0) return -1;
+			}
+			// children atoms
+			else if (c == '{') {
+				if (qt_compile(src, pos, len, 0) < 0) return -1;
+				// skip comments
+			} else if (c == '#') sfgets(comStr, sizeof(comStr), src, pos);
+			else if (c == '\'') {
+				sfgets(comStr, sizeof(comStr), src, pos);
+				if ((cp = strchr(comStr, 0x0a)) != NULL) cp[0] = 0;
+				if ((cp = strchr(comStr, 0x0d)) != NULL) cp[0] = 0;
+				if ((cp = strchr(comStr, '#')) != NULL) cp[0] = 0;
+				cp = comStr + strlen(comStr) - 1;
+				while ((cp > comStr) && ((cp[0] == 0x20) || (cp[0] == 0x09))) cp--;
+				cp[1] = 0;
+				if (add_literal(comStr, strlen(comStr)) < 0) return -1;
+			} else if (strchr(hexStr, c)) {
+				d = 0;
+				l = 1;
+				do {
+					d = (d << 4) + (strchr(hexStr, c) - hexStr);
+					l++;
+				} while ((*pos < len) && (l <= 8) && (strchr(hexStr, (c = src[(*pos)++]))));
+				l = (l) >> 1;
+				if (add_big_endian(d, l) < 0) return -1;
+			} else {
+				return -1;
+			}
+		}
+		c = src[(*pos)++];
+	}
+	if (!top && add_node(QT_ATOM_END) == NULL) return -1;
+
+	return 0;
+}
+
+/** Close current buffer segment and add it to output vectors */
+static int close_segment(struct qt_builder *b)
+{
+	if (b->buff_pos > b->seg_start) {
+		if (b->vect_num >= QT_HDR_VECTORS)
+			return -1;
+		b->vect[b->vect_num].iov_base = &b->buff[b->seg_start];
+		b->vect[b->vect_num].iov_len = b->buff_pos - b->seg_start;
+		b->vect_num++;
+		b->seg_start = b->buff_pos;
+	}
+
+	return 0;
+}
+
+/** Put big endian value of @e l bytes to header buffer */
+static int put_big_endian(struct qt_builder *b, unsigned long d, int l)
+{
+	unsigned char od[4];
+
+	if (b->buff_pos + l > b->buff_sz)
+		return -1;
+	od[3] = d;
+	od[2] = d >> 8;
+	od[1] = d >> 16;
+	od[0] = d >> 24;
+	memcpy(&b->buff[b->buff_pos], &od[4 - l], l);
+	b->buff_pos += l;
+	b->pos += l;
+
+	return 0;
+}
+
+/** Fill in special field of the header */
+static int qt_build_special(int special, const struct qt_params *params, struct qt_builder *b)
+{
+	time_t ltime;
+	int n, i, j, l;
+	int gap;
+
+	switch (special) {
+	case QT_MDATA:
+		return put_big_endian(b, params->header_size, 4);
+	case QT_HEIGHT:
+		return put_big_endian(b, params->height, 2);
+	case QT_WIDTH:
+		return put_big_endian(b, params->width, 2);
+	case QT_NFRAMES:
+		return put_big_endian(b, params->nframes, 4);
+	case QT_TIMESCALE:
+		return put_big_endian(b, params->timescale, 4);
+	case QT_DURATION:
+		return put_big_endian(b, params->nframes * params->sample_dur, 4);
+	case QT_FRAME_DURATION:
+		return put_big_endian(b, params->sample_dur, 4);
+	case QT_SAMPLES_CHUNK:
+		return put_big_endian(b, params->samples_chunk, 4);
+	case QT_SAMPLE_SIZES:
+		// frame sizes are already in big endian order, write them directly from frame size array
+		if (params->nframes > 0) {
+			if (close_segment(b) < 0 || b->vect_num >= QT_HDR_VECTORS)
+				return -1;
+			b->vect[b->vect_num].iov_base = (void *)params->sizes;
+			b->vect[b->vect_num].iov_len = 4 * params->nframes;
+			b->vect_num++;
+			b->pos += 4 * params->nframes;
+		}
+		return 0;
+	case QT_CHUNK_OFFSETS:
+		n = (params->nframes - 1) / params->samples_chunk + 1;
+		if (put_big_endian(b, n, 4) < 0)
+			return -1;
+		l = 0; j = 0;
+		for (i = 0; i < params->nframes; i++) {
+			if (j == 0 && put_big_endian(b, params->header_size + l, 4) < 0)
+				return -1;
+			j++; if (j >= params->samples_chunk) j = 0;
+			l += ntohl(params->sizes[i]);
+		}
+		return 0;
+	case QT_DATA_SIZE:
+		// include 'skip' atom if data position is known and there is a gap between the header and the data
+		gap = params->header_size - b->pos - 8;
+		if (gap > 0) { //it should be exactly 0 if there is no gap or >8 if there is
+			D4(fprintf(debug_file, "Inserting a skip tag to compensate for a gap (%d bytes) between the header and the frame data\n", gap));
+			if (gap < 8 || b->buff_pos + gap > b->buff_sz) {
+				D0(fprintf(debug_file, "not enough room to insret 'skip' tag - %d (need 8)\n", gap));
+				return -1;
+			}
+			put_big_endian(b, gap, 4);
+			memcpy(&b->buff[b->buff_pos], "skip", 4);
+			memset(&b->buff[b->buff_pos + 4], 0, gap - 8);
+			b->buff_pos += gap - 4;
+			b->pos += gap - 4;
+		}
+		l = 0;
+		for (i = 0; i < params->nframes; i++) l += ntohl(params->sizes[i]);
+		return put_big_endian(b, l, 4);
+	case QT_TIME:
+		time(&ltime);
+		ltime += 2082801600;      // 1970->1904// 31,557,600 seconds/year
+		return put_big_endian(b, ltime, 4);
+	}
+
+	return -1;
+}
+
+/**
+ * @brief Build Quicktime header from compiled template in memory.
+ * @param[in]       params   parameters of recorded file
+ * @param[in,out]   b        header build state, the buffer should be large enough to fit the header
+ * @return          0 if the header was built successfully and -1 otherwise
+ */
+static int qt_build(const struct qt_params *params, struct qt_builder *b)
+{
+	int depth = 0;
+	size_t atom_buff[QT_ATOM_DEPTH];
+	long atom_pos[QT_ATOM_DEPTH];
+	const struct qt_node *node;
+	long sz;
+
+	b->buff_pos = 0;
+	b->seg_start = 0;
+	b->pos = 0;
+	b->vect_num = 0;
+	for (int i = 0; i < qt_nodes_num; i++) {
+		node = &qt_nodes[i];
+		switch (node->type) {
+		case QT_LITERAL:
+			if (b->buff_pos + node->len > b->buff_sz)
+				return -1;
+			memcpy(&b->buff[b->buff_pos], &qt_literals[node->offset], node->len);
+			b->buff_pos += node->len;
+			b->pos += node->len;
+			break;
+		case QT_ATOM_START:
+			if (depth >= QT_ATOM_DEPTH)
+				return -1;
+			atom_buff[depth] = b->buff_pos;
+			atom_pos[depth] = b->pos;
+			depth++;
+			if (put_big_endian(b, 0, 4) < 0)
+				return -1;
+			break;
+		case QT_ATOM_END:
+			depth--;
+			sz = b->pos - atom_pos[depth];
+			b->buff[atom_buff[depth]] = (sz >> 24) & 0xff;
+			b->buff[atom_buff[depth] + 1] = (sz >> 16) & 0xff;
+			b->buff[atom_buff[depth] + 2] = (sz >> 8) & 0xff;
+			b->buff[atom_buff[depth] + 3] = sz & 0xff;
+			break;
+		case QT_SPECIAL:
+			if (qt_build_special(node->special, params, b) < 0)
+				return -1;
+			break;
+		}
+	}
+
+	return close_segment(b);
+}
+
+/** Free compiled header template */
+static void qt_free_template(void)
+{
+	free(qt_nodes);
+	free(qt_literals);
+	qt_nodes = NULL;
+	qt_literals = NULL;
+	qt_nodes_num = qt_nodes_sz = 0;
+	qt_literals_len = qt_literals_sz = 0;
+}
 
 /**
  * @brief Called when format is changed to MOV (only once) and recording is stopped.
- * Read frame template from the file if it is not done yet.
+ * Read header template from the file and compile it if it is not done yet.
  */
 int camogm_init_mov(void)
 {
 	FILE* qt_header;
 	int size;
+	int pos = 0;
+	char *q_template;
 
+	if (qt_nodes != NULL)
+		return 0;
 	if ((qt_header = fopen(qtSourceFileName, "r")) == NULL) {
 		D0(fprintf(debug_file, "Error opening Quicktime header template %s for reading\n", qtSourceFileName));
 		return -CAMOGM_FRAME_FILE_ERR;
@@ -91,20 +508,29 @@ int camogm_init_mov(void)
 	if (fread(q_template, size, 1, qt_header) < 1) {
 		D0(fprintf(debug_file, "Could not read %d bytes of Quicktime header template from %s\n", (size + 1), qtSourceFileName));
 		free(q_template);
-		q_template = NULL;
 		fclose(qt_header);
 		return -CAMOGM_FRAME_FILE_ERR;
 	}
+	fclose(qt_header);
 	q_template[size] = 0;
+
+	while (pos < size) {
+		if (qt_compile(q_template, &pos, size, 1) < 0) {
+			D0(fprintf(debug_file, "Error compiling Quicktime header template %s at position %d\n", qtSourceFileName, pos));
+			qt_free_template();
+			free(q_template);
+			return -CAMOGM_FRAME_OTHER;
+		}
+	}
+	free(q_template);
+	D3(fprintf(debug_file, "Quicktime header template compiled: %d nodes, %u bytes of literal data\n", qt_nodes_num, qt_literals_len));
+
 	return 0;
 }
 
 void camogm_free_mov(void)
 {
-	if (q_template) {
-		free(q_template);
-		q_template = NULL;
-	}
+	qt_free_template();
 }
 
 /**
@@ -114,18 +540,25 @@ void camogm_free_mov(void)
  */
 int camogm_start_mov(camogm_state *state)
 {
-
 	// allocate memory for the frame index table
 	if (!((state->frame_lengths = malloc(4 * state->max_frames)))) return -CAMOGM_FRAME_MALLOC;
+	// skip header (plus extra)
+	// Quicktime (and else?) - frame data start (0xff 0xd8...)
+	state->frame_data_start = QUICKTIME_MIN_HEADER + 16 + 4 * (state->max_frames) + ( 4 * (state->max_frames)) / (state->frames_per_chunk); // 8 bytes for "skip" tag
+	// header is built in memory, sample size table is not copied to this buffer
+	if (!((qt_hdr_buff = malloc(state->frame_data_start)))) {
+		free(state->frame_lengths);
+		state->frame_lengths = NULL;
+		return -CAMOGM_FRAME_MALLOC;
+	}
 	// open file for writing
 	sprintf(state->path, "%s%010ld_%06ld.mov", state->path_prefix, state->frame_params[state->port_num].timestamp_sec, state->frame_params[state->port_num].timestamp_usec);
 	if (((state->ivf = open(state->path, O_RDWR | O_CREAT, 0777))) < 0) {
 		D0(fprintf(debug_file, "Error opening %s for writing, returned %d, errno=%d\n", state->path, state->ivf, errno));
+		free(qt_hdr_buff);
+		qt_hdr_buff = NULL;
 		return -CAMOGM_FRAME_FILE_ERR;
 	}
-	// skip header (plus extra)
-	// Quicktime (and else?) - frame data start (0xff 0xd8...)
-	state->frame_data_start = QUICKTIME_MIN_HEADER + 16 + 4 * (state->max_frames) + ( 4 * (state->max_frames)) / (state->frames_per_chunk); // 8 bytes for "skip" tag
 	lseek(state->ivf, state->frame_data_start, SEEK_SET);
 	return 0;
 }
@@ -156,296 +589,86 @@ int camogm_frame_mov(camogm_state *state)
 		state->ivf = -1;
 		return -CAMOGM_FRAME_FILE_ERR;
 	}
-	state->frame_lengths[state->frameno] = l;
+	// frame sizes are stored in big endian order, ready to be written to sample size table
+	state->frame_lengths[state->frameno] = htonl(l);
 	return 0;
 }
 
 /**
- * @brief Move to the start of the file and insert generated header
- * @param[in]   state   pointer to the #camogm_state structure for current sensor port
- * @return      this function is always successful and returns 0
+ * @brief Build header in memory and write it to the start of the file with a single call. This function
+ * can be called from finalizer thread, all the data it needs is in the segment job.
+ * @param[in]   job   segment job prepared by #camogm_end_mov
+ * @return      0 if the header was written successfully and negative error code otherwise
  */
-int camogm_end_mov(camogm_state *state)
+static int mov_finish(struct segment_job *job)
 {
-	off_t l;
-	int port = state->port_num;
-	timescale = 10000;                                                      // frame period measured in 1/10000 of a second?
-	// that was in old code. If that works - try to switch to microseconds
-	l = lseek(state->ivf, 0, SEEK_CUR) - (state->frame_data_start) + 8;     // 4-byte length+"mdat"
-	// fill in the header in the beginning of the file
-	lseek(state->ivf, 0, SEEK_SET);
-	quicktime_template_parser(state,
-			q_template,   // now - string containing header template
-			state->ivf,   // output file descriptor (opened)
-			state->width, // width in pixels
-			state->height,
-			state->frameno,
-			state->frame_period[port] / (1000000 / timescale),
-			state->frames_per_chunk,
-			0,                    // frame size - will look in the table
-			(int)((float)timescale / (state->timescale)),
-			state->frame_lengths, // array of frame lengths to build an index
-			state->frame_data_start
-	);
-#if 0
-	// now we need to overwrite last mdat tag in the header to the skip the gap, instead of the length 'mdat
-	// put length 'skip length 'mdat
-	he = lseek(state->ivf, 0, SEEK_CUR);    // just after the original header end
-	l = state->frame_data_start - he;       // should be >=
-	D4(fprintf(debug_file, "Remaining gap between Quicktime header and the data is %d (it should be>=8) \n", (int)l));
-	lseek(state->ivf, he - 8, SEEK_SET);
-	read(state->ivf, mdat_tag, 8); //!read calculated length+'mdat' tag
-	lseek(state->ivf, state->frame_data_start - 8, SEEK_SET);
-	write(state->ivf, mdat_tag, 8);
-	skip_tag[0] = (l >> 24) & 0xff;
-	skip_tag[1] = (l >> 16) & 0xff;
-	skip_tag[2] = (l >>  8) & 0xff;
-	skip_tag[3] = (l      ) & 0xff;
-	lseek(state->ivf, he - 8, SEEK_SET);
-	write(state->ivf, skip_tag, 8);
-#endif
-	close(state->ivf);
-	state->ivf = -1;
-	// free memory used for index
-	if (state->frame_lengths) {
-		free(state->frame_lengths);
-		state->frame_lengths = NULL;
+	int ret = 0;
+	ssize_t len;
+	struct mov_segment *seg = job->data;
+	struct qt_builder b = {
+			.buff = seg->hdr_buff,
+			.buff_sz = seg->params.header_size
+	};
+
+	if (qt_build(&seg->params, &b) == 0) {
+		len = 0;
+		for (int i = 0; i < b.vect_num; i++)
+			len += b.vect[i].iov_len;
+		if (pwritev(job->fd, b.vect, b.vect_num, 0) < len) {
+			D0(fprintf(debug_file, "Error writing Quicktime header to %s: %s\n", job->path, strerror(errno)));
+			ret = -CAMOGM_FRAME_FILE_ERR;
+		}
+	} else {
+		D0(fprintf(debug_file, "Error building Quicktime header for %s\n", job->path));
+		ret = -CAMOGM_FRAME_OTHER;
 	}
-	return 0;
+	// free memory used for index
+	free(seg->frame_lengths);
+	free(seg->hdr_buff);
+	seg->frame_lengths = NULL;
+	seg->hdr_buff = NULL;
+
+	return ret;
 }
 
 /**
- * @brief Starts with the input file pointer just after the opening "{",
- * and output file - at the beginning of it's output
- * on exit - input pointer - after closing "}", output after it's output
- * @param[in]   d
- * @param[in]   l
- * @return      None
+ * @brief End MOV recording. The file, frame index and header buffer are moved to segment job,
+ * the header is written when the job is run.
+ * @param[in]   state   pointer to the #camogm_state structure for current sensor port
+ * @param[out]  job     segment job to be finalized
+ * @return      0 if the segment was moved to the job and negative error code otherwise
  */
-void putBigEndian(unsigned long d, int l)
+int camogm_end_mov(camogm_state *state, struct segment_job *job)
 {
-	unsigned char od[4];
-
-	od[3] = d;
-	od[2] = d >> 8;
-	od[1] = d >> 16;
-	od[0] = d >> 24;
-	if (l) write(ofd, &od[4 - l], l);
-}
-
-/** @brief Temporary replacement for fgets to read from string */
-char * sfgets(char * str, int size, const char * stream, int * pos)
-{
-	int l;
-	const char * eol = strchr(&stream[*pos], '\n');
-
-	if (!eol) eol = stream + (strlen(stream) - 1);  // pointer to last before '\0'
-	l = (eol - stream) - (*pos);
-	if (l >= size) l = size - 1;
-	memcpy(str, &stream[*pos], l);
-	str[l] = '\0';
-	*pos += l;
-	return str;
-}
-
-int parse_special(void)
-{
-	time_t ltime;
-	int n, j, l;
-	char str[256];
-	char c;
-	int i = 0;
-	int gap;
-
-	while (((c = iFile[iPos++]) != 0x20) && (c != 0x09) && (c != 0x0a) && (c != 0x0d) && (c != 0x0) && (i < 255) && ( iPos < iFileLen )) str[i++] = c;
-	str[i] = 0;
-
-	D4(fprintf(debug_file, "parse_special, str=!%s\n", str));
-
-	if (strcmp(str, "mdata") == 0) {
-		putBigEndian(headerSize, 4); return 0;
-	}                                                                    // will put zeroes on pass 1
-	if (strcmp(str, "height") == 0) {
-		putBigEndian(height, 2); return 0;
-	}
-	if (strcmp(str, "width") == 0) {
-		putBigEndian(width, 2); return 0;
-	}
-	if (strcmp(str, "width") == 0) {
-		putBigEndian(width, 2); return 0;
-	}
-	if (strcmp(str, "nframes") == 0) {
-		putBigEndian(nframes, 4); return 0;
-	}
-	if (strcmp(str, "timescale") == 0) {
-		putBigEndian(timescale, 4); return 0;
-	}
-	if (strcmp(str, "duration") == 0) {
-		putBigEndian(nframes * sample_dur, 4); return 0;
-	}
-	if (strcmp(str, "frame_duration") == 0) {
-		putBigEndian(sample_dur, 4); return 0;
-	}
-	if (strcmp(str, "samples_chunk") == 0) {
-		putBigEndian(samplesPerChunk, 4); return 0;
-	}                                                                                 // will put zeroes on pass 1
-	if (strcmp(str, "sample_sizes") == 0) {
-		if (sizes != NULL) for (i = 0; i < nframes; i++) putBigEndian(sizes[i], 4);
-		else for (i = 0; i < nframes; i++) putBigEndian(framesize, 4);
-		return 0;
-	}
-	if (strcmp(str, "chunk_offsets") == 0) {
-		n = (nframes - 1) / samplesPerChunk + 1;
-		putBigEndian(n, 4);
-		if (sizes != NULL) {
-			l = 0; j = 0;
-			for (i = 0; i < nframes; i++) {
-				if (j == 0) putBigEndian(headerSize + l, 4);
-				j++; if (j >= samplesPerChunk) j = 0;
-				l += sizes[i];
-			}
-
-		} else for (i = 0; i < n; i++) putBigEndian(headerSize + framesize * samplesPerChunk * i, 4);
-		return 0;
-	}
-	// a hack - invlude length'skip if data position (header size is known and there is a gap)
-	if (strcmp(str, "data_size") == 0) {
-		gap = headerSize - lseek(ofd, 0, SEEK_CUR) - 8;
-		if (gap > 0) { //it should be exactly 0 if there is no gap or >8 if there is
-			D4(fprintf(debug_file, "Inserting a skip tag to compensate for a gap (%d bytes) between the header and the frame data\n", gap));
-			if (gap < 8) {
-				D0(fprintf(debug_file, "not enough room to insret 'skip' tag - %d (need 8)\n", gap));
-				return -1;
-			}
-			D4(fprintf(debug_file, "writing hex %x, %x bytes\n", gap, 4));
-			putBigEndian(gap, 4);
-			D4(fprintf(debug_file, "writing string <%s>\n", "skip"));
-			write(ofd, "skip", 4);
-			lseek(ofd, gap - 8, SEEK_CUR); // lseek over the gap and proceed as before
-		}
-		if (sizes != NULL) {
-			l = 0;
-			for (i = 0; i < nframes; i++) l += sizes[i];
-			D4(fprintf(debug_file, "writing hex %x, %x bytes\n", l, 4));
-			putBigEndian(l, 4);
-		} else putBigEndian(nframes * framesize, 4);
-		return 0;
-	}
-	if (strcmp(str, "time") == 0) {
-		time(&ltime);
-		ltime += 2082801600;      // 1970->1904// 31,557,600 seconds/year
-		putBigEndian(ltime, 4); return 0;
-	}
-	return -1;
-}
-
-int parse(camogm_state *state, int top)      // if top - will not include length
-{
-	long out_start, out_end;
-	char c;
-	unsigned long d, l;
-	char * cp;
-
-	D4(fprintf(debug_file, "parse(%x)\n", top));
-	c = iFile[iPos++];
-	D5(fprintf(debug_file, "%c", c));
-	out_start = lseek(ofd, 0, SEEK_CUR);
-
-	if (!top) putBigEndian(0, 4);
-	while (( iPos < iFileLen ) && (c != '}')) {
-		// skip white spaces strchr
-		if ((c != ' ') && (c != 0x9) && (c != 0xa) && (c != 0xd)) {
-			if (c == '!') {
-				if (parse_special() < 0) return -1;
-			}
-			// children atoms
-			else if (c == '{') {
-				if (parse(state, 0) < 0) return -1;
-				// skip comments
-			} else if (c == '#') sfgets( comStr, sizeof(comStr), iFile, &iPos);
-			else if (c == '\'') {
-				sfgets( comStr, sizeof(comStr), iFile, &iPos);
-				if ((cp = strchr(comStr, 0x0a)) != NULL) cp[0] = 0;
-				if ((cp = strchr(comStr, 0x0d)) != NULL) cp[0] = 0;
-				if ((cp = strchr(comStr, '#')) != NULL) cp[0] = 0;
-				cp = comStr + strlen(comStr) - 1;
-				while ((cp > comStr) && ((cp[0] == 0x20) || (cp[0] == 0x09))) cp--;
-				cp[1] = 0;
-				write(ofd, comStr, strlen(comStr));
-				D4(fprintf(debug_file, "writing string <%s>\n", comStr));
-			} else if (strchr(hexStr, c)) {
-				d = 0;
-				l = 1;
-				do {
-					d = (d << 4) + (strchr(hexStr, c) - hexStr);
-					l++;
-				} while (( iPos < iFileLen ) && (l <= 8) && (strchr(hexStr, (c = iFile[iPos++]))) );
-				l = (l) >> 1;
-				putBigEndian(d, l);
-
-				D4(fprintf(debug_file, "writing hex %lx, %lx bytes\n", d, l));
-
-
-			} else if ((c == '}')) {
-				break;
-
-			} else {
-				return -1;
-			}
-
-		}
-		c = iFile[iPos++];
-
-	}
+	int port = state->port_num;
+	int timescale = 10000;                                                  // frame period measured in 1/10000 of a second?
+	struct mov_segment *seg;
 
-	// fread fseek ftell
-	if (!top) {
-		out_end = lseek(ofd, 0, SEEK_CUR);
-		lseek(ofd, out_start, SEEK_SET);
-		putBigEndian((out_end - out_start), 4);
-		lseek(state->ivf, out_end, SEEK_SET);
+	if ((seg = malloc(sizeof(struct mov_segment))) == NULL) {
+		close(state->ivf);
+		state->ivf = -1;
+		free(state->frame_lengths);
+		state->frame_lengths = NULL;
+		free(qt_hdr_buff);
+		qt_hdr_buff = NULL;
+		return -CAMOGM_FRAME_MALLOC;
 	}
-	return 0;
-}
-
-
-int quicktime_template_parser( camogm_state *state,
-		const char * i_iFile,     // now - string containing header template
-		int i_ofd,                // output file descriptor (opened)
-		int i_width,              // width in pixels
-		int i_height,
-		int i_nframes,
-		int i_sample_dur,
-		int i_samplesPerChunk,
-		int i_framesize,
-		int i_timescale,
-		int * i_sizes,
-		int data_start            // zero if dfata is not written yet (will be no gap)
-)
-{
-	iFile =           i_iFile;
-	width =           i_width;
-	height =          i_height;
-	nframes =         i_nframes;
-	sample_dur =      i_sample_dur;
-	samplesPerChunk = i_samplesPerChunk;
-	framesize =       i_framesize;
-	timescale =       i_timescale;
-	sizes =           i_sizes;
-	iPos = 0;                     // position in the string "iFile"
-	ofd =             i_ofd;
-	iFileLen =        strlen(iFile);
-	lseek(ofd, 0, SEEK_SET);
-	if (data_start) headerSize = data_start;
-	D3(fprintf(debug_file, "PASS I\n"));
-
-	while ( iPos < iFileLen ) parse(state, 1);  // pass 1
-	if (!headerSize) headerSize = lseek(ofd, 0, SEEK_CUR);
-	iPos = 0;
-	lseek(ofd, 0, SEEK_SET);
-
-	D3(fprintf(debug_file, "PASS II\n"));
-	while ( iPos < iFileLen ) parse(state, 1);  // pass 2
+	seg->params.width = state->width;
+	seg->params.height = state->height;
+	seg->params.nframes = state->frameno;
+	seg->params.sample_dur = state->frame_period[port] / (1000000 / timescale);
+	seg->params.samples_chunk = state->frames_per_chunk;
+	seg->params.timescale = (int)((float)timescale / (state->timescale));
+	seg->params.sizes = (const uint32_t *)state->frame_lengths;
+	seg->params.header_size = state->frame_data_start;
+	seg->frame_lengths = state->frame_lengths;
+	seg->hdr_buff = qt_hdr_buff;
+	job->fd = state->ivf;
+	job->finish = mov_finish;
+	job->data = seg;
+	state->ivf = -1;
+	state->frame_lengths = NULL;
+	qt_hdr_buff = NULL;
 
 	return 0;
 }
@@ -17,23 +17,370 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <sys/uio.h>
 #include <errno.h>
 #include <string.h>
 
 #include "camogm_ogm.h"
 
+/** @brief The maximum number of lacing values (segments) in one Ogg page */
+#define OGG_MAX_SEGMENTS          255
+/** @brief The size of Ogg page header without segment table */
+#define OGG_HEADER_SIZE           27
+/** @brief Nominal Ogg page body size, a page is closed on packet boundary after this size is exceeded */
+#define OGG_PAGE_NOMINAL          4096
+/** @brief The minimal number of packets finished in a page before the page can be closed on nominal size */
+#define OGG_PAGE_MIN_PACKETS      4
+/** @brief The offset of CRC field in Ogg page header */
+#define OGG_CRC_OFFSET            22
+/** @brief The size of buffer for packet data left over after page output, less than one full page is always left */
+#define OGM_CARRY_SIZE            ((OGG_MAX_SEGMENTS - 1) * 255)
+/** @brief The maximum number of pieces of pending page body: carried over data and the chunks of one packet */
+#define OGM_BODY_VECTORS          (FILE_CHUNKS_NUM + 1)
+/** @brief Initial size of lacing values queue, it grows if a packet does not fit */
+#define OGM_LACING_SIZE           1024
+
+/** Ogg page flags */
+#define OGG_FLAG_CONTINUED        0x01
+#define OGG_FLAG_BOS              0x02
+#define OGG_FLAG_EOS              0x04
+/** Lacing value flag marking the first segment of a packet */
+#define OGG_LACING_FIRST          0x100
+
+/**
+ * @struct ogm_lacing
+ * @brief Lacing value of a packet segment
+ */
+struct ogm_lacing {
+	uint16_t val;                                ///< segment size and #OGG_LACING_FIRST flag
+	int64_t granule;                         ///< granule position of the packet
+};
+
+/**
+ * @struct ogm_writer
+ * @brief Ogg stream state. Packet data is not copied to stream buffers: page body is written directly from
+ * packet chunks and only the data left over after page output is copied to carry buffer.
+ */
+struct ogm_writer {
+	int serialno;                                ///< stream serial number
+	uint32_t pageno;                             ///< page sequence number
+	bool b_o_s;                                  ///< the first page has been written
+	bool e_o_s;                                  ///< the last packet is in stream
+	int64_t granulepos;                      ///< granule position of the last packet
+	struct ogm_lacing *lacing;                   ///< lacing values queue
+	int lacing_sz;                               ///< the size of lacing values queue
+	int lacing_start;                            ///< the first lacing value not yet written
+	int lacing_fill;                             ///< the number of lacing values not yet written
+	struct iovec body[OGM_BODY_VECTORS];         ///< pending page body pieces
+	int body_start;                              ///< the first pending piece
+	int body_num;                                ///< the number of pieces in #body
+	unsigned char header[OGG_HEADER_SIZE + OGG_MAX_SEGMENTS]; ///< page header buffer
+	unsigned char carry[OGM_CARRY_SIZE];         ///< packet data left over after page output
+};
+
+static struct ogm_writer ogm;
+
+/** CRC lookup tables for slicing-by-8 calculation, direct polynomial 0x04c11db7 */
+static uint32_t ogg_crc_table[8][256];
+static pthread_once_t ogg_crc_once = PTHREAD_ONCE_INIT;
+
+static void ogg_crc_init(void)
+{
+	uint32_t c;
+
+	for (int i = 0; i < 256; i++) {
+		c = (uint32_t)i << 24;
+		for (int j = 0; j < 8; j++)
+			c = (c & 0x80000000) ? ((c << 1) ^ 0x04c11db7) : (c << 1);
+		ogg_crc_table[0][i] = c;
+	}
+	for (int i = 0; i < 256; i++) {
+		c = ogg_crc_table[0][i];
+		for (int k = 1; k < 8; k++) {
+			c = (c << 8) ^ ogg_crc_table[0][c >> 24];
+			ogg_crc_table[k][i] = c;
+		}
+	}
+}
+
+/**
+ * @brief Calculate Ogg page CRC, eight bytes are processed at a time
+ * @param[in]   crc    initial value, 0 for a new calculation or the result of previous call to continue
+ * @param[in]   buff   data buffer
+ * @param[in]   len    the length of data in buffer
+ * @return      Updated CRC value
+ */
+static uint32_t ogg_crc(uint32_t crc, const unsigned char *buff, size_t len)
+{
+	uint32_t a;
+
+	while (len >= 8) {
+		a = crc ^ ((uint32_t)buff[0] << 24 | (uint32_t)buff[1] << 16 | (uint32_t)buff[2] << 8 | buff[3]);
+		crc = ogg_crc_table[7][a >> 24] ^ ogg_crc_table[6][(a >> 16) & 0xff] ^
+				ogg_crc_table[5][(a >> 8) & 0xff] ^ ogg_crc_table[4][a & 0xff] ^
+				ogg_crc_table[3][buff[4]] ^ ogg_crc_table[2][buff[5]] ^
+				ogg_crc_table[1][buff[6]] ^ ogg_crc_table[0][buff[7]];
+		buff += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = (crc << 8) ^ ogg_crc_table[0][(crc >> 24) ^ *buff++];
+
+	return crc;
+}
+
+/** Reset stream state for a new file */
+static void ogm_stream_init(int serialno)
+{
+	ogm.serialno = serialno;
+	ogm.pageno = 0;
+	ogm.b_o_s = false;
+	ogm.e_o_s = false;
+	ogm.granulepos = 0;
+	ogm.lacing_start = 0;
+	ogm.lacing_fill = 0;
+	ogm.body_start = 0;
+	ogm.body_num = 0;
+}
+
+/**
+ * @brief Add a packet to stream. Packet data is referenced, not copied, so it should stay valid until
+ * pages are written or #ogm_keep_body is called.
+ * @param[in]   chunks       packet data chunks
+ * @param[in]   chunks_num   the number of chunks
+ * @param[in]   granulepos   packet granule position
+ * @param[in]   e_o_s        this is the last packet in stream
+ * @return      0 if the packet was added and negative error code otherwise
+ */
+static int ogm_packetin(const elph_packet_chunk *chunks, int chunks_num, int64_t granulepos, bool e_o_s)
+{
+	long bytes = 0;
+	int lacing_vals, i;
+	struct ogm_lacing *lv;
+
+	for (i = 0; i < chunks_num; i++) {
+		if (chunks[i].bytes == 0)
+			continue;
+		if (ogm.body_num >= OGM_BODY_VECTORS)
+			return -CAMOGM_FRAME_OTHER;
+		ogm.body[ogm.body_num].iov_base = chunks[i].chunk;
+		ogm.body[ogm.body_num].iov_len = chunks[i].bytes;
+		ogm.body_num++;
+		bytes += chunks[i].bytes;
+	}
+	lacing_vals = bytes / 255 + 1;
+	if (ogm.lacing_start + ogm.lacing_fill + lacing_vals > ogm.lacing_sz) {
+		int sz = ogm.lacing_sz ? ogm.lacing_sz : OGM_LACING_SIZE;
+		while (sz < ogm.lacing_start + ogm.lacing_fill + lacing_vals)
+			sz *= 2;
+		if ((lv = realloc(ogm.lacing, sz * sizeof(struct ogm_lacing))) == NULL)
+			return -CAMOGM_FRAME_MALLOC;
+		ogm.lacing = lv;
+		ogm.lacing_sz = sz;
+	}
+	lv = &ogm.lacing[ogm.lacing_start + ogm.lacing_fill];
+	for (i = 0; i < lacing_vals - 1; i++) {
+		lv[i].val = 255;
+		lv[i].granule = ogm.granulepos;
+	}
+	lv[i].val = bytes % 255;
+	lv[i].granule = ogm.granulepos = granulepos;
+	lv[0].val |= OGG_LACING_FIRST;
+	ogm.lacing_fill += lacing_vals;
+	if (e_o_s)
+		ogm.e_o_s = true;
+
+	return 0;
+}
+
+/**
+ * @brief Build page header for the specified number of segments and write the page with a single call
+ * @param[in]   fd            file descriptor
+ * @param[in]   vals          the number of segments in page
+ * @param[in]   granule_pos   page granule position
+ * @return      0 if the page was written successfully and negative error code otherwise
+ */
+static int ogm_write_page(int fd, int vals, int64_t granule_pos)
+{
+	int vect_num = 1;
+	size_t bytes = 0;
+	size_t len, page_len;
+	uint32_t crc;
+	struct iovec vect[OGM_BODY_VECTORS + 1];
+	struct iovec *piece;
+	unsigned char *hdr = ogm.header;
+	const struct ogm_lacing *lv = &ogm.lacing[ogm.lacing_start];
+
+	memcpy(hdr, "OggS", 4);
+	hdr[4] = 0;
+	hdr[5] = 0;
+	if ((lv[0].val & OGG_LACING_FIRST) == 0) hdr[5] |= OGG_FLAG_CONTINUED;
+	if (!ogm.b_o_s) hdr[5] |= OGG_FLAG_BOS;
+	if (ogm.e_o_s && ogm.lacing_fill == vals) hdr[5] |= OGG_FLAG_EOS;
+	ogm.b_o_s = true;
+	put_uint64(&hdr[6], granule_pos);
+	put_uint32(&hdr[14], ogm.serialno);
+	put_uint32(&hdr[18], ogm.pageno++);
+	put_uint32(&hdr[OGG_CRC_OFFSET], 0);
+	hdr[26] = vals;
+	for (int i = 0; i < vals; i++) {
+		hdr[OGG_HEADER_SIZE + i] = lv[i].val & 0xff;
+		bytes += lv[i].val & 0xff;
+	}
+	vect[0].iov_base = hdr;
+	vect[0].iov_len = OGG_HEADER_SIZE + vals;
+	page_len = vect[0].iov_len + bytes;
+	crc = ogg_crc(0, hdr, vect[0].iov_len);
+
+	// page body is taken from pending pieces, the last piece can be split between pages
+	while (bytes > 0 && ogm.body_start < ogm.body_num) {
+		piece = &ogm.body[ogm.body_start];
+		len = (piece->iov_len > bytes) ? bytes : piece->iov_len;
+		vect[vect_num].iov_base = piece->iov_base;
+		vect[vect_num].iov_len = len;
+		vect_num++;
+		crc = ogg_crc(crc, piece->iov_base, len);
+		piece->iov_base += len;
+		piece->iov_len -= len;
+		if (piece->iov_len == 0)
+			ogm.body_start++;
+		bytes -= len;
+	}
+	put_uint32(&hdr[OGG_CRC_OFFSET], crc);
+	ogm.lacing_start += vals;
+	ogm.lacing_fill -= vals;
+
+	if (writev(fd, vect, vect_num) != page_len) {
+		D0(fprintf(debug_file, "Error writing Ogg page: %s\n", strerror(errno)));
+		return -CAMOGM_FRAME_FILE_ERR;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Write one page if there is enough data for it. Page boundaries are chosen the same way libogg does.
+ * @param[in]   fd      file descriptor
+ * @param[in]   force   write a page even if it is not full (flush)
+ * @return      1 if a page was written, 0 if there is not enough data for a page and negative error code otherwise
+ */
+static int ogm_page(int fd, bool force)
+{
+	int ret;
+	int vals;
+	int maxvals = (ogm.lacing_fill > OGG_MAX_SEGMENTS) ? OGG_MAX_SEGMENTS : ogm.lacing_fill;
+	long acc = 0;
+	int64_t granule_pos = -1;
+	const struct ogm_lacing *lv = &ogm.lacing[ogm.lacing_start];
+
+	if (maxvals == 0)
+		return 0;
+	if (!ogm.b_o_s) {
+		// the first page must only include the initial header packet
+		granule_pos = 0;
+		for (vals = 0; vals < maxvals; vals++) {
+			if ((lv[vals].val & 0xff) < 255) {
+				vals++;
+				break;
+			}
+		}
+	} else {
+		int packets_done = 0;
+		int packet_just_done = 0;
+		for (vals = 0; vals < maxvals; vals++) {
+			if (acc > OGG_PAGE_NOMINAL && packet_just_done >= OGG_PAGE_MIN_PACKETS) {
+				force = true;
+				break;
+			}
+			acc += lv[vals].val & 0xff;
+			if ((lv[vals].val & 0xff) < 255) {
+				granule_pos = lv[vals].granule;
+				packet_just_done = ++packets_done;
+			} else {
+				packet_just_done = 0;
+			}
+		}
+		if (vals == OGG_MAX_SEGMENTS)
+			force = true;
+	}
+	if (!force)
+		return 0;
+	if ((ret = ogm_write_page(fd, vals, granule_pos)) < 0)
+		return ret;
+
+	return 1;
+}
+
+/**
+ * @brief Write all complete pages
+ * @param[in]   fd      file descriptor
+ * @param[in]   flush   write all the data, the last page may be incomplete
+ * @return      0 if the pages were written successfully and negative error code otherwise
+ */
+static int ogm_pageout(int fd, bool flush)
+{
+	int ret;
+
+	do {
+		bool force = flush || (ogm.e_o_s && ogm.lacing_fill) || (ogm.lacing_fill && !ogm.b_o_s);
+		ret = ogm_page(fd, force);
+	} while (ret > 0);
+
+	return ret;
+}
+
+/**
+ * @brief Copy the data left over after page output to carry buffer, packet chunks can be reused after that
+ * @return      0 if the data was copied and negative error code otherwise
+ */
+static int ogm_keep_body(void)
+{
+	size_t pos = 0;
+
+	for (int i = ogm.body_start; i < ogm.body_num; i++) {
+		if (pos + ogm.body[i].iov_len > OGM_CARRY_SIZE)
+			return -CAMOGM_FRAME_OTHER;
+		// the first piece may be the carry buffer itself
+		memmove(&ogm.carry[pos], ogm.body[i].iov_base, ogm.body[i].iov_len);
+		pos += ogm.body[i].iov_len;
+	}
+	ogm.body_start = 0;
+	ogm.body_num = 0;
+	if (pos > 0) {
+		ogm.body[0].iov_base = ogm.carry;
+		ogm.body[0].iov_len = pos;
+		ogm.body_num = 1;
+	}
+	memmove(ogm.lacing, &ogm.lacing[ogm.lacing_start], ogm.lacing_fill * sizeof(struct ogm_lacing));
+	ogm.lacing_start = 0;
+
+	return 0;
+}
+
 /**
  * @brief Called when format is changed to OGM (only once) and recording is stopped
  */
 int camogm_init_ogm(void)
 {
+	pthread_once(&ogg_crc_once, ogg_crc_init);
+	if (ogm.lacing == NULL) {
+		if ((ogm.lacing = malloc(OGM_LACING_SIZE * sizeof(struct ogm_lacing))) == NULL)
+			return -CAMOGM_FRAME_MALLOC;
+		ogm.lacing_sz = OGM_LACING_SIZE;
+	}
 	return 0;
 }
 
 void camogm_free_ogm(void)
 {
+	free(ogm.lacing);
+	ogm.lacing = NULL;
+	ogm.lacing_sz = 0;
 }
 
 /**
@@ -43,25 +390,26 @@ void camogm_free_ogm(void)
  */
 int camogm_start_ogm(camogm_state *state)
 {
+	int ret;
 	char vendor[] = "ElphelOgm v 0.1";
 	int pos;
 	stream_header sh;
 	char hdbuf[sizeof(sh) + 1];
-	ogg_packet ogg_header;
+	elph_packet_chunk ogg_header;
 
 	sprintf(state->path, "%s%010ld_%06ld.ogm", state->path_prefix, state->frame_params[state->port_num].timestamp_sec, state->frame_params[state->port_num].timestamp_usec);
-	if (!((state->vf = fopen(state->path, "w+"))) ) {
+	if (((state->ivf = open(state->path, O_RDWR | O_CREAT | O_TRUNC, 0666))) < 0) {
 		D0(fprintf(debug_file, "Error opening %s for writing\n", state->path));
 		return -CAMOGM_FRAME_FILE_ERR;
 	}
-	ogg_stream_init(&(state->os), state->serialno);
+	ogm_stream_init(state->serialno);
 	state->packetno = 0;
 	memset(&sh, 0, sizeof(stream_header));
 	memcpy(sh.streamtype, "video", 5);
 	memcpy(sh.subtype, "MJPG", 4);
 	put_uint32(&sh.size, sizeof(sh));
 	put_uint64(&sh.time_unit, state->time_unit);
-	put_uint64(&sh.samples_per_unit, (ogg_int64_t)state->timescale);
+	put_uint64(&sh.samples_per_unit, (int64_t)state->timescale);
 	put_uint32(&sh.default_len, 1);
 	put_uint32(&sh.buffersize, state->width * state->height);
 	put_uint16(&sh.bits_per_sample, 0);
@@ -70,22 +418,13 @@ int camogm_start_ogm(camogm_state *state)
 	memcpy(&hdbuf[1], &sh, sizeof(sh));
 	hdbuf[0] = 1;
 	// put it into Ogg stream
-	ogg_header.packet = (unsigned char *)hdbuf;
+	ogg_header.chunk = (unsigned char *)hdbuf;
 	ogg_header.bytes = sizeof(sh) + 1;
-	ogg_header.b_o_s = 1;
-	ogg_header.e_o_s = 0;
-	ogg_header.packetno = state->packetno++;;
-	ogg_header.granulepos = 0;
-	ogg_stream_packetin(&(state->os), &ogg_header);
-
-	// while(ogg_stream_pageout(&(state->os), &(state->og))) {
-	while (ogg_stream_flush(&(state->os), &(state->og))) {
-		int i;
-		if ((((i = fwrite(state->og.header, 1, state->og.header_len, state->vf))) != state->og.header_len) ||
-				(state->og.body_len && (((i = fwrite(state->og.body, 1, state->og.body_len, state->vf))) != state->og.body_len))) {
-			D2(fprintf(debug_file, "\n%d %ld %ld\n", i, state->og.header_len, state->og.body_len));
-			return -CAMOGM_FRAME_FILE_ERR;
-		}
+	state->packetno++;
+	if ((ret = ogm_packetin(&ogg_header, 1, 0, false)) < 0 ||
+			(ret = ogm_pageout(state->ivf, true)) < 0) {
+		D2(fprintf(debug_file, "Error writing Ogg stream header: %d\n", ret));
+		return -CAMOGM_FRAME_FILE_ERR;
 	}
 
 	// create comment
@@ -101,17 +440,16 @@ int camogm_start_ogm(camogm_state *state)
 	put_uint32(&hdbuf[pos], 0);
 	pos += 4;
 	hdbuf[pos++] = 1;
-	// put it into Ogg stream
-	ogg_header.packet = (unsigned char *)hdbuf;
+	// put it into Ogg stream, it will be written with the first frame
+	ogg_header.chunk = (unsigned char *)hdbuf;
 	ogg_header.bytes = pos;
-	ogg_header.b_o_s = 0;
-	ogg_header.e_o_s = 0;
-	ogg_header.packetno = state->packetno++;;
-	ogg_header.granulepos = 0;
-	ogg_stream_packetin(&(state->os), &ogg_header);
+	state->packetno++;
+	if ((ret = ogm_packetin(&ogg_header, 1, 0, false)) < 0 ||
+			(ret = ogm_keep_body()) < 0)
+		return ret;
 	// calculate initial absolute granulepos (from 1970), then increment with each frame. Later try calculating granulepos of each frame
 	// from the absolute time (actual timestamp)
-	state->granulepos = (ogg_int64_t)( (((double)state->frame_params[state->port_num].timestamp_usec) +
+	state->granulepos = (int64_t)( (((double)state->frame_params[state->port_num].timestamp_usec) +
 			(((double)1000000) * ((double)state->frame_params[state->port_num].timestamp_sec))) *
 			((double)10) /
 			((double)state->time_unit) *
@@ -124,81 +462,47 @@ int camogm_start_ogm(camogm_state *state)
 }
 
 /**
- * @brief Write a frame to file
+ * @brief Write a frame to file. Pages are written directly from packet chunks, the part of the frame
+ * which does not fill a complete page is kept till the next frame.
  * @param[in]   state   a pointer to a structure containing current state
  * @return      0 if frame was saved successfully and negative error code otherwise
  */
 int camogm_frame_ogm(camogm_state *state)
 {
-	int indx;
-	elph_ogg_packet elp_packet;
-
-	elp_packet.bytes = 0;
-	for (indx = 0; indx < state->chunk_index; indx++) elp_packet.bytes += state->packetchunks[indx].bytes;
-	elp_packet.packet = state->packetchunks;
-	//D(fprintf (debug_file,"elp_packet.bytes=0x%lx: elp_packet.packet=%p\n",elp_packet.bytes, elp_packet.packet));
-	/*D(fprintf (debug_file,"0:0x%lx: %p\n" \
-                             "1:0x%lx: %p\n" \
-                             "2:0x%lx: %p\n" \
-                             "3:0x%lx: %p\n" \
-                             "4:0x%lx: %p\n" \
-                             "5:0x%lx: %p\n" \
-                             "6:0x%lx: %p\n", \
-                              elp_packet.packet[0].bytes,  elp_packet.packet[0].chunk,
-                              elp_packet.packet[1].bytes,  elp_packet.packet[1].chunk,
-                              elp_packet.packet[2].bytes,  elp_packet.packet[2].chunk,
-                              elp_packet.packet[3].bytes,  elp_packet.packet[3].chunk,
-                              elp_packet.packet[4].bytes,  elp_packet.packet[4].chunk,
-                              elp_packet.packet[5].bytes,  elp_packet.packet[5].chunk,
-                              elp_packet.packet[6].bytes,  elp_packet.packet[6].chunk));
-	 */
-	elp_packet.b_o_s = 0;
-	elp_packet.e_o_s = 0;
-	elp_packet.packetno = state->packetno++;;
-	elp_packet.granulepos = state->granulepos;
+	int ret;
+	int64_t granulepos;
+
+	state->packetno++;
+	granulepos = state->granulepos;
 	/// @todo If that works, calculate granulepos from timestamp for each frame
-	state->granulepos += (ogg_int64_t)state->timescale;
-
-	//D3(fprintf (debug_file,"_121_"));
-	ogg_stream_packetin_elph(&(state->os), &elp_packet);
-	//D3(fprintf (debug_file,"_13_"));
-	while (ogg_stream_pageout(&(state->os), &(state->og))) {
-		int i, j;
-		if ((((i = fwrite(state->og.header, 1, state->og.header_len, state->vf))) != state->og.header_len) ||
-				(state->og.body_len && (((i = fwrite(state->og.body, 1, state->og.body_len, state->vf))) != state->og.body_len))) {
-			j = errno;
-			D0(fprintf(debug_file, "\n%d %ld %ld\n", i, state->og.header_len, state->og.body_len));
-			return -CAMOGM_FRAME_FILE_ERR;
-		}
-	}
-	return 0;
+	state->granulepos += (int64_t)state->timescale;
+
+	if ((ret = ogm_packetin(state->packetchunks, state->chunk_index, granulepos, false)) < 0)
+		return ret;
+	if ((ret = ogm_pageout(state->ivf, false)) < 0)
+		return ret;
+	// packet chunks point to circbuf and per-frame buffers which will be reused
+	return ogm_keep_body();
 }
 
 /**
- * @brief Finish OGM file operation
+ * @brief Finish OGM file operation and move the file to segment job, it is closed when the job is run
  * @param[in]   state   a pointer to a structure containing current state
+ * @param[out]  job     segment job to be finalized
  * @return      0 if file was saved successfully and negative error code otherwise
  * @note Zero packets are OK, use them to end file with "last" turned on
  */
-int camogm_end_ogm(camogm_state *state)
+int camogm_end_ogm(camogm_state *state, struct segment_job *job)
 {
+	int ret;
+
 	// put zero-packet it into stream
-	ogg_packet ogg_header;
-
-	ogg_header.packet = NULL;
-	ogg_header.bytes = 0;
-	ogg_header.b_o_s = 0;
-	ogg_header.e_o_s = 1;
-	ogg_header.packetno = state->packetno++;
-	ogg_header.granulepos = ++(state->granulepos);
-	ogg_stream_packetin(&(state->os), &ogg_header); // +++++++++++++++++++++++++++++++++++++++++++++++++++++
-	while (ogg_stream_flush(&(state->os), &(state->og))) {
-		int i;
-		if ((((i = fwrite(state->og.header, 1, state->og.header_len, state->vf))) != state->og.header_len) ||
-				(state->og.body_len && (((i = fwrite(state->og.body, 1, state->og.body_len, state->vf))) != state->og.body_len))) {
-			D0(fprintf(debug_file, "\n%d %ld %ld\n", i, state->og.header_len, state->og.body_len));
-			return -CAMOGM_FRAME_FILE_ERR;
-		}
-	}
-	return 0;
+	state->packetno++;
+	ret = ogm_packetin(NULL, 0, ++(state->granulepos), true);
+	if (ret == 0)
+		ret = ogm_pageout(state->ivf, true);
+	job->fd = state->ivf;
+	state->ivf = -1;
+
+	return ret;
 }
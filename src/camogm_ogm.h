@@ -19,11 +19,12 @@
 #define _CAMOGM_OGM_H
 
 #include "camogm.h"
+#include "camogm_finalize.h"
 
 int camogm_init_ogm(void);
 int camogm_start_ogm(camogm_state *state);
 int camogm_frame_ogm(camogm_state *state);
-int camogm_end_ogm(camogm_state *state);
+int camogm_end_ogm(camogm_state *state, struct segment_job *job);
 void camogm_free_ogm(void);
 
 #endif /* _CAMOGM_OGM_H */
@@ -48,6 +48,8 @@
 
 #include "camogm_read.h"
 #include "index_list.h"
+#include "camogm_thumb.h"
+#include "camogm_trace.h"
 
 /** @brief Offset in Exif where TIFF header starts */
 #define TIFF_HDR_OFFSET           12
@@ -57,6 +59,10 @@
 #define EXIF_TIMESTAMP_FORMAT     "%04d:%02d:%02d_%02d:%02d:%02d"
 /** @brief The format string used for file parameters reporting. Time and port number are extracted from Exif */
 #define INDEX_FORMAT_STR          "port_number=%d;unix_time=%ld;usec_time=%06u;offset=0x%010llx;file_size=%u\n"
+/** @brief The format string of 'get_thumbs' command arguments: time range in UNIX format and the number of thumbnails */
+#define THUMBS_FORMAT_STR         "from=%ld;to=%ld;count=%d"
+/** @brief The format string of thumbnail image header, binary PPM for color and PGM for monochrome frames */
+#define THUMB_IMAGE_HDR_STR       "P%d\n%d %d\n255\n"
 /** @brief The delimiters used to separate several commands in one command string sent over socket */
 #define CMD_DELIMITER             "/?"
 /** @brief The length of a buffer for command string */
@@ -96,6 +102,8 @@ static const struct iovec elphel_en = {
 	X(CMD_NEXT_FILE, "next_file") \
 	X(CMD_PREV_FILE, "prev_file") \
 	X(CMD_READ_ALL_FILES, "read_all_files") \
+	X(CMD_GET_THUMBS, "get_thumbs") \
+	X(CMD_READ_GROUP, "read_group") \
 	X(CMD_STATUS, "status")
 
 /** @enum socket_commands */
@@ -181,10 +189,10 @@ const unsigned char exif_data_fmt[] = {
  * The data value or offset to the data
  */
 struct ifd_entry {
-	unsigned short tag;
-	unsigned short format;
-	unsigned long len;
-	unsigned long offset;
+	uint16_t tag;
+	uint16_t format;
+	uint32_t len;
+	uint32_t offset;
 };
 
 /**
@@ -198,9 +206,9 @@ struct ifd_entry {
  * Offset to first IFD
  */
 struct tiff_hdr {
-	unsigned short byte_order;
-	unsigned short mark;
-	unsigned long offset;
+	uint16_t byte_order;
+	uint16_t mark;
+	uint32_t offset;
 };
 
 /**
@@ -392,6 +400,32 @@ static size_t exif_get_text(rawdev_buffer *rawdev, struct ifd_entry *tag, char *
 	return bytes;
 }
 
+/**
+ * @brief Check if frame group header precedes the file pointed by disk index node and save
+ * group parameters to the node. File position is not restored.
+ * @param[in]       rawdev   pointer to #rawdev_buffer structure containing
+ * the current state of raw device buffer
+ * @param[in,out]   indx     pointer to disk index node
+ * @return          None
+ */
+static void read_group_hdr(rawdev_buffer *rawdev, struct disk_index *indx)
+{
+	unsigned int ports, frames;
+	long sec, usec;
+	char buff[FRAME_GROUP_HDR_SIZE + 1] = {0};
+
+	if (indx->f_offset < rawdev->start_pos + FRAME_GROUP_HDR_SIZE)
+		return;
+	lseek64(rawdev->rawdev_fd, indx->f_offset - FRAME_GROUP_HDR_SIZE, SEEK_SET);
+	if (read(rawdev->rawdev_fd, buff, FRAME_GROUP_HDR_SIZE) != FRAME_GROUP_HDR_SIZE)
+		return;
+	if (strncmp(buff, FRAME_GROUP_MAGIC, strlen(FRAME_GROUP_MAGIC)) == 0 &&
+			sscanf(buff, FRAME_GROUP_HDR_FORMAT, &ports, &frames, &sec, &usec) == 4) {
+		indx->grp_ports = ports;
+		indx->grp_frames = frames;
+	}
+}
+
 /**
  * @brief Read Exif data from the file starting from #rawdev_buffer::file_start offset and
  * create a new node corresponding to the offset
@@ -466,6 +500,7 @@ static int read_index(rawdev_buffer *rawdev, struct disk_index **indx)
 		// create and fill new disk index node with Exif data
 		if (create_node(&node) == 0) {
 			node->f_offset = rawdev->file_start;
+			read_group_hdr(rawdev, node);
 			if (ifd_page_num.len != 0) {
 				node->port = (uint32_t)ifd_page_num.offset;
 			}
@@ -625,6 +660,56 @@ static int send_file(rawdev_buffer *rawdev, struct disk_index *indx, int sockfd)
 	 return 0;
 }
 
+/**
+ * @brief Send time-aligned frame group containing the file pointed by disk index node over opened socket.
+ * The group header and all the frames of the group are sent as one piece of data.
+ * @param[in,out]   rawdev   pointer to #rawdev_buffer structure containing
+ * the current state of raw device buffer
+ * @param[in]       indx     disk index directory node, any frame of the group
+ * @param[in]       sockfd   opened socket descriptor
+ * @return          0 in case the group was sent successfully and -1 otherwise
+ */
+static int send_group(rawdev_buffer *rawdev, struct disk_index *indx, int sockfd)
+{
+	bool found = false;
+	struct disk_index *grp_start = indx;
+	struct disk_index *grp_end;
+	struct disk_index grp = {0};
+	struct disk_index tail = {0};
+
+	// the first frame of the group is preceded by group header
+	for (int i = 0; i < SENSOR_PORTS - 1 && grp_start->grp_frames == 0 && grp_start->prev != NULL; i++)
+		grp_start = grp_start->prev;
+	if (grp_start->grp_frames == 0) {
+		D0(fprintf(debug_file, "The file at offset 0x%llx does not belong to a frame group\n", indx->f_offset));
+		return -1;
+	}
+	grp_end = grp_start;
+	found = (grp_end == indx);
+	for (unsigned int i = 1; i < grp_start->grp_frames && grp_end->next != NULL && grp_end->next->grp_frames == 0; i++) {
+		grp_end = grp_end->next;
+		if (grp_end == indx)
+			found = true;
+	}
+	if (!found) {
+		D0(fprintf(debug_file, "The file at offset 0x%llx does not belong to a frame group\n", indx->f_offset));
+		return -1;
+	}
+
+	grp.f_offset = grp_start->f_offset - FRAME_GROUP_HDR_SIZE;
+	if (grp_end->f_offset >= grp.f_offset) {
+		grp.f_size = grp_end->f_offset + grp_end->f_size - grp.f_offset;
+		return send_file(rawdev, &grp, sockfd);
+	}
+	// the group crosses raw device buffer end, send it in two pieces
+	grp.f_size = rawdev->end_pos - grp.f_offset;
+	tail.f_offset = rawdev->start_pos;
+	tail.f_size = grp_end->f_offset + grp_end->f_size - rawdev->start_pos;
+	if (send_file(rawdev, &grp, sockfd) != 0)
+		return -1;
+	return send_file(rawdev, &tail, sockfd);
+}
+
 /**
  * @brief Map a piece of raw device buffer to memory
  * @param[in,out]   rawdev   pointer to #rawdev_buffer structure containing
@@ -981,6 +1066,99 @@ static struct disk_index *find_disk_index(rawdev_buffer *rawdev, struct disk_idi
 	return indx_ret;
 }
 
+/**
+ * @brief Build thumbnails of frames sampled evenly across a time range and send them over socket.
+ *
+ * The number of thumbnails is sent first, then each thumbnail is sent as a line with frame parameters
+ * in #INDEX_FORMAT_STR format followed by binary PPM or PGM image. The images are built from DC
+ * coefficients of JPEG frames, see #thumb_decode_dc, by several threads in batches.
+ * @param[in]   rawdev   pointer to #rawdev_buffer structure containing
+ * the current state of raw device buffer
+ * @param[in]   idir     pointer to disk index directory, it should be built beforehand
+ * @param[in]   cmd      pointer to a string with command arguments in #THUMBS_FORMAT_STR format
+ * @param[in]   sockfd   opened socket descriptor
+ * @return      0 if thumbnails were sent and -1 in case of an error
+ */
+static int send_thumbs(rawdev_buffer *rawdev, const struct disk_idir *idir, char *cmd, int sockfd)
+{
+	int count = 0;
+	int batch_sz;
+	int len;
+	int i;
+	size_t found = 0;
+	size_t total;
+	time_t from, to;
+	char buff[CMD_BUFF_LEN];
+	char *cmd_start = strchr(cmd, ':');
+	struct disk_index *indx;
+	struct disk_index **sel;
+	struct thumb_image *imgs;
+	struct thumb_src src = {
+			.path = rawdev->rawdev_path,
+			.start_pos = rawdev->start_pos,
+			.end_pos = rawdev->end_pos
+	};
+
+	if (cmd_start == NULL || sscanf(++cmd_start, THUMBS_FORMAT_STR, &from, &to, &count) != 3 || count <= 0)
+		return -1;
+
+	for (indx = idir->head; indx != NULL; indx = indx->next) {
+		if (indx->rawtime >= from && indx->rawtime <= to)
+			found++;
+	}
+	if (found < count)
+		count = found;
+	send_fnum(sockfd, count);
+	if (count == 0)
+		return 0;
+
+	// pick frames evenly spaced across the range
+	sel = malloc(count * sizeof(struct disk_index *));
+	imgs = malloc(count * sizeof(struct thumb_image));
+	if (sel == NULL || imgs == NULL) {
+		free(sel);
+		free(imgs);
+		return -1;
+	}
+	total = found;
+	found = 0;
+	for (indx = idir->head, i = 0; indx != NULL && i < count; indx = indx->next) {
+		if (indx->rawtime >= from && indx->rawtime <= to) {
+			if (found == (size_t)i * total / count)
+				sel[i++] = indx;
+			found++;
+		}
+	}
+
+	// decode thumbnails in batches to keep memory usage low and send them in time order
+	batch_sz = thumb_get_threads() * THUMB_BATCH_PER_THREAD;
+	for (i = 0; i < count && rawdev->thread_state != STATE_CANCEL; i += batch_sz) {
+		int num = (count - i < batch_sz) ? count - i : batch_sz;
+		thumb_extract(&src, &sel[i], &imgs[i], num);
+		for (int j = i; j < i + num; j++) {
+			indx = sel[j];
+			len = snprintf(buff, CMD_BUFF_LEN - 1, INDEX_FORMAT_STR,
+					indx->port, indx->rawtime, indx->usec, indx->f_offset, indx->f_size);
+			send_buffer(sockfd, (unsigned char *)buff, len);
+			if (imgs[j].data != NULL) {
+				len = snprintf(buff, CMD_BUFF_LEN - 1, THUMB_IMAGE_HDR_STR, (imgs[j].comps == 3) ? 6 : 5,
+						imgs[j].width, imgs[j].height);
+				send_buffer(sockfd, (unsigned char *)buff, len);
+				send_buffer(sockfd, imgs[j].data, imgs[j].width * imgs[j].height * imgs[j].comps);
+				thumb_free(&imgs[j]);
+			} else {
+				// a frame which can not be decoded is reported as empty image
+				len = snprintf(buff, CMD_BUFF_LEN - 1, THUMB_IMAGE_HDR_STR, 5, 0, 0);
+				send_buffer(sockfd, (unsigned char *)buff, len);
+			}
+		}
+	}
+	free(imgs);
+	free(sel);
+
+	return 0;
+}
+
 /**
  * @brief Raw device buffer reading function.
  *
@@ -1021,6 +1199,7 @@ void *reader(void *arg)
 	memset(&index_sparse, 0, sizeof(struct disk_idir));
 
 	prep_socket(&sockfd, state->sock_port);
+	trace_thread_name("reader");
 	pthread_cleanup_push(exit_thread, &exit_state);
 	while (true) {
 		fd = accept(sockfd, NULL, 0);
@@ -1039,8 +1218,10 @@ void *reader(void *arg)
 		cmd_ptr = cmd_buff;
 		trim_command(cmd_ptr, cmd_len);
 		while ((cmd = parse_command(&cmd_ptr)) != -2 && state->rawdev.thread_state != STATE_CANCEL) {
-			if (cmd >= 0)
+			if (cmd >= 0) {
 				D6(fprintf(debug_file, "Got command '%s', number %d\n", cmd_list[cmd], cmd));
+				TRACE_BEGIN(cmd_list[cmd], -1);
+			}
 			switch (cmd) {
 			case CMD_BUILD_INDEX:
 				// scan raw device buffer and create disk index directory
@@ -1219,11 +1400,37 @@ void *reader(void *arg)
 							"directory with 'build_index' command\n"));
 				}
 				break;
+			case CMD_GET_THUMBS:
+				// build thumbnails of the frames in time range and send them over socket; the disk index directory
+				// should be built beforehand
+				if (index_dir.size > 0) {
+					if (send_thumbs(rawdev, &index_dir, cmd_ptr, fd) != 0)
+						D0(fprintf(debug_file, "Unable to send thumbnails, check command arguments\n"));
+				} else {
+					D0(fprintf(debug_file, "Index directory does not contain any files. Try to rebuild index "
+							"directory with 'build_index' command\n"));
+				}
+				break;
+			case CMD_READ_GROUP:
+				// find time-aligned frame group by time stamp and send it with one sequential read; the disk
+				// index directory should be built beforehand
+				if (index_dir.size > 0) {
+					struct disk_index indx;
+					if (get_timestamp_args(cmd_ptr, &indx) > 0 &&
+							(disk_indx = find_nearest_by_time(&index_dir, indx.rawtime)) != NULL)
+						send_group(rawdev, disk_indx, fd);
+				} else {
+					D0(fprintf(debug_file, "Index directory does not contain any files. Try to rebuild index "
+							"directory with 'build_index' command\n"));
+				}
+				break;
 			case CMD_STATUS:
 				break;
 			default:
 				D0(fprintf(debug_file, "Unrecognized command is skipped\n"));
 			}
+			if (cmd >= 0)
+				TRACE_END(cmd_list[cmd], -1);
 		}
 		if (is_fd_valid(fd))
 			close(fd);
@@ -1318,6 +1525,9 @@ static void build_index(camogm_state *state, struct disk_idir *idir)
 	zero_cross = 0;
 	search_state = SEARCH_SKIP;
 	idir_result = 0;
+	// skip reserved area, it does not contain frames
+	dev_curr_pos = state->rawdev.start_pos;
+	lseek64(state->rawdev.rawdev_fd, dev_curr_pos, SEEK_SET);
 	while (process && state->rawdev.thread_state != STATE_CANCEL) {
 		rd = read(state->rawdev.rawdev_fd, buff, sizeof(buff));
 		err = errno;
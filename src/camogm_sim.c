@@ -0,0 +1,841 @@
+/** @file camogm_sim.c
+ * @brief User space simulator of circbuf, JPEG header, Exif and frame parameters drivers
+ * @copyright Copyright (C) 2017 Elphel, Inc.
+ *
+ * @par <b>License</b>
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * The simulator lets camogm run on any Linux box without x393 drivers. Circbuf and frame parameters of
+ * each port are regular files (on tmpfs by default) mmapped both by simulator and camogm, so camogm reads
+ * frame data, interframe parameters and time stamps from the same places as on camera. A thread of each
+ * running port puts frames to circbuf at configured frame rate, overwriting the oldest frames, and
+ * camogm calls to driver files (dev_lseek(), dev_read(), dev_write()) are served here, including the
+ * LSEEK_CIRC_* commands. Frame payloads are valid grayscale JPEG bitstreams of noise with sizes distributed
+ * uniformly around the configured average, they are pregenerated at startup so that the simulator does
+ * not take CPU time from recording. Exif page of each frame has only the fields raw device reader indexes
+ * frames by: port number and time stamp.
+ *
+ * Simulator configuration is a comma separated list of key=value pairs; a value can be a list of per port
+ * values separated by '/', a single value applies to all ports:
+ *   dir=<directory for device files>, fps=<frame rate, 0 - compressor stopped>, size=<average frame size, bytes>,
+ *   jitter=<frame size variation, percent>, width=<frame width>, height=<frame height>, buffer=<circbuf size, MiB>,
+ *   bad_dht=<1 - JPEG header has oversubscribed DC Huffman table, used to check decoders of recorded frames>
+ * i.e. 'fps=30/15,size=500000' runs ports 0 and 1 at 30 and 15 fps with 500 kB frames.
+ */
+
+/** @brief Needed for pthread_setname_np */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+
+#include "camogm.h"
+#include "camogm_sim.h"
+
+/** @brief The maximal file descriptor number of simulated device file */
+#define SIM_MAX_FDS               1024
+/** @brief The maximal size of JPEG header */
+#define SIM_HEADER_SIZE           256
+/** @brief The length of interframe parameters preceding each frame */
+#define SIM_META_SIZE             32
+/** @brief The number of quantized coefficients in JPEG block */
+#define SIM_BLOCK_COEFFS          64
+/** @brief The number of 1 bit codes in malformed DC Huffman table */
+#define SIM_BAD_DHT_CODES         64
+/** @brief The number of Exif pages, frames use them in turn */
+#define SIM_EXIF_PAGES            256
+/** @brief The size of Exif page: APP1 marker, Exif header, TIFF header, IFD0, Exif SubIFD and two strings */
+#define SIM_EXIF_SIZE             106
+/** @brief The maximal length of simulator directory name, leaves room for device file names in it */
+#define SIM_DIR_LEN               (ELPHEL_PATH_MAX - 32)
+/** @brief Return the number of bytes frame of @e len bytes takes in circbuf, including parameters and time stamp */
+#define SIM_FRAME_SPAN(len)       ((((len) + CCAM_MMAP_META + 3) & (~0x1f)) + 2 * SIM_META_SIZE)
+
+/**
+ * @struct sim_port
+ * @brief Simulated sensor port: configuration, circbuf and frame pointers
+ */
+struct sim_port {
+	int fps;                                     ///< frame rate, the port is stopped if it is 0
+	int size;                                    ///< average frame size, in bytes
+	int jitter;                                  ///< frame size variation, in percent of average size
+	int width;                                   ///< frame width
+	int height;                                  ///< frame height
+	int buffer;                                  ///< circbuf size, in MiB
+	int bad_dht;                                 ///< JPEG header has malformed DC Huffman table
+	uint32_t buf_size;                           ///< circbuf size, in bytes
+	unsigned char *circbuf;                      ///< mmapped circbuf file
+	struct framepars_all_t *pars;                ///< mmapped frame parameters file
+	unsigned char header[SIM_HEADER_SIZE];       ///< JPEG header
+	int header_size;                             ///< JPEG header length
+	unsigned char *payload[SIM_PAYLOADS];        ///< pregenerated JPEG bitstreams
+	uint32_t payload_size[SIM_PAYLOADS];         ///< bitstream lengths
+	unsigned int seed;                           ///< random seed used to pick payloads
+	struct timeval exif_time[SIM_EXIF_PAGES];    ///< time stamps of the frames using each Exif page
+	pthread_t tid;                               ///< frame generating thread
+	pthread_mutex_t mutex;                       ///< protects frame pointers
+	pthread_cond_t frame_cond;                   ///< signalled when a new frame is ready
+	uint32_t first;                              ///< the oldest frame which is not overwritten yet
+	uint32_t next;                               ///< the frame being compressed, frames before it are ready
+	uint64_t pos[SIM_FRAMES];                    ///< frame data positions since start (not wrapped), indexed by frame number
+	int32_t rp;                                  ///< global read pointer, set with LSEEK_CIRC_SETP or LSEEK_CIRC_NEXT
+};
+
+/**
+ * @struct sim_file
+ * @brief Open simulated device file
+ */
+struct sim_file {
+	bool used;                                   ///< file descriptor belongs to simulated device
+	int dev;                                     ///< device, one of #sim_dev
+	int port;                                    ///< sensor port
+	off_t pos;                                   ///< file position, circbuf frame pointer
+};
+
+/**
+ * @struct sim_bits
+ * @brief JPEG bitstream writer
+ */
+struct sim_bits {
+	unsigned char *buf;                          ///< output buffer
+	uint32_t len;                                ///< the number of bytes written
+	uint32_t acc;                                ///< bits not written yet
+	int nbits;                                   ///< the number of bits in accumulator
+};
+
+int sim_enabled;
+static char sim_dir[SIM_DIR_LEN + 1] = SIM_DEFAULT_DIR;
+static struct sim_port sim_ports[SENSOR_PORTS];
+static struct sim_file sim_files[SIM_MAX_FDS];
+
+static const char *sim_names[SIM_DEVS] = {
+	[SIM_CIRCBUF]   = "circbuf",
+	[SIM_JPEGHEAD]  = "jpeghead",
+	[SIM_EXIF]      = "exif",
+	[SIM_FRAMEPARS] = "framepars"
+};
+
+/** Integer configuration keys and their offsets in #sim_port */
+static const struct {
+	const char *name;
+	size_t offset;
+} sim_keys[] = {
+	{"fps",    offsetof(struct sim_port, fps)},
+	{"size",   offsetof(struct sim_port, size)},
+	{"jitter", offsetof(struct sim_port, jitter)},
+	{"width",  offsetof(struct sim_port, width)},
+	{"height", offsetof(struct sim_port, height)},
+	{"buffer", offsetof(struct sim_port, buffer)},
+	{"bad_dht", offsetof(struct sim_port, bad_dht)}
+};
+
+/** Return absolute position of the frame */
+static inline uint64_t frame_pos(const struct sim_port *sp, uint32_t n)
+{
+	return sp->pos[n % SIM_FRAMES];
+}
+
+/**
+ * Find the frame at circbuf pointer @e rel among the frames which are not overwritten, including the frame
+ * being compressed. Should be called with port mutex locked.
+ * @return  true if the frame was found, its number is returned in @e n
+ */
+static bool sim_find(const struct sim_port *sp, off_t rel, uint32_t *n)
+{
+	uint64_t lo = frame_pos(sp, sp->first);
+	uint64_t target = lo - lo % sp->buf_size + rel;
+	uint32_t left = sp->first;
+	uint32_t right = sp->next;
+	uint32_t mid;
+
+	if (rel < 0 || rel >= sp->buf_size)
+		return false;
+	if (target < lo)
+		target += sp->buf_size;
+	while (left <= right) {
+		mid = left + (right - left) / 2;
+		if (frame_pos(sp, mid) == target) {
+			*n = mid;
+			return true;
+		} else if (frame_pos(sp, mid) < target) {
+			left = mid + 1;
+		} else {
+			if (mid == sp->first)
+				break;
+			right = mid - 1;
+		}
+	}
+	return false;
+}
+
+/** Return free space in circbuf before the write pointer reaches circbuf pointer @e rel, as the driver does */
+static uint32_t sim_free(const struct sim_port *sp, off_t rel)
+{
+	uint32_t wp = frame_pos(sp, sp->next) % sp->buf_size;
+	uint32_t free_sz = (rel + sp->buf_size - wp) % sp->buf_size;
+
+	return free_sz ? free_sz : sp->buf_size;
+}
+
+/** Copy data to circbuf at absolute position @e pos, rolling over the end of buffer */
+static void sim_put(struct sim_port *sp, uint64_t pos, const void *data, uint32_t len)
+{
+	uint32_t offset = pos % sp->buf_size;
+	uint32_t tail = sp->buf_size - offset;
+
+	if (len <= tail) {
+		memcpy(sp->circbuf + offset, data, len);
+	} else {
+		memcpy(sp->circbuf + offset, data, tail);
+		memcpy(sp->circbuf, (const unsigned char *)data + tail, len - tail);
+	}
+}
+
+/**
+ * Put the next frame to circbuf: invalidate frames which will be overwritten, copy interframe parameters,
+ * bitstream and time stamp, then make the frame ready and wake up waiting readers.
+ */
+static void sim_frame_put(struct sim_port *sp)
+{
+	int idx = rand_r(&sp->seed) % SIM_PAYLOADS;
+	uint32_t len = sp->payload_size[idx];
+	uint32_t n = sp->next;
+	uint64_t pos = frame_pos(sp, n);
+	uint64_t end = pos + SIM_FRAME_SPAN(len);
+	uint64_t ts_pos = pos + ((len + CCAM_MMAP_META + 3) & (~0x1f)) + SIM_META_SIZE - CCAM_MMAP_META_SEC;
+	struct interframe_params_t params;
+	struct timeval tv;
+
+	pthread_mutex_lock(&sp->mutex);
+	while (sp->first < n && (frame_pos(sp, sp->first) + sp->buf_size < end || n + 2 - sp->first > SIM_FRAMES))
+		sp->first++;
+	pthread_mutex_unlock(&sp->mutex);
+
+	gettimeofday(&tv, NULL);
+	memset(&params, 0, sizeof(params));
+	params.width = sp->width;
+	params.height = sp->height;
+	params.frame_length = len;
+	params.signffff = 0xffff;
+	params.timestamp_sec = tv.tv_sec;
+	params.timestamp_usec = tv.tv_usec;
+	params.meta_index = n % SIM_EXIF_PAGES;
+	sp->exif_time[params.meta_index] = tv;
+	sim_put(sp, pos - SIM_META_SIZE, &params, SIM_META_SIZE);
+	sim_put(sp, pos, sp->payload[idx], len);
+	sim_put(sp, ts_pos, &params.timestamp_sec, 8);
+
+	pthread_mutex_lock(&sp->mutex);
+	sp->pos[(n + 1) % SIM_FRAMES] = end;
+	sp->next = n + 1;
+	sp->pars->globalPars[G_THIS_FRAME - FRAMEPAR_GLOBALS] = sp->next;
+	sp->pars->globalPars[G_FRAME_SIZE - FRAMEPAR_GLOBALS] = len;
+	sp->pars->globalPars[G_FREECIRCBUF - FRAMEPAR_GLOBALS] = (sp->rp >= 0) ? sim_free(sp, sp->rp) : sp->buf_size;
+	pthread_cond_broadcast(&sp->frame_cond);
+	pthread_mutex_unlock(&sp->mutex);
+}
+
+/** Frame generating thread of one port, frames are put at fixed rate */
+static void *sim_thread(void *arg)
+{
+	int port = (int)(intptr_t)arg;
+	struct sim_port *sp = &sim_ports[port];
+	long period = 1000000000L / sp->fps;
+	struct timespec t;
+
+	// benchmark tells simulator threads from camogm threads by name
+	pthread_setname_np(pthread_self(), "camogm_sim");
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	while (true) {
+		t.tv_nsec += period;
+		while (t.tv_nsec >= 1000000000L) {
+			t.tv_nsec -= 1000000000L;
+			t.tv_sec++;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL);
+		sim_frame_put(sp);
+	}
+
+	return (void *) 0;
+}
+
+/** Write @e n bits to JPEG bitstream, 0xff bytes are followed by stuffed zero */
+static void put_bits(struct sim_bits *b, uint32_t val, int n)
+{
+	unsigned char byte;
+
+	b->acc = (b->acc << n) | (val & ((1 << n) - 1));
+	b->nbits += n;
+	while (b->nbits >= 8) {
+		byte = (b->acc >> (b->nbits - 8)) & 0xff;
+		b->buf[b->len++] = byte;
+		if (byte == 0xff)
+			b->buf[b->len++] = 0;
+		b->nbits -= 8;
+	}
+}
+
+/**
+ * Generate JPEG bitstream of about @e size bytes matching the tables in #sim_header. Each block has zero DC
+ * difference and a number of random AC coefficients of magnitude 32..63, which are coded with one byte each.
+ * @return  bitstream length or -1 if memory could not be allocated
+ */
+static int sim_payload(struct sim_port *sp, int idx, uint32_t size, unsigned int *seed)
+{
+	uint32_t blocks = ((sp->width + 7) / 8) * ((sp->height + 7) / 8);
+	uint32_t coeffs, per_block, rem, n, r;
+	struct sim_bits b = {0};
+
+	// one bit of DC and one bit of EOB per block, one byte per coefficient
+	coeffs = (size > blocks / 4) ? size - blocks / 4 : 0;
+	if (coeffs > blocks * (SIM_BLOCK_COEFFS - 1))
+		coeffs = blocks * (SIM_BLOCK_COEFFS - 1);
+	per_block = coeffs / blocks;
+	rem = coeffs % blocks;
+	if ((b.buf = malloc(2 * (coeffs + blocks / 4 + 2))) == NULL)
+		return -1;
+	for (uint32_t i = 0; i < blocks; i++) {
+		n = per_block + (i < rem ? 1 : 0);
+		put_bits(&b, 0, 1);
+		for (uint32_t k = 0; k < n; k++) {
+			r = rand_r(seed);
+			put_bits(&b, 0x2, 2);
+			put_bits(&b, (r & 0x20) ? (0x20 | (r & 0x1f)) : ((0x20 | (r & 0x1f)) ^ 0x3f), 6);
+		}
+		if (n < SIM_BLOCK_COEFFS - 1)
+			put_bits(&b, 0, 1);
+	}
+	if (b.nbits > 0)
+		put_bits(&b, 0xff, 8 - b.nbits);
+	sp->payload[idx] = b.buf;
+	sp->payload_size[idx] = b.len;
+
+	return b.len;
+}
+
+/**
+ * Build JPEG header for one component grayscale frames: unit quantization table, DC table with the only code
+ * for zero difference and AC table with end of block and zero run 6 bit coefficient codes. Malformed DC table
+ * has #SIM_BAD_DHT_CODES codes of 1 bit.
+ */
+static void sim_header(struct sim_port *sp)
+{
+	unsigned char *h = sp->header;
+	int len = 0;
+	const unsigned char sof[]  = {0xff, 0xc0, 0x00, 0x0b, 0x08};
+	const unsigned char comp[] = {0x01, 0x01, 0x11, 0x00};
+	const unsigned char dc[]   = {0xff, 0xc4, 0x00, 0x14, 0x00, 0x01, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x00};
+	const unsigned char ac[]   = {0xff, 0xc4, 0x00, 0x15, 0x10, 0x01, 0x01, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x00, 0x06};
+	const unsigned char sos[]  = {0xff, 0xda, 0x00, 0x08, 0x01, 0x01, 0x00, 0x00, 0x3f, 0x00};
+
+	h[len++] = 0xff;
+	h[len++] = 0xd8;
+	h[len++] = 0xff;
+	h[len++] = 0xdb;
+	h[len++] = 0x00;
+	h[len++] = 0x43;
+	h[len++] = 0x00;
+	memset(h + len, 1, SIM_BLOCK_COEFFS);
+	len += SIM_BLOCK_COEFFS;
+	memcpy(h + len, sof, sizeof(sof));
+	len += sizeof(sof);
+	h[len++] = sp->height >> 8;
+	h[len++] = sp->height & 0xff;
+	h[len++] = sp->width >> 8;
+	h[len++] = sp->width & 0xff;
+	memcpy(h + len, comp, sizeof(comp));
+	len += sizeof(comp);
+	if (sp->bad_dht) {
+		h[len++] = 0xff;
+		h[len++] = 0xc4;
+		h[len++] = 0x00;
+		h[len++] = 2 + 1 + 16 + SIM_BAD_DHT_CODES;
+		h[len++] = 0x00;
+		h[len++] = SIM_BAD_DHT_CODES;
+		memset(h + len, 0, 15 + SIM_BAD_DHT_CODES);
+		len += 15 + SIM_BAD_DHT_CODES;
+	} else {
+		memcpy(h + len, dc, sizeof(dc));
+		len += sizeof(dc);
+	}
+	memcpy(h + len, ac, sizeof(ac));
+	len += sizeof(ac);
+	memcpy(h + len, sos, sizeof(sos));
+	len += sizeof(sos);
+	sp->header_size = len;
+}
+
+/** Put big endian value of @e len bytes to buffer */
+static unsigned char *put_be(unsigned char *p, uint32_t val, int len)
+{
+	for (int i = len - 1; i >= 0; i--)
+		*p++ = (val >> (8 * i)) & 0xff;
+	return p;
+}
+
+/** Put Exif IFD entry, @e val is either the value or the offset of value from the beginning of TIFF header */
+static unsigned char *put_ifd(unsigned char *p, uint16_t tag, uint16_t format, uint32_t len, uint32_t val)
+{
+	p = put_be(p, tag, 2);
+	p = put_be(p, format, 2);
+	p = put_be(p, len, 4);
+	return put_be(p, val, 4);
+}
+
+/**
+ * Build Exif page of #SIM_EXIF_SIZE bytes in big endian TIFF format: IFD0 with PageNumber (sensor port) and
+ * pointer to Exif SubIFD with DateTimeOriginal and SubSecTimeOriginal strings.
+ */
+static void sim_exif(int port, const struct timeval *tv, unsigned char *buf)
+{
+	unsigned char *p = buf;
+	unsigned char *tiff;
+	time_t sec = tv->tv_sec;
+	struct tm tm;
+
+	gmtime_r(&sec, &tm);
+	memset(buf, 0, SIM_EXIF_SIZE);
+	p = put_be(p, 0xffe1, 2);
+	p = put_be(p, SIM_EXIF_SIZE - 2, 2);
+	memcpy(p, "Exif\0\0", 6);
+	p += 6;
+	tiff = p;
+	p = put_be(p, 0x4d4d002a, 4);
+	p = put_be(p, 8, 4);
+	// IFD0 at offset 8, Exif SubIFD at 38, strings at 68 and 88
+	p = put_be(p, 2, 2);
+	p = put_ifd(p, Exif_Image_PageNumber, 3, 2, (uint32_t)port << 16);
+	p = put_ifd(p, Exif_Image_ExifTag, 4, 1, 38);
+	p = put_be(p, 0, 4);
+	p = put_be(p, 2, 2);
+	p = put_ifd(p, Exif_Photo_DateTimeOriginal & 0xffff, 2, 20, 68);
+	p = put_ifd(p, Exif_Photo_SubSecTimeOriginal & 0xffff, 2, 7, 88);
+	p = put_be(p, 0, 4);
+	strftime((char *)tiff + 68, 20, "%Y:%m:%d %H:%M:%S", &tm);
+	snprintf((char *)tiff + 88, 7, "%06u", (unsigned int)tv->tv_usec % 1000000);
+}
+
+/** Parse configuration string, see the description of this file for the format */
+static int sim_parse(const char *cfg)
+{
+	int i, port, val;
+	char buf[ELPHEL_PATH_MAX];
+	char *item, *value, *save_item, *save_value;
+
+	strncpy(buf, cfg, ELPHEL_PATH_MAX - 1);
+	buf[ELPHEL_PATH_MAX - 1] = '\0';
+	for (item = strtok_r(buf, ",", &save_item); item != NULL; item = strtok_r(NULL, ",", &save_item)) {
+		if ((value = strchr(item, '=')) == NULL) {
+			D0(fprintf(debug_file, "Simulator option '%s' has no value\n", item));
+			return -1;
+		}
+		*value++ = '\0';
+		if (strcmp(item, "dir") == 0) {
+			if (strlen(value) > SIM_DIR_LEN) {
+				D0(fprintf(debug_file, "Simulator directory name is too long, the maximum is %d characters\n", SIM_DIR_LEN));
+				return -1;
+			}
+			strcpy(sim_dir, value);
+			continue;
+		}
+		for (i = 0; i < sizeof(sim_keys) / sizeof(sim_keys[0]); i++) {
+			if (strcmp(item, sim_keys[i].name) == 0)
+				break;
+		}
+		if (i == sizeof(sim_keys) / sizeof(sim_keys[0])) {
+			D0(fprintf(debug_file, "Unknown simulator option '%s'\n", item));
+			return -1;
+		}
+		// a single value is used for all ports
+		if (strchr(value, '/') == NULL) {
+			val = strtol(value, NULL, 10);
+			for (port = 0; port < SENSOR_PORTS; port++)
+				*(int *)((char *)&sim_ports[port] + sim_keys[i].offset) = val;
+			continue;
+		}
+		port = 0;
+		for (value = strtok_r(value, "/", &save_value); value != NULL && port < SENSOR_PORTS; value = strtok_r(NULL, "/", &save_value))
+			*(int *)((char *)&sim_ports[port++] + sim_keys[i].offset) = strtol(value, NULL, 10);
+	}
+
+	return 0;
+}
+
+/** Create device file of simulated port and mmap it if @e map is not NULL */
+static int sim_create(int dev, int port, size_t size, void **map)
+{
+	int fd;
+	char path[ELPHEL_PATH_MAX];
+
+	snprintf(path, ELPHEL_PATH_MAX, "%s/%s%d", sim_dir, sim_names[dev], port);
+	if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0 || ftruncate(fd, size) < 0) {
+		D0(fprintf(debug_file, "Can not create simulated device file %s: %s\n", path, strerror(errno)));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	if (map != NULL && (*map = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		D0(fprintf(debug_file, "Can not mmap simulated device file %s: %s\n", path, strerror(errno)));
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	return 0;
+}
+
+/** Set up simulated port: create device files, generate JPEG header and frame payloads, reset frame parameters */
+static int sim_port_init(struct sim_port *sp, int port)
+{
+	uint32_t size;
+	unsigned int seed = port + 1;
+
+	if (sp->width <= 0 || sp->height <= 0 || sp->width > 0xffff || sp->height > 0xffff ||
+			sp->buffer <= 0 || sp->size <= 0 || sp->jitter < 0 || sp->jitter > 100 || sp->fps < 0) {
+		D0(fprintf(debug_file, "Invalid simulator settings for port %d\n", port));
+		return -1;
+	}
+	sp->buf_size = (uint32_t)sp->buffer << 20;
+	if (sim_create(SIM_CIRCBUF, port, sp->buf_size, (void **)&sp->circbuf) < 0 ||
+			sim_create(SIM_FRAMEPARS, port, sizeof(struct framepars_all_t), (void **)&sp->pars) < 0 ||
+			sim_create(SIM_JPEGHEAD, port, 0, NULL) < 0 ||
+			sim_create(SIM_EXIF, port, 0, NULL) < 0)
+		return -1;
+	for (int i = 0; i < PARS_FRAMES_MASK + 1; i++) {
+		sp->pars->framePars[i].pars[P_COMPRESSOR_RUN] = sp->fps ? COMPRESSOR_RUN_CONT : COMPRESSOR_RUN_STOP;
+		sp->pars->framePars[i].pars[P_DAEMON_EN] = 0xffffffff;
+	}
+	sp->pars->globalPars[G_FREECIRCBUF - FRAMEPAR_GLOBALS] = sp->buf_size;
+	sim_header(sp);
+	if (sp->fps == 0)
+		return 0;
+	for (int i = 0; i < SIM_PAYLOADS; i++) {
+		size = sp->size + (int)(((int64_t)sp->size * sp->jitter / 100) * (2 * i - (SIM_PAYLOADS - 1)) / (SIM_PAYLOADS - 1));
+		if (sim_payload(sp, i, size, &seed) < 0) {
+			D0(fprintf(debug_file, "Can not allocate simulated frames\n"));
+			return -1;
+		}
+		if (SIM_FRAME_SPAN(sp->payload_size[i]) > sp->buf_size / 2) {
+			D0(fprintf(debug_file, "Simulated circbuf of port %d is too small for %u bytes frames\n", port, sp->payload_size[i]));
+			return -1;
+		}
+	}
+	D1(fprintf(debug_file, "Simulated port %d: %dx%d, %d fps, frames %u..%u bytes, circbuf %u bytes\n", port,
+			sp->width, sp->height, sp->fps, sp->payload_size[0], sp->payload_size[SIM_PAYLOADS - 1], sp->buf_size));
+
+	return 0;
+}
+
+/**
+ * @brief Create simulated device files and start frame generating threads. Device files should be opened
+ * with #sim_open after this function returns.
+ * @param[in]   cfg   configuration string, see the description of this file
+ * @return      0 if the simulator was started and -1 otherwise
+ */
+int sim_init(const char *cfg)
+{
+	struct sim_port *sp;
+
+	for (int port = 0; port < SENSOR_PORTS; port++) {
+		sp = &sim_ports[port];
+		sp->fps = (port == 0) ? SIM_DEFAULT_FPS : 0;
+		sp->size = SIM_DEFAULT_SIZE;
+		sp->jitter = SIM_DEFAULT_JITTER;
+		sp->width = SIM_DEFAULT_WIDTH;
+		sp->height = SIM_DEFAULT_HEIGHT;
+		sp->buffer = SIM_DEFAULT_BUFFER;
+		sp->seed = port + 1;
+		sp->rp = -1;
+		sp->pos[0] = SIM_META_SIZE;
+	}
+	if (sim_parse(cfg) < 0)
+		return -1;
+	if (mkdir(sim_dir, 0777) < 0 && errno != EEXIST) {
+		D0(fprintf(debug_file, "Can not create directory %s: %s\n", sim_dir, strerror(errno)));
+		return -1;
+	}
+	for (int port = 0; port < SENSOR_PORTS; port++) {
+		sp = &sim_ports[port];
+		if (sim_port_init(sp, port) < 0)
+			return -1;
+		pthread_mutex_init(&sp->mutex, NULL);
+		pthread_cond_init(&sp->frame_cond, NULL);
+	}
+	sim_enabled = 1;
+	for (int port = 0; port < SENSOR_PORTS; port++) {
+		sp = &sim_ports[port];
+		if (sp->fps > 0 && (pthread_create(&sp->tid, NULL, sim_thread, (void *)(intptr_t)port) != 0 ||
+				pthread_detach(sp->tid) != 0)) {
+			D0(fprintf(debug_file, "Can not start simulator thread of port %d\n", port));
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Open simulated device file instead of driver file
+ * @param[in]   dev     device, one of #sim_dev
+ * @param[in]   port    sensor port
+ * @param[in]   flags   open() flags
+ * @return      file descriptor or -1 on error
+ */
+int sim_open(int dev, int port, int flags)
+{
+	int fd;
+	char path[ELPHEL_PATH_MAX];
+
+	snprintf(path, ELPHEL_PATH_MAX, "%s/%s%d", sim_dir, sim_names[dev], port);
+	if ((fd = open(path, flags)) < 0)
+		return -1;
+	if (fd >= SIM_MAX_FDS) {
+		close(fd);
+		errno = EMFILE;
+		return -1;
+	}
+	sim_files[fd].used = true;
+	sim_files[fd].dev = dev;
+	sim_files[fd].port = port;
+	sim_files[fd].pos = 0;
+
+	return fd;
+}
+
+/** Set errno and return -1 as failed system call does */
+static off_t sim_error(int err)
+{
+	errno = err;
+	return -1;
+}
+
+/** Move file pointer to frame @e n and return the pointer */
+static off_t sim_seek_frame(const struct sim_port *sp, struct sim_file *f, uint32_t n)
+{
+	f->pos = frame_pos(sp, n) % sp->buf_size;
+	return f->pos;
+}
+
+/** Wait until the frame at file pointer is ready or overwritten, with timeout */
+static off_t sim_wait(struct sim_port *sp, struct sim_file *f)
+{
+	int ret = 0;
+	uint32_t n;
+	struct timeval tv;
+	struct timespec deadline;
+
+	gettimeofday(&tv, NULL);
+	deadline.tv_sec = tv.tv_sec + (tv.tv_usec + SIM_WAIT_TIMEOUT) / 1000000;
+	deadline.tv_nsec = ((tv.tv_usec + SIM_WAIT_TIMEOUT) % 1000000) * 1000;
+	while (sim_find(sp, f->pos, &n) && n == sp->next && ret != ETIMEDOUT)
+		ret = pthread_cond_timedwait(&sp->frame_cond, &sp->mutex, &deadline);
+	if (!sim_find(sp, f->pos, &n))
+		return sim_error(EINVAL);
+
+	return f->pos;
+}
+
+/** Emulate circbuf driver lseek(), see LSEEK_CIRC_* commands in c313a.h */
+static off_t sim_circbuf_lseek(struct sim_port *sp, struct sim_file *f, off_t offset, int whence)
+{
+	off_t ret;
+	uint32_t n;
+	bool found;
+
+	if (whence == SEEK_CUR) {
+		offset += f->pos;
+		whence = SEEK_SET;
+	}
+	if (whence == SEEK_SET) {
+		if (offset < 0 || offset >= sp->buf_size)
+			return sim_error(EINVAL);
+		f->pos = offset;
+		return f->pos;
+	}
+	if (whence != SEEK_END)
+		return sim_error(EINVAL);
+	if (offset == 0)
+		return sp->buf_size;
+
+	pthread_mutex_lock(&sp->mutex);
+	found = sim_find(sp, f->pos, &n);
+	switch (offset) {
+	case LSEEK_CIRC_TORP:
+		if (sp->rp >= 0)
+			f->pos = sp->rp;
+		ret = f->pos;
+		break;
+	case LSEEK_CIRC_TOWP:
+		ret = sim_seek_frame(sp, f, sp->next);
+		break;
+	case LSEEK_CIRC_PREV:
+		ret = (found && n > sp->first) ? sim_seek_frame(sp, f, n - 1) : sim_error(EINVAL);
+		break;
+	case LSEEK_CIRC_NEXT:
+		if (!found) {
+			ret = sim_error(EINVAL);
+		} else if (n == sp->next) {
+			ret = sim_error(EAGAIN);
+		} else {
+			ret = sim_seek_frame(sp, f, n + 1);
+			sp->rp = ret;
+		}
+		break;
+	case LSEEK_CIRC_LAST:
+		ret = (sp->next > sp->first) ? sim_seek_frame(sp, f, sp->next - 1) : sim_error(EINVAL);
+		break;
+	case LSEEK_CIRC_FIRST:
+		ret = (sp->next > sp->first) ? sim_seek_frame(sp, f, sp->first) : sim_error(EINVAL);
+		break;
+	case LSEEK_CIRC_SCND:
+		ret = (sp->next > sp->first + 1) ? sim_seek_frame(sp, f, sp->next - 2) : sim_error(EINVAL);
+		break;
+	case LSEEK_CIRC_SETP:
+		sp->rp = f->pos;
+		ret = f->pos;
+		break;
+	case LSEEK_CIRC_VALID:
+		ret = found ? f->pos : sim_error(EINVAL);
+		break;
+	case LSEEK_CIRC_READY:
+		if (!found)
+			ret = sim_error(EINVAL);
+		else
+			ret = (n != sp->next) ? f->pos : sim_error(EAGAIN);
+		break;
+	case LSEEK_CIRC_FREE:
+		ret = sim_free(sp, f->pos);
+		break;
+	case LSEEK_CIRC_USED:
+		ret = sp->buf_size - sim_free(sp, f->pos);
+		break;
+	case LSEEK_CIRC_WAIT:
+		ret = sim_wait(sp, f);
+		break;
+	case LSEEK_CIRC_GETFRAME:
+		ret = found ? (off_t)n : sim_error(EINVAL);
+		break;
+	default:
+		// daemons are always enabled in simulator
+		if (offset >= LSEEK_DAEMON_CIRCBUF && offset < LSEEK_DAEMON_CIRCBUF + 32)
+			ret = 0;
+		else
+			ret = sim_error(EINVAL);
+	}
+	pthread_mutex_unlock(&sp->mutex);
+
+	return ret;
+}
+
+/**
+ * @brief lseek() of simulated device file. All frames use the same JPEG header, so frame selection in
+ * JPEG header file only returns header length. Exif page @e offset is selected with SEEK_END, the position
+ * of page 1 is page length. Other file descriptors are passed to lseek().
+ */
+off_t sim_lseek(int fd, off_t offset, int whence)
+{
+	struct sim_file *f;
+	struct sim_port *sp;
+
+	if (fd < 0 || fd >= SIM_MAX_FDS || !sim_files[fd].used)
+		return lseek(fd, offset, whence);
+	f = &sim_files[fd];
+	sp = &sim_ports[f->port];
+	switch (f->dev) {
+	case SIM_CIRCBUF:
+		return sim_circbuf_lseek(sp, f, offset, whence);
+	case SIM_JPEGHEAD:
+		if (whence == SEEK_END)
+			return sp->header_size;
+		f->pos = (whence == SEEK_CUR) ? f->pos + offset : offset;
+		return f->pos;
+	case SIM_EXIF:
+		if (whence == SEEK_END)
+			f->pos = (offset >= 0 && offset < SIM_EXIF_PAGES) ? offset * SIM_EXIF_SIZE : -1;
+		else
+			f->pos = (whence == SEEK_CUR) ? f->pos + offset : offset;
+		return (f->pos >= 0) ? f->pos : sim_error(EINVAL);
+	default:
+		return lseek(fd, offset, whence);
+	}
+}
+
+/** @brief read() of simulated device file, reads JPEG header or Exif page; other file descriptors are passed to read() */
+ssize_t sim_read(int fd, void *buf, size_t count)
+{
+	struct sim_file *f;
+	struct sim_port *sp;
+
+	if (fd < 0 || fd >= SIM_MAX_FDS || !sim_files[fd].used)
+		return read(fd, buf, count);
+	f = &sim_files[fd];
+	sp = &sim_ports[f->port];
+	if (f->dev == SIM_EXIF) {
+		unsigned char page[SIM_EXIF_SIZE];
+		off_t offset = f->pos % SIM_EXIF_SIZE;
+
+		if (f->pos < 0 || f->pos >= SIM_EXIF_PAGES * SIM_EXIF_SIZE)
+			return 0;
+		sim_exif(f->port, &sp->exif_time[f->pos / SIM_EXIF_SIZE], page);
+		if (count > SIM_EXIF_SIZE - offset)
+			count = SIM_EXIF_SIZE - offset;
+		memcpy(buf, page + offset, count);
+		f->pos += count;
+		return count;
+	}
+	if (f->dev != SIM_JPEGHEAD)
+		return 0;
+	if (f->pos < 0 || f->pos >= sp->header_size)
+		return 0;
+	if (count > sp->header_size - f->pos)
+		count = sp->header_size - f->pos;
+	memcpy(buf, sp->header + f->pos, count);
+	f->pos += count;
+
+	return count;
+}
+
+/**
+ * @brief write() to simulated device file. Frame parameters file accepts FRAMEPARS_GETFPGATIME command which
+ * sets G_SECONDS and G_MICROSECONDS to current time, other commands are ignored. Other file descriptors are
+ * passed to write().
+ */
+ssize_t sim_write(int fd, const void *buf, size_t count)
+{
+	const unsigned long *cmd = buf;
+	struct sim_port *sp;
+	struct timeval tv;
+
+	if (fd < 0 || fd >= SIM_MAX_FDS || !sim_files[fd].used)
+		return write(fd, buf, count);
+	if (sim_files[fd].dev != SIM_FRAMEPARS)
+		return sim_error(EINVAL);
+	sp = &sim_ports[sim_files[fd].port];
+	for (size_t i = 0; i + 1 < count / sizeof(unsigned long); i += 2) {
+		if (cmd[i] == FRAMEPARS_GETFPGATIME) {
+			gettimeofday(&tv, NULL);
+			sp->pars->globalPars[G_SECONDS - FRAMEPAR_GLOBALS] = tv.tv_sec;
+			sp->pars->globalPars[G_MICROSECONDS - FRAMEPAR_GLOBALS] = tv.tv_usec;
+		}
+	}
+
+	return count;
+}
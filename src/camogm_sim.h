@@ -0,0 +1,83 @@
+/** @file camogm_sim.h
+ * @brief User space simulator of circbuf, JPEG header, Exif and frame parameters drivers
+ * @copyright Copyright (C) 2017 Elphel, Inc.
+ *
+ * @par <b>License</b>
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CAMOGM_SIM_H
+#define _CAMOGM_SIM_H
+
+#include <unistd.h>
+#include <sys/types.h>
+
+/** @brief Default directory for simulated device files, tmpfs is used to keep circbuf in memory */
+#define SIM_DEFAULT_DIR           "/dev/shm/camogm_sim"
+/** @brief Default frame rate of the first port, other ports are stopped by default */
+#define SIM_DEFAULT_FPS           30
+/** @brief Default average frame size, in bytes */
+#define SIM_DEFAULT_SIZE          1000000
+/** @brief Default frame size variation, in percent of average size */
+#define SIM_DEFAULT_JITTER        20
+/** @brief Default frame width */
+#define SIM_DEFAULT_WIDTH         2592
+/** @brief Default frame height */
+#define SIM_DEFAULT_HEIGHT        1936
+/** @brief Default circbuf size, in MiB */
+#define SIM_DEFAULT_BUFFER        64
+/** @brief The number of frames which can be kept in circbuf, older frames are treated as overwritten */
+#define SIM_FRAMES                4096
+/** @brief The number of pregenerated frame payloads of each port */
+#define SIM_PAYLOADS              8
+/** @brief The maximal time LSEEK_CIRC_WAIT waits for a frame, in microseconds */
+#define SIM_WAIT_TIMEOUT          1000000
+
+/**
+ * @enum sim_dev
+ * @brief Simulated device files
+ */
+enum sim_dev {
+	SIM_CIRCBUF,                                 ///< circbuf, mmapped and controlled with LSEEK_CIRC_* commands
+	SIM_JPEGHEAD,                                ///< JPEG header of the frame selected with lseek()
+	SIM_EXIF,                                    ///< Exif pages with port number and time stamp of each frame
+	SIM_FRAMEPARS,                               ///< mmapped frame parameters
+	SIM_DEVS                                     ///< the number of simulated devices
+};
+
+extern int sim_enabled;
+
+int sim_init(const char *cfg);
+int sim_open(int dev, int port, int flags);
+off_t sim_lseek(int fd, off_t offset, int whence);
+ssize_t sim_read(int fd, void *buf, size_t count);
+ssize_t sim_write(int fd, const void *buf, size_t count);
+
+/** @brief lseek() of driver file, the call is passed to simulator when it is enabled */
+static inline off_t dev_lseek(int fd, off_t offset, int whence)
+{
+	return sim_enabled ? sim_lseek(fd, offset, whence) : lseek(fd, offset, whence);
+}
+
+/** @brief read() of driver file, the call is passed to simulator when it is enabled */
+static inline ssize_t dev_read(int fd, void *buf, size_t count)
+{
+	return sim_enabled ? sim_read(fd, buf, count) : read(fd, buf, count);
+}
+
+/** @brief write() to driver file, the call is passed to simulator when it is enabled */
+static inline ssize_t dev_write(int fd, const void *buf, size_t count)
+{
+	return sim_enabled ? sim_write(fd, buf, count) : write(fd, buf, count);
+}
+
+#endif /* _CAMOGM_SIM_H */
@@ -0,0 +1,535 @@
+/** @file camogm_storage.c
+ * @brief Storage backends of raw device writer
+ * @copyright Copyright (C) 2017 Elphel, Inc.
+ *
+ * @par <b>License</b>
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Raw device writer does all its data I/O through storage backend: block device and regular file backends
+ * use positioned writes on file descriptor, io_uring backend submits the same writes through io_uring, and
+ * memory backend keeps recorded data in anonymous memory of raw device size, so recording can be tested
+ * without a disk. Superblock and checkpoints are still written to the raw device path with any backend.
+ *
+ * Storage configuration is backend name optionally followed by a colon and a comma separated list of faults
+ * injected into writes of any backend:
+ *   spike=<us>/<n> - every n-th write is delayed by <us> microseconds,
+ *   rate=<MB/s> - writes are delayed so that throughput does not exceed the cap,
+ *   short=<n> - every n-th write writes half of the data (rounded down to block size) and returns short count,
+ *   eio=<lba>[-<lba>][/<lba>[-<lba>]...] - writes touching these LBAs fail with EIO, LBAs are counted
+ *   from the beginning of raw device.
+ * i.e. 'mem:rate=20,spike=200000/100,eio=500000-500100'.
+ */
+
+/** @brief This define is needed to use pwritev64 and pread64 and should be set before includes */
+#define _LARGEFILE64_SOURCE
+/** @brief Needed for MAP_NORESERVE */
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "camogm_storage.h"
+#include "camogm_align.h"
+#include "camogm_latency.h"
+
+// io_uring support depends on kernel headers of the toolchain, the backend reports ENOSYS without it
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define STORAGE_URING
+#endif
+#endif
+
+/** @brief The number of entries in io_uring submission queue */
+#define URING_ENTRIES             4
+
+/** Open raw device file, @e type is the file type expected */
+static int fd_open(struct storage *st, const char *path, mode_t type)
+{
+	struct stat st_buf;
+
+	if ((st->fd = open(path, O_RDWR)) < 0)
+		return -1;
+	if (fstat(st->fd, &st_buf) < 0 || (st_buf.st_mode & S_IFMT) != type) {
+		close(st->fd);
+		st->fd = -1;
+		errno = ENODEV;
+		return -1;
+	}
+	return 0;
+}
+
+static int blockdev_open(struct storage *st, const char *path)
+{
+	return fd_open(st, path, S_IFBLK);
+}
+
+static int file_open(struct storage *st, const char *path)
+{
+	return fd_open(st, path, S_IFREG);
+}
+
+static ssize_t fd_writev(struct storage *st, const struct iovec *iov, int iovcnt, int64_t offset)
+{
+	return pwritev64(st->fd, iov, iovcnt, offset);
+}
+
+static ssize_t fd_pread(struct storage *st, void *buf, size_t count, int64_t offset)
+{
+	return pread64(st->fd, buf, count, offset);
+}
+
+static int fd_close(struct storage *st)
+{
+	int ret = close(st->fd);
+
+	st->fd = -1;
+	return ret;
+}
+
+#ifdef STORAGE_URING
+/**
+ * @struct uring
+ * @brief io_uring instance with mapped submission and completion rings
+ */
+struct uring {
+	int ring_fd;                                 ///< io_uring file descriptor
+	void *sq_ring;                               ///< mapped submission ring
+	size_t sq_ring_size;                         ///< the size of submission ring mapping
+	void *cq_ring;                               ///< mapped completion ring
+	size_t cq_ring_size;                         ///< the size of completion ring mapping
+	struct io_uring_sqe *sqes;                   ///< mapped submission queue entries
+	size_t sqes_size;                            ///< the size of submission queue entries mapping
+	struct io_uring_params params;               ///< ring offsets returned by io_uring_setup
+};
+
+/** Unmap rings and close io_uring */
+static void uring_free(struct uring *ring)
+{
+	if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED)
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	if (ring->ring_fd >= 0)
+		close(ring->ring_fd);
+	free(ring);
+}
+
+static int uring_open(struct storage *st, const char *path)
+{
+	int err;
+	struct uring *ring;
+	struct stat st_buf;
+
+	if ((st->fd = open(path, O_RDWR)) < 0)
+		return -1;
+	if (fstat(st->fd, &st_buf) < 0 || !(S_ISBLK(st_buf.st_mode) || S_ISREG(st_buf.st_mode))) {
+		errno = ENODEV;
+		goto err_fd;
+	}
+	if ((ring = calloc(1, sizeof(struct uring))) == NULL)
+		goto err_fd;
+	if ((ring->ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &ring->params)) < 0)
+		goto err_ring;
+	ring->sq_ring_size = ring->params.sq_off.array + ring->params.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_size = ring->params.cq_off.cqes + ring->params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_size = ring->params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQ_RING);
+	ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_CQ_RING);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQES);
+	if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED)
+		goto err_ring;
+	st->priv = ring;
+
+	return 0;
+
+err_ring:
+	err = errno;
+	uring_free(ring);
+	errno = err;
+err_fd:
+	err = errno;
+	close(st->fd);
+	st->fd = -1;
+	errno = err;
+	return -1;
+}
+
+/** Submit one write and wait for its completion, the writer releases frame buffers only after the write is done */
+static ssize_t uring_writev(struct storage *st, const struct iovec *iov, int iovcnt, int64_t offset)
+{
+	int ret;
+	unsigned int tail, head, idx;
+	struct uring *ring = st->priv;
+	unsigned char *sq = ring->sq_ring;
+	unsigned char *cq = ring->cq_ring;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+
+	tail = *(unsigned int *)(sq + ring->params.sq_off.tail);
+	idx = tail & *(unsigned int *)(sq + ring->params.sq_off.ring_mask);
+	sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->fd = st->fd;
+	sqe->addr = (uint64_t)(uintptr_t)iov;
+	sqe->len = iovcnt;
+	sqe->off = offset;
+	((unsigned int *)(sq + ring->params.sq_off.array))[idx] = idx;
+	__atomic_store_n((unsigned int *)(sq + ring->params.sq_off.tail), tail + 1, __ATOMIC_RELEASE);
+
+	do {
+		ret = syscall(__NR_io_uring_enter, ring->ring_fd, 1, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		return -1;
+
+	head = *(unsigned int *)(cq + ring->params.cq_off.head);
+	if (head == __atomic_load_n((unsigned int *)(cq + ring->params.cq_off.tail), __ATOMIC_ACQUIRE)) {
+		errno = EIO;
+		return -1;
+	}
+	cqe = &((struct io_uring_cqe *)(cq + ring->params.cq_off.cqes))[head & *(unsigned int *)(cq + ring->params.cq_off.ring_mask)];
+	ret = cqe->res;
+	__atomic_store_n((unsigned int *)(cq + ring->params.cq_off.head), head + 1, __ATOMIC_RELEASE);
+	if (ret < 0) {
+		errno = -ret;
+		return -1;
+	}
+
+	return ret;
+}
+
+static int uring_close(struct storage *st)
+{
+	uring_free(st->priv);
+	st->priv = NULL;
+	return fd_close(st);
+}
+#else
+static int uring_open(struct storage *st, const char *path)
+{
+	errno = ENOSYS;
+	return -1;
+}
+#define uring_writev              fd_writev
+#define uring_close               fd_close
+#endif /* STORAGE_URING */
+
+static int mem_open(struct storage *st, const char *path)
+{
+	if (st->size == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	// pages are allocated when they are written to, so the buffer can be larger than memory until it is filled
+	st->priv = mmap(NULL, st->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (st->priv == MAP_FAILED) {
+		st->priv = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+static ssize_t mem_writev(struct storage *st, const struct iovec *iov, int iovcnt, int64_t offset)
+{
+	size_t len;
+	ssize_t total = 0;
+	unsigned char *buff = st->priv;
+
+	for (int i = 0; i < iovcnt && (uint64_t)offset < st->size; i++) {
+		len = iov[i].iov_len;
+		if ((uint64_t)offset + len > st->size)
+			len = st->size - offset;
+		memcpy(buff + offset, iov[i].iov_base, len);
+		offset += len;
+		total += len;
+	}
+	if (total == 0 && iovcnt > 0) {
+		errno = ENOSPC;
+		return -1;
+	}
+	return total;
+}
+
+static ssize_t mem_pread(struct storage *st, void *buf, size_t count, int64_t offset)
+{
+	if ((uint64_t)offset >= st->size)
+		return 0;
+	if ((uint64_t)offset + count > st->size)
+		count = st->size - offset;
+	memcpy(buf, (unsigned char *)st->priv + offset, count);
+	return count;
+}
+
+static int mem_close(struct storage *st)
+{
+	munmap(st->priv, st->size);
+	st->priv = NULL;
+	return 0;
+}
+
+/** Storage backends, the name is used in configuration string */
+static const struct storage_ops backends[] = {
+	{"blockdev", blockdev_open, fd_writev,    fd_pread,  fd_close},
+	{"file",     file_open,     fd_writev,    fd_pread,  fd_close},
+	{"uring",    uring_open,    uring_writev, fd_pread,  uring_close},
+	{"mem",      mem_open,      mem_writev,   mem_pread, mem_close},
+};
+
+/** Parse EIO ranges list */
+static int parse_eio(char *val, struct storage_faults *faults)
+{
+	char *range, *save, *end;
+
+	for (range = strtok_r(val, "/", &save); range != NULL; range = strtok_r(NULL, "/", &save)) {
+		if (faults->eio_num >= STORAGE_MAX_EIO)
+			return -1;
+		faults->eio_from[faults->eio_num] = strtoull(range, &end, 10);
+		if (end == range)
+			return -1;
+		faults->eio_to[faults->eio_num] = (*end == '-') ? strtoull(end + 1, NULL, 10) : faults->eio_from[faults->eio_num];
+		if (faults->eio_to[faults->eio_num] < faults->eio_from[faults->eio_num])
+			return -1;
+		faults->eio_num++;
+	}
+	return 0;
+}
+
+/**
+ * Parse storage configuration string, @e ops is set to NULL for automatic backend selection.
+ * Return 0 if the string is valid and -1 otherwise.
+ */
+static int parse_cfg(const char *cfg, const struct storage_ops **ops, struct storage_faults *faults)
+{
+	int ret = 0;
+	char buff[STORAGE_CFG_LEN];
+	char *name, *opts, *opt, *val, *save;
+
+	memset(faults, 0, sizeof(struct storage_faults));
+	strncpy(buff, (cfg != NULL && cfg[0] != '\0') ? cfg : STORAGE_DEFAULT_CFG, STORAGE_CFG_LEN - 1);
+	buff[STORAGE_CFG_LEN - 1] = '\0';
+	name = buff;
+	if ((opts = strchr(buff, ':')) != NULL)
+		*opts++ = '\0';
+
+	*ops = NULL;
+	for (int i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+		if (strcmp(name, backends[i].name) == 0)
+			*ops = &backends[i];
+	}
+	if (*ops == NULL && strcmp(name, "auto") != 0) {
+		D0(fprintf(debug_file, "Unknown storage backend '%s'\n", name));
+		return -1;
+	}
+
+	for (opt = (opts != NULL) ? strtok_r(opts, ",", &save) : NULL; opt != NULL; opt = strtok_r(NULL, ",", &save)) {
+		if ((val = strchr(opt, '=')) != NULL)
+			*val++ = '\0';
+		if (val == NULL) {
+			ret = -1;
+		} else if (strcmp(opt, "spike") == 0) {
+			if (sscanf(val, "%u/%u", &faults->spike_us, &faults->spike_every) != 2)
+				ret = -1;
+		} else if (strcmp(opt, "rate") == 0) {
+			faults->rate = strtod(val, NULL) * 1000000;
+		} else if (strcmp(opt, "short") == 0) {
+			faults->short_every = strtoul(val, NULL, 10);
+		} else if (strcmp(opt, "eio") == 0) {
+			ret = parse_eio(val, faults);
+		} else {
+			ret = -1;
+		}
+		if (ret != 0) {
+			D0(fprintf(debug_file, "Invalid storage option '%s'\n", opt));
+			break;
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * @brief Check storage configuration string, used by control thread to validate command arguments
+ * @param[in]   cfg   storage configuration
+ * @return      0 if the configuration is valid and -1 otherwise
+ */
+int storage_check(const char *cfg)
+{
+	const struct storage_ops *ops;
+	struct storage_faults faults;
+
+	return parse_cfg(cfg, &ops, &faults);
+}
+
+/**
+ * @brief Open raw device with storage backend given in configuration, write position is set to
+ * the beginning of raw device
+ * @param[out]  st     storage to open
+ * @param[in]   cfg    storage configuration, default backend is used if it is NULL or empty
+ * @param[in]   path   raw device path
+ * @param[in]   size   raw device size in bytes, writes beyond this size are not possible with memory backend
+ * @return      0 if the raw device was opened and -1 otherwise, errno is set in this case
+ */
+int storage_open(struct storage *st, const char *cfg, const char *path, uint64_t size)
+{
+	struct stat st_buf;
+	const struct storage_ops *ops;
+
+	memset(st, 0, sizeof(struct storage));
+	st->fd = -1;
+	st->size = size;
+	if (parse_cfg(cfg, &ops, &st->faults) != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (ops == NULL)
+		ops = (stat(path, &st_buf) == 0 && S_ISBLK(st_buf.st_mode)) ? &backends[0] : &backends[1];
+	if (ops->open(st, path) != 0) {
+		D0(fprintf(debug_file, "Can not open %s with %s storage backend: %s\n", path, ops->name, strerror(errno)));
+		return -1;
+	}
+	st->ops = ops;
+	D1(fprintf(debug_file, "Raw device %s is open with %s storage backend\n", path, ops->name));
+
+	return 0;
+}
+
+/** Check if write of @e len bytes from current position touches LBAs where EIO should be injected */
+static bool eio_hit(const struct storage *st, size_t len)
+{
+	uint64_t first = st->pos / PHY_BLOCK_SIZE;
+	uint64_t last = (st->pos + len - 1) / PHY_BLOCK_SIZE;
+
+	for (int i = 0; i < st->faults.eio_num; i++) {
+		if (first <= st->faults.eio_to[i] && last >= st->faults.eio_from[i])
+			return true;
+	}
+	return false;
+}
+
+/** Make a copy of vectors containing the first @e len bytes of data, return the number of vectors */
+static int trim_iov(const struct iovec *iov, int iovcnt, size_t len, struct iovec *trimmed)
+{
+	int i;
+
+	for (i = 0; i < iovcnt && len > 0; i++) {
+		trimmed[i] = iov[i];
+		if (trimmed[i].iov_len > len)
+			trimmed[i].iov_len = len;
+		len -= trimmed[i].iov_len;
+	}
+	return i;
+}
+
+/** Delay the calling thread by latency spike and throughput cap */
+static void fault_delay(struct storage *st, size_t len)
+{
+	uint64_t now = lat_time();
+	uint64_t start;
+	struct storage_faults *faults = &st->faults;
+
+	if (faults->spike_every != 0 && faults->writes % faults->spike_every == 0) {
+		D3(fprintf(debug_file, "Storage latency spike of %u us injected at write %llu\n", faults->spike_us, faults->writes));
+		usleep(faults->spike_us);
+		now = lat_time();
+	}
+	if (faults->rate > 0) {
+		// the write is completed when all previous writes are done and this one is transferred at given rate
+		start = (faults->ready_time > now) ? faults->ready_time : now;
+		faults->ready_time = start + (uint64_t)(len * 1000000.0 / faults->rate);
+		if (faults->ready_time > now)
+			usleep(faults->ready_time - now);
+	}
+}
+
+/**
+ * @brief Write data to current position and advance the position by the number of bytes written.
+ * Configured faults are injected here.
+ * @param[in]   st       storage
+ * @param[in]   iov      data vectors
+ * @param[in]   iovcnt   the number of vectors, not more than #STORAGE_MAX_IOV
+ * @return      the number of bytes written or -1 in case of an error, errno is set in this case
+ */
+ssize_t storage_writev(struct storage *st, const struct iovec *iov, int iovcnt)
+{
+	size_t len = 0;
+	ssize_t ret;
+	struct iovec trimmed[STORAGE_MAX_IOV];
+	struct storage_faults *faults = &st->faults;
+
+	if (iovcnt > STORAGE_MAX_IOV) {
+		errno = EINVAL;
+		return -1;
+	}
+	for (int i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	faults->writes++;
+	if (faults->eio_num > 0 && len > 0 && eio_hit(st, len)) {
+		D1(fprintf(debug_file, "Storage write error injected at LBA %llu, write %llu\n", st->pos / PHY_BLOCK_SIZE, faults->writes));
+		fault_delay(st, 0);
+		errno = EIO;
+		return -1;
+	}
+	if (faults->short_every != 0 && faults->writes % faults->short_every == 0) {
+		len = (len / 2) - (len / 2) % PHY_BLOCK_SIZE;
+		iovcnt = trim_iov(iov, iovcnt, len, trimmed);
+		iov = trimmed;
+		D1(fprintf(debug_file, "Storage short write of %u bytes injected at LBA %llu, write %llu\n", len, st->pos / PHY_BLOCK_SIZE, faults->writes));
+	}
+
+	ret = (iovcnt > 0) ? st->ops->writev(st, iov, iovcnt, st->pos) : 0;
+	if (ret > 0)
+		st->pos += ret;
+	fault_delay(st, (ret > 0) ? ret : 0);
+
+	return ret;
+}
+
+/**
+ * @brief Read data from raw device, write position is not changed
+ * @param[in]   st       storage
+ * @param[out]  buf      buffer for data
+ * @param[in]   count    the number of bytes to read
+ * @param[in]   offset   read position, in bytes from the beginning of raw device
+ * @return      the number of bytes read or -1 in case of an error, errno is set in this case
+ */
+ssize_t storage_pread(struct storage *st, void *buf, size_t count, int64_t offset)
+{
+	return st->ops->pread(st, buf, count, offset);
+}
+
+/**
+ * @brief Close raw device
+ * @param[in]   st   storage
+ * @return      0 if the device was closed and -1 otherwise, errno is set in this case
+ */
+int storage_close(struct storage *st)
+{
+	int ret;
+
+	if (st->ops == NULL)
+		return 0;
+	ret = st->ops->close(st);
+	st->ops = NULL;
+
+	return ret;
+}
@@ -0,0 +1,98 @@
+/** @file camogm_storage.h
+ * @brief Storage backends of raw device writer
+ * @copyright Copyright (C) 2017 Elphel, Inc.
+ *
+ * @par <b>License</b>
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CAMOGM_STORAGE_H
+#define _CAMOGM_STORAGE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/** @brief The maximal length of storage configuration string */
+#define STORAGE_CFG_LEN           256
+/** @brief Default storage configuration, block device or regular file backend is selected by raw device type */
+#define STORAGE_DEFAULT_CFG       "auto"
+/** @brief The maximal number of LBA ranges where write errors are injected */
+#define STORAGE_MAX_EIO           16
+/** @brief The maximal number of vectors in one write */
+#define STORAGE_MAX_IOV           16
+
+struct storage;
+
+/**
+ * @struct storage_ops
+ * @brief Storage backend operations, offsets are in bytes from the beginning of raw device
+ */
+struct storage_ops {
+	const char *name;                                                  ///< backend name used in configuration
+	int (*open)(struct storage *st, const char *path);                 ///< open raw device, return 0 or -1 with errno set
+	ssize_t (*writev)(struct storage *st, const struct iovec *iov, int iovcnt, int64_t offset); ///< positioned vector write
+	ssize_t (*pread)(struct storage *st, void *buf, size_t count, int64_t offset);             ///< positioned read
+	int (*close)(struct storage *st);                                  ///< close raw device, return 0 or -1 with errno set
+};
+
+/**
+ * @struct storage_faults
+ * @brief Faults injected into writes, used to check queueing and error handling without real disk problems.
+ * All faults are deterministic: they depend on write sequence number and position only.
+ */
+struct storage_faults {
+	unsigned int spike_us;                       ///< latency spike added to a write, in microseconds
+	unsigned int spike_every;                    ///< every n-th write is delayed by #spike_us, 0 - no spikes
+	double rate;                                 ///< throughput cap, in bytes per second, 0 - no cap
+	unsigned int short_every;                    ///< every n-th write is short, 0 - no short writes
+	uint64_t eio_from[STORAGE_MAX_EIO];          ///< the first LBA of a range where writes fail with EIO
+	uint64_t eio_to[STORAGE_MAX_EIO];            ///< the last LBA of a range where writes fail with EIO
+	int eio_num;                                 ///< the number of EIO ranges
+	uint64_t writes;                             ///< the number of writes done
+	uint64_t ready_time;                         ///< the time the next write can be completed under throughput cap
+};
+
+/**
+ * @struct storage
+ * @brief Raw device opened with one of storage backends. The backend keeps write position, so the writer
+ * works with it the same way it worked with file descriptor.
+ */
+struct storage {
+	const struct storage_ops *ops;               ///< backend, NULL if storage is not open
+	int fd;                                      ///< raw device file descriptor, -1 if the backend does not use it
+	int64_t pos;                                 ///< current write position
+	uint64_t size;                               ///< raw device size, in bytes
+	void *priv;                                  ///< backend specific data
+	struct storage_faults faults;                ///< injected faults
+};
+
+int storage_check(const char *cfg);
+int storage_open(struct storage *st, const char *cfg, const char *path, uint64_t size);
+ssize_t storage_writev(struct storage *st, const struct iovec *iov, int iovcnt);
+ssize_t storage_pread(struct storage *st, void *buf, size_t count, int64_t offset);
+int storage_close(struct storage *st);
+
+/** @brief Set write position of raw device */
+static inline void storage_seek(struct storage *st, int64_t offset)
+{
+	st->pos = offset;
+}
+
+/** @brief Get write position of raw device */
+static inline int64_t storage_tell(const struct storage *st)
+{
+	return st->pos;
+}
+
+#endif /* _CAMOGM_STORAGE_H */
@@ -0,0 +1,233 @@
+/** @file camogm_superblock.c
+ * @brief Provides raw device buffer superblock describing buffer layout
+ * @copyright Copyright (C) 2017 Elphel, Inc.
+ *
+ * @par <b>License</b>
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @addtogroup SPECIAL_INCLUDES Special includes
+ * These defines are needed to use O_DIRECT, pread64 and pwrite64 and should be set before includes
+ * @{
+ */
+/** Needed for O_DIRECT */
+#define _GNU_SOURCE
+/** Needed for pread64 and pwrite64 */
+#define _LARGEFILE64_SOURCE
+/** @} */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#include "camogm_superblock.h"
+#include "camogm_checkpoint.h"
+#include "camogm_align.h"
+
+/** @brief The maximum number of ports which can be described in superblock */
+#define SB_MAX_PORTS              16
+/** @brief The offset of per port layout records in superblock */
+#define SB_PORTS_OFFSET           112
+/** @brief The size of one per port layout record */
+#define SB_PORT_REC_SIZE          8
+/** @brief The offset of CRC field, CRC is calculated over all preceding bytes */
+#define SB_CRC_OFFSET             (SUPERBLOCK_SIZE - 4)
+
+/* Sanity check, superblock must not overlap checkpoint ring */
+#if (SUPERBLOCK_OFFSET + SUPERBLOCK_SIZE) > CHECKPOINT_OFFSET
+#error "Superblock overlaps checkpoint ring"
+#endif
+
+/** Serialize superblock to a buffer of #SUPERBLOCK_SIZE bytes */
+static void sb_to_buff(const struct raw_superblock *sb, unsigned char *buff)
+{
+	unsigned char *rec;
+
+	memset(buff, 0, SUPERBLOCK_SIZE);
+	memcpy(&buff[0], SUPERBLOCK_MAGIC, SUPERBLOCK_MAGIC_LEN);
+	put_uint32(&buff[8], sb->version);
+	put_uint32(&buff[12], SUPERBLOCK_SIZE);
+	put_uint32(&buff[16], sb->sector_size);
+	put_uint32(&buff[20], sb->flags);
+	put_uint64(&buff[24], sb->lba_start);
+	put_uint64(&buff[32], sb->lba_end);
+	put_uint64(&buff[40], sb->ring_start);
+	put_uint64(&buff[48], sb->ring_end);
+	put_uint64(&buff[56], sb->ckpt_offset);
+	put_uint32(&buff[64], sb->ckpt_slot_size);
+	put_uint32(&buff[68], sb->ckpt_slots);
+	put_uint64(&buff[72], sb->journal_offset);
+	put_uint64(&buff[80], sb->journal_size);
+	put_uint64(&buff[88], sb->create_time);
+	put_uint64(&buff[96], sb->update_time);
+	put_uint32(&buff[104], sb->port_mask);
+	put_uint32(&buff[108], SENSOR_PORTS);
+	for (int i = 0; i < SENSOR_PORTS && i < SB_MAX_PORTS; i++) {
+		rec = &buff[SB_PORTS_OFFSET + i * SB_PORT_REC_SIZE];
+		rec[0] = sb->ports[i].width & 0xff;
+		rec[1] = (sb->ports[i].width >> 8) & 0xff;
+		rec[2] = sb->ports[i].height & 0xff;
+		rec[3] = (sb->ports[i].height >> 8) & 0xff;
+		rec[4] = sb->ports[i].color;
+		rec[5] = sb->ports[i].quality;
+	}
+	put_uint32(&buff[SB_CRC_OFFSET], crc32_calc(0, buff, SB_CRC_OFFSET));
+}
+
+/** Restore superblock from a buffer, return 0 if the superblock is valid and -1 otherwise */
+static int buff_to_sb(const unsigned char *buff, struct raw_superblock *sb)
+{
+	uint32_t ports;
+	const unsigned char *rec;
+
+	if (memcmp(&buff[0], SUPERBLOCK_MAGIC, SUPERBLOCK_MAGIC_LEN) != 0 ||
+			get_uint32(&buff[12]) != SUPERBLOCK_SIZE ||
+			get_uint32(&buff[SB_CRC_OFFSET]) != crc32_calc(0, buff, SB_CRC_OFFSET))
+		return -1;
+	memset(sb, 0, sizeof(struct raw_superblock));
+	sb->version = get_uint32(&buff[8]);
+	if (sb->version > SUPERBLOCK_VERSION)
+		return -1;
+	sb->sector_size = get_uint32(&buff[16]);
+	sb->flags = get_uint32(&buff[20]);
+	sb->lba_start = get_uint64(&buff[24]);
+	sb->lba_end = get_uint64(&buff[32]);
+	sb->ring_start = get_uint64(&buff[40]);
+	sb->ring_end = get_uint64(&buff[48]);
+	sb->ckpt_offset = get_uint64(&buff[56]);
+	sb->ckpt_slot_size = get_uint32(&buff[64]);
+	sb->ckpt_slots = get_uint32(&buff[68]);
+	sb->journal_offset = get_uint64(&buff[72]);
+	sb->journal_size = get_uint64(&buff[80]);
+	sb->create_time = get_uint64(&buff[88]);
+	sb->update_time = get_uint64(&buff[96]);
+	sb->port_mask = get_uint32(&buff[104]);
+	ports = get_uint32(&buff[108]);
+	for (uint32_t i = 0; i < ports && i < SENSOR_PORTS && i < SB_MAX_PORTS; i++) {
+		rec = &buff[SB_PORTS_OFFSET + i * SB_PORT_REC_SIZE];
+		sb->ports[i].width = rec[0] | (rec[1] << 8);
+		sb->ports[i].height = rec[2] | (rec[3] << 8);
+		sb->ports[i].color = rec[4];
+		sb->ports[i].quality = rec[5];
+	}
+
+	// sanity check
+	if (sb->sector_size == 0 ||
+			sb->ring_start < SUPERBLOCK_OFFSET + SUPERBLOCK_SIZE ||
+			sb->ring_start >= sb->ring_end ||
+			(sb->ring_start % sb->sector_size) != 0)
+		return -1;
+
+	return 0;
+}
+
+/** Read superblock sector from an open file */
+static int read_sb_buff(int fd, unsigned char *buff)
+{
+	if (pread64(fd, buff, SUPERBLOCK_SIZE, SUPERBLOCK_OFFSET) != SUPERBLOCK_SIZE)
+		return -1;
+	return 0;
+}
+
+/**
+ * @brief Read and validate raw device buffer superblock. Regular files (disk images) can be used
+ * as well as block devices.
+ * @param[in]   path   raw device path or disk image file name
+ * @param[out]  sb     superblock read from disk
+ * @return      0 if valid superblock was found and -1 otherwise
+ */
+int superblock_read(const char *path, struct raw_superblock *sb)
+{
+	int fd;
+	int ret = -1;
+	unsigned char *buff;
+
+	if (posix_memalign((void **)&buff, SUPERBLOCK_SIZE, SUPERBLOCK_SIZE) != 0)
+		return -1;
+	fd = open(path, O_RDONLY);
+	if (fd >= 0) {
+		if (read_sb_buff(fd, buff) == 0)
+			ret = buff_to_sb(buff, sb);
+		close(fd);
+	}
+	free(buff);
+
+	return ret;
+}
+
+/**
+ * @brief Write superblock describing current raw device buffer layout. Creation time is preserved
+ * if the buffer already has a superblock with the same geometry.
+ * @param[in]   state   a pointer to a structure containing current state
+ * @return      0 if superblock was written successfully and -1 otherwise
+ */
+int superblock_write(camogm_state *state)
+{
+	int fd;
+	int ret = 0;
+	unsigned char *buff;
+	struct raw_superblock sb, old_sb;
+	const struct writer_params *params = &state->writer_params;
+
+	if (posix_memalign((void **)&buff, SUPERBLOCK_SIZE, SUPERBLOCK_SIZE) != 0)
+		return -1;
+	fd = open(state->rawdev.rawdev_path, O_RDWR | O_DIRECT | O_DSYNC);
+	if (fd < 0) {
+		D0(fprintf(debug_file, "Unable to open %s for superblock write: %s\n", state->rawdev.rawdev_path, strerror(errno)));
+		free(buff);
+		return -1;
+	}
+
+	memset(&sb, 0, sizeof(sb));
+	sb.version = SUPERBLOCK_VERSION;
+	sb.sector_size = PHY_BLOCK_SIZE;
+	sb.flags = SB_FLAG_CHECKPOINTS;
+	if (state->exif)
+		sb.flags |= SB_FLAG_EXIF;
+	sb.lba_start = params->lba_start;
+	sb.lba_end = params->lba_end;
+	sb.ring_start = RAWDEV_START_OFFSET;
+	sb.ring_end = lba_to_offset(params->lba_end - params->lba_start);
+	sb.ckpt_offset = CHECKPOINT_OFFSET;
+	sb.ckpt_slot_size = CHECKPOINT_SLOT_SIZE;
+	sb.ckpt_slots = CHECKPOINT_SLOTS;
+	sb.update_time = time(NULL);
+	sb.create_time = sb.update_time;
+	if (read_sb_buff(fd, buff) == 0 && buff_to_sb(buff, &old_sb) == 0 &&
+			old_sb.lba_start == sb.lba_start && old_sb.lba_end == sb.lba_end)
+		sb.create_time = old_sb.create_time;
+	for (int port = 0; port < SENSOR_PORTS; port++) {
+		if (state->active_chn & (1 << port)) {
+			sb.port_mask |= 1 << port;
+			sb.ports[port].width = state->frame_params[port].width;
+			sb.ports[port].height = state->frame_params[port].height;
+			sb.ports[port].color = state->frame_params[port].color;
+			sb.ports[port].quality = state->frame_params[port].quality2;
+		}
+	}
+
+	sb_to_buff(&sb, buff);
+	if (pwrite64(fd, buff, SUPERBLOCK_SIZE, SUPERBLOCK_OFFSET) != SUPERBLOCK_SIZE) {
+		D0(fprintf(debug_file, "Superblock write error: %s\n", strerror(errno)));
+		ret = -1;
+	}
+	close(fd);
+	free(buff);
+
+	return ret;
+}
@@ -0,0 +1,85 @@
+/** @file camogm_superblock.h
+ * @brief Provides raw device buffer superblock describing buffer layout
+ * @copyright Copyright (C) 2017 Elphel, Inc.
+ *
+ * @par <b>License</b>
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CAMOGM_SUPERBLOCK_H
+#define _CAMOGM_SUPERBLOCK_H
+
+#include <stdint.h>
+
+#include "camogm.h"
+
+#define SUPERBLOCK_OFFSET         0              ///< Offset of superblock from the beginning of raw device buffer, in bytes
+#define SUPERBLOCK_SIZE           4096           ///< The size of superblock on disk, it is written with a single O_DIRECT write
+#define SUPERBLOCK_MAGIC          "ELPHRAWB"     ///< Superblock signature
+#define SUPERBLOCK_MAGIC_LEN      8              ///< The length of superblock signature
+#define SUPERBLOCK_VERSION        1              ///< Superblock format version
+
+/**
+ * @enum superblock_flags
+ * @brief Format flags stored in superblock
+ * @var superblock_flags::SB_FLAG_EXIF
+ * Frames contain Exif headers
+ * @var superblock_flags::SB_FLAG_CHECKPOINTS
+ * Write pointer checkpoints are stored in the reserved area
+ * @var superblock_flags::SB_FLAG_JOURNAL
+ * Index journal is stored at the location recorded in superblock
+ */
+enum superblock_flags {
+	SB_FLAG_EXIF = 1,
+	SB_FLAG_CHECKPOINTS = 2,
+	SB_FLAG_JOURNAL = 4
+};
+
+/**
+ * @struct sb_port
+ * @brief Layout of frames recorded from one sensor port
+ */
+struct sb_port {
+	uint16_t width;                              ///< frame width in pixels
+	uint16_t height;                             ///< frame height in pixels
+	uint8_t color;                               ///< color mode of compressor
+	uint8_t quality;                             ///< JPEG quality
+};
+
+/**
+ * @struct raw_superblock
+ * @brief Raw device buffer superblock. All offsets are in bytes from the beginning of raw device buffer.
+ * Superblock is stored on disk in little-endian byte order.
+ */
+struct raw_superblock {
+	uint32_t version;                            ///< superblock format version
+	uint32_t sector_size;                        ///< physical sector size used for data alignment
+	uint32_t flags;                              ///< format flags, a combination of #superblock_flags
+	uint64_t lba_start;                          ///< the first LBA of raw device buffer on disk
+	uint64_t lba_end;                            ///< the last LBA of raw device buffer on disk
+	uint64_t ring_start;                         ///< the offset where frame data ring starts
+	uint64_t ring_end;                           ///< the offset where frame data ring ends
+	uint64_t ckpt_offset;                        ///< the offset of checkpoint ring
+	uint32_t ckpt_slot_size;                     ///< the size of one checkpoint slot
+	uint32_t ckpt_slots;                         ///< the number of slots in checkpoint ring
+	uint64_t journal_offset;                     ///< the offset of index journal, 0 if there is no journal
+	uint64_t journal_size;                       ///< the size of index journal
+	uint64_t create_time;                        ///< the time when the buffer was formatted
+	uint64_t update_time;                        ///< the time when superblock was last written
+	uint32_t port_mask;                          ///< bit mask of sensor ports recorded to the buffer
+	struct sb_port ports[SENSOR_PORTS];          ///< per port frame layout
+};
+
+int superblock_read(const char *path, struct raw_superblock *sb);
+int superblock_write(camogm_state *state);
+
+#endif /* _CAMOGM_SUPERBLOCK_H */
@@ -0,0 +1,788 @@
+/** @file camogm_thumb.c
+ * @brief Provides fast thumbnail extraction from JPEG frames stored in raw device buffer
+ * @copyright Copyright (C) 2016 Elphel, Inc.
+ *
+ * @par <b>License</b>
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** @brief This define is needed to use pread64 and should be set before includes */
+#define _LARGEFILE64_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "camogm.h"
+#include "camogm_thumb.h"
+
+/** @brief JPEG markers used by DC decoder */
+#define JPEG_MARKER_SOF0          0xc0
+#define JPEG_MARKER_SOF1          0xc1
+#define JPEG_MARKER_DHT           0xc4
+#define JPEG_MARKER_RST0          0xd0
+#define JPEG_MARKER_RST7          0xd7
+#define JPEG_MARKER_SOI           0xd8
+#define JPEG_MARKER_EOI           0xd9
+#define JPEG_MARKER_SOS           0xda
+#define JPEG_MARKER_DQT           0xdb
+#define JPEG_MARKER_DRI           0xdd
+/** @brief The maximum number of color components in a frame */
+#define JPEG_MAX_COMPS            4
+/** @brief The number of Huffman code bits resolved with a single table lookup */
+#define HUFF_LOOKUP_BITS          9
+
+/**
+ * @struct huff_table
+ * @brief Huffman decoding table
+ * @var huff_table::lookup_len
+ * The length of a code resolved by fast lookup, 0 if the code is longer than #HUFF_LOOKUP_BITS
+ * @var huff_table::lookup_val
+ * The symbol for a code resolved by fast lookup
+ * @var huff_table::maxcode
+ * The largest code of each length, -1 if there are no codes of this length
+ * @var huff_table::mincode
+ * The smallest code of each length
+ * @var huff_table::valptr
+ * The index of the first symbol of each length in #huff_table::vals
+ * @var huff_table::vals
+ * Symbols sorted in code order
+ */
+struct huff_table {
+	uint8_t lookup_len[1 << HUFF_LOOKUP_BITS];
+	uint8_t lookup_val[1 << HUFF_LOOKUP_BITS];
+	int32_t maxcode[17];
+	int32_t mincode[17];
+	int32_t valptr[17];
+	uint8_t vals[256];
+};
+
+/**
+ * @struct jpeg_comp
+ * @brief Color component parameters and its DC coefficients
+ * @var jpeg_comp::id
+ * Component identifier from frame header
+ * @var jpeg_comp::h
+ * Horizontal sampling factor
+ * @var jpeg_comp::v
+ * Vertical sampling factor
+ * @var jpeg_comp::tq
+ * Quantization table selector
+ * @var jpeg_comp::td
+ * DC Huffman table selector
+ * @var jpeg_comp::ta
+ * AC Huffman table selector
+ * @var jpeg_comp::bw
+ * The number of blocks in a row of DC grid
+ * @var jpeg_comp::bh
+ * The number of block rows in DC grid
+ * @var jpeg_comp::pred
+ * DC predictor
+ * @var jpeg_comp::dc
+ * DC coefficients of all blocks of this component
+ */
+struct jpeg_comp {
+	int id;
+	int h;
+	int v;
+	int tq;
+	int td;
+	int ta;
+	int bw;
+	int bh;
+	int pred;
+	int16_t *dc;
+};
+
+/**
+ * @struct jpeg_dec
+ * @brief DC decoder state
+ */
+struct jpeg_dec {
+	int width;                                   ///< frame width in pixels
+	int height;                                  ///< frame height in pixels
+	int ncomp;                                   ///< the number of components in frame
+	int hmax;                                    ///< maximum horizontal sampling factor
+	int vmax;                                    ///< maximum vertical sampling factor
+	int restart;                                 ///< restart interval in MCUs, 0 if restart markers are not used
+	uint16_t dcq[4];                             ///< DC quantization coefficients
+	struct jpeg_comp comp[JPEG_MAX_COMPS];       ///< frame components
+	struct huff_table dc_tbl[4];                 ///< DC Huffman tables
+	struct huff_table ac_tbl[4];                 ///< AC Huffman tables
+	int scan_comp[JPEG_MAX_COMPS];               ///< indexes of components in current scan
+	int scan_ncomp;                              ///< the number of components in current scan
+	const uint8_t *ptr;                          ///< current position in entropy coded data
+	const uint8_t *end;                          ///< the end of frame data
+	uint32_t bits;                               ///< bit buffer
+	int nbits;                                   ///< the number of valid bits in bit buffer
+	int marker;                                  ///< marker found in entropy coded data, 0 if none
+};
+
+/**
+ * @struct thumb_job
+ * @brief Shared state of thumbnail extraction worker threads
+ * @var thumb_job::src
+ * Raw device buffer parameters
+ * @var thumb_job::indx
+ * Disk index nodes of the frames to be processed
+ * @var thumb_job::imgs
+ * Resulting images
+ * @var thumb_job::num
+ * The number of frames to process
+ * @var thumb_job::next
+ * The index of next frame to process, incremented atomically by workers
+ * @var thumb_job::done
+ * The number of thumbnails successfully decoded
+ */
+struct thumb_job {
+	const struct thumb_src *src;
+	struct disk_index **indx;
+	struct thumb_image *imgs;
+	int num;
+	int next;
+	int done;
+};
+
+/**
+ * @brief Build Huffman decoding table from DHT segment data
+ * @param[out]  tbl      Huffman table
+ * @param[in]   counts   the number of codes of each length, 16 elements
+ * @param[in]   vals     symbols in code order
+ * @return      0 if the table was built and -1 if the table data is invalid
+ */
+static int huff_build(struct huff_table *tbl, const uint8_t *counts, const uint8_t *vals)
+{
+	int code = 0;
+	int k = 0;
+
+	memset(tbl, 0, sizeof(struct huff_table));
+	for (int l = 1; l <= 16; l++) {
+		tbl->valptr[l] = k;
+		tbl->mincode[l] = code;
+		for (int i = 0; i < counts[l - 1]; i++, k++, code++) {
+			if (k >= 256)
+				return -1;
+			tbl->vals[k] = vals[k];
+			if (l <= HUFF_LOOKUP_BITS) {
+				int shift = HUFF_LOOKUP_BITS - l;
+				for (int j = code << shift; j < ((code + 1) << shift) && j < (1 << HUFF_LOOKUP_BITS); j++) {
+					tbl->lookup_len[j] = l;
+					tbl->lookup_val[j] = vals[k];
+				}
+			}
+		}
+		// oversubscribed table, codes do not fit in their length
+		if (code > (1 << l))
+			return -1;
+		tbl->maxcode[l] = counts[l - 1] ? code - 1 : -1;
+		code <<= 1;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Fill bit buffer from entropy coded data. Stuffed zero bytes are removed and
+ * zero bits are fed after a marker is found.
+ * @param[in,out]   dec   decoder state
+ * @return          None
+ */
+static inline void fill_bits(struct jpeg_dec *dec)
+{
+	while (dec->nbits <= 24) {
+		unsigned int c = 0;
+		if (dec->marker == 0 && dec->ptr < dec->end) {
+			c = *dec->ptr++;
+			if (c == 0xff) {
+				unsigned int c2 = (dec->ptr < dec->end) ? *dec->ptr : JPEG_MARKER_EOI;
+				if (c2 == 0) {
+					dec->ptr++;
+				} else {
+					dec->marker = c2;
+					dec->ptr--;
+					c = 0;
+				}
+			}
+		}
+		dec->bits = (dec->bits << 8) | c;
+		dec->nbits += 8;
+	}
+}
+
+/**
+ * @brief Get a number of bits from bit buffer
+ * @param[in,out]   dec   decoder state
+ * @param[in]       n     the number of bits, up to 16
+ * @return          The value of the bits
+ */
+static inline int get_bits(struct jpeg_dec *dec, int n)
+{
+	fill_bits(dec);
+	dec->nbits -= n;
+	return (dec->bits >> dec->nbits) & ((1 << n) - 1);
+}
+
+/**
+ * @brief Decode one Huffman coded symbol
+ * @param[in,out]   dec   decoder state
+ * @param[in]       tbl   Huffman table
+ * @return          Decoded symbol or -1 if the code is invalid
+ */
+static inline int huff_decode(struct jpeg_dec *dec, const struct huff_table *tbl)
+{
+	int look;
+
+	fill_bits(dec);
+	look = (dec->bits >> (dec->nbits - HUFF_LOOKUP_BITS)) & ((1 << HUFF_LOOKUP_BITS) - 1);
+	if (tbl->lookup_len[look] != 0) {
+		dec->nbits -= tbl->lookup_len[look];
+		return tbl->lookup_val[look];
+	}
+	for (int l = HUFF_LOOKUP_BITS + 1; l <= 16; l++) {
+		int code = (dec->bits >> (dec->nbits - l)) & ((1 << l) - 1);
+		if (code <= tbl->maxcode[l]) {
+			dec->nbits -= l;
+			return tbl->vals[tbl->valptr[l] + code - tbl->mincode[l]];
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * @brief Decode one 8x8 block. Only DC coefficient is stored, AC coefficients are decoded
+ * to advance the bit stream and then discarded.
+ * @param[in,out]   dec    decoder state
+ * @param[in,out]   comp   component this block belongs to
+ * @param[out]      dc     DC coefficient of the block
+ * @return          0 if the block was decoded and -1 in case of invalid data
+ */
+static int decode_block(struct jpeg_dec *dec, struct jpeg_comp *comp, int16_t *dc)
+{
+	int s, rs;
+	const struct huff_table *ac_tbl = &dec->ac_tbl[comp->ta];
+
+	s = huff_decode(dec, &dec->dc_tbl[comp->td]);
+	if (s < 0 || s > 11)
+		return -1;
+	if (s) {
+		int v = get_bits(dec, s);
+		if (v < (1 << (s - 1)))
+			v -= (1 << s) - 1;
+		comp->pred += v;
+	}
+	*dc = comp->pred;
+
+	for (int k = 1; k < 64; k++) {
+		rs = huff_decode(dec, ac_tbl);
+		if (rs < 0)
+			return -1;
+		s = rs & 0x0f;
+		if (s) {
+			k += rs >> 4;
+			fill_bits(dec);
+			dec->nbits -= s;
+		} else if ((rs >> 4) == 15) {
+			k += 15;
+		} else {
+			break;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Process restart marker: discard remaining bits, skip the marker and reset DC predictors
+ * @param[in,out]   dec   decoder state
+ * @return          None
+ */
+static void restart_scan(struct jpeg_dec *dec)
+{
+	dec->nbits = 0;
+	dec->bits = 0;
+	if (dec->marker >= JPEG_MARKER_RST0 && dec->marker <= JPEG_MARKER_RST7) {
+		dec->ptr += 2;
+		dec->marker = 0;
+	}
+	for (int i = 0; i < dec->ncomp; i++)
+		dec->comp[i].pred = 0;
+}
+
+/**
+ * @brief Decode entropy coded data of one scan
+ * @param[in,out]   dec   decoder state
+ * @return          0 if the scan was decoded and -1 in case of invalid data
+ */
+static int decode_scan(struct jpeg_dec *dec)
+{
+	int mcu_cntr = 0;
+	int mcux, mcuy;
+
+	dec->bits = 0;
+	dec->nbits = 0;
+	dec->marker = 0;
+	for (int i = 0; i < dec->ncomp; i++)
+		dec->comp[i].pred = 0;
+
+	if (dec->scan_ncomp == 1) {
+		// non-interleaved scan, each MCU is a single block
+		struct jpeg_comp *comp = &dec->comp[dec->scan_comp[0]];
+		mcux = ((dec->width * comp->h + dec->hmax - 1) / dec->hmax + 7) / 8;
+		mcuy = ((dec->height * comp->v + dec->vmax - 1) / dec->vmax + 7) / 8;
+		for (int y = 0; y < mcuy; y++) {
+			for (int x = 0; x < mcux; x++) {
+				if (dec->restart && mcu_cntr && (mcu_cntr % dec->restart) == 0)
+					restart_scan(dec);
+				if (decode_block(dec, comp, &comp->dc[y * comp->bw + x]) != 0)
+					return -1;
+				mcu_cntr++;
+			}
+		}
+	} else {
+		mcux = (dec->width + 8 * dec->hmax - 1) / (8 * dec->hmax);
+		mcuy = (dec->height + 8 * dec->vmax - 1) / (8 * dec->vmax);
+		for (int my = 0; my < mcuy; my++) {
+			for (int mx = 0; mx < mcux; mx++) {
+				if (dec->restart && mcu_cntr && (mcu_cntr % dec->restart) == 0)
+					restart_scan(dec);
+				for (int i = 0; i < dec->scan_ncomp; i++) {
+					struct jpeg_comp *comp = &dec->comp[dec->scan_comp[i]];
+					for (int v = 0; v < comp->v; v++) {
+						int16_t *row = &comp->dc[(my * comp->v + v) * comp->bw + mx * comp->h];
+						for (int h = 0; h < comp->h; h++) {
+							if (decode_block(dec, comp, &row[h]) != 0)
+								return -1;
+						}
+					}
+				}
+				mcu_cntr++;
+			}
+		}
+	}
+
+	// move to the marker following entropy coded data
+	while (dec->ptr + 1 < dec->end && !(dec->ptr[0] == 0xff && dec->ptr[1] != 0 &&
+			(dec->ptr[1] < JPEG_MARKER_RST0 || dec->ptr[1] > JPEG_MARKER_RST7)))
+		dec->ptr++;
+
+	return 0;
+}
+
+/**
+ * @brief Parse frame header and allocate DC grids for all components
+ * @param[in,out]   dec    decoder state
+ * @param[in]       seg    segment data following the length field
+ * @param[in]       len    segment data length
+ * @return          0 if the header was parsed and -1 in case of unsupported or invalid header
+ */
+static int parse_sof(struct jpeg_dec *dec, const uint8_t *seg, int len)
+{
+	int mcux, mcuy;
+
+	if (len < 6 || seg[0] != 8)
+		return -1;
+	dec->height = (seg[1] << 8) | seg[2];
+	dec->width = (seg[3] << 8) | seg[4];
+	dec->ncomp = seg[5];
+	if (dec->width == 0 || dec->height == 0 || dec->ncomp == 0 || dec->ncomp > JPEG_MAX_COMPS ||
+			len < 6 + 3 * dec->ncomp)
+		return -1;
+	dec->hmax = dec->vmax = 1;
+	for (int i = 0; i < dec->ncomp; i++) {
+		const uint8_t *c = &seg[6 + 3 * i];
+		dec->comp[i].id = c[0];
+		dec->comp[i].h = c[1] >> 4;
+		dec->comp[i].v = c[1] & 0x0f;
+		dec->comp[i].tq = c[2] & 0x03;
+		if (dec->comp[i].h < 1 || dec->comp[i].h > 4 || dec->comp[i].v < 1 || dec->comp[i].v > 4)
+			return -1;
+		if (dec->comp[i].h > dec->hmax)
+			dec->hmax = dec->comp[i].h;
+		if (dec->comp[i].v > dec->vmax)
+			dec->vmax = dec->comp[i].v;
+	}
+	mcux = (dec->width + 8 * dec->hmax - 1) / (8 * dec->hmax);
+	mcuy = (dec->height + 8 * dec->vmax - 1) / (8 * dec->vmax);
+	for (int i = 0; i < dec->ncomp; i++) {
+		dec->comp[i].bw = mcux * dec->comp[i].h;
+		dec->comp[i].bh = mcuy * dec->comp[i].v;
+		dec->comp[i].dc = calloc(dec->comp[i].bw * dec->comp[i].bh, sizeof(int16_t));
+		if (dec->comp[i].dc == NULL)
+			return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Parse one or several Huffman tables from DHT segment
+ * @param[in,out]   dec    decoder state
+ * @param[in]       seg    segment data following the length field
+ * @param[in]       len    segment data length
+ * @return          0 if the tables were parsed and -1 in case of invalid data
+ */
+static int parse_dht(struct jpeg_dec *dec, const uint8_t *seg, int len)
+{
+	while (len >= 17) {
+		int total = 0;
+		int tc = seg[0] >> 4;
+		int th = seg[0] & 0x0f;
+		for (int i = 1; i <= 16; i++)
+			total += seg[i];
+		if (tc > 1 || th > 3 || total > 256 || len < 17 + total)
+			return -1;
+		if (huff_build(tc ? &dec->ac_tbl[th] : &dec->dc_tbl[th], &seg[1], &seg[17]) != 0)
+			return -1;
+		seg += 17 + total;
+		len -= 17 + total;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Get DC quantization coefficients from DQT segment
+ * @param[in,out]   dec    decoder state
+ * @param[in]       seg    segment data following the length field
+ * @param[in]       len    segment data length
+ * @return          0 if the tables were parsed and -1 in case of invalid data
+ */
+static int parse_dqt(struct jpeg_dec *dec, const uint8_t *seg, int len)
+{
+	while (len > 0) {
+		int pq = seg[0] >> 4;
+		int tq = seg[0] & 0x03;
+		int tbl_len = pq ? 129 : 65;
+		if (len < tbl_len)
+			return -1;
+		dec->dcq[tq] = pq ? ((seg[1] << 8) | seg[2]) : seg[1];
+		seg += tbl_len;
+		len -= tbl_len;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Parse scan header
+ * @param[in,out]   dec    decoder state
+ * @param[in]       seg    segment data following the length field
+ * @param[in]       len    segment data length
+ * @return          0 if the header was parsed and -1 in case of invalid data
+ */
+static int parse_sos(struct jpeg_dec *dec, const uint8_t *seg, int len)
+{
+	if (dec->ncomp == 0 || len < 1)
+		return -1;
+	dec->scan_ncomp = seg[0];
+	if (dec->scan_ncomp < 1 || dec->scan_ncomp > dec->ncomp || len < 1 + 2 * dec->scan_ncomp + 3)
+		return -1;
+	for (int i = 0; i < dec->scan_ncomp; i++) {
+		int j;
+		const uint8_t *c = &seg[1 + 2 * i];
+		for (j = 0; j < dec->ncomp; j++) {
+			if (dec->comp[j].id == c[0])
+				break;
+		}
+		if (j == dec->ncomp)
+			return -1;
+		dec->comp[j].td = (c[1] >> 4) & 0x03;
+		dec->comp[j].ta = c[1] & 0x03;
+		dec->scan_comp[i] = j;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Convert DC grids to thumbnail image
+ * @param[in]   dec   decoder state
+ * @param[out]  img   thumbnail image
+ * @return      0 if the image was created and -1 if memory allocation failed
+ */
+static int make_image(const struct jpeg_dec *dec, struct thumb_image *img)
+{
+	int comps = (dec->ncomp >= 3) ? 3 : 1;
+
+	img->width = (dec->width + 7) / 8;
+	img->height = (dec->height + 7) / 8;
+	img->comps = comps;
+	img->data = malloc(img->width * img->height * comps);
+	if (img->data == NULL)
+		return -1;
+
+	for (int y = 0; y < img->height; y++) {
+		unsigned char *dst = &img->data[y * img->width * comps];
+		for (int x = 0; x < img->width; x++) {
+			int val[3];
+			for (int i = 0; i < comps; i++) {
+				const struct jpeg_comp *comp = &dec->comp[i];
+				int bx = x * comp->h / dec->hmax;
+				int by = y * comp->v / dec->vmax;
+				// DC coefficient is eight times the average value of a block
+				val[i] = comp->dc[by * comp->bw + bx] * dec->dcq[comp->tq] / 8 + 128;
+			}
+			if (comps == 3) {
+				int cb = val[1] - 128;
+				int cr = val[2] - 128;
+				val[2] = val[0] + ((116130 * cb) >> 16);
+				val[1] = val[0] - ((22554 * cb + 46802 * cr) >> 16);
+				val[0] = val[0] + ((91881 * cr) >> 16);
+			}
+			for (int i = 0; i < comps; i++)
+				*dst++ = (val[i] < 0) ? 0 : ((val[i] > 255) ? 255 : val[i]);
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Build a thumbnail of a baseline JPEG frame by decoding DC coefficients only.
+ *
+ * The size of the resulting image is 1/8 of the frame size; each pixel is the average value of
+ * the corresponding 8x8 block. AC coefficients are entropy decoded to advance the bit stream, but
+ * dequantization and IDCT are not performed.
+ * @param[in]   jpeg   pointer to JPEG frame, starting with SOI marker
+ * @param[in]   len    the length of JPEG frame
+ * @param[out]  img    thumbnail image, the pixel buffer is allocated by this function and
+ * should be freed with #thumb_free
+ * @return      0 if the thumbnail was built and -1 in case of unsupported or broken frame
+ */
+int thumb_decode_dc(const unsigned char *jpeg, size_t len, struct thumb_image *img)
+{
+	int ret = -1;
+	bool scan_done = false;
+	const uint8_t *ptr = jpeg;
+	const uint8_t *end = jpeg + len;
+	struct jpeg_dec *dec;
+
+	memset(img, 0, sizeof(struct thumb_image));
+	if (len < 4 || ptr[0] != 0xff || ptr[1] != JPEG_MARKER_SOI)
+		return -1;
+	dec = calloc(1, sizeof(struct jpeg_dec));
+	if (dec == NULL)
+		return -1;
+
+	ptr += 2;
+	while (ptr + 4 <= end) {
+		int marker, seg_len;
+		if (ptr[0] != 0xff) {
+			ptr++;
+			continue;
+		}
+		marker = ptr[1];
+		if (marker == 0xff) {
+			ptr++;
+			continue;
+		}
+		if (marker == JPEG_MARKER_EOI || (marker >= JPEG_MARKER_RST0 && marker <= JPEG_MARKER_RST7)) {
+			ptr += 2;
+			if (marker == JPEG_MARKER_EOI)
+				break;
+			continue;
+		}
+		seg_len = (ptr[2] << 8) | ptr[3];
+		if (seg_len < 2 || ptr + 2 + seg_len > end)
+			break;
+		switch (marker) {
+		case JPEG_MARKER_SOF0:
+		case JPEG_MARKER_SOF1:
+			if (dec->ncomp != 0 || parse_sof(dec, ptr + 4, seg_len - 2) != 0)
+				goto exit;
+			break;
+		case JPEG_MARKER_DHT:
+			if (parse_dht(dec, ptr + 4, seg_len - 2) != 0)
+				goto exit;
+			break;
+		case JPEG_MARKER_DQT:
+			if (parse_dqt(dec, ptr + 4, seg_len - 2) != 0)
+				goto exit;
+			break;
+		case JPEG_MARKER_DRI:
+			if (seg_len >= 4)
+				dec->restart = (ptr[4] << 8) | ptr[5];
+			break;
+		case JPEG_MARKER_SOS:
+			if (parse_sos(dec, ptr + 4, seg_len - 2) != 0)
+				goto exit;
+			dec->ptr = ptr + 2 + seg_len;
+			dec->end = end;
+			if (decode_scan(dec) != 0)
+				goto exit;
+			scan_done = true;
+			ptr = dec->ptr;
+			continue;
+		default:
+			// progressive and lossless frames are not supported
+			if (marker > JPEG_MARKER_SOF1 && marker <= 0xcf && marker != JPEG_MARKER_DHT &&
+					marker != 0xc8 && marker != 0xcc)
+				goto exit;
+			break;
+		}
+		ptr += 2 + seg_len;
+	}
+	if (scan_done)
+		ret = make_image(dec, img);
+
+exit:
+	for (int i = 0; i < JPEG_MAX_COMPS; i++)
+		free(dec->comp[i].dc);
+	free(dec);
+
+	return ret;
+}
+
+/**
+ * @brief Read one frame from raw device buffer. A frame crossing the end of the buffer is read in two parts.
+ * @param[in]   fd     raw device file descriptor
+ * @param[in]   src    raw device buffer parameters
+ * @param[in]   indx   disk index node of the frame
+ * @param[out]  buff   buffer for frame data, at least @e indx->f_size bytes long
+ * @return      0 if the frame was read and -1 otherwise
+ */
+static int read_frame(int fd, const struct thumb_src *src, const struct disk_index *indx, unsigned char *buff)
+{
+	size_t head_sz = indx->f_size;
+	size_t done;
+	ssize_t rd;
+
+	if (indx->f_offset + indx->f_size > src->end_pos)
+		head_sz = src->end_pos - indx->f_offset;
+	for (done = 0; done < head_sz; done += rd) {
+		rd = pread64(fd, &buff[done], head_sz - done, indx->f_offset + done);
+		if (rd <= 0)
+			return -1;
+	}
+	for (done = 0; done < indx->f_size - head_sz; done += rd) {
+		rd = pread64(fd, &buff[head_sz + done], indx->f_size - head_sz - done, src->start_pos + done);
+		if (rd <= 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Thumbnail extraction worker thread. Frames are taken from the shared job one at a time
+ * until all of them are processed.
+ * @param[in,out]   arg   pointer to #thumb_job structure
+ * @return          None
+ */
+static void *thumb_worker(void *arg)
+{
+	int i;
+	int fd;
+	size_t buff_sz = 0;
+	unsigned char *buff = NULL;
+	struct thumb_job *job = (struct thumb_job *)arg;
+
+	fd = open(job->src->path, O_RDONLY);
+	if (fd < 0) {
+		D0(fprintf(debug_file, "Unable to open raw device %s\n", job->src->path));
+		return (void *) -1;
+	}
+	while ((i = __sync_fetch_and_add(&job->next, 1)) < job->num) {
+		struct disk_index *indx = job->indx[i];
+		if (indx->f_size > buff_sz) {
+			unsigned char *new_buff = realloc(buff, indx->f_size);
+			if (new_buff == NULL)
+				continue;
+			buff = new_buff;
+			buff_sz = indx->f_size;
+		}
+		if (read_frame(fd, job->src, indx, buff) == 0 &&
+				thumb_decode_dc(buff, indx->f_size, &job->imgs[i]) == 0) {
+			__sync_fetch_and_add(&job->done, 1);
+		} else {
+			D3(fprintf(debug_file, "Unable to build thumbnail for frame at offset 0x%010llx\n", indx->f_offset));
+		}
+	}
+	free(buff);
+	close(fd);
+
+	return (void *) 0;
+}
+
+/**
+ * @brief Get the number of worker threads used for thumbnail extraction
+ * @return The number of online processors limited to #THUMB_MAX_THREADS
+ */
+int thumb_get_threads(void)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (cpus < 1)
+		cpus = 1;
+	else if (cpus > THUMB_MAX_THREADS)
+		cpus = THUMB_MAX_THREADS;
+
+	return cpus;
+}
+
+/**
+ * @brief Build thumbnails for a set of frames in parallel.
+ *
+ * Frames are distributed between worker threads dynamically, each thread reads frames with
+ * its own file descriptor. The calling thread takes part in processing as well.
+ * @param[in]   src    raw device buffer parameters
+ * @param[in]   indx   array of disk index nodes of the frames to process
+ * @param[out]  imgs   array of thumbnails, @e num elements. The image data pointer of a frame
+ * which can not be decoded is set to NULL
+ * @param[in]   num    the number of frames to process
+ * @return      The number of thumbnails successfully built
+ */
+int thumb_extract(const struct thumb_src *src, struct disk_index **indx, struct thumb_image *imgs, int num)
+{
+	int threads = thumb_get_threads();
+	pthread_t tid[THUMB_MAX_THREADS];
+	struct thumb_job job = {
+			.src = src,
+			.indx = indx,
+			.imgs = imgs,
+			.num = num,
+			.next = 0,
+			.done = 0
+	};
+
+	memset(imgs, 0, num * sizeof(struct thumb_image));
+	if (threads > num)
+		threads = num;
+	for (int i = 1; i < threads; i++) {
+		if (pthread_create(&tid[i], NULL, thumb_worker, &job) != 0) {
+			threads = i;
+			break;
+		}
+	}
+	thumb_worker(&job);
+	for (int i = 1; i < threads; i++)
+		pthread_join(tid[i], NULL);
+
+	return job.done;
+}
+
+/**
+ * @brief Free pixel buffer of a thumbnail
+ * @param[in,out]   img   thumbnail image
+ * @return          None
+ */
+void thumb_free(struct thumb_image *img)
+{
+	free(img->data);
+	img->data = NULL;
+}
@@ -0,0 +1,71 @@
+/** @file camogm_thumb.h
+ * @brief Provides fast thumbnail extraction from JPEG frames stored in raw device buffer
+ * @copyright Copyright (C) 2016 Elphel, Inc.
+ *
+ * @par <b>License</b>
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CAMOGM_THUMB_H
+#define _CAMOGM_THUMB_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "index_list.h"
+
+/** @brief The maximum number of worker threads used for thumbnail extraction */
+#define THUMB_MAX_THREADS         8
+/** @brief The number of frames each worker thread processes in one batch */
+#define THUMB_BATCH_PER_THREAD    4
+
+/**
+ * @struct thumb_image
+ * @brief Thumbnail image built from DC coefficients of a JPEG frame, 1/8 of original size
+ * @var thumb_image::width
+ * Thumbnail width in pixels
+ * @var thumb_image::height
+ * Thumbnail height in pixels
+ * @var thumb_image::comps
+ * The number of color components in thumbnail: 1 for gray scale and 3 for RGB images
+ * @var thumb_image::data
+ * Pixel data, 8 bits per component, interleaved
+ */
+struct thumb_image {
+	int width;
+	int height;
+	int comps;
+	unsigned char *data;
+};
+
+/**
+ * @struct thumb_src
+ * @brief Raw device buffer parameters needed to read frames
+ * @var thumb_src::path
+ * Raw device path
+ * @var thumb_src::start_pos
+ * The offset of raw device buffer start, frames crossing buffer end continue from this offset
+ * @var thumb_src::end_pos
+ * The offset of raw device buffer end
+ */
+struct thumb_src {
+	const char *path;
+	uint64_t start_pos;
+	uint64_t end_pos;
+};
+
+int thumb_decode_dc(const unsigned char *jpeg, size_t len, struct thumb_image *img);
+int thumb_extract(const struct thumb_src *src, struct disk_index **indx, struct thumb_image *imgs, int num);
+int thumb_get_threads(void);
+void thumb_free(struct thumb_image *img);
+
+#endif /* _CAMOGM_THUMB_H */
@@ -0,0 +1,230 @@
+/** @file camogm_trace.c
+ * @brief Recording pipeline timeline in Chrome trace format
+ * @copyright Copyright (C) 2017 Elphel, Inc.
+ *
+ * @par <b>License</b>
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * When tracing is on, recording threads put begin and end events of pipeline stages to a preallocated
+ * event buffer, each thread takes the next slot with one atomic increment. Tracing is started and stopped
+ * by control thread, which writes the events to a file in Chrome trace event JSON format when the trace
+ * duration expires, the buffer is full or tracing is stopped by command. The file can be opened in
+ * chrome://tracing or Perfetto UI.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include "camogm.h"
+#include "camogm_trace.h"
+
+/**
+ * @struct trace_rec
+ * @brief One trace event
+ */
+struct trace_rec {
+	uint64_t time;                               ///< monotonic time, in microseconds
+	const char *name;                            ///< stage name
+	int tid;                                     ///< thread ID
+	int arg;                                     ///< sensor port or -1
+	char phase;                                  ///< 'B', 'E' or 'M' for thread name, zero until the event is completely written
+};
+
+/**
+ * @struct trace_buffer
+ * @brief Trace events and state, state fields are used by control thread only
+ */
+struct trace_buffer {
+	bool active;                                 ///< trace has been started and not written yet
+	uint64_t start;                              ///< trace start time, in microseconds
+	uint64_t stop;                               ///< the time trace should be stopped, in microseconds
+	uint32_t gen;                                ///< trace number, used by threads to name themselves once in each trace
+	uint32_t num;                                ///< the number of slots taken, can exceed #TRACE_MAX_EVENTS
+	struct trace_rec *recs;                      ///< events, allocated on first start and never freed as late events can still be written
+	char path[ELPHEL_PATH_MAX];                  ///< output file name
+};
+
+int trace_enabled;
+static struct trace_buffer trc;
+static __thread int trace_tid;
+static __thread const char *trace_name;
+static __thread uint32_t trace_gen;
+
+/** Return kernel thread ID of the calling thread, the same IDs are shown by top and perf */
+static int get_tid(void)
+{
+	if (trace_tid == 0)
+		trace_tid = syscall(SYS_gettid);
+	return trace_tid;
+}
+
+/** Put an event to the next free slot, tracing is stopped if there are no free slots */
+static void trace_put(const char *name, char phase, int arg)
+{
+	struct trace_rec *rec;
+	uint32_t idx = __atomic_fetch_add(&trc.num, 1, __ATOMIC_RELAXED);
+
+	if (idx >= TRACE_MAX_EVENTS) {
+		__atomic_store_n(&trace_enabled, 0, __ATOMIC_RELAXED);
+		return;
+	}
+	rec = &trc.recs[idx];
+	rec->time = lat_time();
+	rec->name = name;
+	rec->tid = get_tid();
+	rec->arg = arg;
+	__atomic_store_n(&rec->phase, phase, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Add trace event, called by #TRACE_BEGIN and #TRACE_END macros. Tracing stops when the
+ * buffer is full.
+ * @param[in]   name    stage name
+ * @param[in]   phase   'B' for the beginning of stage and 'E' for the end
+ * @param[in]   arg     sensor port or -1
+ * @return      None
+ */
+void trace_event(const char *name, char phase, int arg)
+{
+	uint32_t gen = __atomic_load_n(&trc.gen, __ATOMIC_RELAXED);
+
+	// the first event of named thread in this trace is preceded by thread name
+	if (trace_gen != gen && trace_name != NULL) {
+		trace_gen = gen;
+		trace_put(trace_name, 'M', -1);
+	}
+	trace_put(name, phase, arg);
+}
+
+/**
+ * @brief Set the name of calling thread shown in timeline, called once when the thread starts
+ * @param[in]   name   thread name, should not be freed
+ * @return      None
+ */
+void trace_thread_name(const char *name)
+{
+	trace_name = name;
+}
+
+/**
+ * @brief Start tracing, called by control thread. The trace which is already running is restarted.
+ * @param[in]   path       output file name
+ * @param[in]   duration   trace duration in seconds, the trace is written when it expires
+ * @return      0 if tracing was started and -1 otherwise
+ */
+int trace_start(const char *path, int duration)
+{
+	uint32_t num;
+
+	if (path == NULL || path[0] == '\0')
+		return -1;
+	if (duration <= 0)
+		duration = TRACE_DEFAULT_DURATION;
+	__atomic_store_n(&trace_enabled, 0, __ATOMIC_RELAXED);
+	if (trc.recs == NULL) {
+		trc.recs = calloc(TRACE_MAX_EVENTS, sizeof(struct trace_rec));
+		if (trc.recs == NULL) {
+			D0(fprintf(debug_file, "Can not allocate trace buffer\n"));
+			return -1;
+		}
+	} else {
+		num = __atomic_load_n(&trc.num, __ATOMIC_RELAXED);
+		memset(trc.recs, 0, ((num < TRACE_MAX_EVENTS) ? num : TRACE_MAX_EVENTS) * sizeof(struct trace_rec));
+	}
+	strncpy(trc.path, path, ELPHEL_PATH_MAX - 1);
+	trc.path[ELPHEL_PATH_MAX - 1] = '\0';
+	trc.start = lat_time();
+	trc.stop = trc.start + (uint64_t)duration * 1000000;
+	trc.active = true;
+	__atomic_store_n(&trc.gen, trc.gen + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&trc.num, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&trace_enabled, 1, __ATOMIC_RELEASE);
+	D1(fprintf(debug_file, "Tracing started for %d s, output file %s\n", duration, trc.path));
+
+	return 0;
+}
+
+/** Write thread names and events in Chrome trace event format, times are relative to trace start */
+static int trace_write(FILE *f, uint32_t num)
+{
+	int pid = getpid();
+	int cnt = 0;
+	char phase;
+	struct trace_rec *rec;
+
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"camogm\"}}", pid);
+	for (uint32_t i = 0; i < num; i++) {
+		rec = &trc.recs[i];
+		// the event is being written or the slot was taken after tracing had stopped
+		if ((phase = __atomic_load_n(&rec->phase, __ATOMIC_ACQUIRE)) == 0 || rec->time < trc.start)
+			continue;
+		if (phase == 'M') {
+			fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+					pid, rec->tid, rec->name);
+			continue;
+		}
+		fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu,\"pid\":%d,\"tid\":%d",
+				rec->name, phase, (unsigned long long)(rec->time - trc.start), pid, rec->tid);
+		if (rec->arg >= 0)
+			fprintf(f, ",\"args\":{\"port\":%d}", rec->arg);
+		fputc('}', f);
+		cnt++;
+	}
+	fprintf(f, "\n]}\n");
+
+	return cnt;
+}
+
+/**
+ * @brief Stop tracing and write trace file, called by control thread
+ * @return      the number of events written or -1 if the file could not be written
+ */
+int trace_stop(void)
+{
+	int cnt;
+	uint32_t num;
+	FILE *f;
+
+	if (!trc.active)
+		return 0;
+	__atomic_store_n(&trace_enabled, 0, __ATOMIC_RELAXED);
+	trc.active = false;
+	num = __atomic_load_n(&trc.num, __ATOMIC_RELAXED);
+	if (num > TRACE_MAX_EVENTS)
+		num = TRACE_MAX_EVENTS;
+	if ((f = fopen(trc.path, "w")) == NULL) {
+		D0(fprintf(debug_file, "Can not open trace file %s: %s\n", trc.path, strerror(errno)));
+		return -1;
+	}
+	cnt = trace_write(f, num);
+	fclose(f);
+	D1(fprintf(debug_file, "%d trace events written to %s\n", cnt, trc.path));
+
+	return cnt;
+}
+
+/**
+ * @brief Write trace file if trace duration has expired or event buffer is full, called by control thread
+ * periodically
+ * @return      None
+ */
+void trace_check(void)
+{
+	if (trc.active && (lat_time() >= trc.stop || !__atomic_load_n(&trace_enabled, __ATOMIC_RELAXED)))
+		trace_stop();
+}
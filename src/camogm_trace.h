@@ -0,0 +1,44 @@
+/** @file camogm_trace.h
+ * @brief Recording pipeline timeline in Chrome trace format
+ * @copyright Copyright (C) 2017 Elphel, Inc.
+ *
+ * @par <b>License</b>
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CAMOGM_TRACE_H
+#define _CAMOGM_TRACE_H
+
+#include <stdint.h>
+
+/** @brief The maximal number of events in one trace, tracing stops when the buffer is full */
+#define TRACE_MAX_EVENTS          (1 << 18)
+/** @brief Default trace duration, in seconds */
+#define TRACE_DEFAULT_DURATION    30
+
+/**
+ * @brief Mark the beginning of pipeline stage. Stage name must be a string literal or other string which
+ * is not freed, @e arg is sensor port or -1. Nothing is recorded if tracing is off.
+ */
+#define TRACE_BEGIN(name, arg) { if (__atomic_load_n(&trace_enabled, __ATOMIC_RELAXED)) trace_event(name, 'B', arg); }
+/** @brief Mark the end of pipeline stage started with #TRACE_BEGIN */
+#define TRACE_END(name, arg)   { if (__atomic_load_n(&trace_enabled, __ATOMIC_RELAXED)) trace_event(name, 'E', arg); }
+
+extern int trace_enabled;
+
+void trace_event(const char *name, char phase, int arg);
+void trace_thread_name(const char *name);
+int trace_start(const char *path, int duration);
+int trace_stop(void);
+void trace_check(void);
+
+#endif /* _CAMOGM_TRACE_H */
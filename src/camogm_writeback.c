@@ -0,0 +1,167 @@
+/** @file camogm_writeback.c
+ * @brief Rolling writeback and preallocation of files recorded to file system
+ * @copyright Copyright (C) 2017 Elphel, Inc.
+ *
+ * @par <b>License</b>
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Left alone, the kernel accumulates dirty pages of the file being recorded and then flushes them at once,
+ * which stalls writes for seconds and overruns circbuf. Here each chunk of a file is submitted for writeback
+ * as soon as it is written, and the previous chunk, which has been written out meanwhile, is waited for and
+ * dropped from page cache. Individual JPEG files are handled the same way with a file as a chunk.
+ */
+
+/** @brief This define is needed to use lseek64 and should be set before includes */
+#define _LARGEFILE64_SOURCE
+/** @brief Needed for sync_file_range and fallocate */
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <string.h>
+
+#include "camogm_writeback.h"
+
+/** @brief Flags used to wait for writeback of a range to complete */
+#define SYNC_RANGE_WAIT           (SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER)
+
+/** Get the descriptor of current segment file, -1 if there is no file or formats write individual files */
+static int segment_fd(const camogm_state *state)
+{
+	if (state->rawdev_op || state->format == CAMOGM_FORMAT_JPEG)
+		return -1;
+	return state->ivf;
+}
+
+/** Wait for a range to be written to disk and release it from page cache */
+static void release_range(int fd, off64_t offset, off64_t len)
+{
+	if (sync_file_range(fd, offset, len, SYNC_RANGE_WAIT) < 0) {
+		D3(fprintf(debug_file, "sync_file_range error: %s\n", strerror(errno)));
+	}
+	posix_fadvise64(fd, offset, len, POSIX_FADV_DONTNEED);
+}
+
+/**
+ * @brief Initialize writeback state
+ * @param[in]   state   a pointer to a structure containing current state
+ * @return      None
+ */
+void writeback_init(camogm_state *state)
+{
+	state->wb.fd = -1;
+	state->wb.prev_fd = -1;
+	state->wb.start = 0;
+	state->wb.submitted = 0;
+	state->wb.preallocated = false;
+}
+
+/**
+ * @brief Start writeback of a new segment file and preallocate it up to segment length if this is enabled.
+ * Preallocated space does not change file size and is released when the segment is finalized.
+ * @param[in]   state   a pointer to a structure containing current state
+ * @return      None
+ */
+void writeback_start(camogm_state *state)
+{
+	struct writeback *wb = &state->wb;
+
+	wb->fd = segment_fd(state);
+	wb->start = 0;
+	wb->submitted = 0;
+	wb->preallocated = false;
+	if (wb->fd < 0)
+		return;
+	wb->submitted = lseek64(wb->fd, 0, SEEK_CUR);
+	if (wb->submitted < 0)
+		wb->submitted = 0;
+	wb->start = wb->submitted;
+	if (state->prealloc && state->segment_length > 0) {
+		if (fallocate64(wb->fd, FALLOC_FL_KEEP_SIZE, 0, state->segment_length) == 0) {
+			wb->preallocated = true;
+		} else {
+			D1(fprintf(debug_file, "Could not preallocate %d bytes for %s: %s\n", state->segment_length, state->path, strerror(errno)));
+		}
+	}
+}
+
+/**
+ * @brief Submit recorded data for writeback when a chunk is complete. Called after each frame.
+ * @param[in]   state   a pointer to a structure containing current state
+ * @return      None
+ */
+void writeback_frame(camogm_state *state)
+{
+	off64_t pos;
+	struct writeback *wb = &state->wb;
+
+	if (state->writeback <= 0 || wb->fd < 0)
+		return;
+	pos = lseek64(wb->fd, 0, SEEK_CUR);
+	if (pos < 0 || pos - wb->submitted < state->writeback)
+		return;
+	if (sync_file_range(wb->fd, wb->submitted, pos - wb->submitted, SYNC_FILE_RANGE_WRITE) < 0) {
+		D3(fprintf(debug_file, "sync_file_range error: %s\n", strerror(errno)));
+	}
+	// previous chunk was written to disk while this one was recorded, normally there is nothing to wait for
+	if (wb->submitted > wb->start)
+		release_range(wb->fd, wb->start, wb->submitted - wb->start);
+	wb->start = wb->submitted;
+	wb->submitted = pos;
+}
+
+/**
+ * @brief Submit individual file for writeback and release the previous one. The file is closed by this
+ * function, immediately if writeback is not enabled or after the next file otherwise.
+ * @param[in]   state   a pointer to a structure containing current state
+ * @param[in]   fd      file descriptor
+ * @return      None
+ */
+void writeback_file(camogm_state *state, int fd)
+{
+	struct writeback *wb = &state->wb;
+
+	if (state->writeback <= 0) {
+		close(fd);
+		return;
+	}
+	sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+	if (wb->prev_fd >= 0) {
+		release_range(wb->prev_fd, 0, 0);
+		close(wb->prev_fd);
+	}
+	wb->prev_fd = fd;
+}
+
+/**
+ * @brief Stop writeback of current segment, the rest of data is written by finalizer
+ * @param[in]   state   a pointer to a structure containing current state
+ * @param[out]  job     segment job, preallocated space will be released when the job is run
+ * @return      None
+ */
+void writeback_end(camogm_state *state, struct segment_job *job)
+{
+	struct writeback *wb = &state->wb;
+
+	if (wb->prev_fd >= 0) {
+		release_range(wb->prev_fd, 0, 0);
+		close(wb->prev_fd);
+		wb->prev_fd = -1;
+	}
+	job->trim = wb->preallocated;
+	wb->fd = -1;
+	wb->preallocated = false;
+}
@@ -0,0 +1,30 @@
+/** @file camogm_writeback.h
+ * @brief Rolling writeback and preallocation of files recorded to file system
+ * @copyright Copyright (C) 2017 Elphel, Inc.
+ *
+ * @par <b>License</b>
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CAMOGM_WRITEBACK_H
+#define _CAMOGM_WRITEBACK_H
+
+#include "camogm.h"
+#include "camogm_finalize.h"
+
+void writeback_init(camogm_state *state);
+void writeback_start(camogm_state *state);
+void writeback_frame(camogm_state *state);
+void writeback_file(camogm_state *state, int fd);
+void writeback_end(camogm_state *state, struct segment_job *job);
+
+#endif /* _CAMOGM_WRITEBACK_H */
@@ -71,6 +71,7 @@ $cmd = $_GET['cmd'];
 $debug = $_GET['debug'];
 $debuglev = $_GET['debuglev'];
 $cmd_pipe = "/var/state/camogm_cmd";
+$cmd_socket = "/var/state/camogm_cmd.sock";
 $cmd_state = "/var/state/camogm.state";
 $cmd_port = "3456";
 $default_state = "/home/root/camogm.disk";
@@ -146,17 +147,22 @@ else if ($cmd == "status")
 	else                        $camogm_running = "off";
 
 	if ($camogm_running=="on"){
-		$pipe="/var/state/camogm.state";
-		$mode=0777;
-		if(!file_exists($pipe)) {
-			umask(0);
-			posix_mkfifo($pipe,$mode);
-		}
-		$fcmd=fopen($cmd_pipe,"w");
-		fprintf($fcmd, "xstatus=%s\n",$pipe);
-		fclose($fcmd);
+		$replies = ctl_request("xstatus");
+		if (($replies !== false) && ($replies[0]['code'] >= 0)) {
+			$status = $replies[0]['output'];
+		} else {
+			$pipe="/var/state/camogm.state";
+			$mode=0777;
+			if(!file_exists($pipe)) {
+				umask(0);
+				posix_mkfifo($pipe,$mode);
+			}
+			$fcmd=fopen($cmd_pipe,"w");
+			fprintf($fcmd, "xstatus=%s\n",$pipe);
+			fclose($fcmd);
 
-		$status=file_get_contents($pipe);
+			$status=file_get_contents($pipe);
+		}
 	}else{
 		$status = "<?xml version='1.0'?><camogm_state>\n<state>".$camogm_running."</state>\n</camogm_state>";
 	}
@@ -789,6 +795,28 @@ function get_state_path()
 	return $ret;
 }
 
+/** Send a batch of ';'-separated commands to the control socket and return an array of replies,
+ * each reply containing 'command', 'code' and 'output' fields, or false if the socket is not available */
+function ctl_request($cmd_str)
+{
+	global $cmd_socket;
+
+	$sock = @stream_socket_client("unix://".$cmd_socket, $errno, $errstr, 1);
+	if ($sock === false)
+		return false;
+	stream_set_timeout($sock, 5);
+	fwrite($sock, "reply=json;".$cmd_str."\n");
+	$line = fgets($sock);
+	fclose($sock);
+	if ($line === false)
+		return false;
+	$reply = json_decode($line, true);
+	if (!isset($reply['replies']))
+		return false;
+	// drop the reply to 'reply=json' itself
+	return array_slice($reply['replies'], 1);
+}
+
 /** Write command to camogm command pipe */
 function write_cmd_pipe($cmd_str)
 {
@@ -38,6 +38,10 @@
  * File size in bytes
  * @var disk_index::f_offset
  * The offset of the file start in the raw device buffer (in bytes)
+ * @var disk_index::grp_ports
+ * Bit mask of sensor ports in frame group if this file starts a group and 0 otherwise
+ * @var disk_index::grp_frames
+ * The number of frames in frame group if this file starts a group and 0 otherwise
  */
 struct disk_index {
 	struct disk_index *next;
@@ -47,6 +51,8 @@ struct disk_index {
 	uint32_t port;
 	size_t f_size;
 	uint64_t f_offset;
+	uint32_t grp_ports;
+	uint32_t grp_frames;
 };
 
 /**
@@ -0,0 +1,117 @@
+/** @file jpack_extract.c
+ * @brief Lists and extracts frames from JPEG pack files recorded by @e camogm
+ * @copyright Copyright (C) 2017 Elphel, Inc.
+ *
+ * @par <b>License</b>
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#include "jpack_index.h"
+
+static const char usage[] =
+"Usage: %s [-l] [-p port] [-f from] [-t to] [-o dir] file" JPACK_PACK_EXT "\n\n"
+"Extract frames from JPEG pack file to individual files using its " JPACK_INDEX_EXT " index.\n"
+"  -l        list frames instead of extracting them\n"
+"  -p port   only frames from this sensor port\n"
+"  -f from   only frames with time stamp (in seconds) equal to or after this one\n"
+"  -t to     only frames with time stamp (in seconds) equal to or before this one\n"
+"  -o dir    output directory, pack file name without extension by default\n";
+
+/** Print index entries passing filter */
+static int list_frames(const char *pack_path, const struct jpack_filter *filter)
+{
+	int fd, ret;
+	char index_path[PATH_MAX];
+	struct jpack_index_entry entry;
+
+	if (jpack_index_path(pack_path, index_path, sizeof(index_path)) < 0 ||
+			(fd = jpack_open_index(index_path)) < 0)
+		return -1;
+	printf("port\ttime stamp\t\toffset\t\tsize\n");
+	while ((ret = jpack_read_entry(fd, &entry)) > 0) {
+		if (filter->port >= 0 && entry.port != (uint32_t)filter->port)
+			continue;
+		if (entry.timestamp < filter->from || (filter->to != 0 && entry.timestamp > filter->to))
+			continue;
+		printf("%u\t%llu.%06llu\t%llu\t%u\n", entry.port,
+				(unsigned long long)(entry.timestamp / 1000000), (unsigned long long)(entry.timestamp % 1000000),
+				(unsigned long long)entry.offset, entry.size);
+	}
+	close(fd);
+
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, ret;
+	int list = 0;
+	char *ext;
+	char out_dir[PATH_MAX] = {0};
+	struct jpack_filter filter = {.port = -1, .from = 0, .to = 0};
+
+	while ((opt = getopt(argc, argv, "lp:f:t:o:")) != -1) {
+		switch (opt) {
+		case 'l':
+			list = 1;
+			break;
+		case 'p':
+			filter.port = strtol(optarg, NULL, 10);
+			break;
+		case 'f':
+			filter.from = strtod(optarg, NULL) * 1000000;
+			break;
+		case 't':
+			filter.to = strtod(optarg, NULL) * 1000000;
+			break;
+		case 'o':
+			strncpy(out_dir, optarg, sizeof(out_dir) - 1);
+			break;
+		default:
+			fprintf(stderr, usage, argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (optind >= argc) {
+		fprintf(stderr, usage, argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (list) {
+		ret = list_frames(argv[optind], &filter);
+	} else {
+		if (out_dir[0] == '\0') {
+			strncpy(out_dir, argv[optind], sizeof(out_dir) - 1);
+			ext = strrchr(out_dir, '.');
+			if (ext != NULL && strcmp(ext, JPACK_PACK_EXT) == 0)
+				ext[0] = '\0';
+			else
+				strcat(out_dir, ".d");
+		}
+		ret = jpack_extract(argv[optind], out_dir, &filter);
+		if (ret >= 0)
+			printf("%d frames extracted to %s\n", ret, out_dir);
+	}
+	if (ret < 0) {
+		fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,192 @@
+/** @file jpack_index.c
+ * @brief JPEG pack file index access and frame extraction
+ * @copyright Copyright (C) 2017 Elphel, Inc.
+ *
+ * @par <b>License</b>
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** @brief This define is needed to use pread64 and should be set before includes */
+#define _LARGEFILE64_SOURCE
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "jpack_index.h"
+
+/**
+ * @brief Make index file name from pack file name
+ * @param[in]   pack_path    pack file name
+ * @param[out]  index_path   buffer for index file name
+ * @param[in]   len          the size of @e index_path buffer
+ * @return      0 on success and -1 if the name does not fit the buffer
+ */
+int jpack_index_path(const char *pack_path, char *index_path, size_t len)
+{
+	size_t base_len = strlen(pack_path);
+	size_t ext_len = strlen(JPACK_PACK_EXT);
+
+	if (base_len >= ext_len && strcmp(pack_path + base_len - ext_len, JPACK_PACK_EXT) == 0)
+		base_len -= ext_len;
+	if (base_len + strlen(JPACK_INDEX_EXT) + 1 > len) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	memcpy(index_path, pack_path, base_len);
+	strcpy(index_path + base_len, JPACK_INDEX_EXT);
+
+	return 0;
+}
+
+/**
+ * @brief Open index file and check its header
+ * @param[in]   index_path   index file name
+ * @return      file descriptor positioned at the first entry or -1 in case of error
+ */
+int jpack_open_index(const char *index_path)
+{
+	int fd;
+	struct jpack_index_hdr hdr;
+
+	fd = open(index_path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+			memcmp(hdr.magic, JPACK_INDEX_MAGIC, sizeof(hdr.magic)) != 0 ||
+			hdr.version != JPACK_INDEX_VERSION ||
+			hdr.entry_size != sizeof(struct jpack_index_entry)) {
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+
+	return fd;
+}
+
+/**
+ * @brief Read next index entry
+ * @param[in]   fd      index file descriptor returned by #jpack_open_index
+ * @param[out]  entry   index entry
+ * @return      1 if the entry was read, 0 at the end of index and -1 in case of error
+ */
+int jpack_read_entry(int fd, struct jpack_index_entry *entry)
+{
+	ssize_t ret;
+
+	ret = read(fd, entry, sizeof(*entry));
+	if (ret == sizeof(*entry))
+		return 1;
+	if (ret >= 0)
+		// incomplete last entry is left by interrupted recording, ignore it
+		return 0;
+	return -1;
+}
+
+/** Check if index entry passes filter */
+static int match_filter(const struct jpack_index_entry *entry, const struct jpack_filter *filter)
+{
+	if (filter == NULL)
+		return 1;
+	if (filter->port >= 0 && entry->port != (uint32_t)filter->port)
+		return 0;
+	if (entry->timestamp < filter->from)
+		return 0;
+	if (filter->to != 0 && entry->timestamp > filter->to)
+		return 0;
+	return 1;
+}
+
+/**
+ * @brief Extract frames from pack file to individual JPEG files. The files are named the same way as
+ * in JPEG format: <port>_<seconds>_<microseconds>.jpeg
+ * @param[in]   pack_path   pack file name, index file name is derived from it
+ * @param[in]   out_dir     directory for JPEG files, it is created if it does not exist
+ * @param[in]   filter      frames to extract, NULL to extract all frames
+ * @return      the number of files extracted or -1 in case of error, @e errno is set
+ */
+int jpack_extract(const char *pack_path, const char *out_dir, const struct jpack_filter *filter)
+{
+	int ret = 0;
+	int pack_fd, index_fd, jpeg_fd;
+	int err = 0;
+	ssize_t len;
+	size_t buff_sz = 0;
+	char *buff = NULL;
+	char path[PATH_MAX];
+	struct jpack_index_entry entry;
+
+	if (jpack_index_path(pack_path, path, sizeof(path)) < 0)
+		return -1;
+	if ((index_fd = jpack_open_index(path)) < 0)
+		return -1;
+	if ((pack_fd = open(pack_path, O_RDONLY)) < 0) {
+		err = errno;
+		close(index_fd);
+		errno = err;
+		return -1;
+	}
+	if (mkdir(out_dir, 0777) < 0 && errno != EEXIST) {
+		ret = -1;
+	}
+
+	while (ret >= 0 && (err = jpack_read_entry(index_fd, &entry)) > 0) {
+		if (!match_filter(&entry, filter))
+			continue;
+		if (entry.size > buff_sz) {
+			char *new_buff = realloc(buff, entry.size);
+			if (new_buff == NULL) {
+				ret = -1;
+				break;
+			}
+			buff = new_buff;
+			buff_sz = entry.size;
+		}
+		len = pread64(pack_fd, buff, entry.size, entry.offset);
+		if (len != entry.size) {
+			if (len >= 0)
+				errno = EIO;
+			ret = -1;
+			break;
+		}
+		snprintf(path, sizeof(path), "%s/%u_%010llu_%06llu.jpeg", out_dir, entry.port,
+				(unsigned long long)(entry.timestamp / 1000000), (unsigned long long)(entry.timestamp % 1000000));
+		if ((jpeg_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+			ret = -1;
+			break;
+		}
+		if (write(jpeg_fd, buff, entry.size) != entry.size) {
+			err = errno;
+			close(jpeg_fd);
+			errno = err;
+			ret = -1;
+			break;
+		}
+		close(jpeg_fd);
+		ret++;
+	}
+	if (err < 0)
+		ret = -1;
+	err = errno;
+	free(buff);
+	close(pack_fd);
+	close(index_fd);
+	errno = err;
+
+	return ret;
+}
@@ -0,0 +1,89 @@
+/** @file jpack_index.h
+ * @brief JPEG pack file and sidecar index format, shared by @e camogm and extraction tool
+ * @copyright Copyright (C) 2017 Elphel, Inc.
+ *
+ * @par <b>License</b>
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _JPACK_INDEX_H
+#define _JPACK_INDEX_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/** @brief Pack file name extension, pack file is a plain concatenation of JPEG frames */
+#define JPACK_PACK_EXT            ".jpack"
+/** @brief Sidecar index file name extension */
+#define JPACK_INDEX_EXT           ".jpidx"
+/** @brief Index file magic */
+#define JPACK_INDEX_MAGIC         "ELPHJPIX"
+/** @brief Index file format version */
+#define JPACK_INDEX_VERSION       1
+
+/**
+ * @struct jpack_index_hdr
+ * @brief Index file header, all fields are little endian
+ * @var jpack_index_hdr::magic
+ * #JPACK_INDEX_MAGIC without terminating zero
+ * @var jpack_index_hdr::version
+ * #JPACK_INDEX_VERSION
+ * @var jpack_index_hdr::entry_size
+ * The size of one index entry in bytes, entries may grow in later versions
+ */
+struct jpack_index_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t entry_size;
+};
+
+/**
+ * @struct jpack_index_entry
+ * @brief Index entry, one per frame in the order frames are written to pack file
+ * @var jpack_index_entry::offset
+ * The offset of the frame in pack file, in bytes
+ * @var jpack_index_entry::size
+ * Frame size in bytes
+ * @var jpack_index_entry::port
+ * The sensor port number this frame was captured from
+ * @var jpack_index_entry::timestamp
+ * Frame time stamp in microseconds
+ */
+struct jpack_index_entry {
+	uint64_t offset;
+	uint32_t size;
+	uint32_t port;
+	uint64_t timestamp;
+};
+
+/**
+ * @struct jpack_filter
+ * @brief Frames to extract from pack file
+ * @var jpack_filter::port
+ * Sensor port number, -1 for all ports
+ * @var jpack_filter::from
+ * The first time stamp in microseconds, inclusive
+ * @var jpack_filter::to
+ * The last time stamp in microseconds, inclusive, 0 if not limited
+ */
+struct jpack_filter {
+	int port;
+	uint64_t from;
+	uint64_t to;
+};
+
+int jpack_index_path(const char *pack_path, char *index_path, size_t len);
+int jpack_open_index(const char *index_path);
+int jpack_read_entry(int fd, struct jpack_index_entry *entry);
+int jpack_extract(const char *pack_path, const char *out_dir, const struct jpack_filter *filter);
+
+#endif /* _JPACK_INDEX_H */
@@ -49,29 +49,29 @@
 /** OggDS headers */
 /** Header for the new header format */
 typedef struct stream_header_video {
-	ogg_int32_t width;
-	ogg_int32_t height;
+	int32_t width;
+	int32_t height;
 } stream_header_video;
 
 typedef struct stream_header_audio {
-	ogg_int16_t channels;
-	ogg_int16_t blockalign;
-	ogg_int32_t avgbytespersec;
+	int16_t channels;
+	int16_t blockalign;
+	int32_t avgbytespersec;
 } stream_header_audio;
 
 typedef struct stream_header {
 	char streamtype[8];
 	char subtype[4];
 
-	ogg_int32_t size;               // size of the structure
+	int32_t size;               // size of the structure
 
-	ogg_int64_t time_unit;          // in reference time
-	ogg_int64_t samples_per_unit;
-	ogg_int32_t default_len;        // in media time
+	int64_t time_unit;          // in reference time
+	int64_t samples_per_unit;
+	int32_t default_len;        // in media time
 
-	ogg_int32_t buffersize;
-//	ogg_int16_t     bits_per_sample;
-	ogg_int32_t bits_per_sample;
+	int32_t buffersize;
+//	int16_t     bits_per_sample;
+	int32_t bits_per_sample;
 
 	union {
 		// Video specific
@@ -80,8 +80,8 @@ typedef struct stream_header {
 		stream_header_audio audio;
 	} sh;
 
-//	ogg_int16_t     padding;
-	ogg_int32_t padding;
+//	int16_t     padding;
+	int32_t padding;
 
 } stream_header;
 
@@ -89,16 +89,16 @@ typedef struct old_stream_header {
 	char streamtype[8];
 	char subtype[4];
 
-	ogg_int32_t size;               // size of the structure
+	int32_t size;               // size of the structure
 
-	ogg_int64_t time_unit;          // in reference time
-	ogg_int64_t samples_per_unit;
-	ogg_int32_t default_len;        // in media time
+	int64_t time_unit;          // in reference time
+	int64_t samples_per_unit;
+	int32_t default_len;        // in media time
 
-	ogg_int32_t buffersize;
-	ogg_int16_t bits_per_sample;
+	int32_t buffersize;
+	int16_t bits_per_sample;
 
-	ogg_int16_t padding;
+	int16_t padding;
 
 	union {
 		// Video specific